@@ -4,6 +4,84 @@ const statusElement = document.getElementById('status');
 const flashButton = document.getElementById("toggleFlash");
 const frameSizeSelect = document.getElementById("frameSize");
 const streamElement = document.getElementById('stream');
+const streamCanvas = document.getElementById('streamCanvas');
+
+// binary control protocol, must match CarOpcode in src/CarProtocol.h
+const OP = {
+  STOP: 0,
+  FORWARD: 1,
+  BACKWARD: 2,
+  LEFT: 3,
+  RIGHT: 4,
+  FORWARD_LEFT: 5,
+  FORWARD_RIGHT: 6,
+  BACKWARD_LEFT: 7,
+  BACKWARD_RIGHT: 8,
+  CAMERA: 9,
+  FRAME_SIZE: 10,
+  TOGGLE_FLASH: 11,
+  STREAM_PACING: 12,
+  PING: 13,
+  STATS: 14,
+  RESET: 15,
+  LOG_LEVEL: 16,
+  RECORD: 17,
+  GRAB_MODE: 18,
+  PIXEL_FORMAT: 19,
+  VISION: 20,
+  DRIVE: 21,
+  VIDEO: 22,
+  FRAME_ACK: 23,
+};
+// [throttle, steer] of each key combination for OP.DRIVE, must match legacyDriveVectors in src/CarProtocol.h
+const DRIVE_VECTORS = {
+  "forward": [100, 0],
+  "backward": [-100, 0],
+  "left": [0, -100],
+  "right": [0, 100],
+  "forward-left": [51, -50],
+  "forward-right": [51, 50],
+  "backward-left": [-51, 50],
+  "backward-right": [-51, -50],
+};
+// framesize_t values of the options in the frame size selector, -1 is automatic quality
+const FRAME_SIZES = {
+  AUTO: -1,
+  FRAMESIZE_240X240: 4,
+  FRAMESIZE_HVGA: 7,
+  FRAMESIZE_VGA: 8,
+  FRAMESIZE_SVGA: 9,
+  FRAMESIZE_XGA: 10,
+  FRAMESIZE_HD: 11,
+  FRAMESIZE_UXGA: 13,
+};
+const COMMAND_SIZE = 7;
+// movement and camera only matter as their latest value, must match CommandAxis in src/CommandQueue.h
+const AXIS = {
+  DRIVE: 0,
+  CAMERA: 1,
+};
+// realtime sends per axis: one per interval and a few unacknowledged commands at most, a newer
+// value replaces the one waiting. Without an ack for a while one more send is let through
+const REALTIME_MIN_INTERVAL_MS = 30;
+const REALTIME_MAX_IN_FLIGHT = 2;
+const ACK_TIMEOUT_MS = 500;
+let commandSeq = 0;
+let ackedSeq = 0;
+let acksSeen = false;
+let lastSendAt = 0;
+let realtimeSuperseded = 0;
+const pendingRealtime = [null, null];
+const lastRealtimeAt = [0, 0];
+let realtimeTimer = null;
+// ?video=ws: frames come as binary messages on the WebSocket and are drawn on a canvas, acked
+// once shown so the car skips frames while the browser falls behind. Layout must match
+// encodeVideoHeader in src/CarProtocol.h
+const VIDEO_OVER_WS = new URLSearchParams(window.location.search).get('video') === 'ws' && 'createImageBitmap' in window;
+const VIDEO_MESSAGE_KIND = 0x56;
+const VIDEO_HEADER_SIZE = 20;
+let decodingFrame = false;
+let pendingFrame = null;
 
 // UI functions
 function handleRotationScreen() {
@@ -74,6 +152,22 @@ function updateWiFiIndicator(rssi) {
   rssiValue.textContent = `-${rssi}dBm`;
 }
 
+function updateStreamStats(stats) {
+  const fpsValue = document.getElementById('fpsValue');
+
+  if (!stats.clients.length) {
+    fpsValue.textContent = '';
+
+    return;
+  }
+
+  fpsValue.textContent = `${stats.clients.map(client => Math.round(client.fps)).join('/')}fps`;
+  fpsValue.title = stats.clients
+    .map(client => `send avg ${client.sendAvgMs}ms, histogram (<1..>=256ms): ${client.sendHist.join(' ')}`)
+    .concat(`commands superseded: ${stats.commands.superseded} on the car, ${realtimeSuperseded} here`)
+    .join('\n');
+}
+
 function changeControls(disable) {
   //document.querySelectorAll('.controller').forEach(btn => btn.disabled = disable);
 }
@@ -102,22 +196,27 @@ function handleWebSocket() {
   }
 
   ws = new WebSocket(`ws://${currentUrl}:82/ws`);
+  ws.binaryType = 'arraybuffer';
 
   let heartbeatInterval;
   let missedPongs = 0;
   const maxMissedPongs = 2;
 
   ws.onopen = () => {
+    ackedSeq = commandSeq;
+    acksSeen = false;
     showStatus(true);
     changeControls(false);
 
-    streamElement.src = `#`; //reinit stream src to force reload if connection were lost
-    setTimeout(() => {
-      streamElement.src = `http://${currentUrl}:81/stream`;
-    }, 1000);
+    if (VIDEO_OVER_WS) {
+      ws.sendCommand(OP.VIDEO, 1);
+    } else {
+      showMjpegStream();
+    }
 
     heartbeatInterval = setInterval(() => {
-      ws.send('ping');
+      ws.sendCommand(OP.PING);
+      ws.sendCommand(OP.STATS);
       missedPongs++;
 
       if (missedPongs >= maxMissedPongs) {
@@ -129,6 +228,20 @@ function handleWebSocket() {
   };
 
   ws.onmessage = (event) => {
+    if (event.data instanceof ArrayBuffer) {
+      onVideoFrame(event.data);
+
+      return;
+    }
+
+    if (event.data.startsWith("ack-")) {
+      ackedSeq = parseInt(event.data.slice(4));
+      acksSeen = true;
+      ws.flushRealtime();
+
+      return;
+    }
+
     if (event.data.startsWith("pong-")) {
       showStatus(true);
 
@@ -141,6 +254,25 @@ function handleWebSocket() {
       return;
     }
 
+    if (event.data.startsWith("VIDEO-")) {
+      if (event.data === "VIDEO-1") {
+        streamElement.src = `#`;
+        streamElement.hidden = true;
+        streamCanvas.hidden = false;
+      } else {
+        // video off, or every viewer slot of the car busy: back to /stream
+        showMjpegStream();
+      }
+
+      return;
+    }
+
+    if (event.data.startsWith("STATS-")) {
+      updateStreamStats(JSON.parse(event.data.slice(6)));
+
+      return;
+    }
+
     if (event.data.startsWith("Flash-")) {
       const state = event.data.split("-")[1];
 
@@ -169,7 +301,7 @@ function handleWebSocket() {
 
       toggleWifiModeButton.onclick = () => {
         if (isStationMode) {
-          ws.sendData("reset");
+          ws.sendCommand(OP.RESET);
           acModeScreen.classList.add("visible");
           checkCarConnection();
 
@@ -186,6 +318,10 @@ function handleWebSocket() {
     showStatus(false);
     changeControls(true);
     clearInterval(heartbeatInterval);
+    clearTimeout(realtimeTimer);
+    realtimeTimer = null;
+    pendingRealtime.fill(null);
+    pendingFrame = null;
     setTimeout(handleWebSocket, 2000);
   };
 
@@ -194,16 +330,155 @@ function handleWebSocket() {
     clearInterval(heartbeatInterval);
   };
 
-  ws.sendData = (data) => {
-    console.log(data);
+  // [opcode u8][seq u16][arg0 i16][arg1 i16], little endian
+  ws.sendCommand = (opcode, arg0 = 0, arg1 = 0) => {
+    if (!ws || ws.readyState !== WebSocket.OPEN) {
+      return;
+    }
+
+    const message = new DataView(new ArrayBuffer(COMMAND_SIZE));
+
+    commandSeq = (commandSeq + 1) & 0xffff;
+    message.setUint8(0, opcode);
+    message.setUint16(1, commandSeq, true);
+    message.setInt16(3, arg0, true);
+    message.setInt16(5, arg1, true);
+
+    ws.send(message.buffer);
+    lastSendAt = performance.now();
+  }
+
+  // Outside the command sequence and the realtime throttle, the car does not ack it back
+  ws.sendFrameAck = (seq) => {
+    if (ws.readyState !== WebSocket.OPEN) {
+      return;
+    }
+
+    const message = new DataView(new ArrayBuffer(COMMAND_SIZE));
+
+    message.setUint8(0, OP.FRAME_ACK);
+    message.setUint16(3, seq & 0xffff, true);
+    ws.send(message.buffer);
+  }
+
+  // Keeps only the newest command per axis and sends it once the throttle allows, STOP goes out at once
+  ws.sendRealtime = (axis, opcode, arg0 = 0, arg1 = 0) => {
+    if (pendingRealtime[axis]) {
+      realtimeSuperseded++;
+    }
+
+    pendingRealtime[axis] = [opcode, arg0, arg1];
+
+    if (opcode === OP.STOP) {
+      lastRealtimeAt[axis] = 0;
+    }
+
+    ws.flushRealtime(opcode === OP.STOP ? axis : -1);
+  }
+
+  ws.flushRealtime = (urgentAxis = -1) => {
+    const now = performance.now();
+    const inFlight = (commandSeq - ackedSeq) & 0xffff;
+    // firmware without acks is only rate limited
+    const windowOpen = !acksSeen || inFlight < REALTIME_MAX_IN_FLIGHT || now - lastSendAt >= ACK_TIMEOUT_MS;
+    let wait = Infinity;
+
+    pendingRealtime.forEach((pending, axis) => {
+      if (!pending) {
+        return;
+      }
+
+      const due = lastRealtimeAt[axis] + REALTIME_MIN_INTERVAL_MS - now;
+
+      if (axis === urgentAxis || (windowOpen && due <= 0)) {
+        ws.sendCommand(...pending);
+        pendingRealtime[axis] = null;
+        lastRealtimeAt[axis] = now;
+
+        return;
+      }
+
+      wait = Math.min(wait, windowOpen ? due : ACK_TIMEOUT_MS - (now - lastSendAt));
+    });
 
-    if (ws && ws.readyState === WebSocket.OPEN) {
-      ws.send(data);
+    if (wait !== Infinity && !realtimeTimer) {
+      realtimeTimer = setTimeout(() => {
+        realtimeTimer = null;
+        ws.flushRealtime();
+      }, Math.max(wait, 1));
     }
   }
 }
 
 // car control functions
+function showMjpegStream() {
+  streamCanvas.hidden = true;
+  streamElement.hidden = false;
+  streamElement.src = `#`; //reinit stream src to force reload if connection were lost
+  setTimeout(() => {
+    streamElement.src = `http://${currentUrl}:82/stream`;
+  }, 1000);
+}
+
+// [kind u8][header size u8][reserved u16][seq u32][sensor time u64][jpeg length u32], little endian
+function onVideoFrame(data) {
+  if (data.byteLength < VIDEO_HEADER_SIZE) {
+    return;
+  }
+
+  const header = new DataView(data);
+
+  if (header.getUint8(0) !== VIDEO_MESSAGE_KIND) {
+    return;
+  }
+
+  const frame = {
+    seq: header.getUint32(4, true),
+    jpeg: new Blob([new Uint8Array(data, header.getUint8(1))], { type: 'image/jpeg' }),
+  };
+
+  // one frame decodes at a time, of those arriving meanwhile only the newest is kept
+  if (decodingFrame) {
+    if (pendingFrame) {
+      ws.sendFrameAck(pendingFrame.seq);
+    }
+
+    pendingFrame = frame;
+
+    return;
+  }
+
+  drawVideoFrame(frame);
+}
+
+async function drawVideoFrame(frame) {
+  decodingFrame = true;
+
+  try {
+    const bitmap = await createImageBitmap(frame.jpeg);
+
+    if (streamCanvas.width !== bitmap.width || streamCanvas.height !== bitmap.height) {
+      streamCanvas.width = bitmap.width;
+      streamCanvas.height = bitmap.height;
+    }
+
+    streamCanvas.getContext('2d').drawImage(bitmap, 0, 0);
+    bitmap.close();
+  } catch (error) {
+    console.log('Video frame decode failed:', error);
+  }
+
+  ws.sendFrameAck(frame.seq);
+  decodingFrame = false;
+
+  if (pendingFrame) {
+    const next = pendingFrame;
+
+    pendingFrame = null;
+    drawVideoFrame(next);
+  }
+}
+
 function handleCarMovement() {
   const DATA_SEND_INTERVAL = 100;
   const controllers = document.querySelectorAll('.movement-controller');
@@ -227,12 +502,12 @@ function handleCarMovement() {
     }
 
     if (output) {
-      ws.sendData(output);
+      ws.sendRealtime(AXIS.DRIVE, OP.DRIVE, ...DRIVE_VECTORS[output]);
 
       return
     }
 
-    ws.sendData("stop");
+    ws.sendRealtime(AXIS.DRIVE, OP.STOP);
   }
 
   const startAction = (elementId) => {
@@ -359,12 +634,12 @@ function handleFunctions() {
   }
 
   const attachHandlers = () => {
-    flashButton.addEventListener("click", () => ws.sendData("toggleFlash"));
+    flashButton.addEventListener("click", () => ws.sendCommand(OP.TOGGLE_FLASH));
 
     frameSizeSelect.addEventListener("change", () => {
       const selectedValue = frameSizeSelect.value;
 
-      ws.sendData(`frameSize_${selectedValue}`);
+      ws.sendCommand(OP.FRAME_SIZE, FRAME_SIZES[selectedValue]);
     });
 
     takePhotoButton.addEventListener("click", capturePhoto);
@@ -374,7 +649,7 @@ function handleFunctions() {
 
 function handleCameraDrag() {
   const drag = { x: 0, y: 0 };
-  const dragArea = document.getElementById('stream');
+  const dragAreas = [streamElement, streamCanvas];
   const resetButton = document.getElementById('resetCamera');
   const rangeX = document.getElementById('rangeX');
   const rangeY = document.getElementById('rangeY');
@@ -401,7 +676,7 @@ function handleCameraDrag() {
     rangeX.style.opacity = RANGE_OPACITY;
     rangeY.style.opacity = RANGE_OPACITY;
 
-    ws.sendData(`cameraDrag_${drag.x}_${drag.y}`);
+    ws.sendRealtime(AXIS.CAMERA, OP.CAMERA, drag.x, drag.y);
 
     clearTimeout(timeout);
     timeout = setTimeout(() => {
@@ -426,18 +701,9 @@ function handleCameraDrag() {
   const attachHandlers = () => {
     resetButton.addEventListener('click', () => onDragChange(0, 0));
 
-    dragArea.addEventListener('mousedown', (e) => {
-      e.preventDefault();
-
-      isDragging = true;
-      startX = e.clientX;
-      startY = e.clientY;
-      dragArea.style.cursor = 'grabbing';
-    });
-
     window.addEventListener('mouseup', () => {
       isDragging = false;
-      dragArea.style.cursor = 'grab';
+      dragAreas.forEach((dragArea) => dragArea.style.cursor = 'grab');
     });
 
     window.addEventListener('mousemove', (e) => {
@@ -446,6 +712,20 @@ function handleCameraDrag() {
       handleCameraMove(e.clientX, e.clientY);
     });
 
+    // the <img> shows /stream, the canvas WebSocket video, only one of them is visible
+    dragAreas.forEach((dragArea) => attachDragArea(dragArea));
+  }
+
+  const attachDragArea = (dragArea) => {
+    dragArea.addEventListener('mousedown', (e) => {
+      e.preventDefault();
+
+      isDragging = true;
+      startX = e.clientX;
+      startY = e.clientY;
+      dragArea.style.cursor = 'grabbing';
+    });
+
     dragArea.addEventListener(
       'touchstart',
       (e) => {
@@ -0,0 +1,29 @@
+# PlatformIO pre-script: gzips data/*.min.* next to the originals before the firmware or the
+# LittleFS image is built. serveStaticFile caches the .gz files in PSRAM at boot and serves
+# them with Content-Encoding: gzip. mtime is zeroed so unchanged assets keep the same bytes,
+# and therefore the same ETag, across builds
+import glob
+import gzip
+import os
+
+Import("env")
+
+data_dir = os.path.join(env.subst("$PROJECT_DIR"), "data")
+
+for source in glob.glob(os.path.join(data_dir, "*.min.*")):
+    if source.endswith(".gz"):
+        continue
+
+    target = source + ".gz"
+
+    if os.path.exists(target) and os.path.getmtime(target) >= os.path.getmtime(source):
+        continue
+
+    with open(source, "rb") as f:
+        raw = f.read()
+
+    with open(target, "wb") as f:
+        with gzip.GzipFile(filename="", mode="wb", fileobj=f, compresslevel=9, mtime=0) as gz:
+            gz.write(raw)
+
+    print("gzip %s: %d -> %d bytes" % (os.path.basename(source), len(raw), os.path.getsize(target)))
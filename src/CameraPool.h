@@ -0,0 +1,429 @@
+#pragma once
+#include "FrameBroadcaster.h"
+#include "hal/Hal.h"
+#include "utils.h"
+
+// PSRAM left to everything else (asset cache, JPEG converters, WiFi/LWIP spill-over)
+#define CAMERA_PSRAM_RESERVE (512 * 1024)
+#define CAMERA_PAUSE_TIMEOUT_MS 2000
+#define CAMERA_BURST_MAX_FRAMES 5
+// frames thrown away after a reinit while the sensor's exposure settles
+#define CAMERA_BURST_WARMUP_FRAMES 2
+
+enum CameraConsumer : uint8_t {
+  CAMERA_FOR_STREAM = 0,
+  CAMERA_FOR_PHOTO,
+  CAMERA_FOR_RECORDER,
+  CAMERA_CONSUMER_COUNT
+};
+
+static const char *const cameraConsumerNames[CAMERA_CONSUMER_COUNT] = {"stream", "photo", "recorder"};
+
+struct FrameResolution {
+  uint16_t width;
+  uint16_t height;
+};
+
+// Indexed by framesize_t, same order as the driver's resolution table
+static const FrameResolution frameResolutions[FRAMESIZE_INVALID] = {
+    {96, 96},
+    {160, 120},
+    {176, 144},
+    {240, 176},
+    {240, 240},
+    {320, 240},
+    {400, 296},
+    {480, 320},
+    {640, 480},
+    {800, 600},
+    {1024, 768},
+    {1280, 720},
+    {1280, 1024},
+    {1600, 1200},
+    {1920, 1080},
+    {720, 1280},
+    {864, 1536},
+    {2048, 1536},
+    {2560, 1440},
+    {2560, 1600},
+    {1080, 1920},
+    {2560, 1920}};
+
+// A burst frame copied out of the driver's buffers, so the camera can go back to streaming
+// before it is sent. data belongs to the pool and stays valid until the next burst
+struct BurstFrame {
+  uint8_t *data;
+  size_t length;
+  uint64_t sensorAtUs;
+};
+
+// Owns the camera driver configuration after boot. The driver sizes its frame buffers for
+// the framesize it was initialized with, so growing past it, or shrinking to give PSRAM back,
+// means a deinit/init cycle. The broadcaster is paused around it so no buffer is in use.
+// Grab modes are kept per consumer: the stream wants the latest frame, photos and the
+// recorder want every frame in order. A reinit that fails brings back the last configuration
+// that worked, so a size or format that does not fit never leaves the camera down
+class CameraPool {
+public:
+  CameraPool()
+      : _config(nullptr),
+        _working(),
+        _broadcaster(nullptr),
+        _consumer(CAMERA_FOR_STREAM),
+        _reconfigurations(0),
+        _failures(0),
+        _lastReconfigureMs(0),
+        _bursts(0),
+        _lastBurstMs(0),
+        _burstData(),
+        _burstCapacity() {
+    _grabModes[CAMERA_FOR_STREAM] = CAMERA_GRAB_LATEST;
+    _grabModes[CAMERA_FOR_PHOTO] = CAMERA_GRAB_WHEN_EMPTY;
+    _grabModes[CAMERA_FOR_RECORDER] = CAMERA_GRAB_WHEN_EMPTY;
+  }
+
+  // config is the one the camera was initialized with, it is updated on every reconfiguration
+  void begin(camera_config_t &config, FrameBroadcaster &broadcaster) {
+    _config = &config;
+    _working = config;
+    _broadcaster = &broadcaster;
+    _grabModes[CAMERA_FOR_STREAM] = config.grab_mode;
+  }
+
+  // Approximate JPEG frame buffer of the driver: a fifth of the raw frame
+  static size_t jpegBufferSize(framesize_t size) {
+    return frameBufferSize(size, PIXFORMAT_JPEG);
+  }
+
+  // Raw formats get exactly one frame per buffer
+  static size_t frameBufferSize(framesize_t size, pixformat_t format) {
+    const FrameResolution &resolution = frameResolutions[size < FRAMESIZE_INVALID ? size : FRAMESIZE_UXGA];
+    const size_t pixels = (size_t)resolution.width * resolution.height;
+
+    switch (format) {
+    case PIXFORMAT_RGB565:
+      return pixels * 2;
+    case PIXFORMAT_GRAYSCALE:
+      return pixels;
+    default:
+      return pixels / 5;
+    }
+  }
+
+  static const char *pixelFormatName(pixformat_t format) {
+    switch (format) {
+    case PIXFORMAT_RGB565:
+      return "RGB565";
+    case PIXFORMAT_GRAYSCALE:
+      return "GRAYSCALE";
+    case PIXFORMAT_JPEG:
+      return "JPEG";
+    default:
+      return "OTHER";
+    }
+  }
+
+  // Sensor-only change while the buffers are large enough, full reconfiguration otherwise
+  esp_err_t setFrameSize(framesize_t size, uint8_t quality, CameraConsumer consumer) {
+    if (setSensorFrameSize(size, quality, consumer)) {
+      return ESP_OK;
+    }
+
+    return configure(size, quality, consumer);
+  }
+
+  // Only the sensor's registers, safe from a task that holds frames. Returns false when the
+  // buffers are too small or the grab mode differs, a reconfiguration is needed then
+  bool setSensorFrameSize(framesize_t size, uint8_t quality, CameraConsumer consumer) {
+    sensor_t *s = halCameraSensor();
+    const pixformat_t format = _config->pixel_format;
+
+    if (!s || frameBufferSize(size, format) > frameBufferSize(_config->frame_size, format) || _grabModes[consumer] != _config->grab_mode) {
+      return false;
+    }
+
+    s->set_quality(s, quality);
+    s->set_framesize(s, size);
+    _consumer = consumer;
+
+    return true;
+  }
+
+  // Reinitializes the driver with buffers sized for the framesize, as many as PSRAM allows
+  // up to STREAM_FB_COUNT, and the consumer's grab mode. On failure the previous configuration
+  // is back in place and the error is returned
+  esp_err_t configure(framesize_t size, uint8_t quality, CameraConsumer consumer) {
+    return reconfigure(size, _config->pixel_format, quality, consumer);
+  }
+
+  // RGB565 and grayscale are for on-device vision, the broadcaster encodes them for viewers.
+  // Raw buffers are much larger, so the switch is a reconfiguration at the current sensor size
+  esp_err_t setPixelFormat(pixformat_t format) {
+    if (format == _config->pixel_format) {
+      return ESP_OK;
+    }
+
+    sensor_t *s = halCameraSensor();
+
+    return reconfigure(s ? s->status.framesize : _config->frame_size, format, _config->jpeg_quality, _consumer);
+  }
+
+  // Switches to size for count frames and back to the stream's settings. The stream is paused
+  // for the whole burst, so the driver is only reinitialized when the stream's buffers are too
+  // small, and frames are copied out to keep the send out of the outage. Returns frames taken
+  int captureBurst(framesize_t size, uint8_t quality, BurstFrame *frames, int count) {
+    const uint64_t startedAt = nowUs();
+    sensor_t *s = halCameraSensor();
+
+    if (!s) {
+      return 0;
+    }
+
+    const framesize_t bufferSize = _config->frame_size;
+    const pixformat_t bufferFormat = _config->pixel_format;
+    const framesize_t streamSize = s->status.framesize;
+    const uint8_t streamQuality = s->status.quality;
+    // stills are always JPEG
+    const bool reinit = bufferFormat != PIXFORMAT_JPEG || jpegBufferSize(size) > frameBufferSize(bufferSize, bufferFormat);
+    int taken = 0;
+
+    if (!_broadcaster->pause(CAMERA_PAUSE_TIMEOUT_MS)) {
+      _broadcaster->resume();
+      _failures++;
+      Serial.println("Camera burst aborted: frames still in use");
+
+      return 0;
+    }
+
+    if (reinit) {
+      // one buffer per burst frame and one to capture into
+      if (reinitDriver(size, PIXFORMAT_JPEG, quality, _grabModes[CAMERA_FOR_PHOTO], count + 1) == ESP_OK) {
+        taken = grabFrames(size, CAMERA_BURST_WARMUP_FRAMES, frames, count);
+      }
+
+      restoreWorking();
+      s = halCameraSensor();
+    } else {
+      s->set_quality(s, quality);
+      s->set_framesize(s, size);
+      taken = grabFrames(size, 0, frames, count);
+    }
+
+    if (s) {
+      s->set_quality(s, streamQuality);
+      s->set_framesize(s, streamSize);
+    }
+
+    _bursts++;
+    _lastBurstMs = (nowUs() - startedAt) / 1000;
+    _broadcaster->resume();
+
+    Serial.printf("📸 Burst of %d/%d %s frames took %ums (%s)\n", taken, count, frameSizeToString(size),
+                  _lastBurstMs, reinit ? "reinit" : "sensor only");
+
+    return taken;
+  }
+
+  void setGrabMode(CameraConsumer consumer, camera_grab_mode_t mode) {
+    _grabModes[consumer] = mode;
+  }
+
+  camera_grab_mode_t grabMode(CameraConsumer consumer) const {
+    return _grabModes[consumer];
+  }
+
+  // Consumer the driver is currently configured for
+  CameraConsumer consumer() const {
+    return _consumer;
+  }
+
+  framesize_t bufferFrameSize() const {
+    return _config->frame_size;
+  }
+
+  pixformat_t pixelFormat() const {
+    return _config->pixel_format;
+  }
+
+  // Size of each driver buffer
+  size_t bufferSize() const {
+    return frameBufferSize(_config->frame_size, _config->pixel_format);
+  }
+
+  size_t fbCount() const {
+    return _config->fb_count;
+  }
+
+  uint32_t reconfigurations() const {
+    return _reconfigurations;
+  }
+
+  uint32_t failures() const {
+    return _failures;
+  }
+
+  uint32_t lastReconfigureMs() const {
+    return _lastReconfigureMs;
+  }
+
+  uint32_t bursts() const {
+    return _bursts;
+  }
+
+  // Time the stream was paused for the latest burst
+  uint32_t lastBurstMs() const {
+    return _lastBurstMs;
+  }
+
+private:
+  camera_config_t *_config;
+  camera_config_t _working; // the last configuration the driver came up with
+  FrameBroadcaster *_broadcaster;
+  camera_grab_mode_t _grabModes[CAMERA_CONSUMER_COUNT];
+  CameraConsumer _consumer;
+
+  uint32_t _reconfigurations;
+  uint32_t _failures;
+  uint32_t _lastReconfigureMs;
+  uint32_t _bursts;
+  uint32_t _lastBurstMs;
+  // One buffer per burst frame, grown to the largest frame seen and kept, so repeated photos
+  // do not allocate once the first burst at a size has been taken
+  uint8_t *_burstData[CAMERA_BURST_MAX_FRAMES];
+  size_t _burstCapacity[CAMERA_BURST_MAX_FRAMES];
+
+  esp_err_t reconfigure(framesize_t size, pixformat_t format, uint8_t quality, CameraConsumer consumer) {
+    const uint64_t startedAt = nowUs();
+    sensor_t *s = halCameraSensor();
+    const framesize_t sensorSize = s ? s->status.framesize : _config->frame_size;
+    const uint8_t sensorQuality = s ? s->status.quality : _config->jpeg_quality;
+
+    report("Reconfiguring camera, previous");
+
+    if (!_broadcaster->pause(CAMERA_PAUSE_TIMEOUT_MS)) {
+      _broadcaster->resume();
+      _failures++;
+      Serial.println("Camera reconfiguration aborted: frames still in use");
+
+      return ESP_FAIL;
+    }
+
+    const esp_err_t err = reinitDriver(size, format, quality, _grabModes[consumer], STREAM_FB_COUNT);
+
+    _reconfigurations++;
+
+    if (err == ESP_OK) {
+      _consumer = consumer;
+      _working = *_config;
+    } else {
+      _failures++;
+      Serial.printf("Camera reinit failed: 0x%x, going back to %s %s\n", err, frameSizeToString(_working.frame_size),
+                    pixelFormatName(_working.pixel_format));
+
+      if (restoreWorking() == ESP_OK && (s = halCameraSensor())) {
+        s->set_quality(s, sensorQuality);
+        s->set_framesize(s, sensorSize);
+      }
+    }
+
+    _lastReconfigureMs = (nowUs() - startedAt) / 1000;
+    _broadcaster->resetPeakInFlight();
+    _broadcaster->resume();
+    report("Camera reconfigured");
+
+    return err;
+  }
+
+  // With the broadcaster paused, after a reinit that failed or a burst's own configuration
+  esp_err_t restoreWorking() {
+    const esp_err_t err = reinitDriver(_working.frame_size, _working.pixel_format, _working.jpeg_quality,
+                                       _working.grab_mode, _working.fb_count);
+
+    if (err != ESP_OK) {
+      Serial.printf("Camera restore failed: 0x%x\n", err);
+    }
+
+    return err;
+  }
+
+  // Buffers sized for the framesize, as many as PSRAM allows up to maxBuffers
+  esp_err_t reinitDriver(framesize_t size, pixformat_t format, uint8_t quality, camera_grab_mode_t grabMode, size_t maxBuffers) {
+    halCameraDeinit();
+
+    const size_t bufferSize = frameBufferSize(size, format);
+    const size_t freePsram = halFreePsram();
+    const size_t available = freePsram > CAMERA_PSRAM_RESERVE ? freePsram - CAMERA_PSRAM_RESERVE : 0;
+
+    _config->frame_size = size;
+    _config->pixel_format = format;
+    _config->jpeg_quality = quality;
+    _config->grab_mode = grabMode;
+    _config->fb_count = constrain(available / bufferSize, 1, maxBuffers);
+
+    esp_err_t err = halCameraInit(_config);
+
+    // the estimate can be off for large frames, retry with fewer buffers before giving up
+    while (err != ESP_OK && _config->fb_count > 1) {
+      halCameraDeinit();
+      _config->fb_count--;
+      err = halCameraInit(_config);
+    }
+
+    return err;
+  }
+
+  // Frames still at the previous size are skipped, they were captured before the switch
+  int grabFrames(framesize_t size, int warmup, BurstFrame *frames, int count) {
+    const FrameResolution &resolution = frameResolutions[size];
+    int taken = 0;
+
+    for (int attempt = 0; taken < count && attempt < count + warmup + STREAM_FB_COUNT; attempt++) {
+      camera_fb_t *fb = halCameraGet();
+
+      if (!fb) {
+        continue;
+      }
+
+      const bool stale = fb->width != resolution.width || fb->height != resolution.height;
+
+      if (stale || warmup > 0) {
+        warmup -= !stale;
+        halCameraReturn(fb);
+        continue;
+      }
+
+      if (_burstCapacity[taken] < fb->len) {
+        free(_burstData[taken]);
+        _burstData[taken] = (uint8_t *)halAllocLarge(fb->len);
+        _burstCapacity[taken] = _burstData[taken] ? fb->len : 0;
+      }
+
+      uint8_t *data = _burstData[taken];
+
+      if (data) {
+        memcpy(data, fb->buf, fb->len);
+        frames[taken++] = {data, fb->len, (uint64_t)fb->timestamp.tv_sec * 1000000ULL + fb->timestamp.tv_usec};
+      }
+
+      halCameraReturn(fb);
+
+      if (!data) {
+        break;
+      }
+    }
+
+    return taken;
+  }
+
+  void report(const char *title) {
+    const LatencyHistogram &fbGet = latencyMetrics.histogram(LAT_CAMERA_FB_GET);
+
+    Serial.printf("📷 %s: %s %s for %s, %u x %uKB buffers, grab %s, peak %d in use, fb_get p50 %uus p99 %uus, "
+                  "took %ums, free PSRAM %uKB, internal heap %uKB\n",
+                  title, frameSizeToString(_config->frame_size), pixelFormatName(_config->pixel_format),
+                  cameraConsumerNames[_consumer], (unsigned)_config->fb_count, (unsigned)(bufferSize() / 1024),
+                  _config->grab_mode == CAMERA_GRAB_LATEST ? "latest" : "when empty", _broadcaster->peakInFlight(),
+                  fbGet.percentileUs(50), fbGet.percentileUs(99), _lastReconfigureMs,
+                  (unsigned)(halFreePsram() / 1024), (unsigned)(halFreeInternalHeap() / 1024));
+  }
+};
@@ -1,9 +1,17 @@
 #ifndef CAR_H
 #define CAR_H
 
+#include "DriveMixer.h"
+#include "FrameBroadcaster.h"
 #include "Motor.h"
-#include <Servo.h>
+#include "hal/Hal.h"
 
+#define CAMERA_JPEG_QUALITY 10
+// LEDC channels of the camera servos, one 50 Hz timer for both
+#define SERVO_X_CHANNEL 6
+#define SERVO_Y_CHANNEL 7
+
+// Buffers are sized for frame_size, CameraPool reinitializes the driver for other sizes
 static camera_config_t camera_config = {
     .pin_pwdn = PWDN_GPIO_NUM,
     .pin_reset = RESET_GPIO_NUM,
@@ -25,9 +33,9 @@ static camera_config_t camera_config = {
     .ledc_timer = LEDC_TIMER_0,
     .ledc_channel = LEDC_CHANNEL_0,
     .pixel_format = PIXFORMAT_JPEG,
-    .frame_size = FRAMESIZE_UXGA,
-    .jpeg_quality = 10,
-    .fb_count = 2,
+    .frame_size = FRAMESIZE_VGA,
+    .jpeg_quality = CAMERA_JPEG_QUALITY,
+    .fb_count = STREAM_FB_COUNT,
     .fb_location = CAMERA_FB_IN_PSRAM,
     .grab_mode = CAMERA_GRAB_LATEST};
 
@@ -35,23 +43,39 @@ class Car {
 public:
   Car()
       : isFlashOn(false),
-        currentAngleX(90),
-        targetAngleX(90),
-        lastUpdate(0),
+        panChannel(-1),
+        tiltChannel(-1),
         lastCommandTime(0),
         motorStopped(true),
+        movingForward(false),
+        forwardVeto(false),
+        vetoScore(0),
+        vetoedCommands(0),
+        vetoStops(0),
         motorL(LEFT_MOTOR_IN1, LEFT_MOTOR_IN2, LEFT_MOTOR_PWM_CHANNEL_1, LEFT_MOTOR_PWM_CHANNEL_2),
         motorR(RIGHT_MOTOR_IN1, RIGHT_MOTOR_IN2, RIGHT_MOTOR_PWM_CHANNEL_1, RIGHT_MOTOR_PWM_CHANNEL_2) {}
 
   esp_err_t init() {
-    pinMode(FLASH_PIN, OUTPUT);
-    digitalWrite(FLASH_PIN, LOW);
+    halPinMode(FLASH_PIN, OUTPUT);
+    halDigitalWrite(FLASH_PIN, LOW);
 
     initMotors();
 
-    bool res = servoX.attach(SERVO_X_PIN, 6);
+    bool res = servoX.attach(SERVO_X_PIN, SERVO_X_CHANNEL, 0, 180, SERVO_MIN_PULSE_US, SERVO_MAX_PULSE_US);
     Serial.printf("Servo X attach result: %s\n", res ? "SUCCESS" : "FAILURE");
-    servoX.write(90);
+    servoX.writeMicroseconds(SERVO_CENTER_PULSE_US);
+    panChannel = ramps.addTrajectory(panTrajectory, onPanRamp, this);
+
+    if (SERVO_Y_PIN >= 0) {
+      res = servoY.attach(SERVO_Y_PIN, SERVO_Y_CHANNEL, 0, 180, SERVO_MIN_PULSE_US, SERVO_MAX_PULSE_US);
+      Serial.printf("Servo Y attach result: %s\n", res ? "SUCCESS" : "FAILURE");
+      servoY.writeMicroseconds(SERVO_CENTER_PULSE_US);
+      tiltChannel = ramps.addTrajectory(tiltTrajectory, onTiltRamp, this);
+    }
+
+    if (!ramps.begin()) {
+      Serial.println("Ramp timer failed");
+    }
 
     lastCommandTime = nowMs();
 
@@ -63,126 +87,133 @@ public:
     motorStopped = false;
   }
 
+  // Motors and the servo ramp on the RampEngine's timer, this only checks for stopping
   void tick() {
-    updateServo();
     tickAutoStop();
-    motorL.tick();
-    motorR.tick();
   }
 
   void toggleFlash() {
     isFlashOn = !isFlashOn;
-    digitalWrite(FLASH_PIN, isFlashOn ? HIGH : LOW);
+    halDigitalWrite(FLASH_PIN, isFlashOn ? HIGH : LOW);
   }
 
   void turnFlashOff() {
     isFlashOn = false;
-    digitalWrite(FLASH_PIN, LOW);
+    halDigitalWrite(FLASH_PIN, LOW);
   }
 
   bool getFlashState() {
     return isFlashOn;
   }
 
-  void moveForward() {
+  // throttle and steer are -DRIVE_INPUT_MAX..DRIVE_INPUT_MAX, positive is forward and right.
+  // 0, 0 stops the motors
+  void drive(int throttle, int steer) {
+    // backing off and turning away stay allowed, only moves towards the obstacle are refused
+    if (throttle > 0 && forwardVeto) {
+      vetoedCommands++;
+      throttle = 0;
+    }
+
+    const WheelSpeeds speeds = mixDrive(throttle, steer);
+
+    if (!speeds.left && !speeds.right) {
+      stop();
+      return;
+    }
+
     onCommand();
-    motorL.moveForward(motorMax);
-    motorR.moveForward(motorMax);
+    movingForward = throttle > 0;
+
+    // both calls, no short circuit
+    if (!(motorL.setSpeed(speeds.left) | motorR.setSpeed(speeds.right))) {
+      latencyMetrics.onPwmUnchanged();
+    }
   }
 
-  void moveBackward() {
-    onCommand();
-    motorL.moveBackward(motorMax);
-    motorR.moveBackward(motorMax);
+  void stop() {
+    if (!(motorL.stop() | motorR.stop())) {
+      latencyMetrics.onPwmUnchanged();
+    }
+
+    motorStopped = true;
+    movingForward = false;
   }
 
-  void turnRight() {
-    onCommand();
-    motorL.moveForward(motorMax);
-    motorR.moveBackward(motorMax);
+  // Motors stopped and the camera still, with no movement command for at least ms
+  bool isParked(uint64_t ms) {
+    return motorStopped && ramps.settled(panChannel) && ramps.settled(tiltChannel) && (uint64_t)elapsedSince(lastCommandTime) >= ms;
   }
 
-  void turnLeft() {
-    onCommand();
-    motorL.moveBackward(motorMax);
-    motorR.moveForward(motorMax);
+  // Set by the vision stage from its own task, the control loop acts on it in tick()
+  void setForwardVeto(bool veto, uint8_t score) {
+    vetoScore = score;
+    forwardVeto = veto;
   }
 
-  void moveForwardLeft() {
-    onCommand();
-    motorL.moveForward(motorMax / 1.5);
-    motorR.moveForward(motorMax);
+  bool forwardVetoed() const {
+    return forwardVeto;
   }
 
-  void moveForwardRight() {
-    onCommand();
-    motorL.moveForward(motorMax);
-    motorR.moveForward(motorMax / 1.5);
+  uint8_t forwardVetoScore() const {
+    return vetoScore;
   }
 
-  void moveBackwardLeft() {
-    onCommand();
-    motorL.moveBackward(motorMax / 1.5);
-    motorR.moveBackward(motorMax);
+  // Forward commands refused while vetoed
+  uint32_t forwardVetoedCommands() const {
+    return vetoedCommands;
   }
 
-  void moveBackwardRight() {
-    onCommand();
-    motorL.moveBackward(motorMax);
-    motorR.moveBackward(motorMax / 1.5);
+  // Forward moves the veto cut short
+  uint32_t forwardVetoStops() const {
+    return vetoStops;
   }
 
-  void stop() {
-    motorL.stop();
-    motorR.stop();
-    motorStopped = true;
+  // x pans, y tilts when there is a tilt servo; both -100..100 over the full pulse range
+  void setCamera(int x, int y) {
+    ramps.track(panChannel, cameraPulse(x));
+    ramps.track(tiltChannel, cameraPulse(y));
   }
 
-  void setCameraX(int x) {
-    x = constrain(x, -100, 100);
-    targetAngleX = map(x, -100, 100, 0, 180);
+  RampEngine &rampEngine() {
+    return ramps;
   }
 
 private:
   bool isFlashOn;
-  Servo servoX;
+  HalServo servoX;
+  HalServo servoY;
+  ServoTrajectory panTrajectory;
+  ServoTrajectory tiltTrajectory;
 
-  int currentAngleX;
-  int targetAngleX;
-  uint64_t lastUpdate;
+  RampEngine ramps;
+  int panChannel;
+  int tiltChannel; // -1 without a tilt servo
 
-  uint8_t motorMax = 255;
   Motor motorL;
   Motor motorR;
 
   uint64_t lastCommandTime;
   bool motorStopped;
+  bool movingForward;
 
-  void updateServo() {
-    uint64_t now = nowMs();
-    const int stepDelay = 5;
-
-    int64_t diff = elapsedSince(lastUpdate);
-
-    if (diff < stepDelay) {
-      return;
-    }
-
-    lastUpdate = now;
+  volatile bool forwardVeto;
+  volatile uint8_t vetoScore;
+  uint32_t vetoedCommands;
+  uint32_t vetoStops;
 
-    if (currentAngleX == targetAngleX) {
-      return;
-    }
+  static int cameraPulse(int position) {
+    position = constrain(position, -100, 100);
 
-    const int delta = targetAngleX - currentAngleX;
-    const int step = constrain(abs(delta) / 4 + 1, 1, 8);
-    currentAngleX += (delta > 0) ? step : -step;
+    return map(position, -100, 100, SERVO_MIN_PULSE_US, SERVO_MAX_PULSE_US);
+  }
 
-    if ((delta > 0 && currentAngleX > targetAngleX) || (delta < 0 && currentAngleX < targetAngleX)) {
-      currentAngleX = targetAngleX;
-    }
+  static void onPanRamp(void *context, int pulseUs) {
+    ((Car *)context)->servoX.writeMicroseconds(pulseUs);
+  }
 
-    servoX.write(currentAngleX);
+  static void onTiltRamp(void *context, int pulseUs) {
+    ((Car *)context)->servoY.writeMicroseconds(pulseUs);
   }
 
   void tickAutoStop() {
@@ -193,28 +224,31 @@ private:
 
     if (!motorStopped && (uint64_t)diff > AUTOSTOP_TIMEOUT_MS) {
       stop();
-      Serial.println("[AutoStop] No command for 500ms, stopping motors");
+      logEvent(LOG_INFO, EV_AUTOSTOP, AUTOSTOP_TIMEOUT_MS);
+    }
+
+    if (movingForward && forwardVeto) {
+      stop();
+      vetoStops++;
+      logEvent(LOG_INFO, EV_VISION_STOP, vetoScore);
     }
   }
 
   esp_err_t initCamera() {
-    esp_err_t err = esp_camera_init(&camera_config);
+    esp_err_t err = halCameraInit(&camera_config);
 
     if (err != ESP_OK) {
       Serial.printf("Camera error: 0x%x\n", err);
       return err;
     }
 
-    sensor_t *s = esp_camera_sensor_get();
+    sensor_t *s = halCameraSensor();
     
     if (!s) {
       Serial.println("NO SENSOR DETECTED");
       return ESP_FAIL;
     }
 
-    s->set_framesize(s, FRAMESIZE_VGA);
-    delay(100);
-
     Serial.println("Camera initialized");
     return ESP_OK;
   }
@@ -223,8 +257,8 @@ private:
     motorL.setMinPwm(200);
     motorR.setMinPwm(200);
 
-    motorL.begin();
-    motorR.begin();
+    motorL.begin(ramps);
+    motorR.begin(ramps);
   }
 };
 
@@ -0,0 +1,195 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary WebSocket control message, little endian:
+//   [opcode u8][seq u16][arg0 i16][arg1 i16]
+// Every opcode uses the same fixed-size layout, unused args are 0
+#define CAR_MESSAGE_SIZE 7
+
+enum CarOpcode : uint8_t {
+  OP_STOP = 0,
+  OP_FORWARD,
+  OP_BACKWARD,
+  OP_LEFT,
+  OP_RIGHT,
+  OP_FORWARD_LEFT,
+  OP_FORWARD_RIGHT,
+  OP_BACKWARD_LEFT,
+  OP_BACKWARD_RIGHT,
+  OP_CAMERA,        // arg0 - x, arg1 - y, both -100..100
+  OP_FRAME_SIZE,    // arg0 - framesize_t, -1 - automatic quality control
+  OP_TOGGLE_FLASH,
+  OP_STREAM_PACING, // arg0 - target fps, arg1 - latency budget ms
+  OP_PING,
+  OP_STATS,
+  OP_RESET,
+  OP_LOG_LEVEL,     // arg0 - LogLevel
+  OP_RECORD,        // arg0 - recording fps, 0 - stop
+  OP_GRAB_MODE,     // arg0 - CameraConsumer, arg1 - camera_grab_mode_t
+  OP_PIXEL_FORMAT,  // arg0 - pixformat_t: JPEG, RGB565 or GRAYSCALE
+  OP_VISION,        // arg0 - 1 obstacle veto on, 0 - off
+  OP_DRIVE,         // arg0 - throttle, arg1 - steer, both -100..100, positive is forward and right
+  OP_VIDEO,         // arg0 - 1 video frames as binary messages on this WebSocket, 0 - off
+  OP_FRAME_ACK,     // arg0 - low 16 bits of a video frame's seq, once shown or dropped. Not acked back
+  OP_UDP_VIDEO,     // arg0 - UDP port (u16) on this WebSocket's peer to send video to, 0 - off; arg1 - kbps, 0 - default
+  OP_COUNT
+};
+
+// The fixed directions of OP_STOP..OP_BACKWARD_RIGHT as OP_DRIVE throttle and steer. On a
+// diagonal the old inner wheel got motorMax / 1.5, which the motors' minPwm of 200 raised to
+// 200. Motor::setSpeed spreads speeds over minPwm..255, so the inner wheel gets the smallest
+// non-zero speed the mixer makes, 2, to land on the same 200: 51 - 50 against 51 + 50
+static const int8_t legacyDriveVectors[OP_BACKWARD_RIGHT + 1][2] = {
+    {0, 0},      // OP_STOP
+    {100, 0},    // OP_FORWARD
+    {-100, 0},   // OP_BACKWARD
+    {0, -100},   // OP_LEFT
+    {0, 100},    // OP_RIGHT
+    {51, -50},   // OP_FORWARD_LEFT
+    {51, 50},    // OP_FORWARD_RIGHT
+    {-51, 50},   // OP_BACKWARD_LEFT
+    {-51, -50},  // OP_BACKWARD_RIGHT
+};
+
+struct CarCommand {
+  uint8_t opcode;
+  uint16_t seq;
+  int16_t arg0;
+  int16_t arg1;
+};
+
+inline bool decodeCarCommand(const uint8_t *data, size_t length, CarCommand &command) {
+  if (length != CAR_MESSAGE_SIZE || data[0] >= OP_COUNT) {
+    return false;
+  }
+
+  command.opcode = data[0];
+  command.seq = (uint16_t)(data[1] | (data[2] << 8));
+  command.arg0 = (int16_t)(data[3] | (data[4] << 8));
+  command.arg1 = (int16_t)(data[5] | (data[6] << 8));
+
+  return true;
+}
+
+inline void encodeCarCommand(const CarCommand &command, uint8_t *data) {
+  data[0] = command.opcode;
+  data[1] = command.seq & 0xFF;
+  data[2] = command.seq >> 8;
+  data[3] = (uint16_t)command.arg0 & 0xFF;
+  data[4] = (uint16_t)command.arg0 >> 8;
+  data[5] = (uint16_t)command.arg1 & 0xFF;
+  data[6] = (uint16_t)command.arg1 >> 8;
+}
+
+// Binary WebSocket video frame from the car, little endian, the JPEG follows:
+//   [kind u8][header size u8][reserved u16][seq u32][sensor time u64, esp_timer us][jpeg length u32]
+// Clients skip header size bytes to the JPEG, so fields can be added at the end
+#define VIDEO_HEADER_SIZE 20
+#define VIDEO_MESSAGE_KIND 0x56 // 'V'
+
+struct VideoFrameHeader {
+  uint32_t seq;
+  uint64_t sensorAtUs;
+  uint32_t length;
+};
+
+inline void encodeVideoHeader(const VideoFrameHeader &header, uint8_t *data) {
+  data[0] = VIDEO_MESSAGE_KIND;
+  data[1] = VIDEO_HEADER_SIZE;
+  data[2] = 0;
+  data[3] = 0;
+
+  for (int i = 0; i < 4; i++) {
+    data[4 + i] = header.seq >> (8 * i);
+    data[16 + i] = header.length >> (8 * i);
+  }
+
+  for (int i = 0; i < 8; i++) {
+    data[8 + i] = header.sensorAtUs >> (8 * i);
+  }
+}
+
+inline bool decodeVideoHeader(const uint8_t *data, size_t length, VideoFrameHeader &header) {
+  if (length < VIDEO_HEADER_SIZE || data[0] != VIDEO_MESSAGE_KIND || data[1] < VIDEO_HEADER_SIZE) {
+    return false;
+  }
+
+  header.seq = 0;
+  header.length = 0;
+  header.sensorAtUs = 0;
+
+  for (int i = 0; i < 4; i++) {
+    header.seq |= (uint32_t)data[4 + i] << (8 * i);
+    header.length |= (uint32_t)data[16 + i] << (8 * i);
+  }
+
+  for (int i = 0; i < 8; i++) {
+    header.sensorAtUs |= (uint64_t)data[8 + i] << (8 * i);
+  }
+
+  return true;
+}
+
+// UDP video packet, little endian, a piece of the JPEG follows:
+//   [kind u8][header size u8][fragment index u16][fragment count u16][reserved u16]
+//   [seq u32][sensor time u64, esp_timer us][jpeg length u32][fragment offset u32]
+// Every fragment carries the whole header, a receiver can place any of them without the others
+#define UDP_VIDEO_HEADER_SIZE 28
+#define UDP_VIDEO_MESSAGE_KIND 0x46 // 'F'
+
+struct VideoFragmentHeader {
+  uint16_t index;
+  uint16_t count;
+  uint32_t seq;
+  uint64_t sensorAtUs;
+  uint32_t length;
+  uint32_t offset;
+};
+
+inline void encodeFragmentHeader(const VideoFragmentHeader &header, uint8_t *data) {
+  data[0] = UDP_VIDEO_MESSAGE_KIND;
+  data[1] = UDP_VIDEO_HEADER_SIZE;
+  data[2] = header.index & 0xFF;
+  data[3] = header.index >> 8;
+  data[4] = header.count & 0xFF;
+  data[5] = header.count >> 8;
+  data[6] = 0;
+  data[7] = 0;
+
+  for (int i = 0; i < 4; i++) {
+    data[8 + i] = header.seq >> (8 * i);
+    data[20 + i] = header.length >> (8 * i);
+    data[24 + i] = header.offset >> (8 * i);
+  }
+
+  for (int i = 0; i < 8; i++) {
+    data[12 + i] = header.sensorAtUs >> (8 * i);
+  }
+}
+
+inline bool decodeFragmentHeader(const uint8_t *data, size_t length, VideoFragmentHeader &header) {
+  if (length < UDP_VIDEO_HEADER_SIZE || data[0] != UDP_VIDEO_MESSAGE_KIND || data[1] < UDP_VIDEO_HEADER_SIZE ||
+      data[1] > length) {
+    return false;
+  }
+
+  header.index = data[2] | data[3] << 8;
+  header.count = data[4] | data[5] << 8;
+  header.seq = 0;
+  header.length = 0;
+  header.offset = 0;
+  header.sensorAtUs = 0;
+
+  for (int i = 0; i < 4; i++) {
+    header.seq |= (uint32_t)data[8 + i] << (8 * i);
+    header.length |= (uint32_t)data[20 + i] << (8 * i);
+    header.offset |= (uint32_t)data[24 + i] << (8 * i);
+  }
+
+  for (int i = 0; i < 8; i++) {
+    header.sensorAtUs |= (uint64_t)data[12 + i] << (8 * i);
+  }
+
+  return header.index < header.count && header.offset + (length - data[1]) <= header.length;
+}
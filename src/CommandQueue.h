@@ -0,0 +1,215 @@
+#pragma once
+#include "CarProtocol.h"
+#include <atomic>
+#include <stdint.h>
+
+// Must be a power of two
+#define COMMAND_QUEUE_SIZE 16
+
+struct QueuedCommand {
+  CarCommand command;
+  int fd;              // WebSocket the command came from, responses go back there
+  uint64_t receivedAt; // us
+};
+
+// Lock-free single producer / single consumer ring of preallocated command slots.
+// The httpd task pushes, the control task pops. A full ring drops the new command
+// instead of blocking the network task
+class CommandQueue {
+public:
+  CommandQueue()
+      : _head(0),
+        _tail(0),
+        _dropped(0),
+        _dequeued(0),
+        _totalWaitUs(0),
+        _maxWaitUs(0) {}
+
+  bool push(const QueuedCommand &item) {
+    const uint32_t head = _head.load(std::memory_order_relaxed);
+
+    if (head - _tail.load(std::memory_order_acquire) >= COMMAND_QUEUE_SIZE) {
+      _dropped++;
+      return false;
+    }
+
+    _slots[head & (COMMAND_QUEUE_SIZE - 1)] = item;
+    _head.store(head + 1, std::memory_order_release);
+
+    return true;
+  }
+
+  bool pop(QueuedCommand &item, uint64_t nowUs) {
+    const uint32_t tail = _tail.load(std::memory_order_relaxed);
+
+    if (tail == _head.load(std::memory_order_acquire)) {
+      return false;
+    }
+
+    item = _slots[tail & (COMMAND_QUEUE_SIZE - 1)];
+    _tail.store(tail + 1, std::memory_order_release);
+
+    const uint32_t waitUs = nowUs > item.receivedAt ? nowUs - item.receivedAt : 0;
+
+    _dequeued++;
+    _totalWaitUs += waitUs;
+
+    if (waitUs > _maxWaitUs) {
+      _maxWaitUs = waitUs;
+    }
+
+    return true;
+  }
+
+  uint32_t dropped() const {
+    return _dropped;
+  }
+
+  uint32_t dequeued() const {
+    return _dequeued;
+  }
+
+  uint32_t averageWaitUs() const {
+    return _dequeued ? _totalWaitUs / _dequeued : 0;
+  }
+
+  uint32_t maxWaitUs() const {
+    return _maxWaitUs;
+  }
+
+private:
+  QueuedCommand _slots[COMMAND_QUEUE_SIZE];
+  std::atomic<uint32_t> _head;
+  std::atomic<uint32_t> _tail;
+
+  uint32_t _dropped;
+  uint32_t _dequeued;
+  uint64_t _totalWaitUs;
+  uint32_t _maxWaitUs;
+};
+
+// Realtime commands only matter as the latest value of their axis: a joystick position that
+// was replaced before the control task ran is stale, not pending
+enum CommandAxis : uint8_t {
+  AXIS_DRIVE = 0, // OP_STOP .. OP_BACKWARD_RIGHT and OP_DRIVE
+  AXIS_CAMERA,    // OP_CAMERA
+  AXIS_COUNT
+};
+
+// -1 for opcodes that are not coalesced
+inline int commandAxis(uint8_t opcode) {
+  if (opcode <= OP_BACKWARD_RIGHT || opcode == OP_DRIVE) {
+    return AXIS_DRIVE;
+  }
+
+  return opcode == OP_CAMERA ? AXIS_CAMERA : -1;
+}
+
+// One slot per axis holding the newest command, written by the httpd task and taken by the
+// control task once per period. Each slot is a sequence lock: the version is odd while the
+// writer is inside, and a reader that sees it change retries on its next period. Nothing
+// blocks and nothing is dropped, a command the control task never saw is counted superseded
+class CommandLatch {
+public:
+  CommandLatch()
+      : _posted(0),
+        _superseded(0),
+        _taken(0),
+        _totalWaitUs(0),
+        _maxWaitUs(0) {
+    for (int i = 0; i < AXIS_COUNT; i++) {
+      _slots[i].version.store(0, std::memory_order_relaxed);
+      _slots[i].takenVersion.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Returns false for opcodes without an axis
+  bool post(const QueuedCommand &item) {
+    const int axis = commandAxis(item.command.opcode);
+
+    if (axis < 0) {
+      return false;
+    }
+
+    Slot &slot = _slots[axis];
+    const uint32_t version = slot.version.load(std::memory_order_relaxed);
+
+    if (version != slot.takenVersion.load(std::memory_order_acquire)) {
+      _superseded++;
+    }
+
+    slot.version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.item = item;
+    slot.version.store(version + 2, std::memory_order_release);
+    _posted++;
+
+    return true;
+  }
+
+  // The axis' newest command if the control task has not taken it yet
+  bool take(int axis, QueuedCommand &item, uint64_t nowUs) {
+    Slot &slot = _slots[axis];
+    const uint32_t version = slot.version.load(std::memory_order_acquire);
+
+    if (version & 1 || version == slot.takenVersion.load(std::memory_order_relaxed)) {
+      return false;
+    }
+
+    item = slot.item;
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (slot.version.load(std::memory_order_relaxed) != version) {
+      return false; // overwritten while copying, the newer one is taken next period
+    }
+
+    slot.takenVersion.store(version, std::memory_order_release);
+
+    const uint32_t waitUs = nowUs > item.receivedAt ? nowUs - item.receivedAt : 0;
+
+    _taken++;
+    _totalWaitUs += waitUs;
+
+    if (waitUs > _maxWaitUs) {
+      _maxWaitUs = waitUs;
+    }
+
+    return true;
+  }
+
+  uint32_t posted() const {
+    return _posted;
+  }
+
+  // Replaced by a newer command of the same axis before the control task took them
+  uint32_t superseded() const {
+    return _superseded;
+  }
+
+  uint32_t taken() const {
+    return _taken;
+  }
+
+  uint32_t averageWaitUs() const {
+    return _taken ? _totalWaitUs / _taken : 0;
+  }
+
+  uint32_t maxWaitUs() const {
+    return _maxWaitUs;
+  }
+
+private:
+  struct Slot {
+    std::atomic<uint32_t> version;
+    std::atomic<uint32_t> takenVersion;
+    QueuedCommand item;
+  };
+
+  Slot _slots[AXIS_COUNT];
+
+  uint32_t _posted;
+  uint32_t _superseded;
+  uint32_t _taken;
+  uint64_t _totalWaitUs;
+  uint32_t _maxWaitUs;
+};
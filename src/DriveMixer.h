@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+
+// Joystick range of OP_DRIVE, same as the camera's
+#define DRIVE_INPUT_MAX 100
+// Wheel speed range, a signed PWM duty: negative is backward
+#define DRIVE_SPEED_MAX 255
+
+struct WheelSpeeds {
+  int16_t left;
+  int16_t right;
+};
+
+// Differential (arcade) mixing: throttle moves both wheels, steer speeds one up and the other
+// down, positive steer turns right. A wheel that would go over full speed scales both down by
+// the same factor, so the turn radius set by the stick is kept instead of clipped. At zero
+// throttle the car spins in place, at full throttle and full steer it pivots on the inner wheel.
+// Integer only and without data-dependent branches, it runs in the control task
+inline WheelSpeeds mixDrive(int throttle, int steer) {
+  throttle = throttle < -DRIVE_INPUT_MAX ? -DRIVE_INPUT_MAX : (throttle > DRIVE_INPUT_MAX ? DRIVE_INPUT_MAX : throttle);
+  steer = steer < -DRIVE_INPUT_MAX ? -DRIVE_INPUT_MAX : (steer > DRIVE_INPUT_MAX ? DRIVE_INPUT_MAX : steer);
+
+  const int left = throttle + steer;
+  const int right = throttle - steer;
+  const int leftMagnitude = abs(left);
+  const int rightMagnitude = abs(right);
+  int scale = leftMagnitude > rightMagnitude ? leftMagnitude : rightMagnitude;
+  scale = scale > DRIVE_INPUT_MAX ? scale : DRIVE_INPUT_MAX;
+
+  WheelSpeeds speeds;
+  speeds.left = left * DRIVE_SPEED_MAX / scale;
+  speeds.right = right * DRIVE_SPEED_MAX / scale;
+
+  return speeds;
+}
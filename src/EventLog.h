@@ -0,0 +1,275 @@
+#pragma once
+#include "hal/Hal.h"
+#include "utils.h"
+#include <atomic>
+
+// Must be a power of two
+#define EVENT_LOG_SIZE 256
+#define EVENT_LOG_DRAIN_MS 20
+
+// 0 - the drain task writes raw records to the UART and `program log-decode` formats them on
+// the host. 1 - it formats them on the car, for a plain serial monitor. The native sim prints
+#ifndef EVENT_LOG_TEXT
+#ifdef NATIVE_BUILD
+#define EVENT_LOG_TEXT 1
+#else
+#define EVENT_LOG_TEXT 0
+#endif
+#endif
+
+// A raw record on the UART, little endian, between the text other code prints:
+//   [0x00][LOG_RECORD_MAGIC][timestamp u32][id u16][level u8][a i32][b i32][sum u8]
+// Text never holds a NUL, so a reader finds records by it. sum is the payload bytes added up
+#define LOG_RECORD_MAGIC 0xE7
+#define LOG_RECORD_SIZE 18
+
+enum LogLevel : uint8_t {
+  LOG_ERROR = 0,
+  LOG_INFO,
+  LOG_DEBUG,
+  LOG_TRACE
+};
+
+enum LogEventId : uint16_t {
+  EV_MOTOR_FORWARD = 0, // a - pwm channel, b - speed
+  EV_MOTOR_BACKWARD,    // a - pwm channel, b - speed
+  EV_AUTOSTOP,          // a - timeout ms
+  EV_COMMAND,           // a - opcode, b - seq
+  EV_TEXT_COMMAND,      // a - opcode, b - message length
+  EV_UNKNOWN_COMMAND,   // a - opcode or -1 for text, b - message length
+  EV_COMMAND_DROPPED,   // a - opcode
+  EV_WS_SEND,           // a - fd, b - length
+  EV_WS_SEND_FAILED,    // a - fd, b - esp_err_t
+  EV_RECORDER_SEGMENT,  // a - segment, b - bytes
+  EV_RECORDER_ERROR,    // a - segment, b - errno
+  EV_VISION_STOP,       // a - obstacle score
+  EV_COUNT
+};
+
+// Indexed by LogEventId, formatted by the drain task only
+static const char *const logEventFormats[EV_COUNT] = {
+    "Motor %d FORWARD - Speed: %d",
+    "Motor %d BACKWARD - Speed: %d",
+    "[AutoStop] No command for %dms, stopping motors",
+    "Command opcode %d seq %d",
+    "Text command opcode %d (%d bytes)",
+    "Unknown command %d (%d bytes)",
+    "Command queue full, dropped opcode %d",
+    "Send on fd %d: %d bytes",
+    "Failed to send WS response on fd %d: 0x%x",
+    "Recorder segment %d closed: %d bytes",
+    "Recorder error on segment %d: errno %d",
+    "[Vision] Obstacle ahead (score %d), stopping motors"};
+
+struct LogEvent {
+  uint32_t timestamp; // nowMs()
+  uint16_t id;
+  uint8_t level;
+  int32_t a;
+  int32_t b;
+};
+
+inline void encodeLogRecord(const LogEvent &event, uint8_t *data) {
+  const uint32_t a = (uint32_t)event.a;
+  const uint32_t b = (uint32_t)event.b;
+  uint8_t sum = 0;
+
+  data[0] = 0x00;
+  data[1] = LOG_RECORD_MAGIC;
+
+  for (int i = 0; i < 4; i++) {
+    data[2 + i] = event.timestamp >> (8 * i);
+    data[9 + i] = a >> (8 * i);
+    data[13 + i] = b >> (8 * i);
+  }
+
+  data[6] = event.id & 0xFF;
+  data[7] = event.id >> 8;
+  data[8] = event.level;
+
+  for (int i = 2; i < LOG_RECORD_SIZE - 1; i++) {
+    sum += data[i];
+  }
+
+  data[LOG_RECORD_SIZE - 1] = sum;
+}
+
+// A whole record from its NUL on, false when the magic or the sum is off
+inline bool decodeLogRecord(const uint8_t *data, LogEvent &event) {
+  uint8_t sum = 0;
+
+  for (int i = 2; i < LOG_RECORD_SIZE - 1; i++) {
+    sum += data[i];
+  }
+
+  if (data[0] != 0x00 || data[1] != LOG_RECORD_MAGIC || sum != data[LOG_RECORD_SIZE - 1]) {
+    return false;
+  }
+
+  event.timestamp = 0;
+  uint32_t a = 0;
+  uint32_t b = 0;
+
+  for (int i = 0; i < 4; i++) {
+    event.timestamp |= (uint32_t)data[2 + i] << (8 * i);
+    a |= (uint32_t)data[9 + i] << (8 * i);
+    b |= (uint32_t)data[13 + i] << (8 * i);
+  }
+
+  event.id = (uint16_t)(data[6] | (data[7] << 8));
+  event.level = data[8];
+  event.a = (int32_t)a;
+  event.b = (int32_t)b;
+
+  return true;
+}
+
+// The line an event reads as, the same on the car and in the host decoder
+inline int formatLogEvent(const LogEvent &event, char *line, size_t size) {
+  char text[96];
+  const char *format = event.id < EV_COUNT ? logEventFormats[event.id] : "Event %d %d";
+
+  snprintf(text, sizeof(text), format, event.a, event.b);
+
+  return snprintf(line, size, "[%u] %s\n", event.timestamp, text);
+}
+
+// Lock-free multi-producer / single-consumer ring of binary log events (bounded MPMC queue
+// with per-slot sequence numbers). Logging from the control path costs a few atomics and a
+// 16 byte copy, the UART happens in the drain task. A full ring drops the event
+class EventLog {
+public:
+  EventLog()
+      : _level(LOG_INFO),
+        _head(0),
+        _tail(0),
+        _dropped(0) {
+    for (uint32_t i = 0; i < EVENT_LOG_SIZE; i++) {
+      _slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  void begin() {
+    xTaskCreatePinnedToCore(
+        drainTask,
+        "EventLog",
+        3072,
+        this,
+        1,
+        nullptr,
+        0);
+  }
+
+  void setLevel(uint8_t level) {
+    _level = level > LOG_TRACE ? LOG_TRACE : level;
+  }
+
+  uint8_t level() const {
+    return _level;
+  }
+
+  bool enabled(uint8_t level) const {
+    return level <= _level;
+  }
+
+  void log(uint8_t level, uint16_t id, int32_t a = 0, int32_t b = 0) {
+    if (level > _level) {
+      return;
+    }
+
+    uint32_t pos = _head.load(std::memory_order_relaxed);
+    Slot *slot;
+
+    for (;;) {
+      slot = &_slots[pos & (EVENT_LOG_SIZE - 1)];
+      const int32_t diff = (int32_t)(slot->seq.load(std::memory_order_acquire) - pos);
+
+      if (diff == 0) {
+        if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      } else {
+        pos = _head.load(std::memory_order_relaxed);
+      }
+    }
+
+    slot->event.timestamp = (uint32_t)nowMs();
+    slot->event.id = id;
+    slot->event.level = level;
+    slot->event.a = a;
+    slot->event.b = b;
+    slot->seq.store(pos + 1, std::memory_order_release);
+  }
+
+  // Single consumer only
+  bool pop(LogEvent &event) {
+    Slot *slot = &_slots[_tail & (EVENT_LOG_SIZE - 1)];
+
+    if (slot->seq.load(std::memory_order_acquire) != _tail + 1) {
+      return false;
+    }
+
+    event = slot->event;
+    slot->seq.store(_tail + EVENT_LOG_SIZE, std::memory_order_release);
+    _tail++;
+
+    return true;
+  }
+
+  uint32_t dropped() const {
+    return _dropped.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Slot {
+    std::atomic<uint32_t> seq;
+    LogEvent event;
+  };
+
+  Slot _slots[EVENT_LOG_SIZE];
+  volatile uint8_t _level;
+  std::atomic<uint32_t> _head;
+  uint32_t _tail;
+  std::atomic<uint32_t> _dropped;
+
+  static void drainTask(void *param) {
+    EventLog *self = (EventLog *)param;
+    uint32_t reportedDrops = 0;
+    LogEvent event;
+#if EVENT_LOG_TEXT
+    char line[128];
+#else
+    uint8_t record[LOG_RECORD_SIZE];
+#endif
+
+    for (;;) {
+      while (self->pop(event)) {
+#if EVENT_LOG_TEXT
+        formatLogEvent(event, line, sizeof(line));
+        Serial.print(line);
+#else
+        encodeLogRecord(event, record);
+        Serial.write(record, LOG_RECORD_SIZE);
+#endif
+      }
+
+      const uint32_t dropped = self->dropped();
+
+      if (dropped != reportedDrops) {
+        Serial.printf("[EventLog] %u events dropped\n", dropped - reportedDrops);
+        reportedDrops = dropped;
+      }
+
+      vTaskDelay(EVENT_LOG_DRAIN_MS / portTICK_PERIOD_MS);
+    }
+  }
+};
+
+extern EventLog eventLog;
+
+inline void logEvent(uint8_t level, uint16_t id, int32_t a = 0, int32_t b = 0) {
+  eventLog.log(level, id, a, b);
+}
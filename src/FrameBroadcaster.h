@@ -0,0 +1,465 @@
+#pragma once
+#include "HeapWatermark.h"
+#include "JpegEncoder.h"
+#include "LatencyMetrics.h"
+#include "MotionDetector.h"
+#include "hal/Hal.h"
+#include "utils.h"
+
+// Max simultaneous /stream viewers (driver, co-pilot, dashboard...)
+#define STREAM_MAX_CLIENTS 3
+// Frames consumers hold at once: one per stream viewer, the on-board recorder, the vision
+// stage and the UDP video sender. Also the subscriber slots, the stream sender takes one for
+// all viewers
+#define FRAME_MAX_SUBSCRIBERS (STREAM_MAX_CLIENTS + 3)
+// Every subscriber may hold one frame while the broadcaster holds the latest one
+// and the driver keeps one free buffer to capture into
+#define STREAM_FB_COUNT (FRAME_MAX_SUBSCRIBERS + 2)
+// Same quality the frame2jpg path used for raw sensor formats
+#define FRAME_ENCODE_QUALITY 80
+
+// Camera frame shared between all stream clients. The frame buffer goes back to
+// the driver once the last reference is released. jpeg is what consumers send or store:
+// the driver's buffer in JPEG mode, the slot's encode buffer for raw sensor formats
+struct SharedFrame {
+  camera_fb_t *fb;
+  const uint8_t *jpeg;
+  size_t jpegLength;
+  uint32_t seq;
+  uint64_t capturedAt;
+  uint64_t sensorAtUs;  // fb->timestamp, end of the sensor readout
+  uint64_t fetchedAtUs; // esp_camera_fb_get returned
+  bool changed;         // MotionDetector verdict, always true while detection is off
+  int refs;
+};
+
+class FrameBroadcaster {
+public:
+  FrameBroadcaster()
+      : _latest(nullptr),
+        _seq(0),
+        _clientCount(0),
+        _inFlight(0),
+        _peakInFlight(0),
+        _paused(false),
+        _capturing(false),
+        _detectMotion(false),
+        _motionRestart(false),
+        _lastPublishUs(0),
+        _frameIntervalUs(0),
+        _outagePending(false),
+        _lastOutageUs(0),
+        _lastOutageFramesLost(0),
+        _framesLost(0),
+        _lock(nullptr),
+        _captureTask(nullptr),
+        _encodeFailures(0),
+        _encodeGrew(false) {
+    memset(_frames, 0, sizeof(_frames));
+    memset(_clients, 0, sizeof(_clients));
+    memset(_encoded, 0, sizeof(_encoded));
+    memset(_encodedCapacity, 0, sizeof(_encodedCapacity));
+  }
+
+  void begin() {
+    _lock = xSemaphoreCreateMutex();
+
+    xTaskCreatePinnedToCore(
+        captureTask,
+        "FrameCapture",
+        4096,
+        this,
+        5,
+        &_captureTask,
+        tskNO_AFFINITY);
+  }
+
+  // Registers the calling task as a frame consumer. Returns false when all slots are taken
+  bool subscribe() {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    bool added = false;
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+
+    for (int i = 0; i < FRAME_MAX_SUBSCRIBERS; i++) {
+      if (!_clients[i]) {
+        _clients[i] = task;
+        _clientCount++;
+        added = true;
+        break;
+      }
+    }
+
+    xSemaphoreGive(_lock);
+
+    if (added) {
+      xTaskNotifyGive(_captureTask);
+    }
+
+    return added;
+  }
+
+  void unsubscribe() {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+
+    for (int i = 0; i < FRAME_MAX_SUBSCRIBERS; i++) {
+      if (_clients[i] == task) {
+        _clients[i] = nullptr;
+        _clientCount--;
+        break;
+      }
+    }
+
+    xSemaphoreGive(_lock);
+  }
+
+  int clientCount() {
+    return _clientCount;
+  }
+
+  // Returns the newest frame with a sequence different from lastSeq, or nullptr on timeout.
+  // Frames captured while the caller was busy are skipped, so a slow client only drops
+  // its own frames. Every returned frame must be handed back with release()
+  SharedFrame *acquire(uint32_t lastSeq, uint32_t timeoutMs) {
+    const uint64_t start = nowMs();
+
+    for (;;) {
+      xSemaphoreTake(_lock, portMAX_DELAY);
+      SharedFrame *frame = _latest;
+
+      if (frame && frame->seq != lastSeq) {
+        frame->refs++;
+        xSemaphoreGive(_lock);
+
+        return frame;
+      }
+
+      xSemaphoreGive(_lock);
+
+      const uint64_t waited = elapsedSince(start);
+
+      if (waited >= timeoutMs) {
+        return nullptr;
+      }
+
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeoutMs - waited));
+    }
+  }
+
+  void release(SharedFrame *frame) {
+    if (!frame) {
+      return;
+    }
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+
+    if (--frame->refs == 0) {
+      halCameraReturn(frame->fb);
+      frame->fb = nullptr;
+      _inFlight--;
+    }
+
+    xSemaphoreGive(_lock);
+  }
+
+  // Stops capturing and waits until every frame buffer is back with the driver, so the camera
+  // can be deinitialized. Subscribers stay registered and simply see no new frames
+  bool pause(uint32_t timeoutMs) {
+    const uint64_t start = nowMs();
+
+    _paused = true;
+
+    while (_capturing && elapsedSince(start) < timeoutMs) {
+      vTaskDelay(1);
+    }
+
+    // after the frame being captured is published, only a running stream has an outage
+    _outagePending = _clientCount > 0 && _lastPublishUs;
+
+    dropLatest();
+
+    while (_inFlight && elapsedSince(start) < timeoutMs) {
+      vTaskDelay(1);
+    }
+
+    return !_capturing && !_inFlight;
+  }
+
+  void resume() {
+    _paused = false;
+    xTaskNotifyGive(_captureTask);
+  }
+
+  // Frame buffers currently held by the broadcaster and its subscribers
+  int inFlight() const {
+    return _inFlight;
+  }
+
+  int peakInFlight() const {
+    return _peakInFlight;
+  }
+
+  void resetPeakInFlight() {
+    _peakInFlight = _inFlight;
+  }
+
+  // Runs the motion detector on every captured frame while enabled. Turning it on takes the
+  // next frame as the reference
+  void detectMotion(bool enabled) {
+    if (enabled && !_detectMotion) {
+      _motionRestart = true;
+    }
+
+    _detectMotion = enabled;
+  }
+
+  bool detectingMotion() const {
+    return _detectMotion;
+  }
+
+  const MotionDetector &motion() const {
+    return _motion;
+  }
+
+  // Gap between the last frame before the latest pause and the first one after it
+  uint32_t lastOutageUs() const {
+    return _lastOutageUs;
+  }
+
+  // Frames the sensor would have delivered during the latest outage, at the measured rate
+  uint32_t lastOutageFramesLost() const {
+    return _lastOutageFramesLost;
+  }
+
+  uint32_t framesLost() const {
+    return _framesLost;
+  }
+
+  // Raw frames dropped because the encode buffer could not be allocated or was too small
+  uint32_t encodeFailures() const {
+    return _encodeFailures;
+  }
+
+  // Allocations per captured frame, once the capture loop is warm
+  const HeapWatermark &heap() const {
+    return _heap;
+  }
+
+private:
+  SharedFrame _frames[STREAM_FB_COUNT];
+  SharedFrame *_latest;
+  uint32_t _seq;
+
+  TaskHandle_t _clients[FRAME_MAX_SUBSCRIBERS];
+  volatile int _clientCount;
+  volatile int _inFlight;
+  volatile int _peakInFlight;
+  volatile bool _paused;
+  volatile bool _capturing;
+  volatile bool _detectMotion;
+  volatile bool _motionRestart;
+  MotionDetector _motion; // used by the capture task only
+
+  uint64_t _lastPublishUs;
+  uint32_t _frameIntervalUs; // moving average while streaming
+  volatile bool _outagePending;
+  uint32_t _lastOutageUs;
+  uint32_t _lastOutageFramesLost;
+  uint32_t _framesLost;
+
+  SemaphoreHandle_t _lock;
+  TaskHandle_t _captureTask;
+
+  // Raw sensor formats are encoded once here, not per subscriber. One buffer per slot, sized
+  // on first use and kept, so steady state streaming allocates nothing
+  JpegEncoder _encoder;
+  uint8_t *_encoded[STREAM_FB_COUNT];
+  size_t _encodedCapacity[STREAM_FB_COUNT];
+  uint32_t _encodeFailures;
+  bool _encodeGrew; // an encode buffer was reallocated for a larger frame size
+  HeapWatermark _heap;
+
+  static void captureTask(void *param) {
+    FrameBroadcaster *self = (FrameBroadcaster *)param;
+    AllocationProbe probe;
+
+    probe.restart();
+
+    for (;;) {
+      // raised before checking _paused, so pause() either sees it or this task sees the pause
+      self->_capturing = true;
+
+      if (self->_clientCount == 0 || self->_paused) {
+        self->_capturing = false;
+        self->dropLatest();
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // a pause may have reconfigured the camera, the next frames can size buffers again
+        probe.restart();
+        continue;
+      }
+
+      const uint64_t requestedAt = nowUs();
+      camera_fb_t *fb = halCameraGet();
+      const uint64_t fetchedAt = nowUs();
+
+      if (!fb) {
+        self->_capturing = false;
+        // fb_get already waited for the sensor, retry soon instead of adding a fixed 100ms
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+        continue;
+      }
+
+      latencyMetrics.record(LAT_CAMERA_FB_GET, requestedAt, fetchedAt);
+      self->publish(fb, fetchedAt);
+      self->_capturing = false;
+
+      if (self->_encodeGrew) {
+        self->_encodeGrew = false;
+        probe.restart();
+      } else {
+        self->_heap.record(probe);
+      }
+    }
+  }
+
+  bool checkMotion(const SharedFrame *frame, uint64_t fetchedAtUs) {
+    if (!_detectMotion) {
+      return true;
+    }
+
+    if (_motionRestart) {
+      _motionRestart = false;
+      _motion.reset();
+    }
+
+    const uint64_t scanStart = nowUs();
+    const bool changed = _motion.onFrame(frame->jpeg, frame->jpegLength, fetchedAtUs);
+    _motion.addScanTime(nowUs() - scanStart);
+
+    return changed;
+  }
+
+  // Points the slot at the JPEG to hand out, encoding raw formats into the slot's buffer
+  bool encode(SharedFrame *slot) {
+    camera_fb_t *fb = slot->fb;
+
+    if (fb->format == PIXFORMAT_JPEG) {
+      slot->jpeg = fb->buf;
+      slot->jpegLength = fb->len;
+
+      return true;
+    }
+
+    const int index = slot - _frames;
+    // a JPEG of a camera frame stays well below one byte per pixel at this quality
+    const size_t capacity = fb->width * fb->height;
+
+    if (_encodedCapacity[index] < capacity) {
+      free(_encoded[index]);
+      _encoded[index] = (uint8_t *)halAllocLarge(capacity);
+      _encodedCapacity[index] = _encoded[index] ? capacity : 0;
+      _encodeGrew = true;
+    }
+
+    const uint64_t start = nowUs();
+
+    slot->jpeg = _encoded[index];
+    slot->jpegLength = _encoded[index] ? _encoder.encode(fb->buf, fb->width, fb->height, fb->format, FRAME_ENCODE_QUALITY,
+                                                         _encoded[index], _encodedCapacity[index])
+                                       : 0;
+    latencyMetrics.record(LAT_FRAME_ENCODE, start, nowUs());
+
+    return slot->jpegLength > 0;
+  }
+
+  void publish(camera_fb_t *fb, uint64_t fetchedAtUs) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+
+    SharedFrame *slot = nullptr;
+
+    for (int i = 0; i < STREAM_FB_COUNT; i++) {
+      if (!_frames[i].fb) {
+        slot = &_frames[i];
+        slot->fb = fb; // taken, refs stay 0 until it is published
+        break;
+      }
+    }
+
+    xSemaphoreGive(_lock);
+
+    if (!slot) {
+      // more frames in flight than the driver should be able to hand out
+      halCameraReturn(fb);
+
+      return;
+    }
+
+    // outside the lock, subscribers keep taking the previous frame meanwhile
+    if (!encode(slot)) {
+      _encodeFailures++;
+      xSemaphoreTake(_lock, portMAX_DELAY);
+      slot->fb = nullptr;
+      xSemaphoreGive(_lock);
+      halCameraReturn(fb);
+
+      return;
+    }
+
+    const bool changed = checkMotion(slot, fetchedAtUs);
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+
+    slot->seq = ++_seq;
+    slot->capturedAt = nowMs();
+    slot->sensorAtUs = (uint64_t)fb->timestamp.tv_sec * 1000000ULL + fb->timestamp.tv_usec;
+    slot->fetchedAtUs = fetchedAtUs;
+    slot->changed = changed;
+    latencyMetrics.record(LAT_FRAME_SENSOR_TO_FETCH, slot->sensorAtUs, fetchedAtUs);
+    slot->refs = 1; // broadcaster's own reference while the frame is the latest one
+    trackInterval(fetchedAtUs);
+
+    if (++_inFlight > _peakInFlight) {
+      _peakInFlight = _inFlight;
+    }
+
+    SharedFrame *previous = _latest;
+    _latest = slot;
+
+    // notify under the lock so an unsubscribed task is never woken after it's gone
+    for (int i = 0; i < FRAME_MAX_SUBSCRIBERS; i++) {
+      if (_clients[i]) {
+        xTaskNotifyGive(_clients[i]);
+      }
+    }
+
+    xSemaphoreGive(_lock);
+
+    release(previous);
+  }
+
+  void trackInterval(uint64_t fetchedAtUs) {
+    const uint64_t interval = fetchedAtUs - _lastPublishUs;
+
+    if (_outagePending) {
+      _outagePending = false;
+      _lastOutageUs = interval;
+      _lastOutageFramesLost = _frameIntervalUs && interval > _frameIntervalUs ? (interval + _frameIntervalUs / 2) / _frameIntervalUs - 1 : 0;
+      _framesLost += _lastOutageFramesLost;
+    } else if (_lastPublishUs && interval < 1000000) {
+      _frameIntervalUs = _frameIntervalUs ? (_frameIntervalUs * 7 + interval) / 8 : interval;
+    }
+
+    _lastPublishUs = fetchedAtUs;
+  }
+
+  void dropLatest() {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    SharedFrame *previous = _latest;
+    _latest = nullptr;
+    xSemaphoreGive(_lock);
+
+    release(previous);
+  }
+};
@@ -0,0 +1,129 @@
+#pragma once
+#include <stdint.h>
+
+#define SEND_HISTOGRAM_BUCKETS 10
+#define PACER_MAX_WAIT_US 500000
+
+// Send durations in power-of-two millisecond buckets: <1, <2, <4 ... <256, >=256 ms
+struct SendHistogram {
+  uint32_t buckets[SEND_HISTOGRAM_BUCKETS];
+
+  void add(uint32_t sendUs) {
+    uint32_t ms = sendUs / 1000;
+    int index = 0;
+
+    while (ms && index < SEND_HISTOGRAM_BUCKETS - 1) {
+      ms >>= 1;
+      index++;
+    }
+
+    buckets[index]++;
+  }
+};
+
+// Decides how long a stream client waits before taking the next frame.
+// Pure C++ with caller-supplied timestamps, so it does not depend on the camera or the socket.
+//
+// Two limits are combined:
+//  - targetFps: frame period to keep (0 - as fast as frames and the link allow)
+//  - latencyBudgetUs: when sending a frame takes longer than the budget the link is the
+//    bottleneck, and the client backs off by the overrun so the socket drains and the
+//    next frame goes out fresh instead of queueing behind the previous one
+class FramePacer {
+public:
+  FramePacer()
+      : _targetFps(0),
+        _latencyBudgetUs(0),
+        _sendAvgUs(0),
+        _windowStart(0),
+        _windowFrames(0),
+        _fps(0) {
+    reset();
+  }
+
+  void configure(uint8_t targetFps, uint32_t latencyBudgetUs) {
+    _targetFps = targetFps;
+    _latencyBudgetUs = latencyBudgetUs;
+  }
+
+  void reset() {
+    _sendAvgUs = 0;
+    _windowStart = 0;
+    _windowFrames = 0;
+    _fps = 0;
+
+    for (int i = 0; i < SEND_HISTOGRAM_BUCKETS; i++) {
+      _histogram.buckets[i] = 0;
+    }
+  }
+
+  // frameStartUs - when the client started working on the frame, sendUs - time spent in send,
+  // nowUs - current time. Returns microseconds to wait before taking the next frame
+  uint32_t onFrameSent(uint64_t frameStartUs, uint32_t sendUs, uint64_t nowUs) {
+    _histogram.add(sendUs);
+    // EWMA with 1/8 weight, settles in a few frames but ignores single spikes
+    _sendAvgUs = _sendAvgUs ? _sendAvgUs + ((int32_t)sendUs - (int32_t)_sendAvgUs) / 8 : sendUs;
+
+    updateFps(nowUs);
+
+    uint32_t waitUs = 0;
+
+    if (_targetFps) {
+      const uint64_t periodUs = 1000000 / _targetFps;
+      const uint64_t spentUs = nowUs > frameStartUs ? nowUs - frameStartUs : 0;
+
+      if (spentUs < periodUs) {
+        waitUs = periodUs - spentUs;
+      }
+    }
+
+    if (_latencyBudgetUs && _sendAvgUs > _latencyBudgetUs) {
+      const uint32_t overrunUs = _sendAvgUs - _latencyBudgetUs;
+
+      if (overrunUs > waitUs) {
+        waitUs = overrunUs;
+      }
+    }
+
+    return waitUs < PACER_MAX_WAIT_US ? waitUs : PACER_MAX_WAIT_US;
+  }
+
+  float fps() const {
+    return _fps;
+  }
+
+  uint32_t averageSendUs() const {
+    return _sendAvgUs;
+  }
+
+  const SendHistogram &histogram() const {
+    return _histogram;
+  }
+
+private:
+  uint8_t _targetFps;
+  uint32_t _latencyBudgetUs;
+
+  uint32_t _sendAvgUs;
+  SendHistogram _histogram;
+
+  uint64_t _windowStart;
+  uint32_t _windowFrames;
+  float _fps;
+
+  void updateFps(uint64_t nowUs) {
+    if (!_windowStart) {
+      _windowStart = nowUs;
+    }
+
+    _windowFrames++;
+
+    const uint64_t windowUs = nowUs - _windowStart;
+
+    if (windowUs >= 1000000) {
+      _fps = _windowFrames * 1000000.0f / windowUs;
+      _windowStart = nowUs;
+      _windowFrames = 0;
+    }
+  }
+};
@@ -0,0 +1,407 @@
+#pragma once
+#include "EventLog.h"
+#include "FrameBroadcaster.h"
+#include "hal/Hal.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define RECORDER_DIR "rec"
+// LittleFS block size, every write except the last one of a segment is a multiple of it
+#define RECORDER_BLOCK_SIZE 4096
+#define RECORDER_SEGMENT_SIZE (256 * 1024)
+// Ring of up to 1MB, the default partition table leaves ~1.4MB for LittleFS
+#define RECORDER_MAX_SEGMENTS 4
+#define RECORDER_MAX_FPS 30
+
+// One entry per frame in <segment>.idx, little endian like the rest of the device formats
+struct RecordIndexEntry {
+  uint32_t offset; // in <segment>.mjpg
+  uint32_t length;
+  uint32_t timestampMs;
+  uint32_t seq;
+};
+
+#define RECORDER_INDEX_ENTRIES (RECORDER_BLOCK_SIZE / sizeof(RecordIndexEntry))
+
+// Records the broadcaster's frames into a ring of fixed-size MJPEG segments (concatenated
+// JPEGs) with a frame index each. The recorder is just another subscriber holding one frame
+// at a time, so a slow flash write drops recorder frames, never stream frames.
+//
+// Writes go out in whole blocks: the head of a frame tops up the staging block, the aligned
+// middle is written straight from the camera buffer and only the tail is copied. The index
+// is flushed when its block fills and when the segment closes
+class FrameRecorder {
+public:
+  FrameRecorder()
+      : _broadcaster(nullptr),
+        _task(nullptr),
+        _recording(false),
+        _fps(0),
+        _firstSegment(0),
+        _nextSegment(0),
+        _data(nullptr),
+        _index(nullptr),
+        _segmentBytes(0),
+        _staged(0),
+        _indexed(0),
+        _framesWritten(0),
+        _framesDropped(0),
+        _bytesWritten(0),
+        _writeUs(0),
+        _segmentsRecycled(0),
+        _writeErrors(0) {}
+
+  void begin(FrameBroadcaster &broadcaster) {
+    _broadcaster = &broadcaster;
+    scanSegments();
+
+    xTaskCreatePinnedToCore(
+        recorderTask,
+        "FrameRecorder",
+        4096,
+        this,
+        2,
+        &_task,
+        tskNO_AFFINITY);
+  }
+
+  void start(uint8_t fps) {
+    _fps = constrain(fps, 1, RECORDER_MAX_FPS);
+    _recording = true;
+    xTaskNotifyGive(_task);
+  }
+
+  // The segment is closed by the recorder task once its current frame is written
+  void stop() {
+    _recording = false;
+  }
+
+  bool recording() const {
+    return _recording;
+  }
+
+  uint8_t fps() const {
+    return _fps;
+  }
+
+  uint32_t segments() const {
+    return _nextSegment - _firstSegment;
+  }
+
+  uint32_t framesWritten() const {
+    return _framesWritten;
+  }
+
+  uint32_t framesDropped() const {
+    return _framesDropped;
+  }
+
+  uint64_t bytesWritten() const {
+    return _bytesWritten;
+  }
+
+  // Sustained flash throughput while writing, KB/s
+  uint32_t throughputKBps() const {
+    return _writeUs ? _bytesWritten * 1000000ULL / _writeUs / 1024 : 0;
+  }
+
+  uint32_t segmentsRecycled() const {
+    return _segmentsRecycled;
+  }
+
+  uint32_t writeErrors() const {
+    return _writeErrors;
+  }
+
+private:
+  FrameBroadcaster *_broadcaster;
+  TaskHandle_t _task;
+  volatile bool _recording;
+  uint8_t _fps;
+
+  uint32_t _firstSegment; // oldest segment on disk
+  uint32_t _nextSegment;  // number the next opened segment gets
+  FILE *_data;
+  FILE *_index;
+  uint32_t _segmentBytes; // written to the data file
+  uint32_t _staged;       // waiting in _block
+  uint32_t _indexed;      // waiting in _entries
+
+  uint8_t _block[RECORDER_BLOCK_SIZE] __attribute__((aligned(4)));
+  RecordIndexEntry _entries[RECORDER_INDEX_ENTRIES];
+
+  uint32_t _framesWritten;
+  uint32_t _framesDropped;
+  uint64_t _bytesWritten;
+  uint64_t _writeUs;
+  uint32_t _segmentsRecycled;
+  uint32_t _writeErrors;
+
+  static void recorderTask(void *param) {
+    FrameRecorder *self = (FrameRecorder *)param;
+
+    for (;;) {
+      if (!self->_recording) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        continue;
+      }
+
+      self->record();
+    }
+  }
+
+  void record() {
+    uint32_t lastSeq = 0;
+    uint64_t nextDueUs = nowUs();
+
+    _broadcaster->subscribe();
+
+    while (_recording) {
+      SharedFrame *frame = _broadcaster->acquire(lastSeq, 1000);
+
+      if (!frame) {
+        continue;
+      }
+
+      lastSeq = frame->seq;
+      const bool ok = writeFrame(frame);
+      _broadcaster->release(frame);
+
+      if (!ok) {
+        _recording = false;
+        break;
+      }
+
+      // frames that were due while the previous write was still going count as dropped
+      const uint32_t periodUs = 1000000 / _fps;
+      const uint64_t now = nowUs();
+      nextDueUs += periodUs;
+
+      if (now >= nextDueUs) {
+        _framesDropped += (now - nextDueUs) / periodUs;
+        nextDueUs = now;
+      } else {
+        vTaskDelay(std::max<uint32_t>((nextDueUs - now) / 1000 / portTICK_PERIOD_MS, 1));
+      }
+    }
+
+    _broadcaster->unsubscribe();
+    closeSegment();
+  }
+
+  bool writeFrame(const SharedFrame *frame) {
+    const size_t length = frame->jpegLength;
+
+    if (length > RECORDER_SEGMENT_SIZE) {
+      _framesDropped++;
+      return true;
+    }
+
+    if (!_data || _segmentBytes + _staged + length > RECORDER_SEGMENT_SIZE) {
+      closeSegment();
+
+      if (!openSegment()) {
+        return false;
+      }
+    }
+
+    RecordIndexEntry &entry = _entries[_indexed++];
+    entry.offset = _segmentBytes + _staged;
+    entry.length = length;
+    entry.timestampMs = frame->capturedAt;
+    entry.seq = frame->seq;
+
+    if (_indexed == RECORDER_INDEX_ENTRIES && !flushIndex()) {
+      return false;
+    }
+
+    if (!append(frame->jpeg, length)) {
+      return false;
+    }
+
+    _framesWritten++;
+
+    return true;
+  }
+
+  bool append(const uint8_t *data, size_t length) {
+    if (_staged) {
+      const size_t topUp = std::min<size_t>(length, RECORDER_BLOCK_SIZE - _staged);
+
+      memcpy(_block + _staged, data, topUp);
+      _staged += topUp;
+      data += topUp;
+      length -= topUp;
+
+      if (_staged < RECORDER_BLOCK_SIZE) {
+        return true;
+      }
+
+      _staged = 0;
+
+      if (!writeData(_block, RECORDER_BLOCK_SIZE)) {
+        return false;
+      }
+    }
+
+    const size_t direct = length & ~(size_t)(RECORDER_BLOCK_SIZE - 1);
+
+    if (direct && !writeData(data, direct)) {
+      return false;
+    }
+
+    memcpy(_block, data + direct, length - direct);
+    _staged = length - direct;
+
+    return true;
+  }
+
+  bool writeData(const uint8_t *data, size_t length) {
+    const uint64_t start = nowUs();
+    const size_t written = fwrite(data, 1, length, _data);
+
+    _writeUs += nowUs() - start;
+    _segmentBytes += written;
+    _bytesWritten += written;
+
+    if (written != length) {
+      _writeErrors++;
+      logEvent(LOG_ERROR, EV_RECORDER_ERROR, _nextSegment - 1, errno);
+
+      return false;
+    }
+
+    return true;
+  }
+
+  bool flushIndex() {
+    const size_t length = _indexed * sizeof(RecordIndexEntry);
+    const bool ok = fwrite(_entries, 1, length, _index) == length;
+
+    _indexed = 0;
+
+    if (!ok) {
+      _writeErrors++;
+      logEvent(LOG_ERROR, EV_RECORDER_ERROR, _nextSegment - 1, errno);
+    }
+
+    return ok;
+  }
+
+  void segmentPath(char *path, size_t size, uint32_t segment, const char *extension) {
+    snprintf(path, size, "%s/" RECORDER_DIR "/%05u.%s", halStorageRoot(), segment, extension);
+  }
+
+  bool openSegment() {
+    // keep room for one full segment, the oldest recordings go first
+    while (segments() && (segments() >= RECORDER_MAX_SEGMENTS || halStorageFree() < RECORDER_SEGMENT_SIZE + RECORDER_BLOCK_SIZE)) {
+      removeOldestSegment();
+    }
+
+    if (halStorageFree() < RECORDER_SEGMENT_SIZE + RECORDER_BLOCK_SIZE) {
+      logEvent(LOG_ERROR, EV_RECORDER_ERROR, _nextSegment, ENOSPC);
+      return false;
+    }
+
+    char path[64];
+
+    segmentPath(path, sizeof(path), _nextSegment, "mjpg");
+    _data = fopen(path, "wb");
+    segmentPath(path, sizeof(path), _nextSegment, "idx");
+    _index = fopen(path, "wb");
+
+    if (!_data || !_index) {
+      _writeErrors++;
+      logEvent(LOG_ERROR, EV_RECORDER_ERROR, _nextSegment, errno);
+      closeSegment();
+
+      return false;
+    }
+
+    // writes are already block sized, stdio buffering would only add a copy
+    setvbuf(_data, nullptr, _IONBF, 0);
+    setvbuf(_index, nullptr, _IONBF, 0);
+
+    _segmentBytes = 0;
+    _staged = 0;
+    _indexed = 0;
+    _nextSegment++;
+
+    return true;
+  }
+
+  void closeSegment() {
+    if (_data && _staged) {
+      writeData(_block, _staged);
+    }
+
+    if (_index && _indexed) {
+      flushIndex();
+    }
+
+    if (_data) {
+      fclose(_data);
+      logEvent(LOG_INFO, EV_RECORDER_SEGMENT, _nextSegment - 1, _segmentBytes);
+    }
+
+    if (_index) {
+      fclose(_index);
+    }
+
+    _data = nullptr;
+    _index = nullptr;
+    _staged = 0;
+    _indexed = 0;
+  }
+
+  void removeOldestSegment() {
+    char path[64];
+
+    segmentPath(path, sizeof(path), _firstSegment, "mjpg");
+    remove(path);
+    segmentPath(path, sizeof(path), _firstSegment, "idx");
+    remove(path);
+
+    _firstSegment++;
+    _segmentsRecycled++;
+  }
+
+  // Continues the numbering of segments left from previous drives
+  void scanSegments() {
+    char path[64];
+    mkdir(halStorageRoot(), 0775);
+    snprintf(path, sizeof(path), "%s/" RECORDER_DIR, halStorageRoot());
+    mkdir(path, 0775);
+
+    DIR *dir = opendir(path);
+    bool found = false;
+
+    if (!dir) {
+      return;
+    }
+
+    while (dirent *entry = readdir(dir)) {
+      unsigned segment;
+      char extension[8];
+
+      if (sscanf(entry->d_name, "%u.%7s", &segment, extension) != 2 || strcmp(extension, "mjpg") != 0) {
+        continue;
+      }
+
+      if (!found || segment < _firstSegment) {
+        _firstSegment = segment;
+      }
+
+      if (!found || segment >= _nextSegment) {
+        _nextSegment = segment + 1;
+      }
+
+      found = true;
+    }
+
+    closedir(dir);
+  }
+};
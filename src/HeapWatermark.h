@@ -0,0 +1,103 @@
+#pragma once
+#include "hal/Hal.h"
+#include <atomic>
+#include <stdint.h>
+
+// Iterations a loop may allocate in after it starts or is reconfigured: grow-only buffers
+// reach their size on the first frames at a new frame size
+#define HEAP_WARMUP_ITERATIONS 8
+
+// Heap allocations of one loop iteration, from the counters halTaskAllocations keeps per task.
+// Lives in the loop's own task, one per task
+class AllocationProbe {
+public:
+  AllocationProbe()
+      : _last(0),
+        _warmup(HEAP_WARMUP_ITERATIONS) {}
+
+  // From the loop's task, before the first iteration and after anything that resizes buffers
+  void restart() {
+    _last = halTaskAllocations();
+    _warmup = HEAP_WARMUP_ITERATIONS;
+  }
+
+  // Allocations since the previous call, or since restart()
+  uint32_t sample() {
+    const uint32_t count = halTaskAllocations();
+    const uint32_t allocations = count - _last;
+
+    _last = count;
+    _warmup -= _warmup > 0;
+
+    return allocations;
+  }
+
+  // Past the warmup, allocations from here on are a leak into the steady state
+  bool warm() const {
+    return !_warmup;
+  }
+
+private:
+  uint32_t _last;
+  uint32_t _warmup;
+};
+
+// Allocations per iteration of a steady-state loop (frame capture, stream send, control tick),
+// counted once the loop is warm. Zero allocating iterations is the goal: a malloc per frame
+// fragments PSRAM and takes the heap lock other tasks wait on. Several tasks may record into
+// one watermark, the counters are relaxed atomics
+class HeapWatermark {
+public:
+  HeapWatermark()
+      : _iterations(0),
+        _allocations(0),
+        _allocatingIterations(0),
+        _worst(0) {}
+
+  // End of an iteration
+  void record(AllocationProbe &probe) {
+    const uint32_t allocations = probe.sample();
+
+    if (!probe.warm()) {
+      return;
+    }
+
+    _iterations.fetch_add(1, std::memory_order_relaxed);
+
+    if (!allocations) {
+      return;
+    }
+
+    _allocations.fetch_add(allocations, std::memory_order_relaxed);
+    _allocatingIterations.fetch_add(1, std::memory_order_relaxed);
+
+    uint32_t worst = _worst.load(std::memory_order_relaxed);
+
+    while (allocations > worst && !_worst.compare_exchange_weak(worst, allocations, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Warm iterations counted
+  uint32_t iterations() const {
+    return _iterations.load(std::memory_order_relaxed);
+  }
+
+  uint32_t allocations() const {
+    return _allocations.load(std::memory_order_relaxed);
+  }
+
+  uint32_t allocatingIterations() const {
+    return _allocatingIterations.load(std::memory_order_relaxed);
+  }
+
+  // Most allocations in one warm iteration
+  uint32_t worst() const {
+    return _worst.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint32_t> _iterations;
+  std::atomic<uint32_t> _allocations;
+  std::atomic<uint32_t> _allocatingIterations;
+  std::atomic<uint32_t> _worst;
+};
@@ -0,0 +1,506 @@
+#pragma once
+#include "hal/Hal.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+static const uint8_t jpegZigzag[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+// T.81 annex K tables
+static const uint8_t jpegBaseQuant[2][64] = {
+    {16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+     14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+     18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+     49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99},
+    {17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+     24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+     99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+     99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99}};
+
+static const uint8_t jpegDcLumaBits[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t jpegDcChromaBits[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+static const uint8_t jpegDcValues[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+static const uint8_t jpegAcLumaBits[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const uint8_t jpegAcLumaValues[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa};
+
+static const uint8_t jpegAcChromaBits[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+static const uint8_t jpegAcChromaValues[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa};
+
+// Baseline JPEG encoder for the sensor's raw formats: RGB565 (big endian, as the camera
+// delivers it) to YCbCr 4:2:0 and grayscale to a single component. The frame is processed one
+// MCU (16x16 or 8x8) at a time: the tile is converted straight into DCT input, so the pixels
+// are read once and the working set stays in a few KB. The DCT is the float AAN one, every
+// step applied to a whole row of 8 values, which the host compiler vectorizes and the ESP32
+// FPU runs without int emulation. Output goes to a caller-owned buffer, nothing is allocated
+class JpegEncoder {
+public:
+  JpegEncoder()
+      : _quality(0),
+        _tablesBuilt(false) {}
+
+  // quality 1-100 like fmt2jpg. Returns the JPEG length, 0 when the format is not supported
+  // or the output does not fit into capacity
+  size_t encode(const uint8_t *pixels, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality,
+                uint8_t *out, size_t capacity) {
+    if ((format != PIXFORMAT_RGB565 && format != PIXFORMAT_GRAYSCALE) || !width || !height) {
+      return 0;
+    }
+
+    setQuality(quality);
+
+    const bool color = format == PIXFORMAT_RGB565;
+
+    _out = out;
+    _outEnd = out + capacity;
+    _overflow = false;
+    _bits = 0;
+    _bitCount = 0;
+
+    writeHeaders(width, height, color);
+
+    int predY = 0;
+    int predCb = 0;
+    int predCr = 0;
+
+    if (color) {
+      for (int y = 0; y < height && !_overflow; y += 16) {
+        for (int x = 0; x < width; x += 16) {
+          loadColorTile(pixels, width, height, x, y);
+
+          for (int b = 0; b < 4; b++) {
+            encodeBlock(_y[b], _fdtbl[0], predY, _dcLuma, _acLuma);
+          }
+
+          encodeBlock(_cb, _fdtbl[1], predCb, _dcChroma, _acChroma);
+          encodeBlock(_cr, _fdtbl[1], predCr, _dcChroma, _acChroma);
+        }
+      }
+    } else {
+      for (int y = 0; y < height && !_overflow; y += 8) {
+        for (int x = 0; x < width; x += 8) {
+          loadGrayTile(pixels, width, height, x, y);
+          encodeBlock(_y[0], _fdtbl[0], predY, _dcLuma, _acLuma);
+        }
+      }
+    }
+
+    // pad the last byte with ones, as T.81 asks
+    putBits(0x7F, 7);
+    putByte(0xFF);
+    putByte(0xD9);
+
+    return _overflow ? 0 : _out - out;
+  }
+
+private:
+  struct HuffmanCode {
+    uint16_t code;
+    uint8_t length;
+  };
+
+  uint8_t _quality;
+  uint8_t _quant[2][64]; // natural order
+  float _fdtbl[2][64];   // 1 / (quant x AAN scale), natural order
+
+  float _y[4][64];
+  float _cb[64];
+  float _cr[64];
+
+  HuffmanCode _dcLuma[12];
+  HuffmanCode _acLuma[256];
+  HuffmanCode _dcChroma[12];
+  HuffmanCode _acChroma[256];
+  bool _tablesBuilt;
+
+  uint8_t *_out;
+  uint8_t *_outEnd;
+  bool _overflow;
+  uint32_t _bits;
+  int _bitCount;
+
+  void setQuality(uint8_t quality) {
+    quality = quality < 1 ? 1 : (quality > 100 ? 100 : quality);
+
+    if (!_tablesBuilt) {
+      buildCodes(jpegDcLumaBits, jpegDcValues, _dcLuma);
+      buildCodes(jpegAcLumaBits, jpegAcLumaValues, _acLuma);
+      buildCodes(jpegDcChromaBits, jpegDcValues, _dcChroma);
+      buildCodes(jpegAcChromaBits, jpegAcChromaValues, _acChroma);
+      _tablesBuilt = true;
+    }
+
+    if (quality == _quality) {
+      return;
+    }
+
+    static const float aanScale[8] = {1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+                                      1.0f, 0.785694958f, 0.541196100f, 0.275899379f};
+    // libjpeg's quality scaling, so the numbers mean what they mean everywhere else
+    const int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+    for (int t = 0; t < 2; t++) {
+      for (int i = 0; i < 64; i++) {
+        int q = (jpegBaseQuant[t][i] * scale + 50) / 100;
+        q = q < 1 ? 1 : (q > 255 ? 255 : q);
+
+        _quant[t][i] = q;
+        _fdtbl[t][i] = 1.0f / (q * aanScale[i / 8] * aanScale[i % 8] * 8.0f);
+      }
+    }
+
+    _quality = quality;
+  }
+
+  static void buildCodes(const uint8_t *bits, const uint8_t *values, HuffmanCode *codes) {
+    uint16_t code = 0;
+    int index = 0;
+
+    for (int length = 1; length <= 16; length++) {
+      for (int i = 0; i < bits[length - 1]; i++) {
+        codes[values[index++]] = {code++, (uint8_t)length};
+      }
+
+      code <<= 1;
+    }
+  }
+
+  // Edge tiles repeat the last column and row, which compresses better than black
+  void loadColorTile(const uint8_t *pixels, int width, int height, int x0, int y0) {
+    float cb[16][16];
+    float cr[16][16];
+
+    for (int row = 0; row < 16; row++) {
+      const int y = y0 + row < height ? y0 + row : height - 1;
+      const uint8_t *line = pixels + (size_t)y * width * 2;
+      float r[16];
+      float g[16];
+      float b[16];
+
+      for (int col = 0; col < 16; col++) {
+        const int x = x0 + col < width ? x0 + col : width - 1;
+        const uint8_t hi = line[x * 2];
+        const uint8_t lo = line[x * 2 + 1];
+
+        r[col] = (hi & 0xF8) | (hi >> 5);
+        g[col] = ((hi & 0x07) << 5) | ((lo & 0xE0) >> 3) | ((hi & 0x07) >> 1);
+        b[col] = ((lo & 0x1F) << 3) | ((lo & 0x1F) >> 2);
+      }
+
+      // plain loops over the row, this is what gets vectorized
+      float *luma = _y[(row / 8) * 2] + (row % 8) * 8;
+
+      for (int col = 0; col < 8; col++) {
+        luma[col] = 0.299f * r[col] + 0.587f * g[col] + 0.114f * b[col] - 128.0f;
+        luma[64 + col] = 0.299f * r[col + 8] + 0.587f * g[col + 8] + 0.114f * b[col + 8] - 128.0f;
+      }
+
+      for (int col = 0; col < 16; col++) {
+        cb[row][col] = -0.168736f * r[col] - 0.331264f * g[col] + 0.5f * b[col];
+        cr[row][col] = 0.5f * r[col] - 0.418688f * g[col] - 0.081312f * b[col];
+      }
+    }
+
+    for (int row = 0; row < 8; row++) {
+      for (int col = 0; col < 8; col++) {
+        _cb[row * 8 + col] = 0.25f * (cb[row * 2][col * 2] + cb[row * 2][col * 2 + 1] + cb[row * 2 + 1][col * 2] + cb[row * 2 + 1][col * 2 + 1]);
+        _cr[row * 8 + col] = 0.25f * (cr[row * 2][col * 2] + cr[row * 2][col * 2 + 1] + cr[row * 2 + 1][col * 2] + cr[row * 2 + 1][col * 2 + 1]);
+      }
+    }
+  }
+
+  void loadGrayTile(const uint8_t *pixels, int width, int height, int x0, int y0) {
+    for (int row = 0; row < 8; row++) {
+      const int y = y0 + row < height ? y0 + row : height - 1;
+      const uint8_t *line = pixels + (size_t)y * width;
+
+      for (int col = 0; col < 8; col++) {
+        const int x = x0 + col < width ? x0 + col : width - 1;
+        _y[0][row * 8 + col] = line[x] - 128.0f;
+      }
+    }
+  }
+
+  // One AAN pass down the columns of the block: every statement works on a row of 8
+  static void dctColumns(float *block) {
+    float *d0 = block;
+    float *d1 = block + 8;
+    float *d2 = block + 16;
+    float *d3 = block + 24;
+    float *d4 = block + 32;
+    float *d5 = block + 40;
+    float *d6 = block + 48;
+    float *d7 = block + 56;
+
+    for (int c = 0; c < 8; c++) {
+      const float tmp0 = d0[c] + d7[c];
+      const float tmp7 = d0[c] - d7[c];
+      const float tmp1 = d1[c] + d6[c];
+      const float tmp6 = d1[c] - d6[c];
+      const float tmp2 = d2[c] + d5[c];
+      const float tmp5 = d2[c] - d5[c];
+      const float tmp3 = d3[c] + d4[c];
+      const float tmp4 = d3[c] - d4[c];
+
+      const float tmp10 = tmp0 + tmp3;
+      const float tmp13 = tmp0 - tmp3;
+      const float tmp11 = tmp1 + tmp2;
+      const float tmp12 = tmp1 - tmp2;
+
+      d0[c] = tmp10 + tmp11;
+      d4[c] = tmp10 - tmp11;
+
+      const float z1 = (tmp12 + tmp13) * 0.707106781f;
+      d2[c] = tmp13 + z1;
+      d6[c] = tmp13 - z1;
+
+      const float odd10 = tmp4 + tmp5;
+      const float odd11 = tmp5 + tmp6;
+      const float odd12 = tmp6 + tmp7;
+
+      const float z5 = (odd10 - odd12) * 0.382683433f;
+      const float z2 = 0.541196100f * odd10 + z5;
+      const float z4 = 1.306562965f * odd12 + z5;
+      const float z3 = odd11 * 0.707106781f;
+
+      const float z11 = tmp7 + z3;
+      const float z13 = tmp7 - z3;
+
+      d5[c] = z13 + z2;
+      d3[c] = z13 - z2;
+      d1[c] = z11 + z4;
+      d7[c] = z11 - z4;
+    }
+  }
+
+  static void transpose(float *block) {
+    for (int r = 0; r < 8; r++) {
+      for (int c = r + 1; c < 8; c++) {
+        const float t = block[r * 8 + c];
+        block[r * 8 + c] = block[c * 8 + r];
+        block[c * 8 + r] = t;
+      }
+    }
+  }
+
+  void encodeBlock(float *block, const float *fdtbl, int &predictor, const HuffmanCode *dc, const HuffmanCode *ac) {
+    int coefficients[64];
+
+    dctColumns(block);
+    transpose(block);
+    dctColumns(block);
+
+    // the block is transposed now, which jpegZigzag and the tables are symmetric enough not to
+    // care about: read it back through the transposed index
+    for (int i = 0; i < 64; i++) {
+      const int natural = jpegZigzag[i];
+      const float value = block[(natural % 8) * 8 + natural / 8] * fdtbl[natural];
+
+      coefficients[i] = (int)(value < 0 ? value - 0.5f : value + 0.5f);
+    }
+
+    const int diff = coefficients[0] - predictor;
+    predictor = coefficients[0];
+    putValue(diff, dc);
+
+    int run = 0;
+
+    for (int i = 1; i < 64; i++) {
+      if (!coefficients[i]) {
+        run++;
+        continue;
+      }
+
+      while (run > 15) {
+        putCode(ac[0xF0]);
+        run -= 16;
+      }
+
+      putValue(coefficients[i], ac, run);
+      run = 0;
+    }
+
+    if (run) {
+      putCode(ac[0x00]);
+    }
+  }
+
+  // Category code, prefixed by the run for AC values, followed by the value's bits
+  void putValue(int value, const HuffmanCode *codes, int run = 0) {
+    const int magnitude = value < 0 ? -value : value;
+    int category = 0;
+
+    while (magnitude >> category) {
+      category++;
+    }
+
+    putCode(codes[(run << 4) | category]);
+
+    if (category) {
+      putBits((value < 0 ? value - 1 : value) & ((1 << category) - 1), category);
+    }
+  }
+
+  void putCode(const HuffmanCode &code) {
+    putBits(code.code, code.length);
+  }
+
+  void putBits(uint32_t value, int count) {
+    _bits |= value << (32 - _bitCount - count);
+    _bitCount += count;
+
+    while (_bitCount >= 8) {
+      const uint8_t byte = _bits >> 24;
+
+      putByte(byte);
+
+      if (byte == 0xFF) {
+        putByte(0x00);
+      }
+
+      _bits <<= 8;
+      _bitCount -= 8;
+    }
+  }
+
+  void putByte(uint8_t byte) {
+    if (_out < _outEnd) {
+      *_out++ = byte;
+    } else {
+      _overflow = true;
+    }
+  }
+
+  void putWord(uint16_t word) {
+    putByte(word >> 8);
+    putByte(word & 0xFF);
+  }
+
+  void putHuffmanTable(uint8_t id, const uint8_t *bits, const uint8_t *values, int count) {
+    putByte(id);
+
+    for (int i = 0; i < 16; i++) {
+      putByte(bits[i]);
+    }
+
+    for (int i = 0; i < count; i++) {
+      putByte(values[i]);
+    }
+  }
+
+  void writeHeaders(uint16_t width, uint16_t height, bool color) {
+    static const uint8_t jfif[] = {0xFF, 0xD8, 0xFF, 0xE0, 0, 16, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0};
+    const int tables = color ? 2 : 1;
+
+    for (uint8_t byte : jfif) {
+      putByte(byte);
+    }
+
+    putWord(0xFFDB);
+    putWord(2 + tables * 65);
+
+    for (int t = 0; t < tables; t++) {
+      putByte(t);
+
+      for (int i = 0; i < 64; i++) {
+        putByte(_quant[t][jpegZigzag[i]]);
+      }
+    }
+
+    putWord(0xFFC0);
+    putWord(8 + (color ? 3 : 1) * 3);
+    putByte(8);
+    putWord(height);
+    putWord(width);
+    putByte(color ? 3 : 1);
+    putByte(1);
+    putByte(color ? 0x22 : 0x11);
+    putByte(0);
+
+    if (color) {
+      putByte(2);
+      putByte(0x11);
+      putByte(1);
+      putByte(3);
+      putByte(0x11);
+      putByte(1);
+    }
+
+    putWord(0xFFC4);
+    putWord(2 + (17 + 12) + (17 + 162) + (color ? (17 + 12) + (17 + 162) : 0));
+    putHuffmanTable(0x00, jpegDcLumaBits, jpegDcValues, 12);
+    putHuffmanTable(0x10, jpegAcLumaBits, jpegAcLumaValues, 162);
+
+    if (color) {
+      putHuffmanTable(0x01, jpegDcChromaBits, jpegDcValues, 12);
+      putHuffmanTable(0x11, jpegAcChromaBits, jpegAcChromaValues, 162);
+    }
+
+    putWord(0xFFDA);
+    putWord(6 + (color ? 3 : 1) * 2);
+    putByte(color ? 3 : 1);
+    putByte(1);
+    putByte(0x00);
+
+    if (color) {
+      putByte(2);
+      putByte(0x11);
+      putByte(3);
+      putByte(0x11);
+    }
+
+    putByte(0);
+    putByte(63);
+    putByte(0);
+  }
+};
+
+// Benchmark input for both targets: gradients, a checkerboard of edges and a little noise,
+// somewhere between a flat wall and a busy street
+inline void fillEncoderTestPattern(uint8_t *pixels, int width, int height, pixformat_t format) {
+  uint32_t noise = 12345;
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      noise = noise * 1103515245 + 12345;
+      const int jitter = (int)((noise >> 16) & 15) - 8;
+      const int r = constrain(x * 255 / width + jitter, 0, 255);
+      const int g = constrain(y * 255 / height + jitter, 0, 255);
+      const int b = ((x / 16 + y / 16) & 1) ? 200 : 40;
+
+      if (format == PIXFORMAT_GRAYSCALE) {
+        pixels[y * width + x] = (r * 77 + g * 150 + b * 29) >> 8;
+      } else {
+        const uint16_t pixel = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+        pixels[(y * width + x) * 2] = pixel >> 8;
+        pixels[(y * width + x) * 2 + 1] = pixel & 0xFF;
+      }
+    }
+  }
+}
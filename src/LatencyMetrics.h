@@ -0,0 +1,192 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <stdint.h>
+
+#define LATENCY_HISTOGRAM_BUCKETS 16
+#define LATENCY_HISTOGRAM_FIRST_US 64
+
+enum LatencyStage : uint8_t {
+  LAT_FRAME_SENSOR_TO_FETCH = 0,   // sensor timestamp -> esp_camera_fb_get returned
+  LAT_FRAME_FETCH_TO_FIRST_BYTE,   // fb_get returned -> part header sent to a viewer
+  LAT_FRAME_FIRST_TO_LAST_BYTE,    // part header sent -> last JPEG byte accepted by the socket
+  LAT_FRAME_SENSOR_TO_LAST_BYTE,   // whole on-board part of glass-to-glass
+  LAT_COMMAND_RECEIVE_TO_DISPATCH, // WS frame received -> handler running
+  LAT_COMMAND_DISPATCH_TO_PWM,     // movement handler ran -> first LEDC write after it
+  LAT_COMMAND_RECEIVE_TO_PWM,
+  LAT_CAMERA_FB_GET,               // time blocked in esp_camera_fb_get
+  LAT_FRAME_ENCODE,                // raw sensor frame -> JPEG, RGB565 and grayscale modes only
+  LAT_VISION_FRAME,                // obstacle check of one frame
+  LAT_FRAME_SENSOR_TO_ACK,         // sensor timestamp -> WS video viewer acked the frame as shown
+  LAT_STAGE_COUNT
+};
+
+static const char *const latencyStageNames[LAT_STAGE_COUNT] = {
+    "frameSensorToFetch",
+    "frameFetchToFirstByte",
+    "frameFirstToLastByte",
+    "frameSensorToLastByte",
+    "commandReceiveToDispatch",
+    "commandDispatchToPwm",
+    "commandReceiveToPwm",
+    "cameraFbGet",
+    "frameEncode",
+    "visionFrame",
+    "frameSensorToAck"};
+
+// Durations in power-of-two microsecond buckets: <64, <128 ... <1048576, >=1048576 us.
+// Every counter is a relaxed atomic, so any task may record while another one reads
+class LatencyHistogram {
+public:
+  LatencyHistogram()
+      : _count(0),
+        _maxUs(0) {
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+      _buckets[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void add(uint32_t us) {
+    uint32_t scaled = us / LATENCY_HISTOGRAM_FIRST_US;
+    int index = 0;
+
+    while (scaled && index < LATENCY_HISTOGRAM_BUCKETS - 1) {
+      scaled >>= 1;
+      index++;
+    }
+
+    _buckets[index].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+
+    uint32_t max = _maxUs.load(std::memory_order_relaxed);
+
+    while (us > max && !_maxUs.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+    }
+  }
+
+  uint32_t count() const {
+    return _count.load(std::memory_order_relaxed);
+  }
+
+  uint32_t maxUs() const {
+    return _maxUs.load(std::memory_order_relaxed);
+  }
+
+  uint32_t bucket(int index) const {
+    return _buckets[index].load(std::memory_order_relaxed);
+  }
+
+  // Exclusive upper bound of a bucket, 0 for the open-ended last one
+  static uint32_t bucketLimitUs(int index) {
+    return index < LATENCY_HISTOGRAM_BUCKETS - 1 ? LATENCY_HISTOGRAM_FIRST_US << index : 0;
+  }
+
+  // Upper bound of the bucket holding the given percentile, capped at the max
+  uint32_t percentileUs(uint8_t percentile) const {
+    const uint32_t total = count();
+
+    if (!total) {
+      return 0;
+    }
+
+    const uint32_t rank = ((uint64_t)total * percentile + 99) / 100;
+    uint32_t seen = 0;
+
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS - 1; i++) {
+      seen += bucket(i);
+
+      if (seen >= rank) {
+        return std::min(bucketLimitUs(i), maxUs());
+      }
+    }
+
+    return maxUs();
+  }
+
+  void reset() {
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+      _buckets[i].store(0, std::memory_order_relaxed);
+    }
+
+    _count.store(0, std::memory_order_relaxed);
+    _maxUs.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint32_t> _buckets[LATENCY_HISTOGRAM_BUCKETS];
+  std::atomic<uint32_t> _count;
+  std::atomic<uint32_t> _maxUs;
+};
+
+// Stage timings of the video and control paths, to see where glass-to-glass latency goes.
+// Timestamps are nowUs() values; a later stage stamped before an earlier one (clock
+// mismatch, missing timestamp) is dropped instead of recorded as a huge duration
+class LatencyMetrics {
+public:
+  LatencyMetrics()
+      : _pendingCommandAt(0),
+        _pendingDispatchAt(0),
+        _pending(false) {}
+
+  void record(uint8_t stage, uint64_t fromUs, uint64_t toUs) {
+    if (stage >= LAT_STAGE_COUNT || !fromUs || toUs < fromUs) {
+      return;
+    }
+
+    _histograms[stage].add(toUs - fromUs);
+  }
+
+  // Control task only, before the command is applied: remembers a movement command until the
+  // motors put it on the pins. The stamps are handed over to the ramp timer through _pending
+  void onMovementDispatched(uint64_t receivedUs, uint64_t nowUs) {
+    if (!_pending.load(std::memory_order_acquire)) {
+      _pendingCommandAt = receivedUs;
+      _pendingDispatchAt = nowUs;
+      _pending.store(true, std::memory_order_release);
+    }
+  }
+
+  // Called by Motor after every LEDC write, from the ramp timer
+  void onPwmWrite(uint64_t nowUs) {
+    if (!_pending.load(std::memory_order_acquire)) {
+      return;
+    }
+
+    const uint64_t commandAt = _pendingCommandAt;
+    const uint64_t dispatchAt = _pendingDispatchAt;
+
+    if (takePending()) {
+      record(LAT_COMMAND_DISPATCH_TO_PWM, dispatchAt, nowUs);
+      record(LAT_COMMAND_RECEIVE_TO_PWM, commandAt, nowUs);
+    }
+  }
+
+  // The command left the duties as they were: no write will come for it
+  void onPwmUnchanged() {
+    takePending();
+  }
+
+  const LatencyHistogram &histogram(uint8_t stage) const {
+    return _histograms[stage];
+  }
+
+  void reset() {
+    for (int i = 0; i < LAT_STAGE_COUNT; i++) {
+      _histograms[i].reset();
+    }
+  }
+
+private:
+  LatencyHistogram _histograms[LAT_STAGE_COUNT];
+  uint64_t _pendingCommandAt;
+  uint64_t _pendingDispatchAt;
+  std::atomic<bool> _pending; // stamps above are set and not taken yet
+
+  bool takePending() {
+    bool expected = true;
+
+    return _pending.compare_exchange_strong(expected, false, std::memory_order_acq_rel);
+  }
+};
+
+extern LatencyMetrics latencyMetrics;
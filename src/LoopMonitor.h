@@ -0,0 +1,101 @@
+#pragma once
+#include <stdint.h>
+
+// Timing statistics of a fixed-period loop.
+// Every iteration has a deadline one period after its scheduled wake-up; finishing later
+// than that counts as a deadline miss. Jitter is the distance between the actual and the
+// scheduled wake-up
+class LoopMonitor {
+public:
+  LoopMonitor()
+      : _periodUs(0) {
+    reset(0, 0);
+  }
+
+  void reset(uint32_t periodUs, uint64_t nowUs) {
+    _periodUs = periodUs;
+    _scheduledUs = nowUs;
+    _lastWakeUs = 0;
+    _iterations = 0;
+    _misses = 0;
+    _worstPeriodUs = 0;
+    _maxJitterUs = 0;
+    _totalJitterUs = 0;
+    _maxBusyUs = 0;
+  }
+
+  void onWake(uint64_t nowUs) {
+    // same schedule as vTaskDelayUntil: a late loop keeps its wake times and catches up
+    _scheduledUs += _periodUs;
+
+    const uint32_t jitterUs = nowUs > _scheduledUs ? nowUs - _scheduledUs : _scheduledUs - nowUs;
+
+    if (_lastWakeUs) {
+      const uint32_t periodUs = nowUs - _lastWakeUs;
+
+      if (periodUs > _worstPeriodUs) {
+        _worstPeriodUs = periodUs;
+      }
+    }
+
+    if (jitterUs > _maxJitterUs) {
+      _maxJitterUs = jitterUs;
+    }
+
+    _totalJitterUs += jitterUs;
+    _iterations++;
+    _lastWakeUs = nowUs;
+  }
+
+  void onDone(uint64_t nowUs) {
+    const uint32_t busyUs = nowUs - _lastWakeUs;
+
+    if (busyUs > _maxBusyUs) {
+      _maxBusyUs = busyUs;
+    }
+
+    if (nowUs > _scheduledUs + _periodUs) {
+      _misses++;
+    }
+  }
+
+  uint32_t periodUs() const {
+    return _periodUs;
+  }
+
+  uint32_t iterations() const {
+    return _iterations;
+  }
+
+  uint32_t misses() const {
+    return _misses;
+  }
+
+  uint32_t worstPeriodUs() const {
+    return _worstPeriodUs;
+  }
+
+  uint32_t maxJitterUs() const {
+    return _maxJitterUs;
+  }
+
+  uint32_t averageJitterUs() const {
+    return _iterations ? _totalJitterUs / _iterations : 0;
+  }
+
+  uint32_t maxBusyUs() const {
+    return _maxBusyUs;
+  }
+
+private:
+  uint32_t _periodUs;
+  uint64_t _scheduledUs;
+  uint64_t _lastWakeUs;
+
+  uint32_t _iterations;
+  uint32_t _misses;
+  uint32_t _worstPeriodUs;
+  uint32_t _maxJitterUs;
+  uint64_t _totalJitterUs;
+  uint32_t _maxBusyUs;
+};
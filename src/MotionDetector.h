@@ -0,0 +1,599 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Activity grid over the frame, one luma average per cell
+#define MOTION_GRID_W 8
+#define MOTION_GRID_H 6
+#define MOTION_CELLS (MOTION_GRID_W * MOTION_GRID_H)
+// Mean luma change of a cell, in pixel levels, that counts as activity
+#define MOTION_CELL_THRESHOLD 6
+// Changed cells needed to call it motion, a single cell is usually sensor noise or flicker
+#define MOTION_MIN_CELLS 2
+// Frames keep counting as changed this long after the last change, so a moving scene
+// does not stutter between frames that happen to look alike
+#define MOTION_HOLD_US 1000000
+// Stream idle mode: starts once the car has been parked this long, then unchanged frames
+// are skipped and only one goes out per keepalive period so the viewer sees the link is up
+#define IDLE_AFTER_MS 3000
+#define IDLE_KEEPALIVE_MS 2000
+
+#define JPEG_LOOKAHEAD_BITS 8
+// Largest grid JpegDcScanner averages into, ObstacleDetector's
+#define JPEG_DC_MAX_CELLS (32 * 24)
+
+// Reads the DC coefficient of every luma block of a baseline JPEG without decoding the image:
+// the AC coefficients are only Huffman-decoded to be skipped, no IDCT and no color conversion.
+// The DC term is the block's mean, so the result is the picture at 1/8 scale, averaged into
+// a grid of up to JPEG_DC_MAX_CELLS. Progressive and arithmetic-coded files are rejected
+class JpegDcScanner {
+public:
+  // Fills cells, row by row, with the mean luma of each grid cell (0-255). Returns false for
+  // anything that is not a baseline Huffman JPEG or is truncated
+  bool scan(const uint8_t *data, size_t length, uint8_t *cells, int gridWidth = MOTION_GRID_W,
+            int gridHeight = MOTION_GRID_H) {
+    if (gridWidth < 1 || gridHeight < 1 || gridWidth * gridHeight > JPEG_DC_MAX_CELLS) {
+      return false;
+    }
+
+    _gridWidth = gridWidth;
+    _gridHeight = gridHeight;
+    _data = data;
+    _end = data + length;
+    _restartInterval = 0;
+    _componentCount = 0;
+    _width = 0;
+    _height = 0;
+    memset(_tables, 0, sizeof(_tables));
+    memset(_quantDc, 0, sizeof(_quantDc));
+
+    if (length < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+      return false;
+    }
+
+    const uint8_t *p = data + 2;
+
+    while (p + 4 <= _end) {
+      if (p[0] != 0xFF) {
+        return false;
+      }
+
+      const uint8_t marker = p[1];
+      const size_t segment = (p[2] << 8) | p[3];
+      const uint8_t *body = p + 4;
+
+      if (marker == 0xFF) {
+        p++;
+        continue;
+      }
+
+      if (body + segment - 2 > _end || segment < 2) {
+        return false;
+      }
+
+      switch (marker) {
+      case 0xC0: // baseline
+      case 0xC1: // extended sequential, same entropy coding
+        if (!parseFrame(body, segment - 2)) {
+          return false;
+        }
+        break;
+      case 0xC4:
+        if (!parseHuffman(body, segment - 2)) {
+          return false;
+        }
+        break;
+      case 0xDB:
+        if (!parseQuantization(body, segment - 2)) {
+          return false;
+        }
+        break;
+      case 0xDD:
+        _restartInterval = (body[0] << 8) | body[1];
+        break;
+      case 0xDA:
+        return parseScan(body, segment - 2) && decodeScan(body + segment - 2, cells);
+      case 0xD9:
+        return false;
+      default:
+        if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+          return false; // progressive, lossless or arithmetic coding
+        }
+        break;
+      }
+
+      p = body + segment - 2;
+    }
+
+    return false;
+  }
+
+private:
+  struct HuffmanTable {
+    bool defined;
+    uint8_t symbols[256];
+    int32_t maxCode[18]; // largest code of each length, -1 if none
+    int32_t valueOffset[17];
+    uint16_t lookahead[1 << JPEG_LOOKAHEAD_BITS];      // symbol index + 1, 0 - longer code
+    uint8_t lookaheadLength[1 << JPEG_LOOKAHEAD_BITS]; // code length
+  };
+
+  struct Component {
+    uint8_t id;
+    uint8_t h;
+    uint8_t v;
+    uint8_t quantTable;
+    uint8_t dcTable;
+    uint8_t acTable;
+    int predictor;
+  };
+
+  const uint8_t *_data;
+  const uint8_t *_end;
+  const uint8_t *_p;
+  uint32_t _bits;
+  int _bitCount;
+  bool _hitMarker;
+
+  uint16_t _width;
+  uint16_t _height;
+  int _gridWidth;
+  int _gridHeight;
+  int32_t _sums[JPEG_DC_MAX_CELLS];
+  uint16_t _restartInterval;
+  Component _components[3];
+  int _componentCount;
+  uint16_t _quantDc[4];
+  HuffmanTable _tables[2][4]; // [class][id], class 0 - DC, 1 - AC
+
+  bool parseFrame(const uint8_t *body, size_t length) {
+    if (length < 6 || body[0] != 8) {
+      return false;
+    }
+
+    _height = (body[1] << 8) | body[2];
+    _width = (body[3] << 8) | body[4];
+    _componentCount = body[5];
+
+    if (!_width || !_height || (_componentCount != 1 && _componentCount != 3) || length < 6 + _componentCount * 3u) {
+      return false;
+    }
+
+    for (int i = 0; i < _componentCount; i++) {
+      const uint8_t *c = body + 6 + i * 3;
+
+      _components[i].id = c[0];
+      _components[i].h = c[1] >> 4;
+      _components[i].v = c[1] & 0x0F;
+      _components[i].quantTable = c[2] & 3;
+
+      if (!_components[i].h || !_components[i].v || _components[i].h > 2 || _components[i].v > 2) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // Only the DC entry of each table matters, it scales the coefficients this scanner reads
+  bool parseQuantization(const uint8_t *body, size_t length) {
+    while (length) {
+      const bool wide = body[0] >> 4;
+      const size_t size = 1 + (wide ? 128 : 64);
+
+      if (length < size) {
+        return false;
+      }
+
+      _quantDc[body[0] & 3] = wide ? (body[1] << 8) | body[2] : body[1];
+      body += size;
+      length -= size;
+    }
+
+    return true;
+  }
+
+  bool parseHuffman(const uint8_t *body, size_t length) {
+    while (length >= 17) {
+      const uint8_t tableClass = body[0] >> 4;
+      const uint8_t id = body[0] & 0x0F;
+      const uint8_t *counts = body + 1;
+      size_t total = 0;
+
+      for (int i = 0; i < 16; i++) {
+        total += counts[i];
+      }
+
+      if (tableClass > 1 || id > 3 || total > 256 || length < 17 + total) {
+        return false;
+      }
+
+      HuffmanTable &table = _tables[tableClass][id];
+      memcpy(table.symbols, body + 17, total);
+      buildTable(table, counts);
+
+      body += 17 + total;
+      length -= 17 + total;
+    }
+
+    return length == 0;
+  }
+
+  // Canonical codes as in T.81 annex C, with a table for codes up to JPEG_LOOKAHEAD_BITS long
+  void buildTable(HuffmanTable &table, const uint8_t *counts) {
+    int32_t code = 0;
+    int index = 0;
+
+    memset(table.lookahead, 0, sizeof(table.lookahead));
+
+    for (int length = 1; length <= 16; length++) {
+      table.valueOffset[length] = index - code;
+
+      for (int i = 0; i < counts[length - 1]; i++, index++, code++) {
+        if (length <= JPEG_LOOKAHEAD_BITS) {
+          const int shift = JPEG_LOOKAHEAD_BITS - length;
+
+          for (int fill = 0; fill < (1 << shift); fill++) {
+            table.lookahead[(code << shift) | fill] = index + 1;
+            table.lookaheadLength[(code << shift) | fill] = length;
+          }
+        }
+      }
+
+      table.maxCode[length] = counts[length - 1] ? code - 1 : -1;
+      code <<= 1;
+    }
+
+    table.maxCode[17] = 0x7FFFFFFF;
+    table.defined = true;
+  }
+
+  bool parseScan(const uint8_t *body, size_t length) {
+    const int count = body[0];
+
+    if (count != _componentCount || length < 1 + count * 2u + 3) {
+      return false; // non-interleaved scans are not worth supporting for the OV2640's output
+    }
+
+    for (int i = 0; i < count; i++) {
+      const uint8_t id = body[1 + i * 2];
+      const uint8_t tables = body[2 + i * 2];
+
+      if (_components[i].id != id) {
+        return false;
+      }
+
+      _components[i].dcTable = tables >> 4;
+      _components[i].acTable = tables & 0x0F;
+
+      if (_components[i].dcTable > 3 || _components[i].acTable > 3 ||
+          !_tables[0][_components[i].dcTable].defined || !_tables[1][_components[i].acTable].defined) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  bool decodeScan(const uint8_t *entropy, uint8_t *cells) {
+    int maxH = 1;
+    int maxV = 1;
+
+    for (int i = 0; i < _componentCount; i++) {
+      maxH = _components[i].h > maxH ? _components[i].h : maxH;
+      maxV = _components[i].v > maxV ? _components[i].v : maxV;
+      _components[i].predictor = 0;
+    }
+
+    // a single-component scan is not interleaved, every MCU is one block
+    const Component &luma = _components[0];
+    const int mcuWidth = _componentCount == 1 ? 8 : 8 * maxH;
+    const int mcuHeight = _componentCount == 1 ? 8 : 8 * maxV;
+    const int mcusX = (_width + mcuWidth - 1) / mcuWidth;
+    const int mcusY = (_height + mcuHeight - 1) / mcuHeight;
+    const int lumaH = _componentCount == 1 ? 1 : luma.h;
+    const int lumaV = _componentCount == 1 ? 1 : luma.v;
+    const int quant = _quantDc[luma.quantTable] ? _quantDc[luma.quantTable] : 1;
+
+    const int cellCount = _gridWidth * _gridHeight;
+    memset(_sums, 0, cellCount * sizeof(_sums[0]));
+
+    _p = entropy;
+    _bits = 0;
+    _bitCount = 0;
+    _hitMarker = false;
+
+    int untilRestart = _restartInterval;
+
+    for (int my = 0; my < mcusY; my++) {
+      for (int mx = 0; mx < mcusX; mx++) {
+        if (_restartInterval && untilRestart-- == 0) {
+          if (!restart()) {
+            return false;
+          }
+
+          untilRestart = _restartInterval - 1;
+        }
+
+        for (int c = 0; c < _componentCount; c++) {
+          Component &component = _components[c];
+          const int blocksH = _componentCount == 1 ? 1 : component.h;
+          const int blocksV = _componentCount == 1 ? 1 : component.v;
+
+          for (int by = 0; by < blocksV; by++) {
+            for (int bx = 0; bx < blocksH; bx++) {
+              if (!decodeBlock(component)) {
+                return false;
+              }
+
+              if (c != 0) {
+                continue;
+              }
+
+              const int x = mx * mcuWidth + bx * mcuWidth / lumaH;
+              const int y = my * mcuHeight + by * mcuHeight / lumaV;
+
+              if (x >= _width || y >= _height) {
+                continue;
+              }
+
+              _sums[(y * _gridHeight / _height) * _gridWidth + x * _gridWidth / _width] += component.predictor;
+            }
+          }
+        }
+      }
+    }
+
+    // luma blocks start every 8 pixels, so a cell's block count is its columns times its rows
+    for (int i = 0; i < cellCount; i++) {
+      const int columns = blocksIn(i % _gridWidth, _gridWidth, _width);
+      const int rows = blocksIn(i / _gridWidth, _gridHeight, _height);
+      const int count = columns * rows;
+      // DC = 8 x (mean - 128) once dequantized
+      const int mean = count ? 128 + _sums[i] * quant / count / 8 : 0;
+      cells[i] = mean < 0 ? 0 : (mean > 255 ? 255 : mean);
+    }
+
+    return true;
+  }
+
+  // Blocks whose first pixel falls in grid column (or row) index out of cells over size pixels
+  static int blocksIn(int index, int cells, int size) {
+    const int first = (index * size + cells - 1) / cells;
+    const int end = ((index + 1) * size + cells - 1) / cells;
+
+    return (end + 7) / 8 - (first + 7) / 8;
+  }
+
+  bool decodeBlock(Component &component) {
+    const int dcLength = decodeSymbol(_tables[0][component.dcTable]);
+
+    if (dcLength < 0 || dcLength > 11) {
+      return false;
+    }
+
+    component.predictor += extend(readBits(dcLength), dcLength);
+
+    const HuffmanTable &ac = _tables[1][component.acTable];
+
+    for (int k = 1; k < 64;) {
+      const int symbol = decodeSymbol(ac);
+
+      if (symbol < 0) {
+        return false;
+      }
+
+      const int run = symbol >> 4;
+      const int size = symbol & 0x0F;
+
+      if (size) {
+        skipBits(size);
+        k += run + 1;
+      } else if (run == 15) {
+        k += 16;
+      } else {
+        break; // end of block
+      }
+    }
+
+    return true;
+  }
+
+  void fill() {
+    while (_bitCount <= 24) {
+      uint8_t byte = 0;
+
+      if (!_hitMarker && _p < _end) {
+        byte = *_p;
+
+        if (byte == 0xFF) {
+          const uint8_t next = _p + 1 < _end ? _p[1] : 0xD9;
+
+          if (next == 0x00) {
+            _p += 2;
+          } else {
+            _hitMarker = true; // leave the marker for restart(), pad with zeros
+            byte = 0;
+          }
+        } else {
+          _p++;
+        }
+      }
+
+      _bits |= (uint32_t)byte << (24 - _bitCount);
+      _bitCount += 8;
+    }
+  }
+
+  int decodeSymbol(const HuffmanTable &table) {
+    fill();
+
+    const uint32_t peek = _bits >> (32 - JPEG_LOOKAHEAD_BITS);
+
+    if (table.lookahead[peek]) {
+      const int length = table.lookaheadLength[peek];
+      consume(length);
+
+      return table.symbols[table.lookahead[peek] - 1];
+    }
+
+    int length = JPEG_LOOKAHEAD_BITS + 1;
+    int32_t code = _bits >> (32 - length);
+
+    while (length <= 16 && code > table.maxCode[length]) {
+      length++;
+      code = _bits >> (32 - length);
+    }
+
+    if (length > 16) {
+      return -1;
+    }
+
+    consume(length);
+
+    return table.symbols[(table.valueOffset[length] + code) & 0xFF];
+  }
+
+  int readBits(int count) {
+    if (!count) {
+      return 0;
+    }
+
+    fill();
+    const int value = _bits >> (32 - count);
+    consume(count);
+
+    return value;
+  }
+
+  void skipBits(int count) {
+    fill();
+    consume(count);
+  }
+
+  void consume(int count) {
+    _bits <<= count;
+    _bitCount -= count;
+  }
+
+  static int extend(int value, int length) {
+    return length && value < (1 << (length - 1)) ? value - (1 << length) + 1 : value;
+  }
+
+  // Skips to the RSTn marker, entropy coding and DC prediction start over after it
+  bool restart() {
+    while (_p + 1 < _end && !(_p[0] == 0xFF && _p[1] >= 0xD0 && _p[1] <= 0xD7)) {
+      _p++;
+    }
+
+    if (_p + 1 >= _end) {
+      return false;
+    }
+
+    _p += 2;
+    _bits = 0;
+    _bitCount = 0;
+    _hitMarker = false;
+
+    for (int i = 0; i < _componentCount; i++) {
+      _components[i].predictor = 0;
+    }
+
+    return true;
+  }
+};
+
+// Decides whether a frame shows anything new compared to the last one that did. Pure C++
+// over the JPEG bytes with caller-supplied timestamps, like FramePacer
+class MotionDetector {
+public:
+  MotionDetector()
+      : _hasReference(false),
+        _holdUntilUs(0),
+        _frames(0),
+        _changed(0),
+        _failed(0),
+        _scanUs(0),
+        _maxScanUs(0) {}
+
+  // The next frame becomes the reference and counts as changed, counters keep running
+  void reset() {
+    _hasReference = false;
+    _holdUntilUs = 0;
+  }
+
+  // Frames that cannot be scanned count as changed, idle mode must never hide a picture
+  bool onFrame(const uint8_t *jpeg, size_t length, uint64_t nowUs) {
+    uint8_t cells[MOTION_CELLS];
+
+    _frames++;
+
+    if (!_scanner.scan(jpeg, length, cells)) {
+      _failed++;
+      _changed++;
+
+      return true;
+    }
+
+    int changedCells = 0;
+
+    for (int i = 0; _hasReference && i < MOTION_CELLS; i++) {
+      changedCells += abs(cells[i] - _reference[i]) >= MOTION_CELL_THRESHOLD;
+    }
+
+    const bool motion = !_hasReference || changedCells >= MOTION_MIN_CELLS;
+
+    if (motion) {
+      memcpy(_reference, cells, sizeof(_reference));
+      _hasReference = true;
+      _holdUntilUs = nowUs + MOTION_HOLD_US;
+    }
+
+    if (motion || nowUs < _holdUntilUs) {
+      _changed++;
+
+      return true;
+    }
+
+    return false;
+  }
+
+  // Caller-measured scan time, the detector itself stays clock-free
+  void addScanTime(uint32_t scanUs) {
+    _scanUs += scanUs;
+    _maxScanUs = scanUs > _maxScanUs ? scanUs : _maxScanUs;
+  }
+
+  uint32_t frames() const {
+    return _frames;
+  }
+
+  uint32_t changed() const {
+    return _changed;
+  }
+
+  uint32_t failed() const {
+    return _failed;
+  }
+
+  uint32_t averageScanUs() const {
+    return _frames ? _scanUs / _frames : 0;
+  }
+
+  uint32_t maxScanUs() const {
+    return _maxScanUs;
+  }
+
+private:
+  JpegDcScanner _scanner;
+  uint8_t _reference[MOTION_CELLS];
+  bool _hasReference;
+  uint64_t _holdUntilUs;
+
+  uint32_t _frames;
+  uint32_t _changed;
+  uint32_t _failed;
+  uint64_t _scanUs;
+  uint32_t _maxScanUs;
+};
@@ -1,106 +1,98 @@
 #pragma once
+#include "EventLog.h"
+#include "LatencyMetrics.h"
+#include "RampEngine.h"
+#include "hal/Hal.h"
 #include "utils.h"
-#include <Arduino.h>
 
 #define MOTOR_PWM_FREQ 1000
 class Motor {
 public:
-  enum class Direction : uint8_t {
-    STOP = 0,
-    FORWARD,
-    BACKWARD
-  };
-
   Motor(int pinIN1, int pinIN2, int pwmChannel1, int pwmChannel2)
       : _pinIN1(pinIN1), _pinIN2(pinIN2),
         _pwmChannel1(pwmChannel1), _pwmChannel2(pwmChannel2),
         _minPwm(0),
-        _currentSpeed(0),
-        _targetSpeed(0),
-        _direction(Direction::STOP),
         _accelStep(5),
         _updateInterval(30),
-        _lastUpdate(0) {}
+        _profile(RAMP_SCURVE),
+        _ramps(nullptr),
+        _channel(-1),
+        _duty1(0),
+        _duty2(0) {}
+
+  // The duty is ramped by the shared engine's timer, which calls writeDuty only on a change
+  void begin(RampEngine &ramps) {
+    halPinMode(_pinIN1, OUTPUT);
+    halPinMode(_pinIN2, OUTPUT);
 
-  void begin() {
-    pinMode(_pinIN1, OUTPUT);
-    pinMode(_pinIN2, OUTPUT);
+    halPwmSetup(_pwmChannel1, MOTOR_PWM_FREQ, 8);
+    halPwmSetup(_pwmChannel2, MOTOR_PWM_FREQ, 8);
 
-    ledcSetup(_pwmChannel1, MOTOR_PWM_FREQ, 8);
-    ledcSetup(_pwmChannel2, MOTOR_PWM_FREQ, 8);
+    halPwmAttach(_pinIN1, _pwmChannel1);
+    halPwmAttach(_pinIN2, _pwmChannel2);
 
-    ledcAttachPin(_pinIN1, _pwmChannel1);
-    ledcAttachPin(_pinIN2, _pwmChannel2);
+    halPwmWrite(_pwmChannel1, 0);
+    halPwmWrite(_pwmChannel2, 0);
 
-    stop();
+    _ramps = &ramps;
+    _channel = ramps.addChannel(onRamp, this, 0);
   }
 
   void setMinPwm(uint8_t minPwm) {
     _minPwm = constrain(minPwm, 0, 255);
   }
 
-  void setRamp(uint8_t accelStep, uint16_t updateInterval) {
+  // Average acceleration of accelStep duty per updateInterval ms, shaped by the profile
+  void setRamp(uint8_t accelStep, uint16_t updateInterval, RampProfile profile = RAMP_SCURVE) {
     _accelStep = constrain(accelStep, 1, 50);
     _updateInterval = constrain(updateInterval, 5, 100);
+    _profile = profile;
   }
 
-  void moveForward(uint8_t targetSpeed = 255) {
-    _direction = Direction::FORWARD;
-    _targetSpeed = constrain(targetSpeed, _minPwm, 255);
-  }
+  // Signed speed, -255..255. Any non-zero speed is spread over minPwm..255, so the low end of
+  // the stick still moves the car instead of sitting in the motor's dead band. Returns whether
+  // the duty is going to change
+  bool setSpeed(int speed) {
+    if (!speed || !_ramps) {
+      return stop();
+    }
 
-  void moveBackward(uint8_t targetSpeed = 255) {
-    _direction = Direction::BACKWARD;
-    _targetSpeed = constrain(targetSpeed, _minPwm, 255);
-  }
+    const int magnitude = std::min(abs(speed), 255);
+    const int sign = speed > 0 ? 1 : -1;
+    const int target = sign * (_minPwm + magnitude * (255 - _minPwm) / 255);
 
-  void stop() {
-    _direction = Direction::STOP;
-    _targetSpeed = 0;
-    _currentSpeed = 0;
-  }
+    // the same stick arrives every few tens of ms, restarting the ramp would stall it
+    if (target == _ramps->target(_channel)) {
+      return false;
+    }
 
-  void tick() {
-    int64_t diff = elapsedSince(_lastUpdate);
+    // starting or reversing jumps over the dead band, as the polled ramp did
+    int start = _ramps->value(_channel);
 
-    if (diff < _updateInterval) {
-      return;
+    if (start * sign <= 0) {
+      start = sign * _minPwm;
     }
 
-    _lastUpdate = nowMs();
+    const uint32_t durationUs = (uint32_t)abs(target - start) * _updateInterval * 1000 / _accelStep;
+    _ramps->move(_channel, start, target, durationUs, _profile);
 
-    if (_direction == Direction::STOP) {
-      ledcWrite(_pwmChannel1, 0);
-      ledcWrite(_pwmChannel2, 0);
-      _currentSpeed = 0;
+    return true;
+  }
 
-      return;
+  // Immediate, on the next ramp tick. Returns whether the duty is going to change
+  bool stop() {
+    if (!_ramps || (!_ramps->target(_channel) && !_ramps->value(_channel))) {
+      return false;
     }
 
-    if (_currentSpeed == 0 && _targetSpeed > 0) {
-      _currentSpeed = _minPwm;
-    }
+    _ramps->move(_channel, 0, 0, 0, _profile);
 
-    if (_currentSpeed < _targetSpeed) {
-      _currentSpeed = std::min<uint8_t>(_currentSpeed + _accelStep, _targetSpeed);
-    } else if (_currentSpeed > _targetSpeed) {
-      _currentSpeed = std::max<uint8_t>(_currentSpeed - _accelStep, _targetSpeed);
-    }
+    return true;
+  }
 
-    switch (_direction) {
-    case Direction::FORWARD:
-      ledcWrite(_pwmChannel1, _currentSpeed);
-      ledcWrite(_pwmChannel2, 0);
-      Serial.printf("Motor FORWARD - Speed: %d\n", _currentSpeed);
-      break;
-    case Direction::BACKWARD:
-      ledcWrite(_pwmChannel1, 0);
-      ledcWrite(_pwmChannel2, _currentSpeed);
-      Serial.printf("Motor BACKWARD - Speed: %d\n", _currentSpeed);
-      break;
-    default:
-      break;
-    }
+  // Signed duty on the pins right now
+  int speed() const {
+    return _ramps ? _ramps->value(_channel) : 0;
   }
 
 private:
@@ -108,11 +100,39 @@ private:
   int _pwmChannel1, _pwmChannel2;
 
   uint8_t _minPwm;
-  uint8_t _currentSpeed;
-  uint8_t _targetSpeed;
-  Direction _direction;
-
   uint8_t _accelStep;
   uint16_t _updateInterval;
-  unsigned long _lastUpdate;
+  RampProfile _profile;
+
+  RampEngine *_ramps;
+  int _channel;
+  uint8_t _duty1; // last written, so a pin that keeps its duty is not written again
+  uint8_t _duty2;
+
+  static void onRamp(void *context, int duty) {
+    ((Motor *)context)->writeDuty(duty);
+  }
+
+  void writeDuty(int duty) {
+    const uint8_t duty1 = duty > 0 ? duty : 0;
+    const uint8_t duty2 = duty < 0 ? -duty : 0;
+
+    if (duty1 != _duty1) {
+      halPwmWrite(_pwmChannel1, duty1);
+      _duty1 = duty1;
+    }
+
+    if (duty2 != _duty2) {
+      halPwmWrite(_pwmChannel2, duty2);
+      _duty2 = duty2;
+    }
+
+    if (duty > 0) {
+      logEvent(LOG_TRACE, EV_MOTOR_FORWARD, _pwmChannel1, duty);
+    } else if (duty < 0) {
+      logEvent(LOG_TRACE, EV_MOTOR_BACKWARD, _pwmChannel1, -duty);
+    }
+
+    latencyMetrics.onPwmWrite(nowUs());
+  }
 };
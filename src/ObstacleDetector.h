@@ -0,0 +1,231 @@
+#pragma once
+#include "MotionDetector.h"
+#include "hal/Hal.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Luma grid the obstacle check runs on. At QVGA one cell is about one 8x8 JPEG block, so a
+// JPEG frame only needs its DC coefficients: the grid is the picture at 1/8 scale
+#define VISION_GRID_W 32
+#define VISION_GRID_H 24
+#define VISION_CELLS (VISION_GRID_W * VISION_GRID_H)
+// Rows below the horizon show floor when the camera looks straight ahead
+#define VISION_HORIZON_ROW (VISION_GRID_H / 2)
+// The car's path: the middle half of the picture
+#define VISION_CORRIDOR_FIRST (VISION_GRID_W / 4)
+#define VISION_CORRIDOR_LAST (VISION_GRID_W * 3 / 4)
+// A corridor column is blocked when the floor seen from the bumper ends within this many rows
+#define VISION_NEAR_ROWS 6
+// Luma step between neighbouring cells, in pixel levels, that ends the floor
+#define VISION_EDGE_THRESHOLD 16
+// Difference from the floor followed up the column that ends it, for soft edges
+#define VISION_FLOOR_THRESHOLD 24
+// Bumper row this far from the learned floor means something already fills the view
+#define VISION_FLOOR_DRIFT 20
+// Score (percent of blocked corridor columns) that vetoes forward moves, and the one that
+// clears the veto again, each held for a few frames so one odd frame does not flip it
+#define VISION_VETO_SCORE 50
+#define VISION_VETO_FRAMES 2
+#define VISION_CLEAR_SCORE 25
+#define VISION_CLEAR_FRAMES 3
+
+// Floor-edge obstacle check over one frame. Each corridor column is followed up from the
+// bottom row for as long as it looks like the floor the car stands on: no sharp step between
+// cells and no slow drift away from the bumper's luma. Columns where that ends close to the
+// bumper are blocked. Pure C++ over the frame bytes like MotionDetector, the caller measures
+class ObstacleDetector {
+public:
+  ObstacleDetector()
+      : _floor(-1),
+        _score(0),
+        _vetoing(false),
+        _streak(0),
+        _frames(0),
+        _failed(0),
+        _vetoes(0),
+        _frameUs(0),
+        _maxFrameUs(0) {}
+
+  // Forgets the learned floor and the veto, counters keep running
+  void reset() {
+    _floor = -1;
+    _score = 0;
+    _vetoing = false;
+    _streak = 0;
+  }
+
+  // Takes a JPEG, RGB565 or grayscale frame. Returns whether forward moves are vetoed now;
+  // a frame that cannot be read leaves the verdict as it was
+  bool onFrame(const uint8_t *data, size_t length, uint16_t width, uint16_t height, pixformat_t format) {
+    _frames++;
+
+    if (!toGrid(data, length, width, height, format)) {
+      _failed++;
+
+      return _vetoing;
+    }
+
+    _score = scoreGrid();
+
+    const bool wantVeto = _vetoing ? _score >= VISION_CLEAR_SCORE : _score >= VISION_VETO_SCORE;
+    _streak = wantVeto == _vetoing ? 0 : _streak + 1;
+
+    if (_streak >= (_vetoing ? VISION_CLEAR_FRAMES : VISION_VETO_FRAMES)) {
+      _vetoing = !_vetoing;
+      _streak = 0;
+      _vetoes += _vetoing;
+    }
+
+    return _vetoing;
+  }
+
+  void addFrameTime(uint32_t frameUs) {
+    _frameUs += frameUs;
+    _maxFrameUs = frameUs > _maxFrameUs ? frameUs : _maxFrameUs;
+  }
+
+  const uint8_t *grid() const {
+    return _grid;
+  }
+
+  // 0 - clear path, 100 - every corridor column blocked
+  uint8_t score() const {
+    return _score;
+  }
+
+  bool vetoing() const {
+    return _vetoing;
+  }
+
+  uint32_t frames() const {
+    return _frames;
+  }
+
+  uint32_t failed() const {
+    return _failed;
+  }
+
+  // Times the veto went on
+  uint32_t vetoes() const {
+    return _vetoes;
+  }
+
+  uint32_t averageFrameUs() const {
+    return _frames ? _frameUs / _frames : 0;
+  }
+
+  uint32_t maxFrameUs() const {
+    return _maxFrameUs;
+  }
+
+private:
+  JpegDcScanner _scanner;
+  uint8_t _grid[VISION_CELLS];
+  int _floor; // learned bumper-row luma, -1 until the first frame
+  uint8_t _score;
+  bool _vetoing;
+  uint8_t _streak; // frames in a row that disagree with _vetoing
+
+  uint32_t _frames;
+  uint32_t _failed;
+  uint32_t _vetoes;
+  uint64_t _frameUs;
+  uint32_t _maxFrameUs;
+
+  bool toGrid(const uint8_t *data, size_t length, uint16_t width, uint16_t height, pixformat_t format) {
+    if (format == PIXFORMAT_JPEG) {
+      return _scanner.scan(data, length, _grid, VISION_GRID_W, VISION_GRID_H);
+    }
+
+    const size_t bytesPerPixel = format == PIXFORMAT_RGB565 ? 2 : 1;
+
+    if ((format != PIXFORMAT_RGB565 && format != PIXFORMAT_GRAYSCALE) || width < VISION_GRID_W ||
+        height < VISION_GRID_H || length < (size_t)width * height * bytesPerPixel) {
+      return false;
+    }
+
+    // every other pixel of every other row is plenty for cells this large
+    for (int gy = 0; gy < VISION_GRID_H; gy++) {
+      const int y0 = gy * height / VISION_GRID_H;
+      const int y1 = (gy + 1) * height / VISION_GRID_H;
+
+      for (int gx = 0; gx < VISION_GRID_W; gx++) {
+        const int x0 = gx * width / VISION_GRID_W;
+        const int x1 = (gx + 1) * width / VISION_GRID_W;
+        uint32_t sum = 0;
+        uint32_t count = 0;
+
+        for (int y = y0; y < y1; y += 2) {
+          const uint8_t *row = data + ((size_t)y * width + x0) * bytesPerPixel;
+
+          for (int x = x0; x < x1; x += 2, row += 2 * bytesPerPixel) {
+            sum += bytesPerPixel == 1 ? row[0] : rgb565Luma(row[0] << 8 | row[1]);
+            count++;
+          }
+        }
+
+        _grid[gy * VISION_GRID_W + gx] = count ? sum / count : 0;
+      }
+    }
+
+    return true;
+  }
+
+  // Big-endian sensor RGB565, Y ~ (2R + 5G + B) / 8
+  static uint8_t rgb565Luma(uint16_t pixel) {
+    const int r = (pixel >> 11) << 3;
+    const int g = ((pixel >> 5) & 0x3F) << 2;
+    const int b = (pixel & 0x1F) << 3;
+
+    return (2 * r + 5 * g + b) >> 3;
+  }
+
+  uint8_t scoreGrid() {
+    const uint8_t *bumper = _grid + (VISION_GRID_H - 1) * VISION_GRID_W;
+    int bumperSum = 0;
+    int blocked = 0;
+
+    for (int x = VISION_CORRIDOR_FIRST; x < VISION_CORRIDOR_LAST; x++) {
+      bumperSum += bumper[x];
+      blocked += freeRows(x) < VISION_NEAR_ROWS;
+    }
+
+    const int corridor = VISION_CORRIDOR_LAST - VISION_CORRIDOR_FIRST;
+    const int bumperLuma = bumperSum / corridor;
+
+    // a box pushed right against the bumper has no edge left in view, only the wrong colour
+    if (_floor >= 0 && abs(bumperLuma - _floor) >= VISION_FLOOR_DRIFT) {
+      return 100;
+    }
+
+    // the floor is learned while the path is clear, slowly enough to ride out a passing shadow
+    if (_floor < 0) {
+      _floor = bumperLuma;
+    } else if (blocked * 100 < VISION_CLEAR_SCORE * corridor) {
+      _floor += (bumperLuma - _floor) / 8;
+    }
+
+    return blocked * 100 / corridor;
+  }
+
+  // Floor rows above the bumper in column x, up to the horizon
+  int freeRows(int x) const {
+    int reference = _grid[(VISION_GRID_H - 1) * VISION_GRID_W + x];
+    int below = reference;
+
+    for (int y = VISION_GRID_H - 2; y >= VISION_HORIZON_ROW; y--) {
+      const int luma = _grid[y * VISION_GRID_W + x];
+
+      if (abs(luma - below) >= VISION_EDGE_THRESHOLD || abs(luma - reference) >= VISION_FLOOR_THRESHOLD) {
+        return VISION_GRID_H - 2 - y;
+      }
+
+      // follow the floor's perspective gradient, an object's face is a jump, not a slope
+      reference += (luma - reference) / 4;
+      below = luma;
+    }
+
+    return VISION_GRID_H - 1 - VISION_HORIZON_ROW;
+  }
+};
@@ -0,0 +1,193 @@
+#pragma once
+#include <stdint.h>
+
+// Closed-loop stream quality control. Levels are indexes into a ladder ordered from the
+// cheapest to the most expensive setting (framesize/jpeg quality pairs), where every step
+// costs roughly QUALITY_STEP_GROWTH more bytes than the previous one.
+// Pure C++ with caller-supplied timestamps, so it can be replayed against recorded traces.
+//
+// Every viewer's link is measured on its own, as time per byte, so it holds across levels and
+// frame sizes. The slowest viewer still connected decides: the JPEG size of the current level
+// at its rate is the send time now, the learned size of the next level at its rate is the
+// send time after a step up. Sizes are learned per level, a level never seen is guessed at
+// QUALITY_STEP_GROWTH times the current one.
+//
+// Hysteresis:
+//  - step down as soon as the send time exceeds the target, or the link RSSI falls below
+//    minRssi - QUALITY_RSSI_MARGIN
+//  - step up only when the next level is predicted to stay well under the target and the
+//    RSSI is at least minRssi, for QUALITY_UPGRADE_SAMPLES frames in a row
+//  - no change is made for QUALITY_HOLD_US after the previous one, so the new setting settles
+#define QUALITY_STEP_GROWTH 1.5f
+#define QUALITY_UPGRADE_HEADROOM 0.8f
+#define QUALITY_UPGRADE_SAMPLES 30
+#define QUALITY_MIN_SAMPLES 8
+#define QUALITY_HOLD_US 1000000
+#define QUALITY_RSSI_MARGIN 5
+#define QUALITY_MAX_LEVELS 8
+#define QUALITY_MAX_VIEWERS 4
+// A viewer without a frame for this long has left and no longer holds the quality down
+#define QUALITY_VIEWER_EXPIRY_US 2000000
+
+class QualityController {
+public:
+  QualityController()
+      : _levelCount(1),
+        _level(0),
+        _targetSendUs(80000),
+        _minRssi(-80),
+        _rssi(0),
+        _lastChangeUs(0),
+        _viewers(),
+        _levelBytes(),
+        _levelSeen() {
+    resetSamples();
+  }
+
+  void configure(uint8_t levelCount, uint32_t targetSendUs, int minRssi) {
+    _levelCount = levelCount ? (levelCount < QUALITY_MAX_LEVELS ? levelCount : QUALITY_MAX_LEVELS) : 1;
+    _targetSendUs = targetSendUs;
+    _minRssi = minRssi;
+
+    if (_level >= _levelCount) {
+      _level = _levelCount - 1;
+    }
+  }
+
+  void setLevel(uint8_t level, uint64_t nowUs) {
+    _level = level < _levelCount ? level : _levelCount - 1;
+    _lastChangeUs = nowUs;
+    resetSamples();
+  }
+
+  uint8_t level() const {
+    return _level;
+  }
+
+  // 0 - unknown (no station connected)
+  void onRssi(int rssi) {
+    _rssi = rssi;
+  }
+
+  // A frame of the current level reached viewer, 0..QUALITY_MAX_VIEWERS-1. Returns true when
+  // the level changed and the new setting has to be applied
+  bool onFrameSent(uint8_t viewer, uint32_t bytes, uint32_t sendUs, uint64_t nowUs) {
+    if (!bytes) {
+      return false;
+    }
+
+    ViewerLink &link = _viewers[viewer < QUALITY_MAX_VIEWERS ? viewer : QUALITY_MAX_VIEWERS - 1];
+
+    // a slot reused by a new viewer starts over
+    if (link.samples && nowUs - link.lastUs > QUALITY_VIEWER_EXPIRY_US) {
+      link.samples = 0;
+    }
+
+    smooth(link.avgBytes, bytes, link.samples);
+    smooth(link.avgSendUs, sendUs, link.samples);
+    link.samples++;
+    link.lastUs = nowUs;
+
+    smooth(_levelBytes[_level], bytes, _samples);
+    _levelSeen[_level] = true;
+    _samples++;
+
+    if (_samples < QUALITY_MIN_SAMPLES || nowUs - _lastChangeUs < QUALITY_HOLD_US) {
+      return false;
+    }
+
+    const float usPerByte = slowestUsPerByte(nowUs);
+
+    if (usPerByte <= 0) {
+      return false;
+    }
+
+    const bool rssiKnown = _rssi != 0;
+    const bool linkFailing = rssiKnown && _rssi < _minRssi - QUALITY_RSSI_MARGIN;
+
+    if (_level > 0 && (_levelBytes[_level] * usPerByte > _targetSendUs || linkFailing)) {
+      setLevel(_level - 1, nowUs);
+
+      return true;
+    }
+
+    const bool linkGood = !rssiKnown || _rssi >= _minRssi;
+
+    if (_level + 1 < _levelCount && linkGood && expectedBytes(_level + 1) * usPerByte < _targetSendUs * QUALITY_UPGRADE_HEADROOM) {
+      if (++_upgradeSamples >= QUALITY_UPGRADE_SAMPLES) {
+        setLevel(_level + 1, nowUs);
+
+        return true;
+      }
+
+      return false;
+    }
+
+    _upgradeSamples = 0;
+
+    return false;
+  }
+
+  // Smoothed JPEG size of the current level
+  float averageBytes() const {
+    return _levelBytes[_level];
+  }
+
+  // Send time of the current level's frames to the slowest viewer, 0 - none measured yet
+  float slowestSendUs(uint64_t nowUs) const {
+    return _levelBytes[_level] * slowestUsPerByte(nowUs);
+  }
+
+private:
+  struct ViewerLink {
+    uint64_t lastUs;
+    uint32_t samples;
+    float avgBytes;
+    float avgSendUs;
+  };
+
+  uint8_t _levelCount;
+  uint8_t _level;
+  uint32_t _targetSendUs;
+  int _minRssi;
+  int _rssi;
+  uint64_t _lastChangeUs;
+
+  ViewerLink _viewers[QUALITY_MAX_VIEWERS];
+  float _levelBytes[QUALITY_MAX_LEVELS];
+  bool _levelSeen[QUALITY_MAX_LEVELS];
+  uint32_t _samples; // frames since the level changed
+  uint32_t _upgradeSamples;
+
+  static void smooth(float &average, float sample, uint32_t samples) {
+    average = samples ? average + (sample - average) / 8 : sample;
+  }
+
+  // Of the viewers still there with enough frames measured, 0 - none
+  float slowestUsPerByte(uint64_t nowUs) const {
+    float slowest = 0;
+
+    for (const ViewerLink &link : _viewers) {
+      if (link.samples < QUALITY_MIN_SAMPLES || nowUs - link.lastUs > QUALITY_VIEWER_EXPIRY_US || link.avgBytes <= 0) {
+        continue;
+      }
+
+      const float usPerByte = link.avgSendUs / link.avgBytes;
+
+      if (usPerByte > slowest) {
+        slowest = usPerByte;
+      }
+    }
+
+    return slowest;
+  }
+
+  float expectedBytes(uint8_t level) const {
+    return _levelSeen[level] ? _levelBytes[level] : _levelBytes[_level] * QUALITY_STEP_GROWTH;
+  }
+
+  void resetSamples() {
+    _samples = 0;
+    _upgradeSamples = 0;
+  }
+};
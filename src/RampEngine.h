@@ -0,0 +1,307 @@
+#pragma once
+#include "ServoTrajectory.h"
+#include "hal/Hal.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+// Ramp resolution: a step every 2 ms, fifteen times finer than the old 30 ms polling. Finer
+// costs more value changes than it buys, a servo degree or a duty step takes longer than that
+#define RAMP_TICK_US 2000
+// Points of each precomputed profile, values in between are interpolated
+#define RAMP_PROFILE_POINTS 64
+#define RAMP_PROFILE_ONE 65536
+// Two motors and the camera's pan and tilt servos
+#define RAMP_MAX_CHANNELS 4
+
+// Shape of a move from start to target, as position over time
+enum RampProfile : uint8_t {
+  // Smoothstep: speed rises and falls smoothly, no jerk at either end. Gentle on the motors'
+  // current draw and on the gears
+  RAMP_SCURVE,
+  // Constant acceleration for the first third, cruise, constant deceleration for the last third
+  RAMP_TRAPEZOID,
+  RAMP_PROFILE_COUNT
+};
+
+// Called from the timer with a channel's new value, only when it differs from the last one
+typedef void (*RampOutput)(void *context, int value);
+
+// Drives every ramped output of the car (motor duties, servo pulse widths) from one periodic
+// timer. A move is start, target, duration and profile; each tick looks the position up in the
+// profile's table and hands the value to the channel's output only when it changed. Trajectory
+// channels instead follow a ServoTrajectory towards their target, stepped by the time since the
+// last tick. The timer runs only while some channel is moving, a parked car costs nothing
+class RampEngine {
+public:
+  RampEngine()
+      : _channelCount(0),
+        _moving(0),
+        _ticks(0),
+        _writes(0),
+        _busyUs(0),
+        _maxBusyUs(0),
+        _runUs(0),
+        _startedUs(0) {
+    buildProfiles();
+  }
+
+  // Creates the timer, channels can be added before or after. Without it moves only advance
+  // through tick() calls
+  bool begin() {
+    return _timer.begin(onTimer, this, "ramp");
+  }
+
+  // Returns the channel's index, or -1 when all RAMP_MAX_CHANNELS are taken. The output is
+  // not called until the first move
+  int addChannel(RampOutput output, void *context, int initial) {
+    if (_channelCount >= RAMP_MAX_CHANNELS) {
+      return -1;
+    }
+
+    RampChannel &channel = _channels[_channelCount];
+    channel.output = output;
+    channel.context = context;
+    channel.start = initial;
+    channel.target = initial;
+    channel.value = initial;
+    channel.written = initial;
+    channel.startUs = 0;
+    channel.durationUs = 0;
+    channel.profile = RAMP_SCURVE;
+    channel.trajectory = nullptr;
+
+    return _channelCount++;
+  }
+
+  // A channel that follows the trajectory, its values are the trajectory's pulse widths.
+  // The trajectory belongs to the engine from here on, change it only through track()
+  int addTrajectory(ServoTrajectory &trajectory, RampOutput output, void *context) {
+    const int index = addChannel(output, context, trajectory.pulseUs());
+
+    if (index >= 0) {
+      _channels[index].trajectory = &trajectory;
+      _channels[index].target = trajectory.target();
+    }
+
+    return index;
+  }
+
+  // New target for a trajectory channel, the move in progress bends towards it at its speed
+  void track(int index, int target) {
+    if (index < 0 || index >= _channelCount || !_channels[index].trajectory) {
+      return;
+    }
+
+    portENTER_CRITICAL(&_mux);
+
+    RampChannel &channel = _channels[index];
+    channel.trajectory->setTarget(target);
+    channel.target = channel.trajectory->target();
+
+    if (!(_moving & (1 << index))) {
+      channel.startUs = halNowUs();
+    }
+
+    startLocked(index, channel.startUs);
+    portEXIT_CRITICAL(&_mux);
+  }
+
+  // Replaces whatever move the channel is in. A zero duration jumps on the next tick
+  void move(int index, int start, int target, uint32_t durationUs, RampProfile profile) {
+    if (index < 0 || index >= _channelCount) {
+      return;
+    }
+
+    portENTER_CRITICAL(&_mux);
+
+    RampChannel &channel = _channels[index];
+    channel.start = start;
+    channel.target = target;
+    channel.startUs = halNowUs();
+    channel.durationUs = durationUs;
+    channel.profile = profile < RAMP_PROFILE_COUNT ? profile : RAMP_SCURVE;
+    startLocked(index, channel.startUs);
+    portEXIT_CRITICAL(&_mux);
+  }
+
+  // Last value handed to the output
+  int value(int index) const {
+    return index >= 0 && index < _channelCount ? _channels[index].written : 0;
+  }
+
+  int target(int index) const {
+    return index >= 0 && index < _channelCount ? _channels[index].target : 0;
+  }
+
+  bool settled(int index) const {
+    return index < 0 || index >= _channelCount || !(_moving & (1 << index));
+  }
+
+  // One step of every moving channel. The timer calls it, benchmarks may call it directly
+  void tick(uint64_t nowUs) {
+    int changed[RAMP_MAX_CHANNELS];
+    int changedCount = 0;
+
+    portENTER_CRITICAL(&_mux);
+
+    for (int i = 0; i < _channelCount; i++) {
+      if (!(_moving & (1 << i))) {
+        continue;
+      }
+
+      RampChannel &channel = _channels[i];
+      const uint64_t elapsedUs = nowUs > channel.startUs ? nowUs - channel.startUs : 0;
+
+      if (channel.trajectory) {
+        // startUs is the last step here
+        if (channel.trajectory->step(elapsedUs)) {
+          _moving &= ~(1 << i);
+        }
+
+        channel.startUs = nowUs > channel.startUs ? nowUs : channel.startUs;
+        channel.value = channel.trajectory->pulseUs();
+      } else if (elapsedUs >= channel.durationUs) {
+        channel.value = channel.target;
+        _moving &= ~(1 << i);
+      } else {
+        const uint32_t phase = (uint64_t)elapsedUs * RAMP_PROFILE_ONE / channel.durationUs;
+        const int64_t position = lookup(channel.profile, phase);
+
+        channel.value = channel.start + (int)((channel.target - channel.start) * position / RAMP_PROFILE_ONE);
+      }
+
+      if (channel.value != channel.written) {
+        channel.written = channel.value;
+        changed[changedCount++] = i;
+      }
+    }
+
+    // nothing left to move: stop the timer from its own callback, the next move restarts it
+    if (!_moving && _timer.running()) {
+      _timer.stop();
+      _runUs += nowUs - _startedUs;
+    }
+
+    portEXIT_CRITICAL(&_mux);
+
+    // outputs write the hardware outside the lock, only this tick ever calls them
+    for (int i = 0; i < changedCount; i++) {
+      RampChannel &channel = _channels[changed[i]];
+      channel.output(channel.context, channel.written);
+    }
+
+    _ticks++;
+    _writes += changedCount;
+  }
+
+  void addTickTime(uint32_t tickUs) {
+    _busyUs += tickUs;
+    _maxBusyUs = tickUs > _maxBusyUs ? tickUs : _maxBusyUs;
+  }
+
+  uint32_t ticks() const {
+    return _ticks;
+  }
+
+  // Output calls, one per changed value
+  uint32_t writes() const {
+    return _writes;
+  }
+
+  // Total time spent in ticks, including the outputs' hardware writes
+  uint64_t busyUs() const {
+    return _busyUs;
+  }
+
+  uint32_t maxBusyUs() const {
+    return _maxBusyUs;
+  }
+
+  // Time the timer has been running, moves in progress not counted yet
+  uint64_t runUs() const {
+    return _runUs;
+  }
+
+  bool running() const {
+    return _timer.running();
+  }
+
+private:
+  struct RampChannel {
+    RampOutput output;
+    void *context;
+    int start;
+    int target;
+    int value;
+    int written;
+    uint64_t startUs;
+    uint32_t durationUs;
+    RampProfile profile;
+    ServoTrajectory *trajectory; // null for profile moves
+  };
+
+  RampChannel _channels[RAMP_MAX_CHANNELS];
+  uint8_t _channelCount;
+  volatile uint8_t _moving; // bit per channel with a move in progress
+  HalPeriodicTimer _timer;
+  portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+
+  uint32_t _ticks;
+  uint32_t _writes;
+  uint64_t _busyUs;
+  uint32_t _maxBusyUs;
+  uint64_t _runUs;
+  uint64_t _startedUs;
+
+  // Position 0..RAMP_PROFILE_ONE at time 0..RAMP_PROFILE_POINTS, one table per RampProfile
+  static uint32_t _profiles[RAMP_PROFILE_COUNT][RAMP_PROFILE_POINTS + 1];
+
+  // With _mux held
+  void startLocked(int index, uint64_t nowUs) {
+    _moving |= 1 << index;
+
+    if (!_timer.running()) {
+      _startedUs = nowUs;
+      _timer.start(RAMP_TICK_US);
+    }
+  }
+
+  static void onTimer(void *arg) {
+    RampEngine *engine = (RampEngine *)arg;
+    const uint64_t start = halNowUs();
+
+    engine->tick(start);
+    engine->addTickTime(halNowUs() - start);
+  }
+
+  static int64_t lookup(RampProfile profile, uint32_t phase) {
+    const uint32_t *table = _profiles[profile];
+    const uint32_t scaled = phase * RAMP_PROFILE_POINTS;
+    const uint32_t point = scaled / RAMP_PROFILE_ONE;
+    const uint32_t fraction = scaled % RAMP_PROFILE_ONE;
+
+    return table[point] + (int64_t)(table[point + 1] - table[point]) * fraction / RAMP_PROFILE_ONE;
+  }
+
+  // Once at construction, the ticks only read the tables
+  static void buildProfiles() {
+    for (int i = 0; i <= RAMP_PROFILE_POINTS; i++) {
+      const double t = (double)i / RAMP_PROFILE_POINTS;
+      double trapezoid;
+
+      // peak speed 1.5 reached after a third, so the area under the speed curve is 1
+      if (t < 1.0 / 3) {
+        trapezoid = 2.25 * t * t;
+      } else if (t < 2.0 / 3) {
+        trapezoid = 0.25 + 1.5 * (t - 1.0 / 3);
+      } else {
+        trapezoid = 1 - 2.25 * (1 - t) * (1 - t);
+      }
+
+      _profiles[RAMP_SCURVE][i] = (uint32_t)(RAMP_PROFILE_ONE * t * t * (3 - 2 * t) + 0.5);
+      _profiles[RAMP_TRAPEZOID][i] = (uint32_t)(RAMP_PROFILE_ONE * trapezoid + 0.5);
+    }
+  }
+};
+
+uint32_t RampEngine::_profiles[RAMP_PROFILE_COUNT][RAMP_PROFILE_POINTS + 1];
@@ -0,0 +1,215 @@
+#pragma once
+#include "hal/Hal.h"
+#include "utils.h"
+
+// Longest a response write waits on a client that stopped reading
+#define REQUEST_SEND_TIMEOUT_MS 5000
+
+class RequestWorker;
+
+// A slow request taken off the server's task. run() does the work and writes the whole
+// response on fd, arg0 and arg1 are the request's parameters as parsed by its handler
+struct RequestJob {
+  void (*run)(RequestWorker &worker, int fd, const RequestJob &job);
+  int32_t arg0;
+  int32_t arg1;
+};
+
+// Runs one slow request at a time in its own task, so the server's only task is free for
+// commands and other requests while it runs. The handler hands its socket over with submit()
+// and returns. The job writes a complete response with Connection: close, then the session
+// goes back to the server through the detach hook, as the stream sender gives its sockets back
+class RequestWorker {
+public:
+  RequestWorker()
+      : _fd(-1),
+        _job(),
+        _closed(false),
+        _leaving(false),
+        _task(nullptr),
+        _detach(nullptr),
+        _context(nullptr),
+        _jobs(0),
+        _rejected(0) {
+  }
+
+  // detach asks the server to close the session, false when it cannot and the worker closes
+  // the socket itself
+  void begin(bool (*detach)(void *context, int fd), void *context) {
+    _detach = detach;
+    _context = context;
+
+    xTaskCreatePinnedToCore(
+        workerTask,
+        "RequestWorker",
+        4096,
+        this,
+        2,
+        &_task,
+        tskNO_AFFINITY);
+  }
+
+  // From the handler. False when a job is still running, nothing was taken over then and the
+  // handler answers itself
+  bool submit(int fd, const RequestJob &job) {
+    portENTER_CRITICAL(&_mux);
+    const bool idle = _fd < 0;
+
+    if (idle) {
+      _fd = fd;
+      _job = job;
+      _closed = false;
+      _leaving = false;
+    }
+
+    portEXIT_CRITICAL(&_mux);
+
+    if (!idle) {
+      _rejected++;
+      return false;
+    }
+
+    xTaskNotifyGive(_task);
+
+    return true;
+  }
+
+  // From the server's close_fn. Returns true when a job still writes on the socket and the
+  // worker closes it itself, false when the caller should close it
+  bool onSocketClosed(int fd) {
+    portENTER_CRITICAL(&_mux);
+
+    if (_fd != fd) {
+      portEXIT_CRITICAL(&_mux);
+      return false;
+    }
+
+    if (_leaving) {
+      // handed back, the socket is the server's to close
+      _fd = -1;
+      portEXIT_CRITICAL(&_mux);
+      return false;
+    }
+
+    _closed = true;
+    portEXIT_CRITICAL(&_mux);
+
+    return true;
+  }
+
+  // The whole buffer, false once the client is gone and the job should stop
+  bool sendAll(int fd, const void *data, size_t length) {
+    const char *bytes = (const char *)data;
+
+    while (length) {
+      const int written = send(fd, bytes, length, MSG_NOSIGNAL);
+
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (written <= 0) {
+        return false;
+      }
+
+      bytes += written;
+      length -= written;
+    }
+
+    return true;
+  }
+
+  // Status line and headers. length 0 - not known, the body ends with the connection.
+  // headers are extra header lines, each ending in \r\n
+  bool sendHeader(int fd, const char *status, const char *type, size_t length, const char *headers = "") {
+    char header[384];
+    int written = snprintf(header, sizeof(header),
+                           "HTTP/1.1 %s\r\nContent-Type: %s\r\nAccess-Control-Allow-Origin: *\r\n"
+                           "Cache-Control: no-store\r\nConnection: close\r\n%s",
+                           status, type, headers);
+
+    if (length && written > 0 && written < (int)sizeof(header)) {
+      written += snprintf(header + written, sizeof(header) - written, "Content-Length: %u\r\n", (unsigned)length);
+    }
+
+    if (written > 0 && written < (int)sizeof(header)) {
+      written += snprintf(header + written, sizeof(header) - written, "\r\n");
+    }
+
+    if (written <= 0 || written >= (int)sizeof(header)) {
+      return false;
+    }
+
+    return sendAll(fd, header, written);
+  }
+
+  uint32_t jobs() const {
+    return _jobs;
+  }
+
+  // Requests turned away while a job ran
+  uint32_t rejected() const {
+    return _rejected;
+  }
+
+private:
+  int _fd; // the job's socket, -1 - idle
+  RequestJob _job;
+  bool _closed;  // the server dropped the session while the job ran
+  bool _leaving; // the job is done and the session is being handed back
+  TaskHandle_t _task;
+  bool (*_detach)(void *context, int fd);
+  void *_context;
+  uint32_t _jobs;
+  uint32_t _rejected;
+  portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+
+  static void workerTask(void *param) {
+    RequestWorker *self = (RequestWorker *)param;
+
+    for (;;) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      self->run();
+    }
+  }
+
+  void run() {
+    portENTER_CRITICAL(&_mux);
+    const int fd = _fd;
+    const RequestJob job = _job;
+    portEXIT_CRITICAL(&_mux);
+
+    if (fd < 0) {
+      return;
+    }
+
+    const timeval timeout = {REQUEST_SEND_TIMEOUT_MS / 1000, (REQUEST_SEND_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    job.run(*this, fd, job);
+    _jobs++;
+    finish(fd);
+  }
+
+  void finish(int fd) {
+    portENTER_CRITICAL(&_mux);
+    const bool closed = _closed;
+
+    if (closed) {
+      _fd = -1;
+    } else {
+      _leaving = true;
+    }
+
+    portEXIT_CRITICAL(&_mux);
+
+    if (closed) {
+      close(fd);
+    } else if (!_detach || !_detach(_context, fd)) {
+      portENTER_CRITICAL(&_mux);
+      _fd = -1;
+      portEXIT_CRITICAL(&_mux);
+      close(fd);
+    }
+  }
+};
@@ -0,0 +1,161 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+
+// Pulse range of the SG90 class servos on the camera mount, 0..180 degrees
+#define SERVO_MIN_PULSE_US 544
+#define SERVO_MAX_PULSE_US 2400
+#define SERVO_CENTER_PULSE_US ((SERVO_MIN_PULSE_US + SERVO_MAX_PULSE_US) / 2)
+// Pulse width change per second: about 0.25 s for the full sweep, a little faster than the
+// servo itself so the limit is felt in the acceleration, not in a lagging horn
+#define SERVO_MAX_VELOCITY 8000
+// Per second squared: full speed in 0.1 s, soft enough that the picture does not jerk
+#define SERVO_MAX_ACCELERATION 80000
+// Position fraction bits, a step of a few hundred microseconds moves less than a microsecond
+#define SERVO_POSITION_SHIFT 8
+
+// Velocity and acceleration limited path to a pulse width target, advanced in steps of the
+// caller's choosing. Each step picks the speed from which the servo can still brake to the
+// target at the acceleration limit, capped at the velocity limit, and changes the current
+// speed towards it by at most one step's acceleration. A new target mid-move keeps the
+// current speed, so retargeting never jerks. Pure integer C++ like DriveMixer, the caller
+// supplies the time
+class ServoTrajectory {
+public:
+  ServoTrajectory()
+      : _position(SERVO_CENTER_PULSE_US << SERVO_POSITION_SHIFT),
+        _velocity(0),
+        _target(SERVO_CENTER_PULSE_US),
+        _maxVelocity(SERVO_MAX_VELOCITY),
+        _maxAcceleration(SERVO_MAX_ACCELERATION) {}
+
+  // Jumps to pulseUs and stands still there
+  void reset(int pulseUs) {
+    _target = clampPulse(pulseUs);
+    _position = _target << SERVO_POSITION_SHIFT;
+    _velocity = 0;
+  }
+
+  void setLimits(int32_t maxVelocity, int32_t maxAcceleration) {
+    _maxVelocity = maxVelocity > 0 ? maxVelocity : 1;
+    _maxAcceleration = maxAcceleration > 0 ? maxAcceleration : 1;
+  }
+
+  void setTarget(int pulseUs) {
+    _target = clampPulse(pulseUs);
+  }
+
+  // Advances by dtUs. Returns whether the servo is at the target and still
+  bool step(uint32_t dtUs) {
+    if (settled() || !dtUs) {
+      return settled();
+    }
+
+    const int64_t target = (int64_t)_target << SERVO_POSITION_SHIFT;
+    const int64_t distance = target - _position;
+    const int32_t direction = distance > 0 ? 1 : -1;
+    const int32_t speedStep = (int32_t)((int64_t)_maxAcceleration * dtUs / 1000000);
+    const int32_t limit = speedStep > 0 ? speedStep : 1;
+
+    // v^2 = 2ad, the fastest speed that still stops at the target, for braking in steps of
+    // limit: v = sqrt(2ad + (limit / 2)^2) - limit / 2
+    const uint64_t brakingSquare = ((uint64_t)2 * _maxAcceleration * (uint64_t)llabs(distance) >> SERVO_POSITION_SHIFT) +
+                                   (uint64_t)limit * limit / 4;
+    int32_t wanted = (int32_t)isqrt(brakingSquare) - limit / 2;
+    wanted = direction * (wanted < _maxVelocity ? wanted : _maxVelocity);
+
+    const int32_t change = wanted - _velocity;
+    const int32_t previous = _velocity;
+    _velocity += change > limit ? limit : (change < -limit ? -limit : change);
+
+    const int64_t moved = (int64_t)_velocity * dtUs * (1 << SERVO_POSITION_SHIFT) / 1000000;
+
+    // a step that would reach the target ends on it. A late tick can bring the servo there
+    // before it has braked, it then waits on the target until the speed is braked away
+    if (!distance || (moved >= distance && direction > 0) || (moved <= distance && direction < 0)) {
+      _position = target;
+
+      if (abs(previous) <= limit) {
+        _velocity = 0;
+      }
+
+      return !_velocity;
+    }
+
+    _position += moved;
+
+    return false;
+  }
+
+  // Whole microseconds, what the servo driver gets
+  int pulseUs() const {
+    return (int)((_position + (1 << (SERVO_POSITION_SHIFT - 1))) >> SERVO_POSITION_SHIFT);
+  }
+
+  int target() const {
+    return _target;
+  }
+
+  // Pulse width change per second, signed
+  int32_t velocity() const {
+    return _velocity;
+  }
+
+  bool settled() const {
+    return !_velocity && _position == (int64_t)_target << SERVO_POSITION_SHIFT;
+  }
+
+  int32_t maxVelocity() const {
+    return _maxVelocity;
+  }
+
+  int32_t maxAcceleration() const {
+    return _maxAcceleration;
+  }
+
+  // Shortest time from standing to standing over distanceUs under the limits: a trapezoid,
+  // or a triangle when the move is too short to reach full speed
+  uint32_t minimumTimeUs(int distanceUs) const {
+    const uint64_t distance = abs(distanceUs);
+    const uint64_t rampDistance = (uint64_t)_maxVelocity * _maxVelocity / _maxAcceleration;
+
+    if (distance >= rampDistance) {
+      return distance * 1000000 / _maxVelocity + (uint64_t)_maxVelocity * 1000000 / _maxAcceleration;
+    }
+
+    return 2 * isqrt(distance * 1000000000000ULL / _maxAcceleration);
+  }
+
+  static int clampPulse(int pulseUs) {
+    return pulseUs < SERVO_MIN_PULSE_US ? SERVO_MIN_PULSE_US : (pulseUs > SERVO_MAX_PULSE_US ? SERVO_MAX_PULSE_US : pulseUs);
+  }
+
+private:
+  int64_t _position; // microseconds << SERVO_POSITION_SHIFT
+  int32_t _velocity;
+  int32_t _target;
+  int32_t _maxVelocity;
+  int32_t _maxAcceleration;
+
+  static uint32_t isqrt(uint64_t value) {
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+
+    while (bit > value) {
+      bit >>= 2;
+    }
+
+    while (bit) {
+      if (value >= root + bit) {
+        value -= root + bit;
+        root = (root >> 1) + bit;
+      } else {
+        root >>= 1;
+      }
+
+      bit >>= 2;
+    }
+
+    return (uint32_t)root;
+  }
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include "hal/Hal.h"
+
+// A viewer that accepts no byte for this long while a frame waits is taken for dead. Long
+// enough for a UXGA still over a weak link to make progress, short enough that a car whose
+// only viewer vanished stops within a few seconds
+#define STREAM_STALL_TIMEOUT_MS 4000
+
+// Socket settings of one server: the options set on each socket it accepts for /stream and
+// /ws, and the server's own timeouts
+struct SocketTuning {
+  int sendBufferBytes;        // SO_SNDBUF, 0 - the stack's default. lwIP builds without LWIP_SO_SNDBUF refuse it
+  bool noDelay;               // TCP_NODELAY, a frame's last segment leaves without waiting for the previous ack
+  uint16_t keepAliveIdleS;    // idle time before the first probe, 0 - no keepalive
+  uint16_t keepAliveIntervalS;
+  uint8_t keepAliveCount;     // unanswered probes before the stack drops the connection
+  uint32_t stallTimeoutMs;    // stream sender, 0 - never
+  uint16_t sendWaitTimeoutS;  // the server's own blocking sends: WS replies, assets, stills
+  uint16_t recvWaitTimeoutS;
+  bool lruPurge;              // a new connection closes the least recently used one when all sockets are taken
+};
+
+// Keepalive notices a peer that went away without a FIN in about 11 s on an idle /ws socket.
+// A stream socket with frames waiting is dropped by the stall timeout first
+static const SocketTuning defaultSocketTuning = {
+    .sendBufferBytes = 0,
+    .noDelay = true,
+    .keepAliveIdleS = 5,
+    .keepAliveIntervalS = 2,
+    .keepAliveCount = 3,
+    .stallTimeoutMs = STREAM_STALL_TIMEOUT_MS,
+    .sendWaitTimeoutS = 2,
+    .recvWaitTimeoutS = 5,
+    .lruPurge = true};
+
+// Returns the number of options the stack refused, the socket is usable either way
+inline int applySocketTuning(int fd, const SocketTuning &tuning) {
+  int refused = 0;
+  const int noDelay = tuning.noDelay;
+
+  refused += setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) != 0;
+
+  if (tuning.sendBufferBytes > 0) {
+    refused += setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &tuning.sendBufferBytes, sizeof(tuning.sendBufferBytes)) != 0;
+  }
+
+  if (tuning.keepAliveIdleS) {
+    const int enabled = 1;
+    const int idle = tuning.keepAliveIdleS;
+    const int interval = tuning.keepAliveIntervalS;
+    const int count = tuning.keepAliveCount;
+
+    refused += setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enabled, sizeof(enabled)) != 0;
+    refused += setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) != 0;
+    refused += setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) != 0;
+    refused += setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) != 0;
+  }
+
+  return refused;
+}
@@ -0,0 +1,924 @@
+#pragma once
+#include "CarProtocol.h"
+#include "FrameBroadcaster.h"
+#include "FramePacer.h"
+#include "HeapWatermark.h"
+#include "LatencyMetrics.h"
+#include "MotionDetector.h"
+#include "SocketTuning.h"
+#include "hal/Hal.h"
+#include "utils.h"
+
+// Longest a socket waits in select() before clients waiting for a frame are looked at again
+#define STREAM_POLL_MS 5
+#define STREAM_PART_HEADER_SIZE 224
+// Longest another task waits in holdSocket() for a video frame to finish writing
+#define STREAM_HOLD_TIMEOUT_MS 200
+// WS video frames sent but not acked yet before the viewer's frames are skipped: one on the
+// canvas being decoded, one on its way
+#define VIDEO_MAX_UNACKED 2
+// A viewer that stops acking gets a frame again after this long, a lost ack cannot stall it
+#define VIDEO_ACK_TIMEOUT_MS 1000
+
+static const char *streamResponseHeader = "HTTP/1.1 200 OK\r\n"
+                                          "Content-Type: multipart/x-mixed-replace;boundary=frame\r\n"
+                                          "\r\n";
+
+// Firmware glue, every hook is optional and runs in the sender's task
+struct StreamHooks {
+  void *context;
+  // Whether the car is parked, unchanged frames are then skipped bar one per keepalive
+  bool (*parked)(void *context);
+  // A frame went out to the viewer in slot viewer: its size, the time from first to last
+  // byte and the current time
+  void (*frameSent)(void *context, int viewer, size_t bytes, uint32_t sendUs, uint64_t nowUs);
+  // +1 when a viewer starts, -1 when it ends
+  void (*viewersChanged)(void *context, int delta);
+  // Asks the server that accepted the socket to close the session. Returns false when it
+  // cannot, the sender closes the socket itself
+  bool (*detach)(void *context, int fd);
+};
+
+enum StreamKind : uint8_t {
+  STREAM_MJPEG,   // multipart response on its own /stream connection
+  STREAM_WS_VIDEO // binary messages on the viewer's /ws WebSocket, acked by the viewer
+};
+
+// Viewer served by the sender. Each one holds at most one frame, sent in pieces as its
+// socket accepts them
+struct StreamClient {
+  int fd;
+  StreamKind kind;
+  bool closed;   // the server dropped the session, the sender closes the socket
+  bool leaving;  // the sender asked the server to drop the session, the server closes the socket
+  bool started;  // counted as a viewer
+  bool stopping; // WS video turned off, the slot is freed after the frame in progress
+  bool writing;  // WS video: a frame is partly written, nothing else may go on the socket
+  uint8_t held;  // WS video: text messages being written by other tasks, no frame may start
+  bool ackPending; // WS video: a command ack waits to go out between frames
+  uint16_t ackSeq;
+  FramePacer pacer;
+
+  // WS video frames not acked yet, oldest first, with their sensor timestamps
+  uint8_t unacked;
+  uint16_t unackedSeq[VIDEO_MAX_UNACKED];
+  uint64_t unackedSensorUs[VIDEO_MAX_UNACKED];
+  uint64_t lastAckUs; // the last ack, or when the first of the unacked frames went out
+
+  SharedFrame *frame;
+  char header[STREAM_PART_HEADER_SIZE];
+  size_t headerLength;
+  size_t headerSent;
+  size_t bodySent;
+  uint32_t lastSeq;
+  uint64_t frameStartUs;
+  uint64_t sendStartUs;
+  uint64_t firstByteUs;
+  uint64_t nextFrameUs;
+  uint64_t lastSentMs;
+  uint64_t startedMs;
+  uint64_t progressMs; // the socket last took a byte, or the viewer started
+  uint32_t sent;
+  uint32_t dropped;
+  uint32_t skipped;
+};
+
+// Serves every /stream viewer and every WS video viewer from one task. Writes never block:
+// each round the task hands a new frame to the viewers that are due one, writes what every
+// socket accepts and then sleeps in select() until one of them drains, or on the
+// broadcaster's notification when nothing is left to write. A slow viewer only delays itself,
+// and the web server that accepted the socket is free again as soon as it is handed over
+class StreamSender {
+public:
+  StreamSender()
+      : _broadcaster(nullptr),
+        _task(nullptr),
+        _hooks(),
+        _targetFps(0),
+        _latencyBudgetUs(0),
+        _stallTimeoutMs(STREAM_STALL_TIMEOUT_MS),
+        _subscribed(false),
+        _connections(0),
+        _rejected(0),
+        _framesSent(0),
+        _idleFramesSkipped(0),
+        _idleBytesSaved(0),
+        _ackTimeouts(0),
+        _stalls(0) {
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+      _clients[i].fd = -1;
+    }
+  }
+
+  void begin(FrameBroadcaster &broadcaster, const StreamHooks &hooks) {
+    _broadcaster = &broadcaster;
+    _hooks = hooks;
+
+    xTaskCreatePinnedToCore(
+        senderTask,
+        "StreamSender",
+        4096,
+        this,
+        5,
+        &_task,
+        tskNO_AFFINITY);
+  }
+
+  void setPacing(uint8_t targetFps, uint32_t latencyBudgetUs) {
+    _targetFps = targetFps;
+    _latencyBudgetUs = latencyBudgetUs;
+  }
+
+  // A viewer whose socket takes nothing for timeoutMs while data waits is dropped, 0 - never.
+  // A peer gone without a FIN otherwise holds its slot, and keeps the car driving, until the
+  // stack gives up on the connection
+  void setStallTimeout(uint32_t timeoutMs) {
+    _stallTimeoutMs = timeoutMs;
+  }
+
+  // Takes over a connected socket, the response header included. Returns false when all
+  // STREAM_MAX_CLIENTS slots are busy, the socket stays with the caller then
+  bool add(int fd) {
+    StreamClient *client = claim(fd, STREAM_MJPEG);
+
+    if (!client) {
+      return false;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    client->headerLength = strlen(streamResponseHeader);
+    memcpy(client->header, streamResponseHeader, client->headerLength);
+    serve(*client);
+
+    return true;
+  }
+
+  // Sends video frames as binary messages on a WebSocket the server keeps. The socket stays
+  // the server's, text messages go out between frames through holdSocket(). Returns true
+  // when the socket already gets video, false when every slot is busy
+  bool addVideo(int fd) {
+    portENTER_CRITICAL(&_mux);
+    StreamClient *client = find(fd, STREAM_WS_VIDEO);
+
+    if (client) {
+      client->stopping = false;
+    }
+
+    portEXIT_CRITICAL(&_mux);
+
+    if (client) {
+      return true;
+    }
+
+    client = claim(fd, STREAM_WS_VIDEO);
+
+    if (!client) {
+      return false;
+    }
+
+    client->headerLength = 0;
+    serve(*client);
+
+    return true;
+  }
+
+  // Ends WS video on the socket after the frame in progress, the WebSocket stays open
+  void removeVideo(int fd) {
+    portENTER_CRITICAL(&_mux);
+    StreamClient *client = find(fd, STREAM_WS_VIDEO);
+
+    if (client) {
+      client->stopping = true;
+    }
+
+    portEXIT_CRITICAL(&_mux);
+    xTaskNotifyGive(_task);
+  }
+
+  // A WS video viewer has shown or dropped the frame, seq is its low 16 bits
+  void onVideoAck(int fd, uint16_t seq) {
+    const uint64_t now = nowUs();
+    uint64_t sensorAtUs = 0;
+
+    portENTER_CRITICAL(&_mux);
+    StreamClient *client = find(fd, STREAM_WS_VIDEO);
+
+    if (client) {
+      client->lastAckUs = now;
+
+      for (int i = 0; i < client->unacked; i++) {
+        if (client->unackedSeq[i] != seq) {
+          continue;
+        }
+
+        // frames before the acked one are not coming back either
+        sensorAtUs = client->unackedSensorUs[i];
+        client->unacked -= i + 1;
+        memmove(client->unackedSeq, client->unackedSeq + i + 1, client->unacked * sizeof(uint16_t));
+        memmove(client->unackedSensorUs, client->unackedSensorUs + i + 1, client->unacked * sizeof(uint64_t));
+        break;
+      }
+    }
+
+    portEXIT_CRITICAL(&_mux);
+
+    if (sensorAtUs) {
+      latencyMetrics.record(LAT_FRAME_SENSOR_TO_ACK, sensorAtUs, now);
+      xTaskNotifyGive(_task);
+    }
+  }
+
+  // The ack of a binary command on a WS video socket, written by the sender's task between
+  // frames so the server's task never waits for one. A newer ack replaces one not sent yet,
+  // the client only looks at the newest. Returns false when the socket gets no video, the
+  // caller sends the ack itself then
+  bool queueAck(int fd, uint16_t seq) {
+    portENTER_CRITICAL(&_mux);
+    StreamClient *client = find(fd, STREAM_WS_VIDEO);
+
+    if (client) {
+      client->ackSeq = seq;
+      client->ackPending = true;
+    }
+
+    portEXIT_CRITICAL(&_mux);
+
+    if (client) {
+      xTaskNotifyGive(_task);
+    }
+
+    return client != nullptr;
+  }
+
+  // Before another task writes a message on a socket that may get WS video: waits until no
+  // frame is half written and keeps new ones off the socket until releaseSocket(). Returns
+  // false when a frame did not finish within STREAM_HOLD_TIMEOUT_MS, the socket is not held
+  // then. Sockets without video are not waited for
+  bool holdSocket(int fd) {
+    const uint64_t start = nowMs();
+
+    for (;;) {
+      portENTER_CRITICAL(&_mux);
+      StreamClient *client = find(fd, STREAM_WS_VIDEO);
+      const bool free = !client || !client->writing;
+
+      if (client && free) {
+        client->held++;
+      }
+
+      portEXIT_CRITICAL(&_mux);
+
+      if (free) {
+        return true;
+      }
+
+      if (elapsedSince(start) >= STREAM_HOLD_TIMEOUT_MS) {
+        return false;
+      }
+
+      vTaskDelay(1);
+    }
+  }
+
+  void releaseSocket(int fd) {
+    portENTER_CRITICAL(&_mux);
+    StreamClient *client = find(fd, STREAM_WS_VIDEO);
+
+    if (client && client->held) {
+      client->held--;
+    }
+
+    portEXIT_CRITICAL(&_mux);
+    xTaskNotifyGive(_task);
+  }
+
+  // From the server's close_fn. Returns true when the sender still serves the socket and
+  // closes it itself, false when the caller should close it
+  bool onSocketClosed(int fd) {
+    portENTER_CRITICAL(&_mux);
+
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+      StreamClient &client = _clients[i];
+
+      if (client.fd != fd) {
+        continue;
+      }
+
+      if (client.leaving) {
+        client.fd = -1;
+        portEXIT_CRITICAL(&_mux);
+        // the sender handed the session back, the socket is the server's to close
+        return false;
+      }
+
+      client.closed = true;
+      portEXIT_CRITICAL(&_mux);
+      xTaskNotifyGive(_task);
+
+      return true;
+    }
+
+    portEXIT_CRITICAL(&_mux);
+
+    return false;
+  }
+
+  // Slots in use, including viewers on their way out
+  int clientCount() {
+    int count = 0;
+
+    portENTER_CRITICAL(&_mux);
+
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+      count += _clients[i].fd >= 0;
+    }
+
+    portEXIT_CRITICAL(&_mux);
+
+    return count;
+  }
+
+  const StreamClient &client(int index) const {
+    return _clients[index];
+  }
+
+  // Viewers taken over since boot
+  uint32_t connections() const {
+    return _connections;
+  }
+
+  // Viewers turned away because every slot was busy
+  uint32_t rejected() const {
+    return _rejected;
+  }
+
+  uint32_t framesSent() const {
+    return _framesSent;
+  }
+
+  uint32_t idleFramesSkipped() const {
+    return _idleFramesSkipped;
+  }
+
+  uint64_t idleBytesSaved() const {
+    return _idleBytesSaved;
+  }
+
+  // Times a WS video viewer's unacked frames were given up on after VIDEO_ACK_TIMEOUT_MS
+  uint32_t ackTimeouts() const {
+    return _ackTimeouts;
+  }
+
+  // Viewers dropped after the stall timeout
+  uint32_t stalls() const {
+    return _stalls;
+  }
+
+  // Allocations per round of the sender's loop
+  const HeapWatermark &heap() const {
+    return _heap;
+  }
+
+private:
+  StreamClient _clients[STREAM_MAX_CLIENTS];
+  portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+  FrameBroadcaster *_broadcaster;
+  TaskHandle_t _task;
+  StreamHooks _hooks;
+  uint8_t _targetFps;
+  uint32_t _latencyBudgetUs;
+  uint32_t _stallTimeoutMs;
+  bool _subscribed;
+
+  uint32_t _connections;
+  uint32_t _rejected;
+  uint32_t _framesSent;
+  uint32_t _idleFramesSkipped;
+  uint64_t _idleBytesSaved;
+  uint32_t _ackTimeouts;
+  uint32_t _stalls;
+  HeapWatermark _heap;
+
+  static void senderTask(void *param) {
+    ((StreamSender *)param)->run();
+  }
+
+  // With _mux held
+  StreamClient *find(int fd, StreamKind kind) {
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+      if (_clients[i].fd == fd && _clients[i].kind == kind) {
+        return &_clients[i];
+      }
+    }
+
+    return nullptr;
+  }
+
+  // A free slot for the socket, not served until serve()
+  StreamClient *claim(int fd, StreamKind kind) {
+    StreamClient *client = nullptr;
+
+    portENTER_CRITICAL(&_mux);
+
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+      if (_clients[i].fd < 0) {
+        client = &_clients[i];
+        client->fd = fd;
+        client->kind = kind;
+        client->closed = false;
+        client->leaving = true;
+        break;
+      }
+    }
+
+    portEXIT_CRITICAL(&_mux);
+
+    if (!client) {
+      _rejected++;
+    }
+
+    return client;
+  }
+
+  // Sets up a claimed slot and hands it to the task
+  void serve(StreamClient &client) {
+    client.started = false;
+    client.stopping = false;
+    client.writing = false;
+    client.held = 0;
+    client.ackPending = false;
+    client.pacer.reset();
+    client.unacked = 0;
+    client.lastAckUs = nowUs();
+    client.frame = nullptr;
+    client.headerSent = 0;
+    client.bodySent = 0;
+    client.lastSeq = 0;
+    client.nextFrameUs = 0;
+    client.lastSentMs = 0;
+    client.startedMs = nowMs();
+    client.progressMs = client.startedMs;
+    client.sent = 0;
+    client.dropped = 0;
+    client.skipped = 0;
+    _connections++;
+
+    portENTER_CRITICAL(&_mux);
+    client.leaving = false;
+    portEXIT_CRITICAL(&_mux);
+
+    xTaskNotifyGive(_task);
+  }
+
+  void run() {
+    AllocationProbe probe;
+
+    for (;;) {
+      const uint64_t now = nowUs();
+      uint64_t wakeUs = now + 1000000;
+      fd_set writable;
+      int maxFd = -1;
+      int serving = 0;
+
+      FD_ZERO(&writable);
+
+      for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        StreamClient &client = _clients[i];
+
+        portENTER_CRITICAL(&_mux);
+        const bool active = client.fd >= 0 && !client.leaving;
+        const bool closed = client.closed;
+        const bool stopping = client.stopping;
+        const bool held = client.held;
+        portEXIT_CRITICAL(&_mux);
+
+        if (!active) {
+          continue;
+        }
+
+        if (closed) {
+          finish(client);
+          continue;
+        }
+
+        if (!client.started) {
+          client.started = true;
+          onStart(client);
+        }
+
+        serving++;
+
+        if (client.kind == STREAM_WS_VIDEO && !client.frame && client.headerSent == client.headerLength) {
+          takeAck(client);
+        }
+
+        if (!client.frame && client.headerSent == client.headerLength) {
+          if (stopping) {
+            end(client);
+            release(client);
+            serving--;
+            continue;
+          }
+
+          if (now < client.nextFrameUs) {
+            wakeUs = std::min(wakeUs, client.nextFrameUs);
+            continue;
+          }
+
+          if (client.kind == STREAM_WS_VIDEO && !ackWindowOpen(client, now, wakeUs)) {
+            continue;
+          }
+
+          if (!take(client, now)) {
+            continue;
+          }
+        }
+
+        // a taken WS frame waits for text messages on the socket, releaseSocket() wakes the task
+        if (client.kind == STREAM_WS_VIDEO && !client.writing && (held || !beginWrite(client))) {
+          continue;
+        }
+
+        if (!push(client)) {
+          finish(client);
+          serving--;
+          continue;
+        }
+
+        if (client.frame || client.headerSent < client.headerLength) {
+          if (stalled(client)) {
+            finish(client);
+            serving--;
+            continue;
+          }
+
+          FD_SET(client.fd, &writable);
+          maxFd = std::max(maxFd, client.fd);
+        } else if (client.kind == STREAM_WS_VIDEO) {
+          // an ack went out, or a frame: round again at once for the frame that may be waiting
+          wakeUs = now;
+        }
+      }
+
+      updateSubscription(serving > 0);
+
+      if (!serving) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        probe.restart();
+        continue;
+      }
+
+      _heap.record(probe);
+
+      if (maxFd >= 0) {
+        timeval timeout = {0, STREAM_POLL_MS * 1000};
+        select(maxFd + 1, nullptr, &writable, nullptr, &timeout);
+      } else {
+        // woken by the next published frame, or when the earliest paced viewer is due
+        const uint64_t after = nowUs();
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wakeUs > after ? (wakeUs - after + 999) / 1000 : 0));
+      }
+    }
+  }
+
+  // The broadcaster only captures while someone is subscribed
+  void updateSubscription(bool serving) {
+    if (serving && !_subscribed) {
+      _subscribed = _broadcaster->subscribe();
+    } else if (!serving && _subscribed) {
+      _broadcaster->unsubscribe();
+      _subscribed = false;
+    }
+  }
+
+  void onStart(const StreamClient &client) {
+    if (_hooks.viewersChanged) {
+      _hooks.viewersChanged(_hooks.context, 1);
+    }
+
+    Serial.printf("%s started - %d client(s)\n", client.kind == STREAM_WS_VIDEO ? "WS video" : "Stream", clientCount());
+  }
+
+  // WS video: at most VIDEO_MAX_UNACKED frames in flight to the viewer, the rest are skipped
+  // until it catches up. Sets wakeUs to when the oldest frame times out
+  bool ackWindowOpen(StreamClient &client, uint64_t now, uint64_t &wakeUs) {
+    const uint64_t timeoutUs = VIDEO_ACK_TIMEOUT_MS * 1000ULL;
+
+    portENTER_CRITICAL(&_mux);
+    bool open = client.unacked < VIDEO_MAX_UNACKED;
+
+    if (!open && now - client.lastAckUs >= timeoutUs) {
+      client.unacked = 0;
+      open = true;
+      _ackTimeouts++;
+    }
+
+    const uint64_t timeoutAt = client.lastAckUs + timeoutUs;
+    portEXIT_CRITICAL(&_mux);
+
+    if (!open) {
+      wakeUs = std::min(wakeUs, timeoutAt);
+    }
+
+    return open;
+  }
+
+  // WS video: the socket is the frame's until it is written in full
+  bool beginWrite(StreamClient &client) {
+    portENTER_CRITICAL(&_mux);
+    const bool free = !client.held;
+    client.writing = free;
+    portEXIT_CRITICAL(&_mux);
+
+    return free;
+  }
+
+  // Picks up the newest frame if it is one the viewer has not seen
+  bool take(StreamClient &client, uint64_t now) {
+    SharedFrame *frame = _broadcaster->acquire(client.lastSeq, 0);
+
+    if (!frame) {
+      return false;
+    }
+
+    if (client.lastSeq && frame->seq - client.lastSeq > 1) {
+      client.dropped += frame->seq - client.lastSeq - 1;
+    }
+
+    client.lastSeq = frame->seq;
+    _broadcaster->detectMotion(_hooks.parked && _hooks.parked(_hooks.context));
+
+    // parked and nothing moves in the picture: skip the frame, bar one per keepalive period
+    if (!frame->changed && nowMs() - client.lastSentMs < IDLE_KEEPALIVE_MS) {
+      _idleFramesSkipped++;
+      _idleBytesSaved += frame->jpegLength;
+      client.skipped++;
+      _broadcaster->release(frame);
+
+      return false;
+    }
+
+    // part headers carry the capture timestamp and the on-board stage timings of the frame,
+    // so a client can line them up with its own receive and decode times
+    const camera_fb_t *fb = frame->fb;
+    const uint64_t headerAt = nowUs();
+
+    client.frame = frame;
+    client.progressMs = headerAt / 1000;
+    client.frameStartUs = now;
+    client.sendStartUs = headerAt;
+    client.firstByteUs = 0;
+    client.headerSent = 0;
+    client.bodySent = 0;
+
+    if (client.kind == STREAM_WS_VIDEO) {
+      videoHeader(client);
+
+      return true;
+    }
+
+    client.headerLength = snprintf(client.header, sizeof(client.header),
+                                   "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n"
+                                   "X-Timestamp: %lld.%06ld\r\nX-Frame-Seq: %u\r\n"
+                                   "X-Sensor-To-Fetch-Us: %lld\r\nX-Fetch-To-Send-Us: %lld\r\n\r\n",
+                                   (unsigned)frame->jpegLength, (long long)fb->timestamp.tv_sec, (long)fb->timestamp.tv_usec,
+                                   frame->seq, (long long)(frame->fetchedAtUs - frame->sensorAtUs),
+                                   (long long)(headerAt - frame->fetchedAtUs));
+
+    return true;
+  }
+
+  // Loads a pending ack as the next thing to write: an unmasked text WebSocket frame, all in
+  // the header buffer
+  void takeAck(StreamClient &client) {
+    portENTER_CRITICAL(&_mux);
+    const bool pending = client.ackPending;
+    const uint16_t seq = client.ackSeq;
+    client.ackPending = false;
+    portEXIT_CRITICAL(&_mux);
+
+    if (!pending) {
+      return;
+    }
+
+    const int length = snprintf(client.header + 2, sizeof(client.header) - 2, "ack-%u", seq);
+
+    client.header[0] = (char)0x81; // FIN, text
+    client.header[1] = length;
+    client.headerLength = length + 2;
+    client.headerSent = 0;
+    client.progressMs = nowMs();
+  }
+
+  // One unmasked binary WebSocket frame: its header, then the video header, the JPEG follows
+  void videoHeader(StreamClient &client) {
+    const SharedFrame *frame = client.frame;
+    const uint64_t payload = VIDEO_HEADER_SIZE + frame->jpegLength;
+    uint8_t *header = (uint8_t *)client.header;
+    size_t length = 0;
+
+    header[length++] = 0x82; // FIN, binary
+    if (payload < 126) {
+      header[length++] = payload;
+    } else if (payload <= 0xFFFF) {
+      header[length++] = 126;
+      header[length++] = payload >> 8;
+      header[length++] = payload & 0xFF;
+    } else {
+      header[length++] = 127;
+
+      for (int shift = 56; shift >= 0; shift -= 8) {
+        header[length++] = (payload >> shift) & 0xFF;
+      }
+    }
+
+    encodeVideoHeader({frame->seq, frame->sensorAtUs, (uint32_t)frame->jpegLength}, header + length);
+    client.headerLength = length + VIDEO_HEADER_SIZE;
+
+    portENTER_CRITICAL(&_mux);
+
+    if (!client.unacked) {
+      client.lastAckUs = nowUs();
+    }
+
+    if (client.unacked < VIDEO_MAX_UNACKED) {
+      client.unackedSeq[client.unacked] = frame->seq & 0xFFFF;
+      client.unackedSensorUs[client.unacked] = frame->sensorAtUs;
+      client.unacked++;
+    }
+
+    portEXIT_CRITICAL(&_mux);
+  }
+
+  // Writes as much as the socket takes. Returns false when the viewer is gone
+  bool push(StreamClient &client) {
+    if (!sendSome(client, client.header, client.headerLength, client.headerSent)) {
+      return false;
+    }
+
+    if (!client.frame) {
+      if (client.kind == STREAM_WS_VIDEO && client.headerSent == client.headerLength) {
+        messageSent(client);
+      }
+
+      return true;
+    }
+
+    if (client.headerSent < client.headerLength) {
+      return true;
+    }
+
+    if (!client.firstByteUs) {
+      client.firstByteUs = nowUs();
+    }
+
+    if (!sendSome(client, (const char *)client.frame->jpeg, client.frame->jpegLength, client.bodySent)) {
+      return false;
+    }
+
+    if (client.bodySent == client.frame->jpegLength) {
+      onFrameSent(client);
+    }
+
+    return true;
+  }
+
+  bool sendSome(StreamClient &client, const char *data, size_t length, size_t &sent) {
+    const size_t before = sent;
+
+    while (sent < length) {
+      // a viewer that went away is an error here, not a SIGPIPE. WebSocket sockets stay
+      // blocking for the server, only the sender's writes are not
+      const int written = send(client.fd, data + sent, length - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+      if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+
+      if (written <= 0) {
+        return false;
+      }
+
+      sent += written;
+    }
+
+    if (sent > before) {
+      client.progressMs = nowMs();
+    }
+
+    return true;
+  }
+
+  // The peer's window stayed shut for the stall timeout: unplugged, out of range or a
+  // suspended browser tab. Its TCP stack would hold the connection for minutes
+  bool stalled(StreamClient &client) {
+    if (!_stallTimeoutMs || elapsedSince(client.progressMs) < _stallTimeoutMs) {
+      return false;
+    }
+
+    _stalls++;
+    Serial.printf("%s stalled - nothing sent for %ums\n", client.kind == STREAM_WS_VIDEO ? "WS video" : "Stream",
+                  (uint32_t)elapsedSince(client.progressMs));
+
+    return true;
+  }
+
+  // WS video: an ack is out, the socket is free for the next frame or another task's message
+  void messageSent(StreamClient &client) {
+    client.headerSent = 0;
+    client.headerLength = 0;
+
+    portENTER_CRITICAL(&_mux);
+    client.writing = false;
+    portEXIT_CRITICAL(&_mux);
+  }
+
+  void onFrameSent(StreamClient &client) {
+    SharedFrame *frame = client.frame;
+    const uint64_t lastByteAt = nowUs();
+    const size_t bytes = frame->jpegLength;
+    const uint32_t sendUs = lastByteAt - client.sendStartUs;
+
+    latencyMetrics.record(LAT_FRAME_FETCH_TO_FIRST_BYTE, frame->fetchedAtUs, client.firstByteUs);
+    latencyMetrics.record(LAT_FRAME_FIRST_TO_LAST_BYTE, client.firstByteUs, lastByteAt);
+    latencyMetrics.record(LAT_FRAME_SENSOR_TO_LAST_BYTE, frame->sensorAtUs, lastByteAt);
+
+    _broadcaster->release(frame);
+    client.frame = nullptr;
+    client.headerSent = 0;
+    client.headerLength = 0;
+    client.sent++;
+    client.lastSentMs = lastByteAt / 1000;
+    _framesSent++;
+
+    client.pacer.configure(_targetFps, _latencyBudgetUs);
+    client.nextFrameUs = lastByteAt + client.pacer.onFrameSent(client.frameStartUs, sendUs, lastByteAt);
+
+    if (client.kind == STREAM_WS_VIDEO) {
+      portENTER_CRITICAL(&_mux);
+      client.writing = false;
+      portEXIT_CRITICAL(&_mux);
+    }
+
+    if (_hooks.frameSent) {
+      _hooks.frameSent(_hooks.context, &client - _clients, bytes, sendUs, lastByteAt);
+    }
+  }
+
+  // Ends the viewer and gives the socket back
+  void finish(StreamClient &client) {
+    const int fd = client.fd;
+
+    end(client);
+    portENTER_CRITICAL(&_mux);
+    const bool closed = client.closed;
+
+    if (closed) {
+      client.fd = -1;
+    } else {
+      client.leaving = true;
+    }
+
+    portEXIT_CRITICAL(&_mux);
+
+    if (closed) {
+      close(fd);
+    } else if (!_hooks.detach || !_hooks.detach(_hooks.context, fd)) {
+      portENTER_CRITICAL(&_mux);
+      client.fd = -1;
+      portEXIT_CRITICAL(&_mux);
+      close(fd);
+    }
+  }
+
+  // Frees the slot of a WS video viewer, the socket stays with the server
+  void release(StreamClient &client) {
+    portENTER_CRITICAL(&_mux);
+    client.fd = -1;
+    portEXIT_CRITICAL(&_mux);
+  }
+
+  // Drops the viewer's frame and counts it out
+  void end(StreamClient &client) {
+    _broadcaster->release(client.frame);
+    client.frame = nullptr;
+
+    portENTER_CRITICAL(&_mux);
+    client.writing = false;
+    portEXIT_CRITICAL(&_mux);
+
+    if (client.started) {
+      const uint64_t duration = std::max<uint64_t>(elapsedSince(client.startedMs), 1);
+
+      if (_hooks.viewersChanged) {
+        _hooks.viewersChanged(_hooks.context, -1);
+      }
+
+      Serial.printf("%s ended - %u frames sent, %u dropped, %u skipped idle, %.1f fps\n",
+                    client.kind == STREAM_WS_VIDEO ? "WS video" : "Stream", client.sent, client.dropped, client.skipped,
+                    client.sent * 1000.0f / duration);
+      client.started = false;
+    }
+  }
+};
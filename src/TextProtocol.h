@@ -0,0 +1,133 @@
+#pragma once
+#include "CarProtocol.h"
+#include "DriveMixer.h"
+#include "FrameRecorder.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Text WebSocket commands, kept for compatibility with older clients. Each parses to the same
+// CarCommand a binary message decodes to. Arguments follow the name, separated by '_', and
+// nothing may follow them: a cut off or padded command is rejected rather than half applied.
+// No Arduino dependencies, the host build fuzzes it
+struct TextCommand {
+  const char *name;
+  CarOpcode opcode;
+};
+
+static const TextCommand textCommands[] = {
+    {"stop", OP_STOP},
+    {"forward", OP_FORWARD},
+    {"backward", OP_BACKWARD},
+    {"left", OP_LEFT},
+    {"right", OP_RIGHT},
+    {"forward-left", OP_FORWARD_LEFT},
+    {"forward-right", OP_FORWARD_RIGHT},
+    {"backward-left", OP_BACKWARD_LEFT},
+    {"backward-right", OP_BACKWARD_RIGHT},
+    {"toggleFlash", OP_TOGGLE_FLASH},
+    {"ping", OP_PING},
+    {"stats", OP_STATS},
+    {"reset", OP_RESET}};
+
+// Commands with arguments: the name is a prefix, args its argument count, each clamped
+struct TextArgCommand {
+  const char *prefix;
+  CarOpcode opcode;
+  uint8_t args;
+  int32_t min0, max0;
+  int32_t min1, max1;
+};
+
+static const TextArgCommand textArgCommands[] = {
+    {"cameraDrag_", OP_CAMERA, 2, -100, 100, -100, 100},
+    {"streamPacing_", OP_STREAM_PACING, 2, 0, 60, 0, 1000},
+    {"logLevel_", OP_LOG_LEVEL, 1, INT16_MIN, INT16_MAX, 0, 0},
+    {"record_", OP_RECORD, 1, 0, RECORDER_MAX_FPS, 0, 0},
+    {"grabMode_", OP_GRAB_MODE, 2, INT16_MIN, INT16_MAX, INT16_MIN, INT16_MAX},
+    {"pixelFormat_", OP_PIXEL_FORMAT, 1, INT16_MIN, INT16_MAX, 0, 0},
+    {"drive_", OP_DRIVE, 2, -DRIVE_INPUT_MAX, DRIVE_INPUT_MAX, -DRIVE_INPUT_MAX, DRIVE_INPUT_MAX},
+    {"vision_", OP_VISION, 1, INT16_MIN, INT16_MAX, 0, 0}, // any other value than 0 is on
+    {"udpVideo_", OP_UDP_VIDEO, 2, 0, UINT16_MAX, 0, INT16_MAX}};
+
+// count decimal integers separated by '_', then the end of the text. Out of range values
+// saturate, so clamping them afterwards is exact
+static bool scanTextArgs(const char *text, uint8_t count, long *args) {
+  for (uint8_t i = 0; i < count; i++) {
+    if (i && *text++ != '_') {
+      return false;
+    }
+
+    // strtol would skip spaces and a '+' too
+    if (*text != '-' && (*text < '0' || *text > '9')) {
+      return false;
+    }
+
+    char *end;
+    args[i] = strtol(text, &end, 10);
+
+    if (end == text) {
+      return false;
+    }
+
+    text = end;
+  }
+
+  return *text == '\0';
+}
+
+// A u16 range, such as a port, keeps its bit pattern in the i16
+static int16_t clampTextArg(long value, int32_t low, int32_t high) {
+  return (int16_t)(uint16_t)(value < low ? low : (value > high ? high : value));
+}
+
+static bool parseTextCommand(const char *text, CarCommand &command) {
+  long args[2] = {0, 0};
+
+  memset(&command, 0, sizeof(command));
+
+  for (size_t i = 0; i < sizeof(textCommands) / sizeof(textCommands[0]); i++) {
+    if (strcmp(text, textCommands[i].name) == 0) {
+      command.opcode = textCommands[i].opcode;
+      return true;
+    }
+  }
+
+  for (size_t i = 0; i < sizeof(textArgCommands) / sizeof(textArgCommands[0]); i++) {
+    const TextArgCommand &entry = textArgCommands[i];
+    const size_t prefixLength = strlen(entry.prefix);
+
+    if (strncmp(text, entry.prefix, prefixLength) != 0) {
+      continue;
+    }
+
+    if (!scanTextArgs(text + prefixLength, entry.args, args)) {
+      return false;
+    }
+
+    command.opcode = entry.opcode;
+    command.arg0 = clampTextArg(args[0], entry.min0, entry.max0);
+    command.arg1 = clampTextArg(args[1], entry.min1, entry.max1);
+
+    if (entry.opcode == OP_VISION) {
+      command.arg0 = args[0] != 0;
+    }
+
+    return true;
+  }
+
+  if (strncmp(text, "frameSize_", 10) == 0) {
+    const char *sizeName = text + 10;
+    const framesize_t size = stringToFrameSize(sizeName);
+
+    if (strcmp(sizeName, "AUTO") != 0 && size == FRAMESIZE_INVALID) {
+      return false;
+    }
+
+    command.opcode = OP_FRAME_SIZE;
+    command.arg0 = strcmp(sizeName, "AUTO") == 0 ? -1 : size;
+    return true;
+  }
+
+  return false;
+}
@@ -0,0 +1,312 @@
+#pragma once
+#include "CarProtocol.h"
+#include "FrameBroadcaster.h"
+#include "HeapWatermark.h"
+#include "StreamSender.h"
+#include "hal/Hal.h"
+#include "utils.h"
+
+// Packets fit a WiFi frame with the IPv4 and UDP headers, with room to spare for a tunnel on
+// the way, so nothing is fragmented at the IP level where one lost piece loses the packet
+#define UDP_VIDEO_PACKET_SIZE 1400
+#define UDP_VIDEO_PAYLOAD_SIZE (UDP_VIDEO_PACKET_SIZE - UDP_VIDEO_HEADER_SIZE)
+// Pacing rate unless the client asks for another one, a little under what a weak 2.4 GHz
+// link still carries. Bursts up to UDP_VIDEO_BURST_PACKETS go out back to back
+#define UDP_VIDEO_DEFAULT_KBPS 6000
+#define UDP_VIDEO_BURST_PACKETS 4
+
+// Sends the newest frame to one UDP receiver, cut into UDP_VIDEO_PACKET_SIZE packets that
+// each carry the frame's seq, sensor time, length and their own offset. Nothing is
+// retransmitted: a lost packet loses its frame, the receiver drops it and shows the next one,
+// and a weak link never holds the following frames back the way TCP's retransmits do.
+// Packets are paced with a token bucket, so a frame does not land on the WiFi driver's queue
+// all at once and push out the control traffic. Frames published while one is being sent are
+// skipped, the next frame is always the newest
+class UdpVideoSender {
+public:
+  UdpVideoSender()
+      : _broadcaster(nullptr),
+        _task(nullptr),
+        _hooks(),
+        _socket(-1),
+        _ownerFd(-1),
+        _active(false),
+        _kbps(UDP_VIDEO_DEFAULT_KBPS),
+        _tokens(0),
+        _refilledUs(0),
+        _framesSent(0),
+        _framesSkipped(0),
+        _framesAbandoned(0),
+        _idleFramesSkipped(0),
+        _packetsSent(0),
+        _sendErrors(0),
+        _bytesSent(0),
+        _pacingWaitUs(0) {
+    memset(&_destination, 0, sizeof(_destination));
+  }
+
+  // Hooks as for the stream sender: parked and viewersChanged are used
+  void begin(FrameBroadcaster &broadcaster, const StreamHooks &hooks) {
+    _broadcaster = &broadcaster;
+    _hooks = hooks;
+    _socket = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (_socket < 0) {
+      Serial.printf("UDP video socket failed: %d\n", errno);
+      return;
+    }
+
+    xTaskCreatePinnedToCore(
+        senderTask,
+        "UdpVideo",
+        4096,
+        this,
+        5,
+        &_task,
+        tskNO_AFFINITY);
+  }
+
+  // Sends to destination from the next frame on, replacing any earlier receiver. ownerFd is
+  // the WebSocket that asked for it, the stream stops when it closes. kbps 0 keeps the rate
+  bool start(const sockaddr_in &destination, int ownerFd, uint32_t kbps) {
+    if (!_task) {
+      return false;
+    }
+
+    portENTER_CRITICAL(&_mux);
+    _destination = destination;
+    _ownerFd = ownerFd;
+    _kbps = kbps ? kbps : _kbps;
+    _active = true;
+    portEXIT_CRITICAL(&_mux);
+
+    const uint32_t address = ntohl(destination.sin_addr.s_addr);
+
+    Serial.printf("UDP video to %u.%u.%u.%u:%u at %u kbps\n", address >> 24, (address >> 16) & 0xFF, (address >> 8) & 0xFF,
+                  address & 0xFF, ntohs(destination.sin_port), _kbps);
+    xTaskNotifyGive(_task);
+
+    return true;
+  }
+
+  void stop() {
+    portENTER_CRITICAL(&_mux);
+    _active = false;
+    _ownerFd = -1;
+    portEXIT_CRITICAL(&_mux);
+  }
+
+  // From the server's close_fn
+  void onSocketClosed(int fd) {
+    portENTER_CRITICAL(&_mux);
+    const bool owner = _active && fd == _ownerFd;
+    portEXIT_CRITICAL(&_mux);
+
+    if (owner) {
+      stop();
+    }
+  }
+
+  bool active() const {
+    return _active;
+  }
+
+  uint32_t kbps() const {
+    return _kbps;
+  }
+
+  uint32_t framesSent() const {
+    return _framesSent;
+  }
+
+  // Published while an older frame was still going out
+  uint32_t framesSkipped() const {
+    return _framesSkipped;
+  }
+
+  // Cut short by a failed send, the receiver drops what it got of them
+  uint32_t framesAbandoned() const {
+    return _framesAbandoned;
+  }
+
+  uint32_t idleFramesSkipped() const {
+    return _idleFramesSkipped;
+  }
+
+  uint32_t packetsSent() const {
+    return _packetsSent;
+  }
+
+  // sendto failures, mostly the network stack out of buffers on a congested link
+  uint32_t sendErrors() const {
+    return _sendErrors;
+  }
+
+  uint64_t bytesSent() const {
+    return _bytesSent;
+  }
+
+  // Time spent waiting for the pacer
+  uint64_t pacingWaitUs() const {
+    return _pacingWaitUs;
+  }
+
+  const HeapWatermark &heap() const {
+    return _heap;
+  }
+
+private:
+  FrameBroadcaster *_broadcaster;
+  TaskHandle_t _task;
+  StreamHooks _hooks;
+  portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+  int _socket;
+  sockaddr_in _destination;
+  int _ownerFd;
+  volatile bool _active;
+  uint32_t _kbps;
+  uint8_t _packet[UDP_VIDEO_PACKET_SIZE];
+
+  // token bucket, in bytes
+  int64_t _tokens;
+  uint64_t _refilledUs;
+
+  uint32_t _framesSent;
+  uint32_t _framesSkipped;
+  uint32_t _framesAbandoned;
+  uint32_t _idleFramesSkipped;
+  uint32_t _packetsSent;
+  uint32_t _sendErrors;
+  uint64_t _bytesSent;
+  uint64_t _pacingWaitUs;
+  HeapWatermark _heap;
+
+  static void senderTask(void *param) {
+    ((UdpVideoSender *)param)->run();
+  }
+
+  void run() {
+    AllocationProbe probe;
+    uint32_t lastSeq = 0;
+    uint64_t lastSentMs = 0;
+    bool subscribed = false;
+
+    for (;;) {
+      if (!_active) {
+        if (subscribed) {
+          _broadcaster->unsubscribe();
+          subscribed = false;
+          viewersChanged(-1);
+          Serial.printf("UDP video ended - %u frames, %u packets, %u send errors\n", _framesSent, _packetsSent, _sendErrors);
+        }
+
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        continue;
+      }
+
+      if (!subscribed) {
+        subscribed = _broadcaster->subscribe();
+
+        if (!subscribed) {
+          vTaskDelay(pdMS_TO_TICKS(100));
+          continue;
+        }
+
+        viewersChanged(1);
+        _tokens = UDP_VIDEO_BURST_PACKETS * UDP_VIDEO_PACKET_SIZE;
+        _refilledUs = nowUs();
+        lastSeq = 0;
+        probe.restart();
+      }
+
+      SharedFrame *frame = _broadcaster->acquire(lastSeq, 1000);
+
+      if (!frame) {
+        continue;
+      }
+
+      if (lastSeq && frame->seq - lastSeq > 1) {
+        _framesSkipped += frame->seq - lastSeq - 1;
+      }
+
+      lastSeq = frame->seq;
+      _broadcaster->detectMotion(_hooks.parked && _hooks.parked(_hooks.context));
+
+      // parked and nothing moves in the picture: one frame per keepalive period
+      if (!frame->changed && nowMs() - lastSentMs < IDLE_KEEPALIVE_MS) {
+        _idleFramesSkipped++;
+      } else if (sendFrame(frame)) {
+        lastSentMs = nowMs();
+        _framesSent++;
+      } else {
+        _framesAbandoned++;
+      }
+
+      _broadcaster->release(frame);
+      _heap.record(probe);
+    }
+  }
+
+  void viewersChanged(int delta) {
+    if (_hooks.viewersChanged) {
+      _hooks.viewersChanged(_hooks.context, delta);
+    }
+  }
+
+  // Returns false when a packet could not be sent, the rest of the frame is not worth sending
+  bool sendFrame(const SharedFrame *frame) {
+    portENTER_CRITICAL(&_mux);
+    const sockaddr_in destination = _destination;
+    portEXIT_CRITICAL(&_mux);
+
+    VideoFragmentHeader header;
+    header.count = (frame->jpegLength + UDP_VIDEO_PAYLOAD_SIZE - 1) / UDP_VIDEO_PAYLOAD_SIZE;
+    header.seq = frame->seq;
+    header.sensorAtUs = frame->sensorAtUs;
+    header.length = frame->jpegLength;
+
+    for (header.index = 0; header.index < header.count; header.index++) {
+      header.offset = header.index * UDP_VIDEO_PAYLOAD_SIZE;
+
+      const size_t payload = std::min<size_t>(UDP_VIDEO_PAYLOAD_SIZE, frame->jpegLength - header.offset);
+      const size_t length = UDP_VIDEO_HEADER_SIZE + payload;
+
+      encodeFragmentHeader(header, _packet);
+      memcpy(_packet + UDP_VIDEO_HEADER_SIZE, frame->jpeg + header.offset, payload);
+      pace(length);
+
+      if (sendto(_socket, _packet, length, 0, (const sockaddr *)&destination, sizeof(destination)) != (int)length) {
+        _sendErrors++;
+        return false;
+      }
+
+      _packetsSent++;
+      _bytesSent += length;
+    }
+
+    return true;
+  }
+
+  // Waits until the bucket holds the packet. Refilled at _kbps, never above a burst
+  void pace(size_t bytes) {
+    const int64_t capacity = UDP_VIDEO_BURST_PACKETS * UDP_VIDEO_PACKET_SIZE;
+
+    for (;;) {
+      const uint64_t now = nowUs();
+
+      _tokens = std::min<int64_t>(capacity, _tokens + (int64_t)(now - _refilledUs) * _kbps / 8000);
+      _refilledUs = now;
+
+      if (_tokens >= (int64_t)bytes) {
+        _tokens -= bytes;
+        return;
+      }
+
+      // sleeps in whole ticks, the burst allowance absorbs the oversleep
+      const uint32_t waitUs = (uint32_t)((bytes - _tokens) * 8000 / _kbps);
+
+      vTaskDelay(std::max<TickType_t>(1, pdMS_TO_TICKS(waitUs / 1000)));
+      _pacingWaitUs += nowUs() - now;
+    }
+  }
+};
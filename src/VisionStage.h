@@ -0,0 +1,180 @@
+#pragma once
+#include "Car.h"
+#include "FrameBroadcaster.h"
+#include "LatencyMetrics.h"
+#include "ObstacleDetector.h"
+#include "hal/Hal.h"
+
+// Per-frame budget of the obstacle check. A frame over it makes the stage skip more frames,
+// so vision never takes more than its share of a core however large the camera frames get
+#define VISION_BUDGET_US 8000
+// At most every VISION_MAX_STRIDE-th frame is skipped down to, then frames under half the
+// budget win the stride back one step at a time
+#define VISION_MAX_STRIDE 8
+#define VISION_RECOVER_FRAMES 25
+// Without a verdict this long the veto is dropped: a stalled camera must not lock the car
+#define VISION_STALE_MS 500
+
+// Runs ObstacleDetector on the broadcaster's frames in its own low priority task and hands the
+// verdict to the car, which then refuses forward moves. Like the recorder it is just another
+// subscriber holding one frame at a time, so it can only ever drop its own frames
+class VisionStage {
+public:
+  VisionStage()
+      : _broadcaster(nullptr),
+        _car(nullptr),
+        _task(nullptr),
+        _enabled(false),
+        _stride(1),
+        _underBudget(0),
+        _lastVerdictMs(0),
+        _overruns(0),
+        _skipped(0),
+        _staleDrops(0) {}
+
+  void begin(FrameBroadcaster &broadcaster, Car &car) {
+    _broadcaster = &broadcaster;
+    _car = &car;
+
+    xTaskCreatePinnedToCore(
+        visionTask,
+        "VisionStage",
+        4096,
+        this,
+        3,
+        &_task,
+        tskNO_AFFINITY);
+  }
+
+  void start() {
+    _enabled = true;
+    xTaskNotifyGive(_task);
+  }
+
+  // The veto is lifted by the vision task once its current frame is done
+  void stop() {
+    _enabled = false;
+  }
+
+  bool enabled() const {
+    return _enabled;
+  }
+
+  const ObstacleDetector &detector() const {
+    return _detector;
+  }
+
+  uint8_t stride() const {
+    return _stride;
+  }
+
+  uint32_t overruns() const {
+    return _overruns;
+  }
+
+  uint32_t skipped() const {
+    return _skipped;
+  }
+
+  uint32_t staleDrops() const {
+    return _staleDrops;
+  }
+
+private:
+  FrameBroadcaster *_broadcaster;
+  Car *_car;
+  TaskHandle_t _task;
+  volatile bool _enabled;
+  ObstacleDetector _detector;
+
+  uint8_t _stride; // every _stride-th frame is checked
+  uint8_t _underBudget;
+  uint64_t _lastVerdictMs;
+
+  uint32_t _overruns;
+  uint32_t _skipped;
+  uint32_t _staleDrops;
+
+  static void visionTask(void *param) {
+    VisionStage *self = (VisionStage *)param;
+
+    for (;;) {
+      if (!self->_enabled) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        continue;
+      }
+
+      self->watch();
+    }
+  }
+
+  void watch() {
+    uint32_t lastSeq = 0;
+
+    _detector.reset();
+    _stride = 1;
+    _underBudget = 0;
+    _lastVerdictMs = nowMs();
+    _broadcaster->subscribe();
+
+    while (_enabled) {
+      SharedFrame *frame = _broadcaster->acquire(lastSeq, VISION_STALE_MS);
+
+      if (!frame) {
+        dropIfStale();
+        continue;
+      }
+
+      const uint32_t seq = frame->seq;
+
+      if (lastSeq && seq - lastSeq < _stride) {
+        _broadcaster->release(frame);
+        _skipped++;
+        continue;
+      }
+
+      lastSeq = seq;
+
+      const camera_fb_t *fb = frame->fb;
+      const uint32_t failed = _detector.failed();
+      const uint64_t start = nowUs();
+      const bool veto = _detector.onFrame(fb->buf, fb->len, fb->width, fb->height, fb->format);
+      const uint64_t end = nowUs();
+
+      _broadcaster->release(frame);
+      _detector.addFrameTime(end - start);
+      latencyMetrics.record(LAT_VISION_FRAME, start, end);
+      adjustStride(end - start);
+
+      // an unreadable frame is no verdict
+      if (_detector.failed() != failed) {
+        dropIfStale();
+        continue;
+      }
+
+      _car->setForwardVeto(veto, _detector.score());
+      _lastVerdictMs = nowMs();
+    }
+
+    _broadcaster->unsubscribe();
+    _car->setForwardVeto(false, 0);
+  }
+
+  void adjustStride(uint64_t frameUs) {
+    if (frameUs > VISION_BUDGET_US) {
+      _overruns++;
+      _underBudget = 0;
+      _stride = std::min<int>(_stride * 2, VISION_MAX_STRIDE);
+    } else if (_stride > 1 && frameUs < VISION_BUDGET_US / 2 && ++_underBudget >= VISION_RECOVER_FRAMES) {
+      _underBudget = 0;
+      _stride--;
+    }
+  }
+
+  void dropIfStale() {
+    if (_car->forwardVetoed() && elapsedSince(_lastVerdictMs) >= VISION_STALE_MS) {
+      _staleDrops++;
+      _car->setForwardVeto(false, 0);
+    }
+  }
+};
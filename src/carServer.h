@@ -2,13 +2,124 @@
 #include "car.h"
 #include "esp_camera.h"
 #include "esp_http_server.h"
+#include "CameraPool.h"
+#include "CarProtocol.h"
+#include "CommandQueue.h"
+#include "FrameBroadcaster.h"
+#include "FramePacer.h"
+#include "HeapWatermark.h"
+#include "FrameRecorder.h"
+#include "LatencyMetrics.h"
+#include "LoopMonitor.h"
+#include "QualityController.h"
+#include "RequestWorker.h"
+#include "SocketTuning.h"
+#include "StreamSender.h"
+#include "TextProtocol.h"
+#include "UdpVideoSender.h"
+#include "VisionStage.h"
+#include "lwip/sockets.h"
 #include <WiFiManager.h>
-
-bool isClientActive = false;
-static httpd_handle_t stream_httpd = NULL;
+#include <stdarg.h>
+
+#define WS_MAX_MESSAGE_LEN 64
+#define ENCODER_BENCH_RUNS 5
+#define BURST_BOUNDARY "burst"
+#define BURST_PART "\r\n--" BURST_BOUNDARY "\r\nContent-Type: image/jpeg\r\n"                       \
+                   "Content-Disposition: attachment; filename=capture_%d.jpg\r\nContent-Length: %u\r\n" \
+                   "X-Timestamp: %llu.%06u\r\n\r\n"
+#define BURST_END "\r\n--" BURST_BOUNDARY "--\r\n"
+
+// Read by the LED fade in main.cpp, set from the stream and UDP senders' tasks
+std::atomic<bool> isClientActive(false);
 static httpd_handle_t camera_httpd = NULL;
+static FrameBroadcaster frameBroadcaster;
+static FrameRecorder frameRecorder;
+static VisionStage visionStage;
+static CameraPool cameraPool;
+static CommandLatch controlLatch; // newest movement and camera command, taken by the control task
+static CommandQueue serviceQueue; // everything else, drained by the command task
+static TaskHandle_t commandTaskHandle = NULL;
+static uint8_t streamTargetFps = 0;            // 0 - as fast as the camera and the link allow
+static uint32_t streamLatencyBudgetMs = 100;   // max send time per frame before clients back off
+static SocketTuning serverTuning = defaultSocketTuning; // /stream and /ws sockets, set before startCarServer()
 extern Car car;
 extern WiFiManager wm;
+extern LoopMonitor controlLoopMonitor;
+extern HeapWatermark controlHeap;
+
+int getClientRSSI() {
+  wifi_sta_list_t wifi_sta_list;
+  esp_wifi_ap_get_sta_list(&wifi_sta_list);
+
+  if (wifi_sta_list.num == 0) {
+    return 0;
+  }
+
+  return wifi_sta_list.sta[0].rssi;
+}
+
+// Settings the quality controller steps through, cheapest first
+struct QualityLevel {
+  framesize_t frameSize;
+  uint8_t jpegQuality;
+};
+
+static const QualityLevel qualityLadder[] = {
+    {FRAMESIZE_QVGA, 20},
+    {FRAMESIZE_QVGA, 12},
+    {FRAMESIZE_HVGA, 14},
+    {FRAMESIZE_VGA, 16},
+    {FRAMESIZE_VGA, 10},
+    {FRAMESIZE_SVGA, 12}};
+
+static const uint8_t QUALITY_LEVEL_COUNT = sizeof(qualityLadder) / sizeof(qualityLadder[0]);
+static const uint32_t QUALITY_TARGET_SEND_MS = 80;
+static const int QUALITY_MIN_RSSI = -78;
+
+static QualityController qualityController;
+static SemaphoreHandle_t qualityLock = NULL;
+// Read on every frame sent, written under qualityLock
+static std::atomic<bool> autoQuality(false);
+// A level the stream sender could not apply with the sensor alone, for the command task
+static std::atomic<int> pendingQualityLevel(-1);
+
+static StreamSender streamSender; // every /stream and WS video viewer, served from one task
+static UdpVideoSender udpVideoSender;
+// Photos and the encoder benchmark, requests that take seconds
+static RequestWorker requestWorker;
+// Viewers only, the recorder also subscribes to the broadcaster but does not drive the car.
+// Counted by the stream sender's and the UDP sender's tasks
+static std::atomic<int> streamViewerCount(0);
+
+// Sends from outside the httpd task, e.g. responses produced by the command task
+void sendResponseAsync(int fd, const char *message) {
+  if (fd < 0 || !message) {
+    return;
+  }
+
+  httpd_ws_frame_t res;
+  memset(&res, 0, sizeof(res));
+  res.payload = (uint8_t *)message;
+  res.len = strlen(message);
+  res.type = HTTPD_WS_TYPE_TEXT;
+  res.final = true;
+
+  // a WS video frame may be half written on the socket, the reply goes out after it
+  if (!streamSender.holdSocket(fd)) {
+    logEvent(LOG_ERROR, EV_WS_SEND_FAILED, fd, ESP_ERR_TIMEOUT);
+    return;
+  }
+
+  esp_err_t err = httpd_ws_send_frame_async(camera_httpd, fd, &res);
+  streamSender.releaseSocket(fd);
+
+  logEvent(LOG_DEBUG, EV_WS_SEND, fd, res.len);
+
+  if (err != ESP_OK) {
+    logEvent(LOG_ERROR, EV_WS_SEND_FAILED, fd, err);
+  }
+}
 
 void sendResponse(httpd_req_t *req, const char *message) {
   if (!req || !message) {
@@ -16,44 +127,185 @@ void sendResponse(httpd_req_t *req, const char *message) {
   }
 
   httpd_ws_frame_t res;
+  memset(&res, 0, sizeof(res));
   res.payload = (uint8_t *)message;
   res.len = strlen(message);
   res.type = HTTPD_WS_TYPE_TEXT;
+  res.final = true;
+
+  const int fd = httpd_req_to_sockfd(req);
+
+  if (!streamSender.holdSocket(fd)) {
+    logEvent(LOG_ERROR, EV_WS_SEND_FAILED, fd, ESP_ERR_TIMEOUT);
+    return;
+  }
 
   esp_err_t err = httpd_ws_send_frame(req, &res);
+  streamSender.releaseSocket(fd);
 
-  Serial.printf("Send: %s\n", message);
+  logEvent(LOG_DEBUG, EV_WS_SEND, fd, res.len);
 
   if (err != ESP_OK) {
-    Serial.printf("Failed to send WS response: 0x%x\n", err);
+    logEvent(LOG_ERROR, EV_WS_SEND_FAILED, fd, err);
+  }
+}
+
+struct MimeType {
+  const char *extension;
+  const char *type;
+};
+
+static const MimeType mimeTypes[] = {
+    {".html", "text/html"},
+    {".js", "application/javascript"},
+    {".css", "text/css"},
+    {".png", "image/png"},
+    {".jpg", "image/jpeg"},
+    {".jpeg", "image/jpeg"},
+    {".ico", "image/x-icon"}};
+
+static const char *mimeTypeOf(const char *path) {
+  const char *extension = strrchr(path, '.');
+
+  for (size_t i = 0; extension && i < sizeof(mimeTypes) / sizeof(mimeTypes[0]); i++) {
+    if (strcmp(extension, mimeTypes[i].extension) == 0) {
+      return mimeTypes[i].type;
+    }
+  }
+
+  return "text/plain";
+}
+
+// Page assets kept in memory, gzipped at build time by scripts/gzip_assets.py
+struct StaticAsset {
+  const char *path;
+  const char *type;
+  uint8_t *data;
+  size_t length;
+  bool gzip;
+  char etag[24];
+};
+
+static StaticAsset staticAssets[] = {
+    {"/index.min.html"},
+    {"/busy.min.html"},
+    {"/script.min.js"},
+    {"/style.min.css"}};
+
+static const uint8_t STATIC_ASSET_COUNT = sizeof(staticAssets) / sizeof(staticAssets[0]);
+
+static uint32_t assetCacheHits = 0;
+static uint32_t assetNotModified = 0;
+static uint32_t assetFlashReads = 0;
+
+static uint32_t fnv1a(const uint8_t *data, size_t length) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+
+  return hash;
+}
+
+// Prefers path.gz, falls back to the plain file when the build step did not run
+static bool loadStaticAsset(StaticAsset &asset) {
+  char gzPath[32];
+  snprintf(gzPath, sizeof(gzPath), "%s.gz", asset.path);
+
+  asset.gzip = LittleFS.exists(gzPath);
+  File file = LittleFS.open(asset.gzip ? gzPath : asset.path, "r");
+
+  if (!file) {
+    return false;
+  }
+
+  const size_t length = file.size();
+  uint8_t *data = (uint8_t *)(psramFound() ? ps_malloc(length) : malloc(length));
+
+  if (!data || file.read(data, length) != length) {
+    free(data);
+    file.close();
+    return false;
+  }
+
+  file.close();
+
+  asset.type = mimeTypeOf(asset.path);
+  asset.data = data;
+  asset.length = length;
+  snprintf(asset.etag, sizeof(asset.etag), "\"%08x-%x\"", fnv1a(data, length), length);
+
+  return true;
+}
+
+static void loadStaticAssets() {
+  const uint64_t startedAt = nowUs();
+  size_t total = 0;
+
+  for (int i = 0; i < STATIC_ASSET_COUNT; i++) {
+    StaticAsset &asset = staticAssets[i];
+
+    if (!loadStaticAsset(asset)) {
+      Serial.printf("Asset %s not cached, served from flash\n", asset.path);
+      continue;
+    }
+
+    total += asset.length;
   }
+
+  Serial.printf("Static assets cached: %u bytes in %ums\n", total, (uint32_t)((nowUs() - startedAt) / 1000));
+}
+
+static const StaticAsset *findStaticAsset(const char *path) {
+  for (int i = 0; i < STATIC_ASSET_COUNT; i++) {
+    if (staticAssets[i].data && strcmp(staticAssets[i].path, path) == 0) {
+      return &staticAssets[i];
+    }
+  }
+
+  return nullptr;
+}
+
+static esp_err_t serveCachedAsset(httpd_req_t *req, const StaticAsset *asset) {
+  char ifNoneMatch[sizeof(asset->etag)];
+
+  assetCacheHits++;
+  httpd_resp_set_hdr(req, "ETag", asset->etag);
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache"); // revalidate, answered with 304 while unchanged
+
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", ifNoneMatch, sizeof(ifNoneMatch)) == ESP_OK &&
+      strcmp(ifNoneMatch, asset->etag) == 0) {
+    assetNotModified++;
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  httpd_resp_set_type(req, asset->type);
+
+  if (asset->gzip) {
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+  }
+
+  return httpd_resp_send(req, (const char *)asset->data, asset->length);
 }
 
 static esp_err_t serveStaticFile(httpd_req_t *req, const char *filepath) {
-  String path = filepath;
-
-  const char *type = "text/plain";
-  if (path.endsWith(".html"))
-    type = "text/html";
-  else if (path.endsWith(".js"))
-    type = "application/javascript";
-  else if (path.endsWith(".css"))
-    type = "text/css";
-  else if (path.endsWith(".png"))
-    type = "image/png";
-  else if (path.endsWith(".jpg") || path.endsWith(".jpeg"))
-    type = "image/jpeg";
-  else if (path.endsWith(".ico"))
-    type = "image/x-icon";
-
-  File file = LittleFS.open(path, "r");
+  const StaticAsset *asset = findStaticAsset(filepath);
+
+  if (asset) {
+    return serveCachedAsset(req, asset);
+  }
+
+  File file = LittleFS.open(filepath, "r");
   if (!file) {
-    Serial.printf("404 Not Found: %s\n", path.c_str());
+    Serial.printf("404 Not Found: %s\n", filepath);
     httpd_resp_send_404(req);
     return ESP_FAIL;
   }
 
-  httpd_resp_set_type(req, type);
+  assetFlashReads++;
+  httpd_resp_set_type(req, mimeTypeOf(filepath));
 
   char chunk[512];
   size_t chunksize;
@@ -72,135 +324,437 @@ static esp_err_t serveStaticFile(httpd_req_t *req, const char *filepath) {
   return ESP_OK;
 }
 
-void handleCarCommand(const char *command, httpd_req_t *req) {
-  Serial.printf("Command handler received: %s\n", command);
+// From a task that holds no frames, the driver may be reinitialized
+static void applyQualityLevel(uint8_t level) {
+  const QualityLevel &setting = qualityLadder[level];
 
-  if (strcmp(command, "toggleFlash") == 0) {
-    car.toggleFlash();
+  cameraPool.setFrameSize(setting.frameSize, setting.jpegQuality, CAMERA_FOR_STREAM);
+  Serial.printf("Auto quality level %u: %s, jpeg quality %u\n", level, frameSizeToString(setting.frameSize), setting.jpegQuality);
+}
 
-    const char *response = car.getFlashState() ? "Flash-ON" : "Flash-OFF";
-    sendResponse(req, response);
+// The command task takes over a level that needs the driver reinitialized
+static void applyPendingQualityLevel() {
+  const int level = pendingQualityLevel.exchange(-1);
 
+  if (level < 0) {
     return;
   }
 
-  if (strncmp(command, "cameraDrag_", 11) == 0) {
-    int x, y;
+  xSemaphoreTake(qualityLock, portMAX_DELAY);
+  const bool current = autoQuality && qualityController.level() == level;
+  xSemaphoreGive(qualityLock);
 
-    if (sscanf(command + 11, "%d_%d", &x, &y) == 2) {
-      car.setCameraX(x);
+  if (current) {
+    applyQualityLevel(level);
+  }
+}
+
+static void enableAutoQuality() {
+  sensor_t *s = esp_camera_sensor_get();
+  uint8_t level = 0;
+
+  // start from the best level that is not larger than the current frame size
+  for (uint8_t i = 0; s && i < QUALITY_LEVEL_COUNT; i++) {
+    if (qualityLadder[i].frameSize <= s->status.framesize) {
+      level = i;
     }
+  }
+
+  // size the buffers for the top of the ladder once, so level changes stay sensor-only
+  const QualityLevel &top = qualityLadder[QUALITY_LEVEL_COUNT - 1];
+
+  if (cameraPool.bufferSize() < CameraPool::frameBufferSize(top.frameSize, cameraPool.pixelFormat())) {
+    cameraPool.configure(top.frameSize, top.jpegQuality, CAMERA_FOR_STREAM);
+  }
+
+  xSemaphoreTake(qualityLock, portMAX_DELAY);
+  qualityController.configure(QUALITY_LEVEL_COUNT, QUALITY_TARGET_SEND_MS * 1000, QUALITY_MIN_RSSI);
+  qualityController.setLevel(level, nowUs());
+  autoQuality = true;
+  xSemaphoreGive(qualityLock);
+
+  applyQualityLevel(level);
+}
 
+// In the stream sender's task, which holds frames: a reinit would wait on them in pause(), so
+// only sensor-only changes are made here and the rest goes to the command task
+static void updateAutoQuality(int viewer, uint32_t frameBytes, uint32_t sendUs, uint64_t now) {
+  if (!autoQuality) {
     return;
   }
 
-  if (strncmp(command, "frameSize_", 10) == 0) {
-    const char *sizeName = command + 10;
-    sensor_t *s = esp_camera_sensor_get();
+  // again under the lock, a frame size command may have turned it off since
+  xSemaphoreTake(qualityLock, portMAX_DELAY);
+  const bool changed = autoQuality && qualityController.onFrameSent(viewer, frameBytes, sendUs, now);
+  const uint8_t level = qualityController.level();
+  xSemaphoreGive(qualityLock);
+
+  if (!changed) {
+    return;
+  }
+
+  const QualityLevel &setting = qualityLadder[level];
+
+  if (cameraPool.setSensorFrameSize(setting.frameSize, setting.jpegQuality, CAMERA_FOR_STREAM)) {
+    Serial.printf("Auto quality level %u: %s, jpeg quality %u\n", level, frameSizeToString(setting.frameSize), setting.jpegQuality);
+    return;
+  }
+
+  pendingQualityLevel = level;
+  xTaskNotifyGive(commandTaskHandle);
+}
 
-    if (!s) {
-      return;
+static void sendStats(int fd) {
+  char response[768];
+  size_t length = snprintf(response, sizeof(response), "STATS-{\"targetFps\":%u,\"budgetMs\":%u,\"clients\":[",
+                           streamTargetFps, streamLatencyBudgetMs);
+  bool first = true;
+
+  for (int i = 0; i < STREAM_MAX_CLIENTS && length < sizeof(response); i++) {
+    if (streamSender.client(i).fd < 0) {
+      continue;
+    }
+
+    const FramePacer &pacer = streamSender.client(i).pacer;
+    const SendHistogram &histogram = pacer.histogram();
+
+    length += snprintf(response + length, sizeof(response) - length, "%s{\"fps\":%.1f,\"sendAvgMs\":%.1f,\"sendHist\":[",
+                       first ? "" : ",", pacer.fps(), pacer.averageSendUs() / 1000.0f);
+
+    for (int b = 0; b < SEND_HISTOGRAM_BUCKETS && length < sizeof(response); b++) {
+      length += snprintf(response + length, sizeof(response) - length, "%s%u", b ? "," : "", histogram.buckets[b]);
     }
 
-    framesize_t newSize = stringToFrameSize(sizeName);
+    if (length < sizeof(response)) {
+      length += snprintf(response + length, sizeof(response) - length, "]}");
+    }
 
-    s->set_framesize(s, newSize);
-    Serial.printf("✅ Frame size changed to %s\n", sizeName);
+    first = false;
+  }
+
+  if (length < sizeof(response)) {
+    length += snprintf(response + length, sizeof(response) - length,
+                       "],\"commands\":{\"handled\":%u,\"dropped\":%u,\"superseded\":%u,\"queueAvgUs\":%u,\"queueMaxUs\":%u}",
+                       controlLatch.taken() + serviceQueue.dequeued(), serviceQueue.dropped(), controlLatch.superseded(),
+                       controlLatch.averageWaitUs(), controlLatch.maxWaitUs());
+  }
+
+  if (length < sizeof(response)) {
+    const LoopMonitor &loop = controlLoopMonitor;
+
+    snprintf(response + length, sizeof(response) - length,
+             ",\"control\":{\"periodUs\":%u,\"worstPeriodUs\":%u,\"maxJitterUs\":%u,\"avgJitterUs\":%u,\"maxBusyUs\":%u,\"misses\":%u}}",
+             loop.periodUs(), loop.worstPeriodUs(), loop.maxJitterUs(), loop.averageJitterUs(), loop.maxBusyUs(), loop.misses());
+  }
+
+  sendResponseAsync(fd, response);
+}
+
+typedef void (*CarCommandHandler)(const CarCommand &command, int fd);
+
+static void stopCommand(const CarCommand &command, int fd) {
+  car.stop();
+}
 
+// OP_FORWARD..OP_BACKWARD_RIGHT from clients that predate OP_DRIVE
+static void legacyDriveCommand(const CarCommand &command, int fd) {
+  car.drive(legacyDriveVectors[command.opcode][0], legacyDriveVectors[command.opcode][1]);
+}
+
+static void driveCommand(const CarCommand &command, int fd) {
+  car.drive(command.arg0, command.arg1);
+}
+
+static void cameraCommand(const CarCommand &command, int fd) {
+  car.setCamera(command.arg0, command.arg1);
+}
+
+static void frameSizeCommand(const CarCommand &command, int fd) {
+  sensor_t *s = esp_camera_sensor_get();
+
+  if (!s) {
     return;
   }
 
-  if (strcmp(command, "reset") == 0) {
-    wm.resetSettings();
-    ESP.restart();
+  if (command.arg0 < 0) {
+    enableAutoQuality();
+    Serial.println("✅ Frame size is controlled automatically");
 
     return;
   }
 
-  if (strcmp(command, "ping") == 0) {
-    int rssi = (WiFi.getMode() & WIFI_MODE_AP) ? getClientRSSI() : WiFi.RSSI();
+  if (command.arg0 >= FRAMESIZE_INVALID) {
+    return;
+  }
 
-    char response[32];
+  framesize_t newSize = (framesize_t)command.arg0;
+  const CameraConsumer consumer = streamViewerCount == 0 && frameRecorder.recording() ? CAMERA_FOR_RECORDER : CAMERA_FOR_STREAM;
 
-    snprintf(response, sizeof(response), "pong-%d", abs(rssi));
-    sendResponse(req, response);
+  // buffers match the chosen size exactly, so a smaller size gives PSRAM back
+  xSemaphoreTake(qualityLock, portMAX_DELAY);
+  autoQuality = false;
+  xSemaphoreGive(qualityLock);
 
-    return;
+  if (cameraPool.configure(newSize, CAMERA_JPEG_QUALITY, consumer) == ESP_OK) {
+    Serial.printf("✅ Frame size changed to %s\n", frameSizeToString(newSize));
   }
+}
+
+static void toggleFlashCommand(const CarCommand &command, int fd) {
+  car.toggleFlash();
+
+  const char *response = car.getFlashState() ? "Flash-ON" : "Flash-OFF";
+  sendResponseAsync(fd, response);
+}
+
+static void streamPacingCommand(const CarCommand &command, int fd) {
+  streamTargetFps = constrain(command.arg0, 0, 60);
+  streamLatencyBudgetMs = constrain(command.arg1, 0, 1000);
+  streamSender.setPacing(streamTargetFps, streamLatencyBudgetMs * 1000);
+}
+
+static void pingCommand(const CarCommand &command, int fd) {
+  int rssi = (WiFi.getMode() & WIFI_MODE_AP) ? getClientRSSI() : WiFi.RSSI();
+  qualityController.onRssi(rssi);
 
-  if (strcmp(command, "forward") == 0) {
-    car.moveForward();
+  char response[32];
+
+  snprintf(response, sizeof(response), "pong-%d", abs(rssi));
+  sendResponseAsync(fd, response);
+}
+
+static void statsCommand(const CarCommand &command, int fd) {
+  sendStats(fd);
+}
+
+static void resetCommand(const CarCommand &command, int fd) {
+  wm.resetSettings();
+  ESP.restart();
+}
+
+static void logLevelCommand(const CarCommand &command, int fd) {
+  eventLog.setLevel(constrain(command.arg0, LOG_ERROR, LOG_TRACE));
+}
+
+static void recordCommand(const CarCommand &command, int fd) {
+  if (command.arg0 <= 0) {
+    frameRecorder.stop();
+    Serial.println("⏹️ Recording stopped");
 
     return;
   }
 
-  if (strcmp(command, "backward") == 0) {
-    car.moveBackward();
+  frameRecorder.start(command.arg0);
+  Serial.printf("⏺️ Recording at %u fps\n", frameRecorder.fps());
+}
 
+static void grabModeCommand(const CarCommand &command, int fd) {
+  if (command.arg0 < 0 || command.arg0 >= CAMERA_CONSUMER_COUNT || command.arg1 < CAMERA_GRAB_WHEN_EMPTY ||
+      command.arg1 > CAMERA_GRAB_LATEST) {
     return;
   }
 
-  if (strcmp(command, "left") == 0) {
-    car.turnLeft();
+  const CameraConsumer consumer = (CameraConsumer)command.arg0;
 
+  cameraPool.setGrabMode(consumer, (camera_grab_mode_t)command.arg1);
+
+  if (cameraPool.consumer() == consumer) {
+    sensor_t *s = esp_camera_sensor_get();
+    cameraPool.configure(s ? (framesize_t)s->status.framesize : cameraPool.bufferFrameSize(), s ? s->status.quality : CAMERA_JPEG_QUALITY, consumer);
+  }
+}
+
+static void pixelFormatCommand(const CarCommand &command, int fd) {
+  const pixformat_t format = (pixformat_t)command.arg0;
+
+  if (format != PIXFORMAT_JPEG && format != PIXFORMAT_RGB565 && format != PIXFORMAT_GRAYSCALE) {
     return;
   }
 
-  if (strcmp(command, "right") == 0) {
-    car.turnRight();
+  if (cameraPool.setPixelFormat(format) == ESP_OK) {
+    Serial.printf("✅ Pixel format changed to %s\n", CameraPool::pixelFormatName(format));
+  }
+}
+
+static void visionCommand(const CarCommand &command, int fd) {
+  if (command.arg0) {
+    visionStage.start();
+    Serial.println("👁️ Obstacle veto on");
 
     return;
   }
 
-  if (strcmp(command, "forward-left") == 0) {
-    car.moveForwardLeft();
+  visionStage.stop();
+  Serial.println("👁️ Obstacle veto off");
+}
+
+// Video frames as binary messages on the sender's WebSocket instead of a /stream connection
+static void videoCommand(const CarCommand &command, int fd) {
+  if (!command.arg0) {
+    streamSender.removeVideo(fd);
+    sendResponseAsync(fd, "VIDEO-0");
 
     return;
   }
 
-  if (strcmp(command, "forward-right") == 0) {
-    car.moveForwardRight();
+  // all viewer slots busy: the client stays on, or falls back to, /stream
+  sendResponseAsync(fd, streamSender.addVideo(fd) ? "VIDEO-1" : "VIDEO-0");
+}
+
+// Handled in websocketHandler, acks never wait in a queue behind other commands
+static void frameAckCommand(const CarCommand &command, int fd) {
+  streamSender.onVideoAck(fd, (uint16_t)command.arg0);
+}
+
+// Video as UDP packets to the port on this WebSocket's peer, for receivers that tolerate loss
+static void udpVideoCommand(const CarCommand &command, int fd) {
+  const uint16_t port = (uint16_t)command.arg0;
+  sockaddr_in peer;
+  socklen_t peerLength = sizeof(peer);
+
+  if (!port || getpeername(fd, (sockaddr *)&peer, &peerLength) != 0 || peer.sin_family != AF_INET) {
+    udpVideoSender.stop();
+    sendResponseAsync(fd, "UDP-0");
 
     return;
   }
 
-  if (strcmp(command, "backward-left") == 0) {
-    car.moveBackwardLeft();
+  peer.sin_port = htons(port);
 
+  char response[16];
+  snprintf(response, sizeof(response), "UDP-%u", udpVideoSender.start(peer, fd, (uint16_t)command.arg1) ? port : 0);
+  sendResponseAsync(fd, response);
+}
+
+struct CarCommandEntry {
+  CarCommandHandler handler;
+  bool realtime; // runs in the control task, must be short and never block
+};
+
+// Indexed by CarOpcode
+static const CarCommandEntry carCommandHandlers[OP_COUNT] = {
+    {stopCommand, true},
+    {legacyDriveCommand, true},
+    {legacyDriveCommand, true},
+    {legacyDriveCommand, true},
+    {legacyDriveCommand, true},
+    {legacyDriveCommand, true},
+    {legacyDriveCommand, true},
+    {legacyDriveCommand, true},
+    {legacyDriveCommand, true},
+    {cameraCommand, true},
+    {frameSizeCommand, false},
+    {toggleFlashCommand, false},
+    {streamPacingCommand, false},
+    {pingCommand, false},
+    {statsCommand, false},
+    {resetCommand, false},
+    {logLevelCommand, false},
+    {recordCommand, false},
+    {grabModeCommand, false},
+    {pixelFormatCommand, false},
+    {visionCommand, false},
+    {driveCommand, true},
+    {videoCommand, false},
+    {frameAckCommand, false},
+    {udpVideoCommand, false}};
+
+void dispatchCarCommand(const CarCommand &command, int fd) {
+  if (command.opcode >= OP_COUNT) {
+    logEvent(LOG_ERROR, EV_UNKNOWN_COMMAND, command.opcode, CAR_MESSAGE_SIZE);
     return;
   }
 
-  if (strcmp(command, "backward-right") == 0) {
-    car.moveBackwardRight();
+  logEvent(LOG_DEBUG, EV_COMMAND, command.opcode, command.seq);
+  carCommandHandlers[command.opcode].handler(command, fd);
+}
+
+// Called by the control task every period, before the car is ticked. Applies the newest
+// command of each axis, whatever arrived before it in the same period is already stale
+void processControlCommands() {
+  QueuedCommand item;
+
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    if (!controlLatch.take(axis, item, nowUs())) {
+      continue;
+    }
+
+    const uint64_t dispatchedAt = nowUs();
 
+    latencyMetrics.record(LAT_COMMAND_RECEIVE_TO_DISPATCH, item.receivedAt, dispatchedAt);
+
+    // stamped first, the ramp timer may put the command on the pins before dispatch returns
+    if (axis == AXIS_DRIVE) {
+      latencyMetrics.onMovementDispatched(item.receivedAt, dispatchedAt);
+    }
+
+    dispatchCarCommand(item.command, item.fd);
+  }
+}
+
+// Executes the non-realtime commands queued by websocketHandler, so the httpd task never waits on them
+static void commandTask(void *param) {
+  QueuedCommand item;
+
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    while (serviceQueue.pop(item, nowUs())) {
+      latencyMetrics.record(LAT_COMMAND_RECEIVE_TO_DISPATCH, item.receivedAt, nowUs());
+      dispatchCarCommand(item.command, item.fd);
+    }
+
+    applyPendingQualityLevel();
+  }
+}
+
+static void queueCarCommand(const CarCommand &command, int fd) {
+  QueuedCommand item = {command, fd, nowUs()};
+  const bool realtime = command.opcode < OP_COUNT && carCommandHandlers[command.opcode].realtime;
+
+  if (realtime) {
+    controlLatch.post(item);
     return;
   }
 
-  if (strcmp(command, "stop") == 0) {
-    car.stop();
+  if (!serviceQueue.push(item)) {
+    logEvent(LOG_ERROR, EV_COMMAND_DROPPED, command.opcode);
+    return;
+  }
+
+  xTaskNotifyGive(commandTaskHandle);
+}
+
+void handleCarCommand(const char *command, int fd) {
+  CarCommand parsed;
 
+  if (!parseTextCommand(command, parsed)) {
+    logEvent(LOG_ERROR, EV_UNKNOWN_COMMAND, -1, strlen(command));
     return;
   }
 
-  Serial.printf("Unknown command: %s\n", command);
+  logEvent(LOG_DEBUG, EV_TEXT_COMMAND, parsed.opcode, strlen(command));
+
+  queueCarCommand(parsed, fd);
 }
 
 static esp_err_t websocketHandler(httpd_req_t *req) {
   if (req->method == HTTP_GET) {
-    Serial.println("WebSocket connection requested" + String(WiFi.status()));
+    Serial.printf("WebSocket connection requested, WiFi status %d\n", WiFi.status());
+    applySocketTuning(httpd_req_to_sockfd(req), serverTuning);
     const char *message = car.getFlashState() ? "Flash-ON" : "Flash-OFF";
 
+    // the handshake is done and the page handles messages in any order: the state goes out
+    // back to back, this task serves every other request and command too
     sendResponse(req, message);
-    vTaskDelay(300 / portTICK_PERIOD_MS);
 
     char wifiStatus[16];
     snprintf(wifiStatus, sizeof(wifiStatus), "WIFI-%d", WiFi.status() == WL_CONNECTED);
     sendResponse(req, wifiStatus);
-    vTaskDelay(300 / portTICK_PERIOD_MS);
 
     sensor_t *s = esp_camera_sensor_get();
     if (s) {
-      const char *frameSizeName = frameSizeToString(s->status.framesize);
+      const char *frameSizeName = autoQuality ? "AUTO" : frameSizeToString(s->status.framesize);
       char frameMsg[64];
       snprintf(frameMsg, sizeof(frameMsg), "FRAMESIZE-%s", frameSizeName);
       sendResponse(req, frameMsg);
@@ -212,154 +766,445 @@ static esp_err_t websocketHandler(httpd_req_t *req) {
     return ESP_OK;
   }
 
+  // the server runs a single task, so one receive buffer is enough. Header and payload are
+  // read in one call, messages over WS_MAX_MESSAGE_LEN are refused by httpd_ws_recv_frame
+  static uint8_t buffer[WS_MAX_MESSAGE_LEN + 1];
+
   httpd_ws_frame_t wsFrame;
   memset(&wsFrame, 0, sizeof(wsFrame));
-  wsFrame.type = HTTPD_WS_TYPE_TEXT;
+  wsFrame.payload = buffer;
+
+  esp_err_t ret = httpd_ws_recv_frame(req, &wsFrame, WS_MAX_MESSAGE_LEN);
 
-  esp_err_t ret = httpd_ws_recv_frame(req, &wsFrame, 0);
-  if (ret != ESP_OK)
+  if (ret != ESP_OK) {
+    Serial.printf("WS receive failed: 0x%x\n", ret);
     return ret;
+  }
 
   if (!wsFrame.len)
     return ESP_OK;
 
-  uint8_t *buffer = (uint8_t *)calloc(1, wsFrame.len + 1);
-  if (!buffer)
-    return ESP_ERR_NO_MEM;
+  const int fd = httpd_req_to_sockfd(req);
 
-  wsFrame.payload = buffer;
-  ret = httpd_ws_recv_frame(req, &wsFrame, wsFrame.len);
+  if (wsFrame.type == HTTPD_WS_TYPE_BINARY) {
+    CarCommand command;
+
+    if (!decodeCarCommand(buffer, wsFrame.len, command)) {
+      Serial.printf("Malformed binary command: %u bytes\n", wsFrame.len);
+    } else if (command.opcode == OP_FRAME_ACK) {
+      frameAckCommand(command, fd);
+    } else {
+      queueCarCommand(command, fd);
+
+      // the client paces its realtime sends on these, so a slow link slows the sender down.
+      // With WS video on the socket the stream sender writes it between frames
+      if (!streamSender.queueAck(fd, command.seq)) {
+        char ack[16];
+        snprintf(ack, sizeof(ack), "ack-%u", command.seq);
+        sendResponse(req, ack);
+      }
+    }
+
+    return ESP_OK;
+  }
+
+  buffer[wsFrame.len] = '\0';
+  handleCarCommand((char *)buffer, fd);
 
-  if (ret == ESP_OK) {
-    buffer[wsFrame.len] = '\0';
-    handleCarCommand((char *)buffer, req);
+  return ESP_OK;
+}
+
+// close_fn of the server. Sockets still owned by the stream sender or the request worker are
+// closed by them
+static void serverSocketClosed(httpd_handle_t hd, int fd) {
+  udpVideoSender.onSocketClosed(fd);
+
+  if (!streamSender.onSocketClosed(fd) && !requestWorker.onSocketClosed(fd)) {
+    close(fd);
+  }
+}
+
+static void onStreamViewersChanged(void *context, int delta) {
+  // both senders' tasks call this: only the one whose change took the count from 0 or to 0 flips
+  // the flag, reading the flag back instead could see the other task's change half done
+  const int before = streamViewerCount.fetch_add(delta);
+  const int after = before + delta;
+
+  if (before == 0 && after > 0) {
+    isClientActive = true;
+  } else if (before > 0 && after == 0) {
+    isClientActive = false;
+    car.stop();
+    car.turnFlashOff();
+    frameBroadcaster.detectMotion(false);
   }
+}
 
-  free(buffer);
+static bool isCarParked(void *context) {
+  return car.isParked(IDLE_AFTER_MS);
+}
+
+static void onStreamFrameSent(void *context, int viewer, size_t bytes, uint32_t sendUs, uint64_t nowUs) {
+  updateAutoQuality(viewer, bytes, sendUs, nowUs);
+}
 
-  return ret;
+// The stream sender and the request worker hand their sockets back through here
+static bool detachServerSocket(void *context, int fd) {
+  return httpd_sess_trigger_close(camera_httpd, fd) == ESP_OK;
 }
 
+// Hands the socket over to the stream sender, the server is free for the next request at once
 static esp_err_t streamHandler(httpd_req_t *req) {
-  if (isClientActive) {
-    Serial.println("Stream rejected - client already active");
+  if (!esp_camera_sensor_get()) {
+    Serial.println("NO SENSOR DETECTED");
     httpd_resp_send_404(req);
     return ESP_FAIL;
   }
 
-  isClientActive = true;
-  Serial.println("Stream started - client locked");
+  const int fd = httpd_req_to_sockfd(req);
 
-  camera_fb_t *frameBuffer = NULL;
-  esp_err_t res = ESP_OK;
-  size_t jpgBufferLength = 0;
-  uint8_t *jpgBuffer = NULL;
-  char part_buf[64];
+  applySocketTuning(fd, serverTuning);
 
-  sensor_t *s = esp_camera_sensor_get();
-  if (!s) {
-    Serial.println("NO SENSOR DETECTED");
-    httpd_resp_send_404(req);
+  if (!streamSender.add(fd)) {
+    Serial.println("Stream rejected - all client slots are busy");
+    httpd_resp_send_err(req, HTTPD_503_SERVICE_UNAVAILABLE, "Stream busy");
     return ESP_FAIL;
   }
 
-  res = httpd_resp_set_type(req, "multipart/x-mixed-replace;boundary=frame");
+  return ESP_OK;
+}
 
-  if (res != ESP_OK) {
-    isClientActive = false;
-    return res;
+// A still, or a burst as multipart/mixed ending with the connection. arg0 - the frame size,
+// arg1 - the frame count. Grabbing may re-initialise the driver and takes up to seconds, in
+// the request worker. The stream only pauses while the frames are grabbed, they are sent from
+// copies after it is back
+static void capturePhotoJob(RequestWorker &worker, int fd, const RequestJob &job) {
+  const framesize_t size = (framesize_t)job.arg0;
+  const int count = job.arg1;
+  BurstFrame frames[CAMERA_BURST_MAX_FRAMES];
+  const int taken = cameraPool.captureBurst(size, CAMERA_JPEG_QUALITY, frames, count);
+
+  if (!taken) {
+    Serial.println("Camera capture failed");
+    worker.sendHeader(fd, "500 Internal Server Error", "text/plain", 0);
+    return;
   }
 
-  while (true) {
-    frameBuffer = esp_camera_fb_get();
-    if (!frameBuffer) {
-      delay(100);
-      continue;
+  char headers[160];
+  bool sent;
+  size_t total = 0;
+
+  if (count == 1) {
+    snprintf(headers, sizeof(headers),
+             "X-Burst-Ms: %u\r\nX-Timestamp: %llu.%06u\r\nContent-Disposition: inline; filename=capture.jpg\r\n",
+             cameraPool.lastBurstMs(), frames[0].sensorAtUs / 1000000, (unsigned)(frames[0].sensorAtUs % 1000000));
+
+    sent = worker.sendHeader(fd, "200 OK", "image/jpeg", frames[0].length, headers) &&
+           worker.sendAll(fd, frames[0].data, frames[0].length);
+    total = frames[0].length;
+  } else {
+    snprintf(headers, sizeof(headers), "X-Burst-Ms: %u\r\n", cameraPool.lastBurstMs());
+    sent = worker.sendHeader(fd, "200 OK", "multipart/mixed; boundary=" BURST_BOUNDARY, 0, headers);
+
+    for (int i = 0; i < taken && sent; i++) {
+      char part[160];
+      const size_t length = snprintf(part, sizeof(part), BURST_PART, i, (unsigned)frames[i].length,
+                                     frames[i].sensorAtUs / 1000000, (unsigned)(frames[i].sensorAtUs % 1000000));
+
+      sent = worker.sendAll(fd, part, length) && worker.sendAll(fd, frames[i].data, frames[i].length);
+      total += frames[i].length;
+    }
+
+    if (sent) {
+      sent = worker.sendAll(fd, BURST_END, strlen(BURST_END));
+    }
+  }
+
+  Serial.printf("%s JPEG x%d %s: %u bytes, stream paused %ums\n", frameSizeToString(size), taken,
+                sent ? "sent" : "cut off", (unsigned)total, cameraPool.lastBurstMs());
+}
+
+// GET /capture_photo[?size=FRAMESIZE_UXGA&count=N] - a still at full resolution by default, or
+// a burst of up to CAMERA_BURST_MAX_FRAMES, see capturePhotoJob
+static esp_err_t capturePhotoHandler(httpd_req_t *req) {
+  char query[64];
+  char value[24];
+  framesize_t size = FRAMESIZE_UXGA;
+  int count = 1;
+
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    if (httpd_query_key_value(query, "size", value, sizeof(value)) == ESP_OK && stringToFrameSize(value) != FRAMESIZE_INVALID) {
+      size = stringToFrameSize(value);
     }
 
-    if (frameBuffer->format != PIXFORMAT_JPEG) {
-      bool convertedJpeg = frame2jpg(frameBuffer, 80, &jpgBuffer, &jpgBufferLength);
+    if (httpd_query_key_value(query, "count", value, sizeof(value)) == ESP_OK) {
+      count = constrain(atoi(value), 1, CAMERA_BURST_MAX_FRAMES);
+    }
+  }
+
+  if (!esp_camera_sensor_get()) {
+    Serial.println("Camera sensor not found");
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+
+  const RequestJob job = {capturePhotoJob, size, count};
+
+  if (!requestWorker.submit(httpd_req_to_sockfd(req), job)) {
+    httpd_resp_send_err(req, HTTPD_503_SERVICE_UNAVAILABLE, "Busy with another request");
+    return ESP_FAIL;
+  }
+
+  return ESP_OK;
+}
 
-      esp_camera_fb_return(frameBuffer);
-      frameBuffer = NULL;
+// Builds a response in a fixed buffer and sends it as a chunk whenever the next piece does not
+// fit, so the response is not bounded by the buffer. After a failed send, or a single piece
+// larger than the buffer, nothing more is appended and finish() returns the error
+class ChunkedResponse {
+public:
+  ChunkedResponse(httpd_req_t *req, char *buffer, size_t capacity)
+      : _req(req),
+        _buffer(buffer),
+        _capacity(capacity),
+        _length(0),
+        _err(ESP_OK) {}
+
+  void append(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+    for (int attempt = 0; attempt < 2 && _err == ESP_OK; attempt++) {
+      va_list args;
+      va_start(args, format);
+      const int written = vsnprintf(_buffer + _length, _capacity - _length, format, args);
+      va_end(args);
+
+      if (written < 0) {
+        _err = ESP_FAIL;
+        return;
+      }
 
-      if (!convertedJpeg) {
+      if (_length + written < _capacity) {
+        _length += written;
+        return;
+      }
+
+      // cut off: send what came before it and write it again into the empty buffer
+      if (!attempt && _length) {
+        flush();
         continue;
       }
-    } else {
-      jpgBufferLength = frameBuffer->len;
-      jpgBuffer = frameBuffer->buf;
-    }
 
-    if (res == ESP_OK) {
-      size_t headerLength = snprintf(part_buf, 64, "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n", jpgBufferLength);
-      res = httpd_resp_send_chunk(req, part_buf, headerLength);
+      _err = ESP_ERR_INVALID_SIZE;
     }
+  }
 
-    if (res == ESP_OK) {
-      res = httpd_resp_send_chunk(req, (const char *)jpgBuffer, jpgBufferLength);
+  esp_err_t finish() {
+    flush();
+
+    if (_err == ESP_OK) {
+      _err = httpd_resp_send_chunk(_req, NULL, 0);
     }
 
-    if (frameBuffer) {
-      esp_camera_fb_return(frameBuffer);
-      jpgBuffer = NULL;
-    } else if (jpgBuffer) {
-      free(jpgBuffer);
-      jpgBuffer = NULL;
+    return _err;
+  }
+
+private:
+  httpd_req_t *_req;
+  char *_buffer;
+  size_t _capacity;
+  size_t _length;
+  esp_err_t _err;
+
+  void flush() {
+    if (_err == ESP_OK && _length) {
+      _err = httpd_resp_send_chunk(_req, _buffer, _length);
     }
 
-    if (res != ESP_OK) {
-      break;
+    _length = 0;
+  }
+};
+
+// Stage latency histograms as JSON: per stage count, max, p50/p90/p99 and raw buckets, plus
+// the static asset counters. Percentiles are bucket upper bounds. ?reset=1 clears the
+// histograms after reading
+static esp_err_t metricsHandler(httpd_req_t *req) {
+  // too large for the httpd stack, the server runs a single task so one buffer is enough
+  static char buffer[1024];
+  ChunkedResponse response(req, buffer, sizeof(buffer));
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+
+  response.append("{\"bucketFirstUs\":%u,\"stages\":{", LATENCY_HISTOGRAM_FIRST_US);
+
+  for (int stage = 0; stage < LAT_STAGE_COUNT; stage++) {
+    const LatencyHistogram &histogram = latencyMetrics.histogram(stage);
+
+    response.append("%s\"%s\":{\"count\":%u,\"maxUs\":%u,\"p50Us\":%u,\"p90Us\":%u,\"p99Us\":%u,\"buckets\":[",
+                    stage ? "," : "", latencyStageNames[stage], histogram.count(), histogram.maxUs(),
+                    histogram.percentileUs(50), histogram.percentileUs(90), histogram.percentileUs(99));
+
+    for (int b = 0; b < LATENCY_HISTOGRAM_BUCKETS; b++) {
+      response.append("%s%u", b ? "," : "", histogram.bucket(b));
     }
 
-    delay(50);
+    response.append("]}");
   }
 
-  isClientActive = false;
-  Serial.println("Stream ended - client unlocked");
-  car.stop();
-  car.turnFlashOff();
-  return res;
+  const MotionDetector &motion = frameBroadcaster.motion();
+  const ObstacleDetector &obstacles = visionStage.detector();
+  RampEngine &ramps = car.rampEngine();
+  const HeapWatermark &capture = frameBroadcaster.heap();
+  const HeapWatermark &stream = streamSender.heap();
+
+  response.append("},\"assets\":{\"cacheHits\":%u,\"notModified\":%u,\"flashReads\":%u},", assetCacheHits,
+                  assetNotModified, assetFlashReads);
+  response.append("\"recorder\":{\"recording\":%s,\"fps\":%u,\"segments\":%u,\"framesWritten\":%u,\"framesDropped\":%u,"
+                  "\"bytesWritten\":%llu,\"throughputKBps\":%u,\"segmentsRecycled\":%u,\"writeErrors\":%u},",
+                  frameRecorder.recording() ? "true" : "false", frameRecorder.fps(), frameRecorder.segments(),
+                  frameRecorder.framesWritten(), frameRecorder.framesDropped(), (unsigned long long)frameRecorder.bytesWritten(),
+                  frameRecorder.throughputKBps(), frameRecorder.segmentsRecycled(), frameRecorder.writeErrors());
+  response.append("\"camera\":{\"bufferFrameSize\":\"%s\",\"pixelFormat\":\"%s\",\"encodeFailures\":%u,\"consumer\":\"%s\","
+                  "\"fbCount\":%u,\"fbKB\":%u,\"grabLatest\":%s,\"inFlight\":%d,\"peakInFlight\":%d,\"reconfigurations\":%u,"
+                  "\"failures\":%u,\"lastReconfigureMs\":%u,\"bursts\":%u,\"lastBurstMs\":%u,\"lastOutageUs\":%u,"
+                  "\"lastOutageFramesLost\":%u,\"framesLost\":%u,\"freePsramKB\":%u,\"freeInternalKB\":%u},",
+                  frameSizeToString(cameraPool.bufferFrameSize()), CameraPool::pixelFormatName(cameraPool.pixelFormat()),
+                  frameBroadcaster.encodeFailures(), cameraConsumerNames[cameraPool.consumer()],
+                  (unsigned)cameraPool.fbCount(), (unsigned)(cameraPool.bufferSize() / 1024),
+                  cameraPool.grabMode(cameraPool.consumer()) == CAMERA_GRAB_LATEST ? "true" : "false",
+                  frameBroadcaster.inFlight(), frameBroadcaster.peakInFlight(), cameraPool.reconfigurations(),
+                  cameraPool.failures(), cameraPool.lastReconfigureMs(), cameraPool.bursts(), cameraPool.lastBurstMs(),
+                  frameBroadcaster.lastOutageUs(), frameBroadcaster.lastOutageFramesLost(), frameBroadcaster.framesLost(),
+                  (unsigned)(halFreePsram() / 1024), (unsigned)(halFreeInternalHeap() / 1024));
+  response.append("\"idle\":{\"detecting\":%s,\"frames\":%u,\"changed\":%u,\"unreadable\":%u,\"scanAvgUs\":%u,"
+                  "\"scanMaxUs\":%u,\"skipped\":%u,\"bytesSaved\":%llu},",
+                  frameBroadcaster.detectingMotion() ? "true" : "false", motion.frames(), motion.changed(), motion.failed(),
+                  motion.averageScanUs(), motion.maxScanUs(), streamSender.idleFramesSkipped(),
+                  (unsigned long long)streamSender.idleBytesSaved());
+  response.append("\"vision\":{\"enabled\":%s,\"vetoing\":%s,\"score\":%u,\"frames\":%u,\"unreadable\":%u,\"vetoes\":%u,"
+                  "\"vetoedCommands\":%u,\"stops\":%u,\"frameAvgUs\":%u,\"frameMaxUs\":%u,\"budgetUs\":%u,\"overruns\":%u,"
+                  "\"stride\":%u,\"skipped\":%u,\"staleDrops\":%u},",
+                  visionStage.enabled() ? "true" : "false", car.forwardVetoed() ? "true" : "false", car.forwardVetoScore(),
+                  obstacles.frames(), obstacles.failed(), obstacles.vetoes(), car.forwardVetoedCommands(),
+                  car.forwardVetoStops(), obstacles.averageFrameUs(), obstacles.maxFrameUs(), VISION_BUDGET_US,
+                  visionStage.overruns(), visionStage.stride(), visionStage.skipped(), visionStage.staleDrops());
+  response.append("\"ramp\":{\"running\":%s,\"ticks\":%u,\"writes\":%u,\"busyUs\":%llu,\"maxTickUs\":%u,\"runMs\":%llu},",
+                  ramps.running() ? "true" : "false", ramps.ticks(), ramps.writes(), (unsigned long long)ramps.busyUs(),
+                  ramps.maxBusyUs(), (unsigned long long)(ramps.runUs() / 1000));
+  response.append("\"heap\":{\"lowestFreePsramKB\":%u,\"lowestFreeInternalKB\":%u,"
+                  "\"capture\":{\"frames\":%u,\"allocating\":%u,\"allocations\":%u,\"worst\":%u},"
+                  "\"stream\":{\"frames\":%u,\"allocating\":%u,\"allocations\":%u,\"worst\":%u},"
+                  "\"control\":{\"ticks\":%u,\"allocating\":%u,\"allocations\":%u,\"worst\":%u}},",
+                  (unsigned)(halLowestFreePsram() / 1024), (unsigned)(halLowestFreeInternalHeap() / 1024),
+                  capture.iterations(), capture.allocatingIterations(), capture.allocations(), capture.worst(),
+                  stream.iterations(), stream.allocatingIterations(), stream.allocations(), stream.worst(),
+                  controlHeap.iterations(), controlHeap.allocatingIterations(), controlHeap.allocations(), controlHeap.worst());
+  response.append("\"stream\":{\"viewers\":%d,\"connections\":%u,\"rejected\":%u,\"framesSent\":%u,\"ackTimeouts\":%u,"
+                  "\"stalls\":%u},",
+                  streamSender.clientCount(), streamSender.connections(), streamSender.rejected(), streamSender.framesSent(),
+                  streamSender.ackTimeouts(), streamSender.stalls());
+  response.append("\"udp\":{\"active\":%s,\"kbps\":%u,\"framesSent\":%u,\"framesSkipped\":%u,\"framesAbandoned\":%u,"
+                  "\"idleSkipped\":%u,\"packetsSent\":%u,\"sendErrors\":%u,\"bytesSent\":%llu,\"pacingWaitMs\":%llu}}",
+                  udpVideoSender.active() ? "true" : "false", udpVideoSender.kbps(), udpVideoSender.framesSent(),
+                  udpVideoSender.framesSkipped(), udpVideoSender.framesAbandoned(), udpVideoSender.idleFramesSkipped(),
+                  udpVideoSender.packetsSent(), udpVideoSender.sendErrors(), (unsigned long long)udpVideoSender.bytesSent(),
+                  (unsigned long long)(udpVideoSender.pacingWaitUs() / 1000));
+
+  const esp_err_t err = response.finish();
+  char query[16];
+  char reset[4];
+
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+      httpd_query_key_value(query, "reset", reset, sizeof(reset)) == ESP_OK && strcmp(reset, "1") == 0) {
+    latencyMetrics.reset();
+  }
+
+  return err;
 }
 
-static esp_err_t capturePhotoHandler(httpd_req_t *req) {
-  camera_fb_t *fb = NULL;
-  esp_err_t res = ESP_OK;
-  sensor_t *s = esp_camera_sensor_get();
+// The broadcaster's JpegEncoder against the driver's fmt2jpg on the same synthetic frames,
+// QVGA and VGA, RGB565 and grayscale. fmt2jpg is timed with its own allocation, as the stream
+// used it. Takes a couple of seconds, in the request worker
+static void encoderBenchJob(RequestWorker &worker, int fd, const RequestJob &job) {
+  static JpegEncoder encoder;
+  static const framesize_t sizes[] = {FRAMESIZE_QVGA, FRAMESIZE_VGA};
+  static const pixformat_t formats[] = {PIXFORMAT_RGB565, PIXFORMAT_GRAYSCALE};
+  char response[768];
+  size_t length = snprintf(response, sizeof(response), "{\"runs\":%d,\"quality\":%d,\"results\":[",
+                           ENCODER_BENCH_RUNS, FRAME_ENCODE_QUALITY);
+  int results = 0;
+
+  for (framesize_t size : sizes) {
+    for (pixformat_t format : formats) {
+      const FrameResolution &resolution = frameResolutions[size];
+      const size_t rawLength = CameraPool::frameBufferSize(size, format);
+      const size_t capacity = (size_t)resolution.width * resolution.height;
+      uint8_t *pixels = (uint8_t *)halAllocLarge(rawLength);
+      uint8_t *out = (uint8_t *)halAllocLarge(capacity);
+      uint64_t encoderUs = 0;
+      uint64_t fmt2jpgUs = 0;
+      size_t encoderBytes = 0;
+      size_t fmt2jpgBytes = 0;
+
+      if (!pixels || !out) {
+        free(pixels);
+        free(out);
+        worker.sendHeader(fd, "500 Internal Server Error", "text/plain", 0);
+        return;
+      }
 
-  if (!s) {
-    Serial.println("Camera sensor not found");
-    httpd_resp_send_500(req);
-    return ESP_FAIL;
-  }
+      fillEncoderTestPattern(pixels, resolution.width, resolution.height, format);
 
-  fb = esp_camera_fb_get();
+      for (int run = 0; run < ENCODER_BENCH_RUNS; run++) {
+        uint64_t start = nowUs();
+        encoderBytes = encoder.encode(pixels, resolution.width, resolution.height, format, FRAME_ENCODE_QUALITY, out, capacity);
+        encoderUs += nowUs() - start;
 
-  if (!fb) {
-    Serial.println("Camera capture failed");
-    httpd_resp_send_500(req);
-    return ESP_FAIL;
+        uint8_t *jpeg = NULL;
+        start = nowUs();
+
+        if (fmt2jpg(pixels, rawLength, resolution.width, resolution.height, format, FRAME_ENCODE_QUALITY, &jpeg, &fmt2jpgBytes)) {
+          free(jpeg);
+        }
+
+        fmt2jpgUs += nowUs() - start;
+      }
+
+      free(pixels);
+      free(out);
+
+      length += snprintf(response + length, sizeof(response) - length,
+                         "%s{\"frameSize\":\"%s\",\"format\":\"%s\",\"encoderUs\":%u,\"encoderBytes\":%u,"
+                         "\"fmt2jpgUs\":%u,\"fmt2jpgBytes\":%u}",
+                         results++ ? "," : "", frameSizeToString(size), CameraPool::pixelFormatName(format),
+                         (unsigned)(encoderUs / ENCODER_BENCH_RUNS), (unsigned)encoderBytes,
+                         (unsigned)(fmt2jpgUs / ENCODER_BENCH_RUNS), (unsigned)fmt2jpgBytes);
+      // keep the watchdog and the other tasks fed between the runs
+      vTaskDelay(1);
+    }
   }
 
-  httpd_resp_set_type(req, "image/jpeg");
-  httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  length += snprintf(response + length, sizeof(response) - length, "]}");
+
+  if (worker.sendHeader(fd, "200 OK", "application/json", length)) {
+    worker.sendAll(fd, response, length);
+  }
+}
 
-  char ts[32];
-  snprintf(ts, 32, "%lld.%06ld", fb->timestamp.tv_sec, fb->timestamp.tv_usec);
-  httpd_resp_set_hdr(req, "X-Timestamp", (const char *)ts);
+// GET /encoder_bench - see encoderBenchJob
+static esp_err_t encoderBenchHandler(httpd_req_t *req) {
+  const RequestJob job = {encoderBenchJob, 0, 0};
 
-  if (fb->format == PIXFORMAT_JPEG) {
-    res = httpd_resp_send(req, (const char *)fb->buf, fb->len);
-    Serial.printf("VGA JPEG sent: %u bytes\n", fb->len);
+  if (!requestWorker.submit(httpd_req_to_sockfd(req), job)) {
+    httpd_resp_send_err(req, HTTPD_503_SERVICE_UNAVAILABLE, "Busy with another request");
+    return ESP_FAIL;
   }
 
-  esp_camera_fb_return(fb);
-  return res;
+  return ESP_OK;
 }
 
 static esp_err_t indexHandler(httpd_req_t *req) {
-  const char *htmlToSend = isClientActive ? "/busy.min.html" : "/index.min.html";
+  const char *htmlToSend = streamSender.clientCount() >= STREAM_MAX_CLIENTS ? "/busy.min.html" : "/index.min.html";
   return serveStaticFile(req, htmlToSend);
 }
 
@@ -371,10 +1216,36 @@ static esp_err_t scriptHandler(httpd_req_t *req) {
   return serveStaticFile(req, "/script.min.js");
 }
 
+// One server for the page, its assets, the websocket and /stream. Stream sockets are handed to
+// the stream sender after the request, so a viewer never holds the server's task
 void startCarServer() {
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
   config.server_port = 82;
   config.ctrl_port = 32768;
+  // the sockets both servers had between them: stream viewers, websockets and asset requests
+  config.max_open_sockets = 10;
+  config.max_uri_handlers = 10;
+  config.close_fn = serverSocketClosed;
+  // a blocking send to a viewer that went away holds the server's only task until it times out
+  config.send_wait_timeout = serverTuning.sendWaitTimeoutS;
+  config.recv_wait_timeout = serverTuning.recvWaitTimeoutS;
+  config.lru_purge_enable = serverTuning.lruPurge;
+
+  const size_t freeBefore = halFreeInternalHeap();
+  const StreamHooks streamHooks = {nullptr, isCarParked, onStreamFrameSent, onStreamViewersChanged, detachServerSocket};
+
+  qualityLock = xSemaphoreCreateMutex();
+  loadStaticAssets();
+  frameBroadcaster.begin();
+  cameraPool.begin(camera_config, frameBroadcaster);
+  frameRecorder.begin(frameBroadcaster);
+  visionStage.begin(frameBroadcaster, car);
+  streamSender.setPacing(streamTargetFps, streamLatencyBudgetMs * 1000);
+  streamSender.setStallTimeout(serverTuning.stallTimeoutMs);
+  streamSender.begin(frameBroadcaster, streamHooks);
+  udpVideoSender.begin(frameBroadcaster, streamHooks);
+  requestWorker.begin(detachServerSocket, nullptr);
+  xTaskCreatePinnedToCore(commandTask, "CarCommands", 4096, nullptr, 6, &commandTaskHandle, tskNO_AFFINITY);
 
   httpd_uri_t index_uri = {
       .uri = "/",
@@ -392,6 +1263,16 @@ void startCarServer() {
       .method = HTTP_GET,
       .handler = capturePhotoHandler,
       .user_ctx = NULL};
+  httpd_uri_t metrics_uri = {
+      .uri = "/metrics",
+      .method = HTTP_GET,
+      .handler = metricsHandler,
+      .user_ctx = NULL};
+  httpd_uri_t encoder_bench_uri = {
+      .uri = "/encoder_bench",
+      .method = HTTP_GET,
+      .handler = encoderBenchHandler,
+      .user_ctx = NULL};
   httpd_uri_t script_uri = {
       .uri = "/script.js",
       .method = HTTP_GET,
@@ -402,6 +1283,11 @@ void startCarServer() {
       .method = HTTP_GET,
       .handler = styleHandler,
       .user_ctx = NULL};
+  httpd_uri_t stream_uri = {
+      .uri = "/stream",
+      .method = HTTP_GET,
+      .handler = streamHandler,
+      .user_ctx = NULL};
 
   Serial.printf("Starting web server on port: '%d'\n", config.server_port);
 
@@ -409,25 +1295,14 @@ void startCarServer() {
     httpd_register_uri_handler(camera_httpd, &index_uri);
     httpd_register_uri_handler(camera_httpd, &photo_uri);
     httpd_register_uri_handler(camera_httpd, &ws_uri);
+    httpd_register_uri_handler(camera_httpd, &metrics_uri);
+    httpd_register_uri_handler(camera_httpd, &encoder_bench_uri);
     httpd_register_uri_handler(camera_httpd, &script_uri);
     httpd_register_uri_handler(camera_httpd, &style_uri);
-    Serial.println("WebSocket handler registered on /ws");
+    httpd_register_uri_handler(camera_httpd, &stream_uri);
+    Serial.println("WebSocket handler registered on /ws, stream on /stream");
   }
 
-  // Server for streaming on port 81
-  config.server_port = 81;
-  config.ctrl_port = 32769;
-
-  httpd_uri_t stream_uri = {
-      .uri = "/stream",
-      .method = HTTP_GET,
-      .handler = streamHandler,
-      .user_ctx = NULL};
-
-  Serial.printf("Starting stream server on port: '%d'\n", config.server_port);
-  
-  if (httpd_start(&stream_httpd, &config) == ESP_OK) {
-    httpd_register_uri_handler(stream_httpd, &stream_uri);
-    Serial.println("Stream server started on port 81");
-  }
+  Serial.printf("Server, stream sender and camera tasks took %uKB of internal heap, %uKB left\n",
+                (unsigned)((freeBefore - halFreeInternalHeap()) / 1024), (unsigned)(halFreeInternalHeap() / 1024));
 }
\ No newline at end of file
@@ -32,6 +32,8 @@
 
 // Car pin definitions
 #define SERVO_X_PIN 2
+// Camera tilt servo, -1 - none. The AI Thinker board has no spare pin, GPIO 3 (U0RXD) works without serial input
+#define SERVO_Y_PIN -1
 
 #define RIGHT_MOTOR_IN1 12
 #define RIGHT_MOTOR_IN2 13
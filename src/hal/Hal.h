@@ -0,0 +1,9 @@
+#pragma once
+
+// Hardware abstraction layer: everything Car, Motor and the frame pipeline need from the board.
+// NATIVE_BUILD selects the Linux simulation used by [env:native]
+#ifdef NATIVE_BUILD
+#include "HalNative.h"
+#else
+#include "HalEsp32.h"
+#endif
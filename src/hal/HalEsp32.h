@@ -0,0 +1,245 @@
+#pragma once
+#include "LittleFS.h"
+#include "esp_camera.h"
+#include "lwip/sockets.h"
+#include <Arduino.h>
+#include <Servo.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+// ESP32 side of the HAL, thin wrappers over the Arduino core and esp32-camera
+
+typedef Servo HalServo;
+
+inline uint64_t halNowUs() {
+  return esp_timer_get_time();
+}
+
+inline void halPinMode(int pin, int mode) {
+  pinMode(pin, mode);
+}
+
+inline void halDigitalWrite(int pin, int value) {
+  digitalWrite(pin, value);
+}
+
+inline void halPwmSetup(uint8_t channel, uint32_t frequency, uint8_t resolutionBits) {
+  ledcSetup(channel, frequency, resolutionBits);
+}
+
+inline void halPwmAttach(int pin, uint8_t channel) {
+  ledcAttachPin(pin, channel);
+}
+
+inline void halPwmWrite(uint8_t channel, uint32_t duty) {
+  ledcWrite(channel, duty);
+}
+
+// Periodic callback on the esp_timer task. Stopping and restarting is cheap, so a user with
+// nothing to do can leave the timer off instead of polling
+class HalPeriodicTimer {
+public:
+  HalPeriodicTimer()
+      : _timer(nullptr),
+        _running(false) {}
+
+  bool begin(void (*callback)(void *), void *arg, const char *name) {
+    esp_timer_create_args_t args = {};
+    args.callback = callback;
+    args.arg = arg;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = name;
+
+    return esp_timer_create(&args, &_timer) == ESP_OK;
+  }
+
+  bool start(uint32_t periodUs) {
+    if (_timer && !_running) {
+      _running = esp_timer_start_periodic(_timer, periodUs) == ESP_OK;
+    }
+
+    return _running;
+  }
+
+  void stop() {
+    if (_running) {
+      esp_timer_stop(_timer);
+      _running = false;
+    }
+  }
+
+  bool running() const {
+    return _running;
+  }
+
+private:
+  esp_timer_handle_t _timer;
+  volatile bool _running;
+};
+
+inline esp_err_t halCameraInit(const camera_config_t *config) {
+  return esp_camera_init(config);
+}
+
+inline esp_err_t halCameraDeinit() {
+  return esp_camera_deinit();
+}
+
+inline camera_fb_t *halCameraGet() {
+  return esp_camera_fb_get();
+}
+
+inline void halCameraReturn(camera_fb_t *fb) {
+  esp_camera_fb_return(fb);
+}
+
+inline sensor_t *halCameraSensor() {
+  return esp_camera_sensor_get();
+}
+
+inline size_t halFreePsram() {
+  return heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+}
+
+inline size_t halFreeInternalHeap() {
+  return heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+}
+
+// Since boot, for a low watermark
+inline size_t halLowestFreePsram() {
+  return heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM);
+}
+
+inline size_t halLowestFreeInternalHeap() {
+  return heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+}
+
+// Heap allocations counted per task. The linker sends malloc, calloc, realloc and their
+// heap_caps_ variants through the __wrap_ functions below (-Wl,--wrap in platformio.ini),
+// which count a call when the calling task is one of the few that asked for it
+#define HAL_COUNTED_TASKS 8
+
+struct HalTaskAllocations {
+  TaskHandle_t task;
+  volatile uint32_t count;
+};
+
+static HalTaskAllocations halCountedTasks[HAL_COUNTED_TASKS];
+static volatile uint8_t halCountedTaskCount = 0;
+static portMUX_TYPE halCountedTasksMux = portMUX_INITIALIZER_UNLOCKED;
+
+inline void halCountAllocation() {
+  if (!halCountedTaskCount) {
+    return;
+  }
+
+  const TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+  for (int i = 0; i < HAL_COUNTED_TASKS; i++) {
+    if (halCountedTasks[i].task == task) {
+      halCountedTasks[i].count++;
+      return;
+    }
+  }
+}
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *data, size_t size);
+void *__real_heap_caps_malloc(size_t size, uint32_t caps);
+void *__real_heap_caps_calloc(size_t count, size_t size, uint32_t caps);
+void *__real_heap_caps_realloc(void *data, size_t size, uint32_t caps);
+
+void *__wrap_malloc(size_t size) {
+  halCountAllocation();
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  halCountAllocation();
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *data, size_t size) {
+  halCountAllocation();
+  return __real_realloc(data, size);
+}
+
+void *__wrap_heap_caps_malloc(size_t size, uint32_t caps) {
+  halCountAllocation();
+  return __real_heap_caps_malloc(size, caps);
+}
+
+void *__wrap_heap_caps_calloc(size_t count, size_t size, uint32_t caps) {
+  halCountAllocation();
+  return __real_heap_caps_calloc(count, size, caps);
+}
+
+void *__wrap_heap_caps_realloc(void *data, size_t size, uint32_t caps) {
+  halCountAllocation();
+  return __real_heap_caps_realloc(data, size, caps);
+}
+}
+
+// Allocations made by the calling task so far. The first call starts counting for the task;
+// past HAL_COUNTED_TASKS tasks it stays 0
+inline uint32_t halTaskAllocations() {
+  const TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  int free = -1;
+
+  portENTER_CRITICAL(&halCountedTasksMux);
+
+  for (int i = 0; i < HAL_COUNTED_TASKS; i++) {
+    if (halCountedTasks[i].task == task) {
+      portEXIT_CRITICAL(&halCountedTasksMux);
+      return halCountedTasks[i].count;
+    }
+
+    if (!halCountedTasks[i].task && free < 0) {
+      free = i;
+    }
+  }
+
+  if (free >= 0) {
+    halCountedTasks[free].count = 0;
+    halCountedTasks[free].task = task;
+    halCountedTaskCount++;
+  }
+
+  portEXIT_CRITICAL(&halCountedTasksMux);
+
+  return 0;
+}
+
+// Gives the calling task's slot back, for tasks that end
+inline void halForgetTaskAllocations() {
+  const TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+  portENTER_CRITICAL(&halCountedTasksMux);
+
+  for (int i = 0; i < HAL_COUNTED_TASKS; i++) {
+    if (halCountedTasks[i].task == task) {
+      halCountedTasks[i].task = nullptr;
+      halCountedTaskCount--;
+    }
+  }
+
+  portEXIT_CRITICAL(&halCountedTasksMux);
+}
+
+// PSRAM when there is any, release with free()
+inline void *halAllocLarge(size_t size) {
+  void *data = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+
+  return data ? data : malloc(size);
+}
+
+// LittleFS is mounted into the VFS, so stdio and dirent work below this path
+inline const char *halStorageRoot() {
+  return "/littlefs";
+}
+
+inline size_t halStorageFree() {
+  return LittleFS.totalBytes() - LittleFS.usedBytes();
+}
@@ -0,0 +1,798 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Linux side of the HAL for [env:native]: simulated PWM, GPIO and servo outputs, a camera
+// that replays JPEG files from disk, plus the small part of the Arduino core and FreeRTOS
+// that the car code relies on, emulated with std::thread
+
+// ===================
+// Arduino core subset
+// ===================
+#define OUTPUT 0x03
+#define INPUT 0x01
+#define HIGH 0x1
+#define LOW 0x0
+#define IRAM_ATTR
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+inline uint64_t halNowUs() {
+  static const auto start = std::chrono::steady_clock::now();
+
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline long map(long x, long inMin, long inMax, long outMin, long outMax) {
+  return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+inline unsigned long millis() {
+  return halNowUs() / 1000;
+}
+
+inline void delay(uint32_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+class SimSerial {
+public:
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+    va_list args;
+    va_start(args, format);
+    int written = vprintf(format, args);
+    va_end(args);
+
+    return written > 0 ? written : 0;
+  }
+
+  size_t print(const char *text) {
+    return fputs(text, stdout);
+  }
+
+  size_t println(const char *text = "") {
+    return puts(text);
+  }
+
+  size_t write(const uint8_t *data, size_t length) {
+    return fwrite(data, 1, length, stdout);
+  }
+};
+
+static SimSerial Serial;
+
+// ===================
+// FreeRTOS subset
+// ===================
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portTICK_PERIOD_MS 1
+#define portMAX_DELAY 0xFFFFFFFFUL
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define configMAX_PRIORITIES 25
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+struct SimTask {
+  std::mutex lock;
+  std::condition_variable wake;
+  uint32_t notifications = 0;
+};
+
+typedef SimTask *TaskHandle_t;
+typedef std::timed_mutex *SemaphoreHandle_t;
+
+struct portMUX_TYPE {
+  std::mutex lock;
+};
+
+#define portMUX_INITIALIZER_UNLOCKED \
+  {}
+
+inline void portENTER_CRITICAL(portMUX_TYPE *mux) {
+  mux->lock.lock();
+}
+
+inline void portEXIT_CRITICAL(portMUX_TYPE *mux) {
+  mux->lock.unlock();
+}
+
+inline SimTask *&simCurrentTask() {
+  thread_local SimTask *task = nullptr;
+
+  return task;
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() {
+  if (!simCurrentTask()) {
+    simCurrentTask() = new SimTask();
+  }
+
+  return simCurrentTask();
+}
+
+// Priorities and core affinity are ignored, every task is a detached thread
+inline BaseType_t xTaskCreatePinnedToCore(void (*task)(void *), const char *name, uint32_t stackDepth, void *param,
+                                          UBaseType_t priority, TaskHandle_t *handle, BaseType_t core) {
+  SimTask *created = new SimTask();
+
+  if (handle) {
+    *handle = created;
+  }
+
+  std::thread([task, param, created]() {
+    simCurrentTask() = created;
+    task(param);
+  }).detach();
+
+  return pdPASS;
+}
+
+inline BaseType_t xTaskCreate(void (*task)(void *), const char *name, uint32_t stackDepth, void *param,
+                              UBaseType_t priority, TaskHandle_t *handle) {
+  return xTaskCreatePinnedToCore(task, name, stackDepth, param, priority, handle, tskNO_AFFINITY);
+}
+
+inline void vTaskDelete(TaskHandle_t task) {
+  pthread_exit(nullptr);
+}
+
+inline TickType_t xTaskGetTickCount() {
+  return halNowUs() / 1000;
+}
+
+inline void vTaskDelay(TickType_t ticks) {
+  delay(ticks);
+}
+
+inline void vTaskDelayUntil(TickType_t *previousWake, TickType_t increment) {
+  *previousWake += increment;
+  const TickType_t now = xTaskGetTickCount();
+
+  if (*previousWake > now) {
+    delay(*previousWake - now);
+  }
+}
+
+inline BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  std::lock_guard<std::mutex> guard(task->lock);
+  task->notifications++;
+  task->wake.notify_one();
+
+  return pdPASS;
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks) {
+  SimTask *task = xTaskGetCurrentTaskHandle();
+  std::unique_lock<std::mutex> guard(task->lock);
+  auto notified = [task]() { return task->notifications > 0; };
+
+  if (ticks == portMAX_DELAY) {
+    task->wake.wait(guard, notified);
+  } else {
+    task->wake.wait_for(guard, std::chrono::milliseconds(ticks), notified);
+  }
+
+  const uint32_t value = task->notifications;
+
+  if (value) {
+    task->notifications = clearOnExit ? 0 : value - 1;
+  }
+
+  return value;
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex() {
+  return new std::timed_mutex();
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t ticks) {
+  if (ticks == portMAX_DELAY) {
+    mutex->lock();
+
+    return pdTRUE;
+  }
+
+  return mutex->try_lock_for(std::chrono::milliseconds(ticks)) ? pdTRUE : pdFALSE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex) {
+  mutex->unlock();
+
+  return pdTRUE;
+}
+
+// ===================
+// GPIO, PWM and servo
+// ===================
+#define SIM_PWM_CHANNELS 16
+#define SIM_GPIO_PINS 40
+
+struct SimOutputs {
+  uint8_t pinModes[SIM_GPIO_PINS];
+  uint8_t pins[SIM_GPIO_PINS];
+  uint32_t pwmDuty[SIM_PWM_CHANNELS];
+  uint32_t pwmWrites[SIM_PWM_CHANNELS];
+};
+
+inline SimOutputs &simOutputs() {
+  static SimOutputs outputs = {};
+
+  return outputs;
+}
+
+inline void halPinMode(int pin, int mode) {
+  if (pin >= 0 && pin < SIM_GPIO_PINS) {
+    simOutputs().pinModes[pin] = mode;
+  }
+}
+
+inline void halDigitalWrite(int pin, int value) {
+  if (pin >= 0 && pin < SIM_GPIO_PINS) {
+    simOutputs().pins[pin] = value;
+  }
+}
+
+inline void halPwmSetup(uint8_t channel, uint32_t frequency, uint8_t resolutionBits) {
+}
+
+inline void halPwmAttach(int pin, uint8_t channel) {
+}
+
+inline void halPwmWrite(uint8_t channel, uint32_t duty) {
+  if (channel < SIM_PWM_CHANNELS) {
+    simOutputs().pwmDuty[channel] = duty;
+    simOutputs().pwmWrites[channel]++;
+  }
+}
+
+// Same interface as ServoESP32, records the last pulse instead of driving a pin
+class HalServo {
+public:
+  HalServo()
+      : _minUs(544),
+        _maxUs(2400),
+        _pulseUs(0),
+        _writes(0) {}
+
+  bool attach(int pin, int channel = -1, int minAngle = 0, int maxAngle = 180, int minPulseWidthUs = 544, int maxPulseWidthUs = 2400) {
+    _minUs = minPulseWidthUs;
+    _maxUs = maxPulseWidthUs;
+
+    return true;
+  }
+
+  void write(int degrees) {
+    writeMicroseconds(map(constrain(degrees, 0, 180), 0, 180, _minUs, _maxUs));
+  }
+
+  void writeMicroseconds(int pulseUs) {
+    _pulseUs = pulseUs;
+    _writes++;
+  }
+
+  int readMicroseconds() const {
+    return _pulseUs;
+  }
+
+  uint32_t writes() const {
+    return _writes;
+  }
+
+private:
+  int _minUs;
+  int _maxUs;
+  int _pulseUs;
+  uint32_t _writes;
+};
+
+// Same interface as HalEsp32's esp_timer wrapper, one thread per timer. The thread's state
+// is never freed, like SimTask, so exit() does not pull it from under a sleeping timer
+class HalPeriodicTimer {
+public:
+  HalPeriodicTimer()
+      : _state(nullptr) {}
+
+  bool begin(void (*callback)(void *), void *arg, const char *name) {
+    State *state = new State();
+    state->callback = callback;
+    state->arg = arg;
+    _state = state;
+
+    std::thread([state]() { run(state); }).detach();
+
+    return true;
+  }
+
+  bool start(uint32_t periodUs) {
+    if (!_state) {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> guard(_state->lock);
+
+    if (!_state->running) {
+      _state->periodUs = periodUs;
+      _state->running = true;
+      _state->wake.notify_one();
+    }
+
+    return true;
+  }
+
+  void stop() {
+    if (_state) {
+      std::lock_guard<std::mutex> guard(_state->lock);
+      _state->running = false;
+    }
+  }
+
+  bool running() const {
+    return _state && _state->running;
+  }
+
+private:
+  struct State {
+    void (*callback)(void *) = nullptr;
+    void *arg = nullptr;
+    uint32_t periodUs = 0;
+    volatile bool running = false;
+    std::mutex lock;
+    std::condition_variable wake;
+  };
+
+  State *_state;
+
+  static void run(State *state) {
+    std::unique_lock<std::mutex> guard(state->lock);
+
+    for (;;) {
+      state->wake.wait(guard, [state]() { return state->running; });
+
+      // esp_timer keeps the period from the start, not from the end of the callback
+      auto next = std::chrono::steady_clock::now();
+
+      while (state->running) {
+        next += std::chrono::microseconds(state->periodUs);
+        guard.unlock();
+        std::this_thread::sleep_until(next);
+        state->callback(state->arg);
+        guard.lock();
+      }
+    }
+  }
+};
+
+// ===================
+// Camera
+// ===================
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+typedef enum {
+  PIXFORMAT_RGB565,
+  PIXFORMAT_YUV422,
+  PIXFORMAT_YUV420,
+  PIXFORMAT_GRAYSCALE,
+  PIXFORMAT_JPEG,
+  PIXFORMAT_RGB888,
+  PIXFORMAT_RAW,
+  PIXFORMAT_RGB444,
+  PIXFORMAT_RGB555,
+} pixformat_t;
+
+typedef enum {
+  FRAMESIZE_96X96,
+  FRAMESIZE_QQVGA,
+  FRAMESIZE_QCIF,
+  FRAMESIZE_HQVGA,
+  FRAMESIZE_240X240,
+  FRAMESIZE_QVGA,
+  FRAMESIZE_CIF,
+  FRAMESIZE_HVGA,
+  FRAMESIZE_VGA,
+  FRAMESIZE_SVGA,
+  FRAMESIZE_XGA,
+  FRAMESIZE_HD,
+  FRAMESIZE_SXGA,
+  FRAMESIZE_UXGA,
+  FRAMESIZE_FHD,
+  FRAMESIZE_P_HD,
+  FRAMESIZE_P_3MP,
+  FRAMESIZE_QXGA,
+  FRAMESIZE_QHD,
+  FRAMESIZE_WQXGA,
+  FRAMESIZE_P_FHD,
+  FRAMESIZE_QSXGA,
+  FRAMESIZE_INVALID
+} framesize_t;
+
+typedef enum { LEDC_TIMER_0 } ledc_timer_t;
+typedef enum { LEDC_CHANNEL_0 } ledc_channel_t;
+typedef enum { CAMERA_GRAB_WHEN_EMPTY, CAMERA_GRAB_LATEST } camera_grab_mode_t;
+typedef enum { CAMERA_FB_IN_PSRAM, CAMERA_FB_IN_DRAM } camera_fb_location_t;
+
+typedef struct {
+  int pin_pwdn;
+  int pin_reset;
+  int pin_xclk;
+  int pin_sscb_sda;
+  int pin_sscb_scl;
+  int pin_d7;
+  int pin_d6;
+  int pin_d5;
+  int pin_d4;
+  int pin_d3;
+  int pin_d2;
+  int pin_d1;
+  int pin_d0;
+  int pin_vsync;
+  int pin_href;
+  int pin_pclk;
+  int xclk_freq_hz;
+  ledc_timer_t ledc_timer;
+  ledc_channel_t ledc_channel;
+  pixformat_t pixel_format;
+  framesize_t frame_size;
+  int jpeg_quality;
+  size_t fb_count;
+  camera_fb_location_t fb_location;
+  camera_grab_mode_t grab_mode;
+} camera_config_t;
+
+typedef struct {
+  uint8_t *buf;
+  size_t len;
+  size_t width;
+  size_t height;
+  pixformat_t format;
+  struct timeval timestamp;
+} camera_fb_t;
+
+typedef struct {
+  framesize_t framesize;
+  uint8_t quality;
+} camera_status_t;
+
+typedef struct {
+  const uint16_t width;
+  const uint16_t height;
+} resolution_info_t;
+
+// The driver's resolution table, frames are stamped with the sensor's current framesize
+inline const resolution_info_t resolution[FRAMESIZE_INVALID] = {
+    {96, 96}, {160, 120}, {176, 144}, {240, 176}, {240, 240}, {320, 240}, {400, 296}, {480, 320},
+    {640, 480}, {800, 600}, {1024, 768}, {1280, 720}, {1280, 1024}, {1600, 1200}, {1920, 1080},
+    {720, 1280}, {864, 1536}, {2048, 1536}, {2560, 1440}, {2560, 1600}, {1080, 1920}, {2560, 1920}};
+
+typedef struct _sensor sensor_t;
+
+struct _sensor {
+  camera_status_t status;
+  pixformat_t pixformat;
+  int (*set_framesize)(sensor_t *sensor, framesize_t framesize);
+  int (*set_quality)(sensor_t *sensor, int quality);
+  int (*set_pixformat)(sensor_t *sensor, pixformat_t format);
+};
+
+#define SIM_CAMERA_DEFAULT_FPS 25
+// Frame structs handed out at once, the driver's fb_count never gets near it
+#define SIM_CAMERA_MAX_FBS 12
+
+// Replays the *.jpg files of $CAR_SIM_FRAMES (default ./frames) in name order, in a loop,
+// at $CAR_SIM_FPS frames per second. Without files a small synthetic JPEG is served.
+// $CAR_SIM_CAMERA_MAX_FRAMESIZE makes init fail above that framesize, as the driver does when
+// the buffers do not fit.
+// In RGB565 and grayscale modes a raw diagonal gradient of the sensor's size is served instead
+struct SimCamera {
+  std::mutex lock;
+  std::vector<std::vector<uint8_t>> frames;
+  std::vector<uint8_t> raw;
+  camera_fb_t fbs[SIM_CAMERA_MAX_FBS]; // preallocated like the driver's, fb_get does not allocate
+  bool fbInUse[SIM_CAMERA_MAX_FBS];
+  size_t next;
+  uint32_t periodUs;
+  uint64_t nextFrameUs;
+  sensor_t sensor;
+};
+
+inline SimCamera &simCamera() {
+  static SimCamera camera;
+
+  return camera;
+}
+
+inline int simSetFramesize(sensor_t *sensor, framesize_t framesize) {
+  sensor->status.framesize = framesize;
+
+  return 0;
+}
+
+inline int simSetQuality(sensor_t *sensor, int quality) {
+  sensor->status.quality = quality;
+
+  return 0;
+}
+
+inline int simSetPixformat(sensor_t *sensor, pixformat_t format) {
+  sensor->pixformat = format;
+
+  return 0;
+}
+
+inline void simLoadFrames(SimCamera &camera, const char *directory) {
+  DIR *dir = opendir(directory);
+  std::vector<std::string> names;
+
+  if (dir) {
+    while (dirent *entry = readdir(dir)) {
+      const size_t length = strlen(entry->d_name);
+
+      if (length > 4 && strcmp(entry->d_name + length - 4, ".jpg") == 0) {
+        names.push_back(std::string(directory) + "/" + entry->d_name);
+      }
+    }
+
+    closedir(dir);
+  }
+
+  std::sort(names.begin(), names.end());
+
+  for (const std::string &name : names) {
+    FILE *file = fopen(name.c_str(), "rb");
+
+    if (!file) {
+      continue;
+    }
+
+    std::vector<uint8_t> data;
+    uint8_t chunk[4096];
+    size_t read;
+
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+      data.insert(data.end(), chunk, chunk + read);
+    }
+
+    fclose(file);
+    camera.frames.push_back(data);
+  }
+
+  if (camera.frames.empty()) {
+    // SOI, filler of a typical VGA frame size, EOI
+    std::vector<uint8_t> synthetic(24 * 1024, 0);
+    synthetic[0] = 0xFF;
+    synthetic[1] = 0xD8;
+    synthetic[synthetic.size() - 2] = 0xFF;
+    synthetic[synthetic.size() - 1] = 0xD9;
+    camera.frames.push_back(synthetic);
+  }
+}
+
+inline esp_err_t halCameraInit(const camera_config_t *config) {
+  SimCamera &camera = simCamera();
+  const char *directory = getenv("CAR_SIM_FRAMES");
+  const char *fps = getenv("CAR_SIM_FPS");
+  const char *maxFrameSize = getenv("CAR_SIM_CAMERA_MAX_FRAMESIZE");
+
+  if (maxFrameSize && config->frame_size > atoi(maxFrameSize)) {
+    printf("SimCamera: %d does not fit\n", config->frame_size);
+    return ESP_FAIL;
+  }
+
+  std::lock_guard<std::mutex> guard(camera.lock);
+
+  camera.frames.clear();
+  simLoadFrames(camera, directory ? directory : "frames");
+
+  camera.next = 0;
+  camera.periodUs = 1000000 / (fps && atoi(fps) > 0 ? atoi(fps) : SIM_CAMERA_DEFAULT_FPS);
+  camera.nextFrameUs = halNowUs();
+  camera.sensor.status.framesize = config->frame_size;
+  camera.sensor.status.quality = config->jpeg_quality;
+  camera.sensor.pixformat = config->pixel_format;
+  camera.sensor.set_framesize = simSetFramesize;
+  camera.sensor.set_quality = simSetQuality;
+  camera.sensor.set_pixformat = simSetPixformat;
+
+  printf("SimCamera: %u frame(s) at %u fps\n", (unsigned)camera.frames.size(), 1000000 / camera.periodUs);
+
+  return ESP_OK;
+}
+
+// Blocks until the next frame is due, like the driver waiting for VSYNC
+inline camera_fb_t *halCameraGet() {
+  SimCamera &camera = simCamera();
+  uint64_t dueUs;
+
+  {
+    std::lock_guard<std::mutex> guard(camera.lock);
+    dueUs = camera.nextFrameUs;
+    camera.nextFrameUs = std::max<uint64_t>(dueUs + camera.periodUs, halNowUs());
+  }
+
+  const uint64_t now = halNowUs();
+
+  if (dueUs > now) {
+    std::this_thread::sleep_for(std::chrono::microseconds(dueUs - now));
+  }
+
+  std::lock_guard<std::mutex> guard(camera.lock);
+  camera_fb_t *fb = nullptr;
+
+  for (int i = 0; i < SIM_CAMERA_MAX_FBS && !fb; i++) {
+    if (!camera.fbInUse[i]) {
+      camera.fbInUse[i] = true;
+      fb = &camera.fbs[i];
+    }
+  }
+
+  if (!fb) {
+    return nullptr;
+  }
+
+  std::vector<uint8_t> &frame = camera.frames[camera.next];
+  camera.next = (camera.next + 1) % camera.frames.size();
+  fb->width = resolution[camera.sensor.status.framesize].width;
+  fb->height = resolution[camera.sensor.status.framesize].height;
+  fb->format = camera.sensor.pixformat == PIXFORMAT_RGB565 || camera.sensor.pixformat == PIXFORMAT_GRAYSCALE
+                   ? camera.sensor.pixformat
+                   : PIXFORMAT_JPEG;
+
+  if (fb->format == PIXFORMAT_JPEG) {
+    fb->buf = frame.data();
+    fb->len = frame.size();
+  } else {
+    const size_t bytesPerPixel = fb->format == PIXFORMAT_RGB565 ? 2 : 1;
+    const size_t length = fb->width * fb->height * bytesPerPixel;
+
+    if (camera.raw.size() != length) {
+      camera.raw.resize(length);
+
+      for (size_t pixel = 0; pixel < fb->width * fb->height; pixel++) {
+        const uint8_t value = (pixel % fb->width + pixel / fb->width) * 255 / (fb->width + fb->height);
+
+        if (bytesPerPixel == 1) {
+          camera.raw[pixel] = value;
+        } else {
+          // big-endian RGB565, like the sensor sends it
+          const uint16_t rgb = (value >> 3) << 11 | (value >> 2) << 5 | value >> 3;
+          camera.raw[pixel * 2] = rgb >> 8;
+          camera.raw[pixel * 2 + 1] = rgb & 0xFF;
+        }
+      }
+    }
+
+    fb->buf = camera.raw.data();
+    fb->len = length;
+  }
+
+  // esp32-camera stamps frames with esp_timer time, not wall clock
+  fb->timestamp.tv_sec = dueUs / 1000000;
+  fb->timestamp.tv_usec = dueUs % 1000000;
+
+  return fb;
+}
+
+inline esp_err_t halCameraDeinit() {
+  return ESP_OK;
+}
+
+inline void halCameraReturn(camera_fb_t *fb) {
+  SimCamera &camera = simCamera();
+  std::lock_guard<std::mutex> guard(camera.lock);
+
+  camera.fbInUse[fb - camera.fbs] = false;
+}
+
+inline sensor_t *halCameraSensor() {
+  return &simCamera().sensor;
+}
+
+// ===================
+// Memory
+// ===================
+// Nominal figures of the AI Thinker module after boot, there is nothing to measure on the host
+#define SIM_PSRAM_SIZE (4 * 1024 * 1024)
+#define SIM_INTERNAL_HEAP (160 * 1024)
+
+inline size_t halFreePsram() {
+  return SIM_PSRAM_SIZE;
+}
+
+inline size_t halFreeInternalHeap() {
+  return SIM_INTERNAL_HEAP;
+}
+
+inline size_t halLowestFreePsram() {
+  return SIM_PSRAM_SIZE;
+}
+
+inline size_t halLowestFreeInternalHeap() {
+  return SIM_INTERNAL_HEAP;
+}
+
+// Heap allocations per thread: malloc, calloc and realloc are interposed here, operator new
+// goes through malloc. Counting starts with the thread, there is nothing to register
+inline uint32_t &simThreadAllocations() {
+  thread_local uint32_t allocations = 0;
+
+  return allocations;
+}
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *data, size_t size);
+
+extern "C" void *malloc(size_t size) {
+  simThreadAllocations()++;
+
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+  simThreadAllocations()++;
+
+  return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *data, size_t size) {
+  simThreadAllocations()++;
+
+  return __libc_realloc(data, size);
+}
+
+inline uint32_t halTaskAllocations() {
+  return simThreadAllocations();
+}
+
+inline void halForgetTaskAllocations() {
+}
+
+inline void *halAllocLarge(size_t size) {
+  return malloc(size);
+}
+
+// ===================
+// Storage
+// ===================
+// $CAR_SIM_STORAGE (default ./storage) stands in for the LittleFS partition
+inline const char *halStorageRoot() {
+  const char *root = getenv("CAR_SIM_STORAGE");
+
+  return root ? root : "storage";
+}
+
+inline size_t halStorageFree() {
+  struct statvfs stats;
+
+  if (statvfs(halStorageRoot(), &stats) != 0) {
+    return 0;
+  }
+
+  return (size_t)stats.f_bavail * stats.f_frsize;
+}
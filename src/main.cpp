@@ -16,11 +16,36 @@
 #define LED_PIN 33
 #define LEDC_CHANNEL 0
 #define LEDC_FREQ 5000
+#define CONTROL_PERIOD_MS 5
 
+EventLog eventLog;
+LatencyMetrics latencyMetrics;
 Car car;
 WiFiManager wm;
+LoopMonitor controlLoopMonitor;
+HeapWatermark controlHeap;
 bool mDNSStarted = false;
-extern bool isClientActive;
+extern std::atomic<bool> isClientActive;
+
+// Motor ramping, servo stepping and auto stop at a fixed period, away from WiFiManager and mDNS in loop()
+void controlTask(void *param) {
+  TickType_t lastWake = xTaskGetTickCount();
+  controlLoopMonitor.reset(CONTROL_PERIOD_MS * 1000, nowUs());
+  AllocationProbe probe;
+
+  probe.restart();
+
+  for (;;) {
+    vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(CONTROL_PERIOD_MS));
+    controlLoopMonitor.onWake(nowUs());
+
+    processControlCommands();
+    car.tick();
+
+    controlLoopMonitor.onDone(nowUs());
+    controlHeap.record(probe);
+  }
+}
 
 void ledTask(void *param) {
   unsigned long lastBlink = 0;
@@ -75,6 +100,7 @@ void setup() {
 
   Serial.begin(115200);
   Serial.setDebugOutput(true);
+  eventLog.begin();
 
   Serial.println("=== ESP32-CAM with WebSocket Flash Control ===");
   pinMode(33, OUTPUT);
@@ -110,6 +136,15 @@ void setup() {
 
   wm.autoConnect("WiFi Car");
 
+  xTaskCreatePinnedToCore(
+      controlTask,
+      "CarControl",
+      4096,
+      nullptr,
+      configMAX_PRIORITIES - 5,
+      nullptr,
+      1);
+
   startCarServer();
 
   blink(LED_PIN, 1, 1000); // successful boot indication
@@ -147,7 +182,6 @@ void setupMDNS() {
 }
 
 void loop() {
-  car.tick();
   wm.process();
 
   if (WiFi.status() == WL_CONNECTED && !mDNSStarted) {
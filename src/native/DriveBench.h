@@ -0,0 +1,151 @@
+#pragma once
+// Drive mixing check and control tick benchmark: `program drive [iterations]`
+//
+// Walks every throttle/steer pair of mixDrive and checks its curves: wheel speeds in range,
+// mirror symmetric in steer, negated by reversing the stick, monotonic in each input and full
+// speed whenever the stick is at its edge. Then drives a Car through the legacy directions and
+// checks the PWM its motors write is the duty the fixed direction methods wrote before.
+// Exits with 1 on the first failed check. Then times mixDrive and Car::drive plus Car::tick,
+// the work a drive command adds to the control task. The ramp itself runs on the RampEngine's
+// timer, RampBench.h measures it
+#include "../Car.h"
+#include "../CarProtocol.h"
+#include "../DriveMixer.h"
+
+#define DRIVE_BENCH_DEFAULT_ITERATIONS 200000
+
+static bool checkDrive(bool ok, const char *what, int throttle, int steer) {
+  if (!ok) {
+    const WheelSpeeds speeds = mixDrive(throttle, steer);
+    printf("FAIL %s at throttle %d steer %d: left %d right %d\n", what, throttle, steer, speeds.left, speeds.right);
+  }
+
+  return ok;
+}
+
+static bool checkDriveCurves() {
+  for (int t = -DRIVE_INPUT_MAX; t <= DRIVE_INPUT_MAX; t++) {
+    for (int s = -DRIVE_INPUT_MAX; s <= DRIVE_INPUT_MAX; s++) {
+      const WheelSpeeds speeds = mixDrive(t, s);
+      const WheelSpeeds mirrored = mixDrive(t, -s);
+      const WheelSpeeds reversed = mixDrive(-t, -s);
+      const int fastest = std::max(abs(speeds.left), abs(speeds.right));
+      bool ok = checkDrive(abs(speeds.left) <= DRIVE_SPEED_MAX && abs(speeds.right) <= DRIVE_SPEED_MAX, "range", t, s);
+
+      ok = ok && checkDrive(mirrored.left == speeds.right && mirrored.right == speeds.left, "mirror", t, s);
+      ok = ok && checkDrive(reversed.left == -speeds.left && reversed.right == -speeds.right, "reverse", t, s);
+      ok = ok && checkDrive((t || s) == (fastest > 0), "dead stick", t, s);
+
+      // at the edge of the stick the faster wheel runs flat out
+      if (abs(t) == DRIVE_INPUT_MAX || abs(s) == DRIVE_INPUT_MAX) {
+        ok = ok && checkDrive(fastest >= DRIVE_SPEED_MAX - 1, "full stick", t, s);
+      }
+
+      if (s < DRIVE_INPUT_MAX) {
+        const WheelSpeeds right = mixDrive(t, s + 1);
+        ok = ok && checkDrive(right.left >= speeds.left && right.right <= speeds.right, "steer monotonic", t, s);
+      }
+
+      if (t < DRIVE_INPUT_MAX) {
+        const WheelSpeeds faster = mixDrive(t + 1, s);
+        ok = ok && checkDrive(faster.left >= speeds.left && faster.right >= speeds.right, "throttle monotonic", t, s);
+      }
+
+      if (!ok) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+// The duty on a motor's pins, signed as Motor::speed
+static int motorPwm(int channel1, int channel2) {
+  return (int)simOutputs().pwmDuty[channel1] - (int)simOutputs().pwmDuty[channel2];
+}
+
+static bool checkLegacyPwm(Car &bench) {
+  // motorMax and motorMax / 1.5 as the old direction methods set them, and the 170 raised to
+  // the motors' minPwm of 200 by their constrain
+  static const int16_t legacyPwm[OP_BACKWARD_RIGHT + 1][2] = {
+      {0, 0}, {255, 255}, {-255, -255}, {-255, 255}, {255, -255}, {200, 255}, {255, 200}, {-200, -255}, {-255, -200}};
+  RampEngine &ramps = bench.rampEngine();
+
+  for (int op = OP_STOP; op <= OP_BACKWARD_RIGHT; op++) {
+    const int t = legacyDriveVectors[op][0];
+    const int s = legacyDriveVectors[op][1];
+
+    bench.drive(t, s);
+
+    // to the end of the ramp, then let a tick the timer had started finish its writes
+    ramps.tick(nowUs() + 10000000);
+    delay(5);
+
+    const int left = motorPwm(LEFT_MOTOR_PWM_CHANNEL_1, LEFT_MOTOR_PWM_CHANNEL_2);
+    const int right = motorPwm(RIGHT_MOTOR_PWM_CHANNEL_1, RIGHT_MOTOR_PWM_CHANNEL_2);
+
+    if (left != legacyPwm[op][0] || right != legacyPwm[op][1]) {
+      printf("FAIL legacy direction %d at throttle %d steer %d: PWM left %d right %d, was %d %d\n", op, t, s, left,
+             right, legacyPwm[op][0], legacyPwm[op][1]);
+      return false;
+    }
+  }
+
+  bench.stop();
+
+  return true;
+}
+
+static int runDriveBench(uint32_t iterations) {
+  if (!checkDriveCurves()) {
+    return 1;
+  }
+
+  printf("Mixing curves OK, %d x %d inputs\n", 2 * DRIVE_INPUT_MAX + 1, 2 * DRIVE_INPUT_MAX + 1);
+  printf("Full throttle, steer -100..100: ");
+
+  for (int s = -DRIVE_INPUT_MAX; s <= DRIVE_INPUT_MAX; s += 25) {
+    const WheelSpeeds speeds = mixDrive(DRIVE_INPUT_MAX, s);
+    printf("%s%d/%d", s > -DRIVE_INPUT_MAX ? " " : "", speeds.left, speeds.right);
+  }
+
+  printf("\n");
+
+  volatile int sink = 0;
+  uint64_t start = nowUs();
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    const WheelSpeeds speeds = mixDrive((int)(i % 201) - 100, (int)(i * 7 % 201) - 100);
+    sink += speeds.left - speeds.right;
+  }
+
+  const uint64_t mixUs = nowUs() - start;
+  Car bench;
+  uint64_t maxUs = 0;
+
+  bench.init();
+
+  if (!checkLegacyPwm(bench)) {
+    return 1;
+  }
+
+  printf("Legacy directions OK, on their old PWM\n");
+
+  start = nowUs();
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    const uint64_t tickStart = nowUs();
+    bench.drive((int)(i % 201) - 100, (int)(i * 7 % 201) - 100);
+    bench.tick();
+    maxUs = std::max(maxUs, nowUs() - tickStart);
+  }
+
+  const uint64_t tickUs = nowUs() - start;
+
+  bench.stop();
+  printf("mixDrive: %.1f ns/call\n", 1000.0 * mixUs / iterations);
+  printf("Car::drive + Car::tick: %.1f ns/call, max %lluus\n", 1000.0 * tickUs / iterations, (unsigned long long)maxUs);
+
+  return 0;
+}
@@ -0,0 +1,47 @@
+#pragma once
+// Raw frame encoder benchmark: `program encode [runs]`
+//
+// Times JpegEncoder on the synthetic test pattern at the stream's usual sizes. The esp32-camera
+// frame2jpg path only exists on the device, GET /encoder_bench on port 81 compares both there
+#include "../JpegEncoder.h"
+#include <vector>
+
+#define ENCODER_BENCH_DEFAULT_RUNS 50
+
+static int runEncoderBench(uint32_t runs) {
+  static const framesize_t sizes[] = {FRAMESIZE_QVGA, FRAMESIZE_VGA};
+  static const pixformat_t formats[] = {PIXFORMAT_RGB565, PIXFORMAT_GRAYSCALE};
+  JpegEncoder encoder;
+
+  for (framesize_t size : sizes) {
+    const int width = resolution[size].width;
+    const int height = resolution[size].height;
+
+    for (pixformat_t format : formats) {
+      const size_t rawLength = width * height * (format == PIXFORMAT_RGB565 ? 2 : 1);
+      std::vector<uint8_t> pixels(rawLength);
+      std::vector<uint8_t> out(width * height);
+      fillEncoderTestPattern(pixels.data(), width, height, format);
+
+      uint64_t totalUs = 0;
+      uint64_t maxUs = 0;
+      size_t length = 0;
+
+      for (uint32_t i = 0; i < runs; i++) {
+        const uint64_t start = nowUs();
+        length = encoder.encode(pixels.data(), width, height, format, FRAME_ENCODE_QUALITY, out.data(), out.size());
+        const uint64_t elapsed = nowUs() - start;
+        totalUs += elapsed;
+        maxUs = std::max(maxUs, elapsed);
+      }
+
+      const uint64_t averageUs = runs ? totalUs / runs : 0;
+
+      printf("%ux%u %s: %u bytes, avg %lluus max %lluus, %.1f MB/s raw\n", width, height,
+             format == PIXFORMAT_RGB565 ? "RGB565" : "GRAYSCALE", (unsigned)length, (unsigned long long)averageUs,
+             (unsigned long long)maxUs, averageUs ? (double)rawLength / averageUs : 0.0);
+    }
+  }
+
+  return 0;
+}
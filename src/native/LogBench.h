@@ -0,0 +1,318 @@
+#pragma once
+// Event log cost and ordering check: `program log [iterations]`
+// Event log decoder: `program log-decode [capture]`
+//
+// Times what a log call costs the task that makes it: logEvent below the level, logEvent
+// queued, and the Serial.printf it replaced, formatted and written to /dev/null. The UART
+// is not there on the host: on the car a printf returns once its line fits in the UART's
+// transmit buffer, so when logging goes on faster than 115200 baud drains it, every call waits
+// about the time its line takes on the wire. That time is worked out from the line length.
+// The drain task is timed both ways, writing raw records and formatting lines on the car.
+// Then several producer threads log into one ring while a consumer drains it, as the drain
+// task does: every event must come out or be counted dropped, each producer's in order, and
+// raw records mixed into text must decode back to the same events.
+// Exits with 1 when one is lost, out of order or decoded wrong
+//
+// log-decode reads what the car wrote to its UART, from a capture file or stdin, e.g.
+//   stty -F /dev/ttyUSB0 115200 raw && .pio/build/native/program log-decode /dev/ttyUSB0
+// Text passes through, raw records are printed as the lines the car would have formatted
+#include "../EventLog.h"
+#include <thread>
+
+#define LOG_BENCH_DEFAULT_ITERATIONS 1000000
+#define LOG_BENCH_PRODUCERS 3
+#define LOG_BENCH_BURST 64
+#define LOG_BENCH_BURST_GAP_US 100
+// 8N1, 10 bits on the wire per byte
+#define LOG_BENCH_UART_BAUD 115200
+
+static double logBenchNsPerCall(uint64_t startUs, uint32_t calls) {
+  return (nowUs() - startUs) * 1000.0 / calls;
+}
+
+struct LogDecodeCounts {
+  uint32_t records;
+  uint32_t corrupt;
+};
+
+// Text through as it is, records formatted. A NUL without a valid record after it is dropped
+// and the bytes after it are read again as text
+static LogDecodeCounts decodeLogStream(FILE *in, FILE *out) {
+  LogDecodeCounts counts = {0, 0};
+  uint8_t record[LOG_RECORD_SIZE];
+  LogEvent event;
+  char line[128];
+  size_t held = 0;
+  int c;
+
+  while ((c = fgetc(in)) != EOF) {
+    if (!held && c != 0x00) {
+      fputc(c, out);
+      continue;
+    }
+
+    record[held++] = c;
+
+    if (held == 2 && record[1] != LOG_RECORD_MAGIC) {
+      counts.corrupt++;
+      held = 0;
+
+      if (c == 0x00) {
+        record[held++] = c;
+      } else {
+        fputc(c, out);
+      }
+
+      continue;
+    }
+
+    if (held < LOG_RECORD_SIZE) {
+      continue;
+    }
+
+    held = 0;
+
+    if (!decodeLogRecord(record, event)) {
+      counts.corrupt++;
+      continue;
+    }
+
+    formatLogEvent(event, line, sizeof(line));
+    fputs(line, out);
+    counts.records++;
+  }
+
+  fflush(out);
+
+  return counts;
+}
+
+static int runLogDecode(const char *path) {
+  FILE *in = path ? fopen(path, "rb") : stdin;
+
+  if (!in) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return 1;
+  }
+
+  const LogDecodeCounts counts = decodeLogStream(in, stdout);
+
+  fprintf(stderr, "log-decode: %u records, %u corrupt\n", counts.records, counts.corrupt);
+
+  if (in != stdin) {
+    fclose(in);
+  }
+
+  return 0;
+}
+
+// Events written as records between lines of text, as the UART carries them, must come back
+// as the lines formatted on the car would have read
+static bool checkLogDecode(uint32_t events) {
+  FILE *capture = tmpfile();
+  FILE *decoded = tmpfile();
+  FILE *expected = tmpfile();
+  uint8_t record[LOG_RECORD_SIZE];
+  char line[128];
+  bool ok = capture && decoded && expected;
+
+  for (uint32_t i = 0; ok && i < events; i++) {
+    // ids past the table and values with NULs and newlines in their bytes
+    const LogEvent event = {i * 7919u, (uint16_t)(i % (EV_COUNT + 2)), (uint8_t)(i % 4), (int32_t)(i * 2654435761u),
+                            (int32_t)(0x0A000A00 ^ i)};
+
+    if (i % 3 == 0) {
+      fprintf(capture, "Text line %u\n", i);
+      fprintf(expected, "Text line %u\n", i);
+    }
+
+    encodeLogRecord(event, record);
+    fwrite(record, 1, sizeof(record), capture);
+    formatLogEvent(event, line, sizeof(line));
+    fputs(line, expected);
+  }
+
+  if (ok) {
+    rewind(capture);
+
+    const LogDecodeCounts counts = decodeLogStream(capture, decoded);
+    const long length = ftell(decoded);
+
+    rewind(decoded);
+    rewind(expected);
+
+    int a;
+    int b;
+
+    do {
+      a = fgetc(decoded);
+      b = fgetc(expected);
+    } while (a == b && a != EOF);
+
+    ok = a == b && counts.records == events && !counts.corrupt;
+    printf("Decode: %u records between text, %ld bytes out, %u corrupt, %s\n", counts.records, length, counts.corrupt,
+           ok ? "same as formatted on the car" : "DIFFERENT");
+  }
+
+  for (FILE *file : {capture, decoded, expected}) {
+    if (file) {
+      fclose(file);
+    }
+  }
+
+  if (!ok) {
+    printf("FAIL: records did not decode to the lines formatted on the car\n");
+  }
+
+  return ok;
+}
+
+static bool checkLogOrdering(uint32_t perProducer) {
+  EventLog ring;
+  std::thread producers[LOG_BENCH_PRODUCERS];
+  uint32_t next[LOG_BENCH_PRODUCERS] = {};
+  uint32_t popped = 0;
+  bool ordered = true;
+  std::atomic<int> running(LOG_BENCH_PRODUCERS);
+  LogEvent event;
+
+  for (int p = 0; p < LOG_BENCH_PRODUCERS; p++) {
+    producers[p] = std::thread([&ring, &running, p, perProducer]() {
+      for (uint32_t i = 0; i < perProducer; i++) {
+        ring.log(LOG_INFO, EV_COMMAND, p, i);
+
+        // in bursts, as commands and motor steps come: the ring fills at times, not always
+        if (i % LOG_BENCH_BURST == LOG_BENCH_BURST - 1) {
+          std::this_thread::sleep_for(std::chrono::microseconds(LOG_BENCH_BURST_GAP_US));
+        }
+      }
+
+      running--;
+    });
+  }
+
+  // a dropped event leaves a gap, never a step back
+  for (;;) {
+    const bool done = !running;
+
+    while (ring.pop(event)) {
+      const int p = event.a;
+
+      if (p < 0 || p >= LOG_BENCH_PRODUCERS || (uint32_t)event.b < next[p]) {
+        ordered = false;
+      } else {
+        next[p] = event.b + 1;
+      }
+
+      popped++;
+    }
+
+    if (done) {
+      break;
+    }
+  }
+
+  for (std::thread &producer : producers) {
+    producer.join();
+  }
+
+  const uint32_t produced = perProducer * LOG_BENCH_PRODUCERS;
+
+  printf("Ordering: %d producers, %u events, %u drained, %u dropped, %s\n", LOG_BENCH_PRODUCERS, produced, popped,
+         ring.dropped(), ordered ? "each producer's in order" : "OUT OF ORDER");
+
+  if (!ordered || popped + ring.dropped() != produced) {
+    printf("FAIL: events lost or out of order\n");
+    return false;
+  }
+
+  return true;
+}
+
+static int runLogBench(uint32_t iterations) {
+  static EventLog ring;
+  const uint32_t batch = EVENT_LOG_SIZE / 2;
+  FILE *null = fopen("/dev/null", "w");
+  uint64_t pushUs = 0;
+  uint64_t drainUs = 0;
+  uint64_t rawUs = 0;
+  uint32_t pushed = 0;
+  LogEvent event;
+  uint8_t record[LOG_RECORD_SIZE];
+  char line[128];
+
+  if (!null) {
+    return 1;
+  }
+
+  printf("\n=== Event log (%u calls each) ===\n", iterations);
+
+  // below the level, the motors' ramp steps at the default INFO
+  uint64_t start = nowUs();
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    ring.log(LOG_TRACE, EV_MOTOR_FORWARD, 2, i);
+  }
+
+  const double filteredNs = logBenchNsPerCall(start, iterations);
+
+  // queued, then drained between batches the way the drain task does it, every other batch
+  // written raw and formatted
+  for (bool raw = false; pushed < iterations; raw = !raw) {
+    start = nowUs();
+
+    for (uint32_t i = 0; i < batch; i++) {
+      ring.log(LOG_INFO, EV_MOTOR_FORWARD, 2, i);
+    }
+
+    pushUs += nowUs() - start;
+    pushed += batch;
+    start = nowUs();
+
+    while (ring.pop(event)) {
+      if (raw) {
+        encodeLogRecord(event, record);
+        fwrite(record, 1, sizeof(record), null);
+      } else {
+        formatLogEvent(event, line, sizeof(line));
+        fputs(line, null);
+      }
+    }
+
+    (raw ? rawUs : drainUs) += nowUs() - start;
+  }
+
+  const double queuedNs = pushUs * 1000.0 / pushed;
+  const double drainNs = drainUs * 2000.0 / pushed;
+  const double rawNs = rawUs * 2000.0 / pushed;
+
+  // what Motor::tick did before
+  start = nowUs();
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    fprintf(null, "Motor %d FORWARD - Speed: %d\n", 2, (int)(i & 0xFF));
+  }
+
+  const double printfNs = logBenchNsPerCall(start, iterations);
+  const int lineBytes = snprintf(line, sizeof(line), "Motor %d FORWARD - Speed: %d\n", 2, 200);
+  const double wireUs = lineBytes * 10 * 1000000.0 / LOG_BENCH_UART_BAUD;
+
+  fclose(null);
+
+  printf("logEvent below the level: %.1f ns per call\n", filteredNs);
+  printf("logEvent queued: %.1f ns per call, %u dropped\n", queuedNs, ring.dropped());
+  printf("Drain, raw record: %.1f ns per event, %d bytes on the wire, in the drain task\n", rawNs, LOG_RECORD_SIZE);
+  printf("Drain, format and write: %.1f ns per event, in the drain task with EVENT_LOG_TEXT\n", drainNs);
+  printf("Serial.printf, format and write: %.1f ns per call (%.0fx logEvent queued)\n", printfNs,
+         queuedNs > 0 ? printfNs / queuedNs : 0);
+  printf("Serial.printf on the car once the UART buffer is full: %d byte line, %.0f us per call at %u baud (%.0fx)\n",
+         lineBytes, wireUs, LOG_BENCH_UART_BAUD, queuedNs > 0 ? wireUs * 1000 / queuedNs : 0);
+
+  if (!checkLogOrdering(iterations / LOG_BENCH_PRODUCERS) || !checkLogDecode(10000)) {
+    return 1;
+  }
+
+  printf("Event log OK\n");
+
+  return 0;
+}
@@ -0,0 +1,129 @@
+#pragma once
+// Idle mode benchmark over recorded clips: `program motion <clip.mjpg>...`
+//
+// Clips are FrameRecorder segments, frames and timestamps come from the .idx next to the
+// .mjpg. Without an index the file is split at JPEG boundaries and timed at CAR_SIM_FPS.
+// Every frame goes through the MotionDetector and the stream's keepalive rule, as if the car
+// was parked for the whole clip, and the report shows what a viewer would not have been sent
+#include "../FrameRecorder.h"
+#include "../MotionDetector.h"
+#include <string>
+#include <vector>
+
+struct BenchFrame {
+  size_t offset;
+  size_t length;
+  uint64_t timestampUs;
+};
+
+static bool readClip(const char *path, std::vector<uint8_t> &data) {
+  FILE *file = fopen(path, "rb");
+
+  if (!file) {
+    return false;
+  }
+
+  uint8_t chunk[16 * 1024];
+  size_t read;
+
+  while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data.insert(data.end(), chunk, chunk + read);
+  }
+
+  fclose(file);
+
+  return true;
+}
+
+static void indexClip(const char *path, const std::vector<uint8_t> &data, uint32_t fps, std::vector<BenchFrame> &frames) {
+  std::string indexPath(path);
+  const size_t dot = indexPath.rfind('.');
+  indexPath = indexPath.substr(0, dot) + ".idx";
+
+  std::vector<uint8_t> index;
+
+  if (readClip(indexPath.c_str(), index)) {
+    const RecordIndexEntry *entries = (const RecordIndexEntry *)index.data();
+    const size_t count = index.size() / sizeof(RecordIndexEntry);
+
+    for (size_t i = 0; i < count; i++) {
+      if (entries[i].offset + entries[i].length <= data.size()) {
+        frames.push_back({entries[i].offset, entries[i].length, (uint64_t)entries[i].timestampMs * 1000});
+      }
+    }
+
+    return;
+  }
+
+  // entropy-coded data stuffs every 0xFF, so SOI and EOI only appear as frame boundaries
+  size_t start = SIZE_MAX;
+
+  for (size_t i = 0; i + 1 < data.size(); i++) {
+    if (data[i] != 0xFF) {
+      continue;
+    }
+
+    if (data[i + 1] == 0xD8 && start == SIZE_MAX) {
+      start = i;
+    } else if (data[i + 1] == 0xD9 && start != SIZE_MAX) {
+      frames.push_back({start, i + 2 - start, frames.size() * 1000000ULL / fps});
+      start = SIZE_MAX;
+    }
+  }
+}
+
+static int runMotionBench(int count, char **paths, uint32_t fps) {
+  uint64_t allBytes = 0;
+  uint64_t allSaved = 0;
+
+  for (int c = 0; c < count; c++) {
+    std::vector<uint8_t> data;
+    std::vector<BenchFrame> frames;
+
+    if (!readClip(paths[c], data)) {
+      printf("%s: cannot read\n", paths[c]);
+      continue;
+    }
+
+    indexClip(paths[c], data, fps, frames);
+
+    MotionDetector detector;
+    uint64_t lastSentUs = 0;
+    uint32_t sent = 0;
+    uint64_t bytes = 0;
+    uint64_t saved = 0;
+
+    for (size_t i = 0; i < frames.size(); i++) {
+      const BenchFrame &frame = frames[i];
+      const uint64_t scanStart = nowUs();
+      const bool changed = detector.onFrame(data.data() + frame.offset, frame.length, frame.timestampUs);
+      detector.addScanTime(nowUs() - scanStart);
+
+      bytes += frame.length;
+
+      if (!changed && i && frame.timestampUs - lastSentUs < IDLE_KEEPALIVE_MS * 1000ULL) {
+        saved += frame.length;
+        continue;
+      }
+
+      lastSentUs = frame.timestampUs;
+      sent++;
+    }
+
+    printf("%s: %u frames, %u changed, %u unreadable, %u sent, %llu of %llu KB saved (%.1f%%), "
+           "scan avg %uus max %uus\n",
+           paths[c], detector.frames(), detector.changed(), detector.failed(), sent,
+           (unsigned long long)(saved / 1024), (unsigned long long)(bytes / 1024),
+           bytes ? 100.0 * saved / bytes : 0.0, detector.averageScanUs(), detector.maxScanUs());
+
+    allBytes += bytes;
+    allSaved += saved;
+  }
+
+  if (count > 1) {
+    printf("Total: %llu of %llu KB saved (%.1f%%)\n", (unsigned long long)(allSaved / 1024),
+           (unsigned long long)(allBytes / 1024), allBytes ? 100.0 * allSaved / allBytes : 0.0);
+  }
+
+  return 0;
+}
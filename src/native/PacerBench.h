@@ -0,0 +1,226 @@
+#pragma once
+// Frame pacing check: `program pacer [seconds]`
+//
+// One stream client in simulated time: the camera produces a frame every period, the client
+// takes the newest one when its FramePacer lets it, and writes it into a socket buffer the
+// size of lwIP's send window that a link drains at its rate. The write blocks while the buffer
+// is full, so the send time the pacer sees is the link's, as on the car. Runs the client
+// through a fast link, a slow one and one that stalls like a TCP retransmit timeout, each
+// paced the way the firmware is and again unpaced. Reports the frame rate reaching the
+// viewer, the bytes already queued in the buffer when a frame is taken (a frame queued behind
+// them arrives that much later) and capture to last byte delivered.
+// Exits with 1 when a frame rate, a queue depth or a latency is off
+#include "../FramePacer.h"
+#include "../LatencyMetrics.h"
+
+#define PACER_BENCH_DEFAULT_SECONDS 30
+#define PACER_BENCH_CAMERA_FPS 25
+#define PACER_BENCH_FRAME_BYTES 20000
+// Same as the sim's viewer sockets
+#define PACER_BENCH_BUFFER_BYTES (6 * 1024)
+#define PACER_BENCH_STEP_US 100
+// The firmware's default latency budget
+#define PACER_BENCH_BUDGET_US 100000
+
+struct PacerLink {
+  const char *name;
+  uint32_t kbps;
+  uint32_t stallChance; // per 10 ms of link time, in 1/1000
+  uint32_t stallUs;     // nothing drains for this long
+};
+
+struct PacerResult {
+  uint32_t taken;
+  uint32_t delivered;
+  double fps;
+  double averageQueuedBytes; // in the buffer when a frame is taken
+  double averageLatencyUs;   // capture to last byte delivered
+  uint32_t longestGapUs;     // between two frames delivered
+  LatencyHistogram latency;
+};
+
+// The frames written and not yet delivered, by the byte count at which each one ends
+struct PacerInFlight {
+  uint64_t endsAt[4];
+  uint64_t capturedUs[4];
+  int count;
+};
+
+static void runPacerLink(const PacerLink &link, uint8_t targetFps, uint32_t budgetUs, uint32_t seconds,
+                         PacerResult &result) {
+  PacerInFlight inFlight = {};
+  FramePacer pacer;
+  const uint64_t endUs = seconds * 1000000ULL;
+  const uint64_t periodUs = 1000000 / PACER_BENCH_CAMERA_FPS;
+  const double bytesPerUs = link.kbps / 8000.0;
+  uint32_t random = 12345;
+  double drainCredit = 0;
+  uint64_t written = 0;
+  uint64_t delivered = 0;
+  uint64_t stalledUntilUs = 0;
+  uint64_t nextTakeUs = 0;
+  uint64_t lastCapturedUs = UINT64_MAX;
+  uint64_t lastDeliveredUs = 0;
+  uint64_t frameStartUs = 0;
+  uint64_t frameCapturedUs = 0;
+  size_t frameLeft = 0;
+  double queuedSum = 0;
+  double latencySum = 0;
+
+  result.taken = 0;
+  result.delivered = 0;
+  result.longestGapUs = 0;
+  pacer.configure(targetFps, budgetUs);
+
+  for (uint64_t now = 0; now < endUs; now += PACER_BENCH_STEP_US) {
+    if (now % 10000 == 0 && now >= stalledUntilUs) {
+      random = random * 1103515245 + 12345;
+
+      if ((random >> 16) % 1000 < link.stallChance) {
+        stalledUntilUs = now + link.stallUs;
+      }
+    }
+
+    if (now >= stalledUntilUs) {
+      drainCredit += bytesPerUs * PACER_BENCH_STEP_US;
+      const uint64_t drained = std::min<uint64_t>(written - delivered, (uint64_t)drainCredit);
+
+      drainCredit = written - delivered > drained ? drainCredit - drained : 0;
+      delivered += drained;
+    }
+
+    while (inFlight.count && delivered >= inFlight.endsAt[0]) {
+      const uint64_t latencyUs = now - inFlight.capturedUs[0];
+
+      result.latency.add(latencyUs);
+      latencySum += latencyUs;
+
+      if (result.delivered && now - lastDeliveredUs > result.longestGapUs) {
+        result.longestGapUs = now - lastDeliveredUs;
+      }
+
+      lastDeliveredUs = now;
+      result.delivered++;
+      inFlight.count--;
+      memmove(inFlight.endsAt, inFlight.endsAt + 1, inFlight.count * sizeof(inFlight.endsAt[0]));
+      memmove(inFlight.capturedUs, inFlight.capturedUs + 1, inFlight.count * sizeof(inFlight.capturedUs[0]));
+    }
+
+    // the newest frame, once the pacer lets the client take one it has not sent
+    const uint64_t capturedUs = now / periodUs * periodUs;
+
+    if (!frameLeft && now >= nextTakeUs && capturedUs != lastCapturedUs && inFlight.count < 4) {
+      lastCapturedUs = capturedUs;
+      frameCapturedUs = capturedUs;
+      frameStartUs = now;
+      frameLeft = PACER_BENCH_FRAME_BYTES;
+      queuedSum += written - delivered;
+      result.taken++;
+    }
+
+    if (frameLeft) {
+      const size_t room = PACER_BENCH_BUFFER_BYTES - (written - delivered);
+      const size_t accepted = std::min(frameLeft, room);
+
+      written += accepted;
+      frameLeft -= accepted;
+
+      if (!frameLeft) {
+        inFlight.endsAt[inFlight.count] = written;
+        inFlight.capturedUs[inFlight.count] = frameCapturedUs;
+        inFlight.count++;
+        nextTakeUs = now + pacer.onFrameSent(frameStartUs, now - frameStartUs, now);
+      }
+    }
+  }
+
+  result.fps = (double)result.delivered / seconds;
+  result.averageQueuedBytes = result.taken ? queuedSum / result.taken : 0;
+  result.averageLatencyUs = result.delivered ? latencySum / result.delivered : 0;
+}
+
+static void printPacerResult(const char *pacing, const PacerResult &result) {
+  printf("  %-9s %5.1f fps, %4u taken, queued ahead avg %5.0f bytes, latency avg %6.1fms p90 <%ums, longest gap %ums\n",
+         pacing, result.fps, result.taken, result.averageQueuedBytes, result.averageLatencyUs / 1000,
+         result.latency.percentileUs(90) / 1000, result.longestGapUs / 1000);
+}
+
+static bool pacerCheck(bool ok, const char *what) {
+  if (!ok) {
+    printf("FAIL: %s\n", what);
+  }
+
+  return ok;
+}
+
+static int runPacerBench(uint32_t seconds) {
+  static const PacerLink fast = {"fast", 20000, 0, 0};
+  static const PacerLink slow = {"slow", 1000, 0, 0};
+  static const PacerLink lossy = {"lossy", 2000, 10, 200000};
+  bool ok = true;
+
+  printf("\n=== Frame pacing (%us simulated, %u fps camera, %u byte frames, %u byte buffer) ===\n", seconds,
+         PACER_BENCH_CAMERA_FPS, PACER_BENCH_FRAME_BYTES, PACER_BENCH_BUFFER_BYTES);
+
+  const PacerLink *links[] = {&fast, &slow, &lossy};
+
+  for (const PacerLink *link : links) {
+    const double capacityFps = std::min<double>(PACER_BENCH_CAMERA_FPS, link->kbps * 1000.0 / 8 / PACER_BENCH_FRAME_BYTES);
+    PacerResult paced;
+    PacerResult unpaced;
+
+    runPacerLink(*link, 0, PACER_BENCH_BUDGET_US, seconds, paced);
+    runPacerLink(*link, 0, 0, seconds, unpaced);
+
+    printf("%s link, %u kbps, room for %.1f fps", link->name, link->kbps, capacityFps);
+
+    if (link->stallChance) {
+      printf(", a %ums stall starting in %.1f%% of 10ms slots", link->stallUs / 1000, link->stallChance / 10.0);
+    }
+
+    printf(":\n");
+    printPacerResult("paced", paced);
+    printPacerResult("unpaced", unpaced);
+
+    // no pacing when the link keeps up, the camera sets the rate
+    if (link == &fast) {
+      ok &= pacerCheck(paced.fps >= capacityFps * 0.95, "fast link: the pacer held frames back");
+      ok &= pacerCheck(paced.averageQueuedBytes < PACER_BENCH_BUFFER_BYTES / 4, "fast link: frames queued");
+    } else {
+      // backing off costs some of the link
+      ok &= pacerCheck(paced.fps >= capacityFps * 0.6, "the pacer gave up too much of the link");
+    }
+
+    // over the budget on every frame, the pacer lets the buffer drain before the next one, so
+    // frames stop queueing behind stale bytes
+    if (link == &slow) {
+      ok &= pacerCheck(paced.averageQueuedBytes < unpaced.averageQueuedBytes * 0.75,
+                       "slow link: frames still start behind a full buffer");
+      ok &= pacerCheck(paced.averageLatencyUs < unpaced.averageLatencyUs * 0.9, "slow link: pacing did not make frames earlier");
+    }
+
+    // the stalls set the latency here, paced and unpaced differ by noise that depends on the
+    // run length. Pacing must not cost more than that
+    if (link == &lossy) {
+      ok &= pacerCheck(paced.averageLatencyUs <= unpaced.averageLatencyUs * 1.05, "lossy link: pacing made frames later");
+    }
+
+    // a stall may hold the link, never the pacer on top of it
+    ok &= pacerCheck(paced.longestGapUs < link->stallUs + PACER_MAX_WAIT_US + 2 * 1000000 / capacityFps,
+                     "frames stopped for longer than the link did");
+  }
+
+  // a target rate under what the link allows is kept
+  const uint8_t targetFps = 15;
+  PacerResult targeted;
+
+  runPacerLink(fast, targetFps, PACER_BENCH_BUDGET_US, seconds, targeted);
+
+  printf("fast link, %u fps target:\n", targetFps);
+  printPacerResult("paced", targeted);
+  ok &= pacerCheck(targeted.fps >= targetFps * 0.9 && targeted.fps <= targetFps * 1.05, "the target frame rate was missed");
+
+  printf(ok ? "Pacer OK\n" : "Pacer FAILED\n");
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,346 @@
+#pragma once
+// Command parser fuzzing and parse rate: `program protocol [iterations]`
+//
+// Feeds both parsers random and damaged messages. Binary: random lengths and bytes, and every
+// valid message cut short; accepted exactly when the length and opcode are valid, and then
+// encoding the command gives the same bytes back. Text: random strings and valid commands cut
+// short, with a byte changed or with bytes added; accepted exactly when the text is a whole
+// command by a grammar of its own here, and then with its arguments within that command's
+// limits and reading back the same from the text formatted for it. Exits with 1 on the first
+// message that breaks one of these. Then times both parsers on the same mix of commands
+#include "../CarProtocol.h"
+#include "../TextProtocol.h"
+
+#define PROTOCOL_BENCH_DEFAULT_ITERATIONS 200000
+#define PROTOCOL_BENCH_TEXT_MAX 48
+#define PROTOCOL_BENCH_MIX 1024
+
+static uint32_t protocolRandomState = 2463534242u;
+
+static uint32_t protocolRandom() {
+  protocolRandomState ^= protocolRandomState << 13;
+  protocolRandomState ^= protocolRandomState >> 17;
+  protocolRandomState ^= protocolRandomState << 5;
+
+  return protocolRandomState;
+}
+
+static const TextArgCommand *findTextArgCommand(uint8_t opcode) {
+  for (const TextArgCommand &entry : textArgCommands) {
+    if (entry.opcode == opcode) {
+      return &entry;
+    }
+  }
+
+  return nullptr;
+}
+
+static const char *findTextCommandName(uint8_t opcode) {
+  for (const TextCommand &entry : textCommands) {
+    if (entry.opcode == opcode) {
+      return entry.name;
+    }
+  }
+
+  return nullptr;
+}
+
+// The text a client sends for the command, false when the opcode has no text form
+static bool formatTextCommand(const CarCommand &command, char *text, size_t size) {
+  const char *name = findTextCommandName(command.opcode);
+  const TextArgCommand *entry = findTextArgCommand(command.opcode);
+
+  if (name) {
+    snprintf(text, size, "%s", name);
+  } else if (command.opcode == OP_FRAME_SIZE) {
+    snprintf(text, size, "frameSize_%s", command.arg0 < 0 ? "AUTO" : frameSizeToString((framesize_t)command.arg0));
+  } else if (entry) {
+    const long arg0 = entry->max0 > INT16_MAX ? (long)(uint16_t)command.arg0 : command.arg0;
+
+    if (entry->args == 1) {
+      snprintf(text, size, "%s%ld", entry->prefix, arg0);
+    } else {
+      snprintf(text, size, "%s%ld_%d", entry->prefix, arg0, command.arg1);
+    }
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+static bool sameCommand(const CarCommand &a, const CarCommand &b) {
+  return a.opcode == b.opcode && a.seq == b.seq && a.arg0 == b.arg0 && a.arg1 == b.arg1;
+}
+
+// A command with a text form and arguments in its limits, or false when there is none
+static bool randomTextCommand(CarCommand &command) {
+  command.opcode = protocolRandom() % OP_COUNT;
+  command.seq = 0;
+  command.arg0 = 0;
+  command.arg1 = 0;
+
+  const TextArgCommand *entry = findTextArgCommand(command.opcode);
+
+  if (entry) {
+    command.arg0 = clampTextArg((int32_t)(protocolRandom() % 70000) - 35000, entry->min0, entry->max0);
+    command.arg1 = entry->args > 1 ? clampTextArg((int32_t)(protocolRandom() % 70000) - 35000, entry->min1, entry->max1) : 0;
+
+    if (command.opcode == OP_VISION) {
+      command.arg0 = command.arg0 != 0;
+    }
+  } else if (command.opcode == OP_FRAME_SIZE) {
+    command.arg0 = (int16_t)(protocolRandom() % (FRAMESIZE_INVALID + 1)) - 1;
+  }
+
+  char text[PROTOCOL_BENCH_TEXT_MAX];
+
+  return formatTextCommand(command, text, sizeof(text));
+}
+
+static bool inLimits(const CarCommand &command) {
+  const TextArgCommand *entry = findTextArgCommand(command.opcode);
+
+  if (command.opcode == OP_FRAME_SIZE) {
+    return command.arg0 >= -1 && command.arg0 < FRAMESIZE_INVALID && !command.arg1;
+  }
+
+  if (command.opcode == OP_VISION) {
+    return (command.arg0 == 0 || command.arg0 == 1) && !command.arg1;
+  }
+
+  if (!entry) {
+    return findTextCommandName(command.opcode) && !command.arg0 && !command.arg1;
+  }
+
+  const long arg0 = entry->max0 > INT16_MAX ? (long)(uint16_t)command.arg0 : command.arg0;
+
+  return arg0 >= entry->min0 && arg0 <= entry->max0 && command.arg1 >= entry->min1 && command.arg1 <= entry->max1;
+}
+
+static bool protocolCheck(bool ok, const char *what, const char *text) {
+  if (!ok) {
+    printf("FAIL %s: \"%s\"\n", what, text);
+  }
+
+  return ok;
+}
+
+// Everything an accepted text command must hold to
+static bool checkAcceptedText(const char *text, const CarCommand &command) {
+  char formatted[PROTOCOL_BENCH_TEXT_MAX];
+  CarCommand again;
+
+  return protocolCheck(command.opcode < OP_COUNT && inLimits(command), "accepted out of limits", text) &&
+         protocolCheck(formatTextCommand(command, formatted, sizeof(formatted)) && parseTextCommand(formatted, again) &&
+                           sameCommand(command, again),
+                       "does not read back the same", text);
+}
+
+// count integers separated by '_' and nothing else, written the way formatTextCommand does
+static bool isWholeTextArgs(const char *text, uint8_t count) {
+  for (uint8_t i = 0; i < count; i++) {
+    if (i && *text++ != '_') {
+      return false;
+    }
+
+    text += *text == '-';
+
+    if (!isdigit((unsigned char)*text)) {
+      return false;
+    }
+
+    while (isdigit((unsigned char)*text)) {
+      text++;
+    }
+  }
+
+  return !*text;
+}
+
+// What is left of a command cut short still reads as a whole one, e.g. forward of forward-left
+static bool isWholeTextCommand(const char *text) {
+  for (const TextCommand &entry : textCommands) {
+    if (strcmp(text, entry.name) == 0) {
+      return true;
+    }
+  }
+
+  for (const TextArgCommand &entry : textArgCommands) {
+    const size_t prefixLength = strlen(entry.prefix);
+
+    if (strncmp(text, entry.prefix, prefixLength) == 0) {
+      return isWholeTextArgs(text + prefixLength, entry.args);
+    }
+  }
+
+  return strncmp(text, "frameSize_", 10) == 0 && (strcmp(text + 10, "AUTO") == 0 || stringToFrameSize(text + 10) != FRAMESIZE_INVALID);
+}
+
+static bool fuzzBinary(uint32_t iterations, uint32_t &accepted) {
+  uint8_t data[CAR_MESSAGE_SIZE * 2];
+  uint8_t encoded[CAR_MESSAGE_SIZE];
+  CarCommand command;
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    const size_t length = protocolRandom() % (sizeof(data) + 1);
+
+    for (size_t j = 0; j < sizeof(data); j++) {
+      data[j] = protocolRandom();
+    }
+
+    // half the messages the right size, so the opcode check gets exercised
+    if (i % 2 == 0) {
+      const bool ok = decodeCarCommand(data, CAR_MESSAGE_SIZE, command);
+
+      if (ok != (data[0] < OP_COUNT)) {
+        printf("FAIL binary: opcode %u %s\n", data[0], ok ? "accepted" : "rejected");
+        return false;
+      }
+
+      if (ok) {
+        accepted++;
+        encodeCarCommand(command, encoded);
+
+        if (memcmp(encoded, data, CAR_MESSAGE_SIZE) != 0) {
+          printf("FAIL binary: opcode %u does not encode back the same\n", data[0]);
+          return false;
+        }
+
+        // cut short at every length
+        for (size_t cut = 0; cut < CAR_MESSAGE_SIZE; cut++) {
+          if (decodeCarCommand(data, cut, command)) {
+            printf("FAIL binary: a message cut to %u bytes was accepted\n", (unsigned)cut);
+            return false;
+          }
+        }
+      }
+
+      continue;
+    }
+
+    if (decodeCarCommand(data, length, command) != (length == CAR_MESSAGE_SIZE && data[0] < OP_COUNT)) {
+      printf("FAIL binary: %u random bytes\n", (unsigned)length);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool fuzzText(uint32_t iterations, uint32_t &accepted, uint32_t &cutsRejected) {
+  static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-+ 0123456789\t\x01\xff";
+  char text[PROTOCOL_BENCH_TEXT_MAX + 8];
+  CarCommand command;
+  CarCommand parsed;
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    const uint32_t kind = i % 4;
+
+    if (kind == 0 || !randomTextCommand(command)) {
+      // random characters, also from the alphabet of the commands
+      const size_t length = protocolRandom() % PROTOCOL_BENCH_TEXT_MAX;
+
+      for (size_t j = 0; j < length; j++) {
+        text[j] = alphabet[protocolRandom() % (sizeof(alphabet) - 1)];
+      }
+
+      text[length] = '\0';
+    } else {
+      formatTextCommand(command, text, PROTOCOL_BENCH_TEXT_MAX);
+
+      const size_t length = strlen(text);
+
+      if (!protocolCheck(parseTextCommand(text, parsed) && sameCommand(parsed, command), "a valid command was not read", text)) {
+        return false;
+      }
+
+      if (kind == 1) {
+        // cut short
+        const size_t cut = protocolRandom() % length;
+
+        text[cut] = '\0';
+        cutsRejected += !isWholeTextCommand(text);
+      } else if (kind == 2) {
+        text[protocolRandom() % length] = alphabet[protocolRandom() % (sizeof(alphabet) - 1)];
+      } else {
+        // bytes after a whole command
+        const size_t added = 1 + protocolRandom() % 6;
+
+        for (size_t j = 0; j < added; j++) {
+          text[length + j] = alphabet[protocolRandom() % (sizeof(alphabet) - 1)];
+        }
+
+        text[length + added] = '\0';
+      }
+    }
+
+    const bool ok = parseTextCommand(text, parsed);
+
+    if (!protocolCheck(ok == isWholeTextCommand(text), ok ? "accepted but not a whole command" : "rejected a whole command", text)) {
+      return false;
+    }
+
+    if (ok) {
+      accepted++;
+
+      if (!checkAcceptedText(text, parsed)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+static int runProtocolBench(uint32_t iterations) {
+  uint32_t binaryAccepted = 0;
+  uint32_t textAccepted = 0;
+  uint32_t cutsRejected = 0;
+
+  printf("\n=== Command parsers (%u messages each) ===\n", iterations);
+
+  if (!fuzzBinary(iterations, binaryAccepted) || !fuzzText(iterations, textAccepted, cutsRejected)) {
+    return 1;
+  }
+
+  printf("Fuzz: binary %u accepted, text %u accepted, %u of %u cut off commands rejected\n", binaryAccepted,
+         textAccepted, cutsRejected, iterations / 4);
+
+  // the same mix through both parsers
+  static uint8_t binary[PROTOCOL_BENCH_MIX][CAR_MESSAGE_SIZE];
+  static char text[PROTOCOL_BENCH_MIX][PROTOCOL_BENCH_TEXT_MAX];
+  CarCommand command;
+  uint32_t checksum = 0;
+
+  for (int i = 0; i < PROTOCOL_BENCH_MIX; i++) {
+    while (!randomTextCommand(command)) {
+    }
+
+    encodeCarCommand(command, binary[i]);
+    formatTextCommand(command, text[i], sizeof(text[i]));
+  }
+
+  const uint64_t binaryStart = nowUs();
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    decodeCarCommand(binary[i % PROTOCOL_BENCH_MIX], CAR_MESSAGE_SIZE, command);
+    checksum += command.arg0;
+  }
+
+  const uint64_t textStart = nowUs();
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    parseTextCommand(text[i % PROTOCOL_BENCH_MIX], command);
+    checksum += command.arg0;
+  }
+
+  const double binaryNs = (textStart - binaryStart) * 1000.0 / iterations;
+  const double textNs = (nowUs() - textStart) * 1000.0 / iterations;
+
+  printf("Parse: binary %.1f ns, text %.1f ns per command (%.0fx), checksum %u\n", binaryNs, textNs,
+         binaryNs > 0 ? textNs / binaryNs : 0, checksum);
+  printf("Protocol OK\n");
+
+  return 0;
+}
@@ -0,0 +1,157 @@
+#pragma once
+// Stream quality controller replay: `program quality`
+//
+// Replays frame traces through QualityController the way the stream sender reports them: a
+// 25 fps camera, every frame's JPEG size at the current level, and the time each viewer's link
+// takes to send it. Sizes follow the firmware's ladder, QVGA q20 up to SVGA q12, with per-frame
+// jitter. Two traces: a fast viewer and a 400 KB/s one from the top level, the slow one
+// leaving halfway through, and the slow one alone from the bottom level. Checks that stepping
+// down settles on the highest level whose frames reach the slowest viewer within the target,
+// that climbing stops at the highest one within the target's upgrade headroom, that the level
+// climbs back once the slow viewer has been gone QUALITY_VIEWER_EXPIRY_US, and that a steady
+// trace never steps back and forth. Exits with 1 when one of these does not hold
+#include "../QualityController.h"
+
+#define QUALITY_BENCH_FPS 25
+// Same as the firmware's
+#define QUALITY_BENCH_TARGET_US 80000
+#define QUALITY_BENCH_MIN_RSSI -78
+// Bytes per second
+#define QUALITY_BENCH_FAST_RATE 2000000
+#define QUALITY_BENCH_SLOW_RATE 400000
+// Per frame, in percent either way
+#define QUALITY_BENCH_JITTER 15
+
+// Typical JPEG sizes of the firmware's ladder, levels 0..5
+static const uint32_t qualityBenchBytes[] = {5000, 8000, 12000, 18000, 27000, 40000};
+static const uint8_t QUALITY_BENCH_LEVELS = sizeof(qualityBenchBytes) / sizeof(qualityBenchBytes[0]);
+
+struct QualityViewer {
+  uint32_t rate;    // bytes per second
+  uint64_t fromUs;  // connected over [fromUs, untilUs)
+  uint64_t untilUs;
+};
+
+struct QualityTrace {
+  uint32_t changes;
+  uint32_t downSteps;
+  uint64_t lastChangeUs;
+  uint64_t firstTopUs; // first time at the top level after a given time, 0 - never
+};
+
+// The highest level whose frames reach a viewer at rate within budgetUs
+static uint8_t qualityBenchExpected(uint32_t rate, uint32_t budgetUs) {
+  uint8_t level = 0;
+
+  for (uint8_t i = 0; i < QUALITY_BENCH_LEVELS; i++) {
+    if ((uint64_t)qualityBenchBytes[i] * 1000000 / rate <= budgetUs) {
+      level = i;
+    }
+  }
+
+  return level;
+}
+
+static void replayQualityTrace(QualityController &controller, const QualityViewer *viewers, int viewerCount,
+                               uint64_t fromUs, uint64_t untilUs, uint64_t topAfterUs, QualityTrace &trace) {
+  static uint32_t random = 2463534242u;
+  const uint64_t periodUs = 1000000 / QUALITY_BENCH_FPS;
+
+  for (uint64_t now = fromUs; now < untilUs; now += periodUs) {
+    random = random * 1103515245 + 12345;
+
+    const int jitter = (int)((random >> 16) % (2 * QUALITY_BENCH_JITTER + 1)) - QUALITY_BENCH_JITTER;
+    const uint32_t bytes = qualityBenchBytes[controller.level()] * (100 + jitter) / 100;
+
+    for (int v = 0; v < viewerCount; v++) {
+      if (now < viewers[v].fromUs || now >= viewers[v].untilUs) {
+        continue;
+      }
+
+      const uint8_t before = controller.level();
+      const uint32_t sendUs = (uint64_t)bytes * 1000000 / viewers[v].rate;
+
+      if (!controller.onFrameSent(v, bytes, sendUs, now)) {
+        continue;
+      }
+
+      printf("  %6.2fs level %u -> %u\n", now / 1e6, before, controller.level());
+      trace.changes++;
+      trace.downSteps += controller.level() < before;
+      trace.lastChangeUs = now;
+
+      if (!trace.firstTopUs && now >= topAfterUs && controller.level() == QUALITY_BENCH_LEVELS - 1) {
+        trace.firstTopUs = now;
+      }
+    }
+  }
+}
+
+static bool qualityCheck(bool ok, const char *what) {
+  if (!ok) {
+    printf("FAIL: %s\n", what);
+  }
+
+  return ok;
+}
+
+static int runQualityBench() {
+  const uint8_t slowLevel = qualityBenchExpected(QUALITY_BENCH_SLOW_RATE, QUALITY_BENCH_TARGET_US);
+  const uint8_t fastLevel = qualityBenchExpected(QUALITY_BENCH_FAST_RATE, QUALITY_BENCH_TARGET_US);
+  // a step up needs the next level predicted under the headroom, so a climb stops lower
+  const uint8_t slowClimbLevel = qualityBenchExpected(QUALITY_BENCH_SLOW_RATE, QUALITY_BENCH_TARGET_US * QUALITY_UPGRADE_HEADROOM);
+  const uint64_t leaveUs = 20000000;
+  const uint64_t endUs = 40000000;
+  bool ok = true;
+
+  printf("\n=== Quality controller (%u fps, %ums target, levels %u..%u bytes, +-%u%% jitter) ===\n", QUALITY_BENCH_FPS,
+         QUALITY_BENCH_TARGET_US / 1000, qualityBenchBytes[0], qualityBenchBytes[QUALITY_BENCH_LEVELS - 1],
+         QUALITY_BENCH_JITTER);
+
+  // a fast viewer and a slow one from the top level, the slow one leaves at 20 s
+  QualityController mixed;
+  QualityTrace trace = {};
+  const QualityViewer both[] = {{QUALITY_BENCH_FAST_RATE, 0, endUs}, {QUALITY_BENCH_SLOW_RATE, 0, leaveUs}};
+
+  mixed.configure(QUALITY_BENCH_LEVELS, QUALITY_BENCH_TARGET_US, QUALITY_BENCH_MIN_RSSI);
+  mixed.setLevel(QUALITY_BENCH_LEVELS - 1, 0);
+  printf("%u and %u KB/s viewers, the slow one leaves at %.0fs:\n", QUALITY_BENCH_FAST_RATE / 1000,
+         QUALITY_BENCH_SLOW_RATE / 1000, leaveUs / 1e6);
+  replayQualityTrace(mixed, both, 2, 0, leaveUs, leaveUs, trace);
+
+  printf("  level %u with both, expected %u\n", mixed.level(), slowLevel);
+  ok &= qualityCheck(mixed.level() == slowLevel, "not settled on the slow viewer's level");
+  ok &= qualityCheck(trace.lastChangeUs < leaveUs / 2, "still changing level on a steady trace");
+
+  const uint32_t changesWithBoth = trace.changes;
+
+  replayQualityTrace(mixed, both, 2, leaveUs, endUs, leaveUs, trace);
+
+  const double climbS = trace.firstTopUs ? (trace.firstTopUs - leaveUs) / 1e6 : 0;
+
+  printf("  level %u alone, expected %u, climbed %.2fs after the slow viewer left\n", mixed.level(), fastLevel, climbS);
+  ok &= qualityCheck(mixed.level() == fastLevel, "not back on the fast viewer's level");
+  ok &= qualityCheck(trace.firstTopUs >= leaveUs + QUALITY_VIEWER_EXPIRY_US &&
+                         trace.firstTopUs <= leaveUs + QUALITY_VIEWER_EXPIRY_US + 2 * QUALITY_HOLD_US,
+                     "did not climb back about when the slow viewer expired");
+  ok &= qualityCheck(trace.changes == changesWithBoth + 1, "more than one step back up");
+
+  // the slow viewer alone from the bottom: straight up, never a step back
+  QualityController climbing;
+  QualityTrace steady = {};
+  const QualityViewer slow[] = {{QUALITY_BENCH_SLOW_RATE, 0, endUs}};
+
+  climbing.configure(QUALITY_BENCH_LEVELS, QUALITY_BENCH_TARGET_US, QUALITY_BENCH_MIN_RSSI);
+  climbing.setLevel(0, 0);
+  printf("%u KB/s viewer alone from level 0:\n", QUALITY_BENCH_SLOW_RATE / 1000);
+  replayQualityTrace(climbing, slow, 1, 0, endUs, endUs, steady);
+
+  printf("  level %u, expected %u, %u changes, %u down\n", climbing.level(), slowClimbLevel, steady.changes,
+         steady.downSteps);
+  ok &= qualityCheck(climbing.level() == slowClimbLevel, "the slow viewer alone did not reach its level");
+  ok &= qualityCheck(steady.changes == slowClimbLevel && !steady.downSteps, "the level flapped on a steady trace");
+
+  printf(ok ? "Quality OK\n" : "Quality FAILED\n");
+
+  return ok ? 0 : 1;
+}
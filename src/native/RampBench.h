@@ -0,0 +1,99 @@
+#pragma once
+// Ramp cost benchmark: `program ramp [seconds]`
+//
+// Runs the car's control loop in real time for the given seconds: the first half drives with a
+// new stick position and camera pan every 200 ms, the second half is parked. Reports the CPU
+// time the RampEngine's timer spends per second in each half, along with its ticks and output
+// writes. The control loop's own cost, Car::tick, is timed alongside
+#include "../Car.h"
+
+#define RAMP_BENCH_DEFAULT_SECONDS 10
+#define RAMP_BENCH_COMMAND_MS 200
+// Same as the control task's
+#define RAMP_BENCH_PERIOD_MS 5
+
+extern Car car;
+
+struct RampSample {
+  uint64_t busyUs;
+  uint32_t ticks;
+  uint32_t writes;
+  uint32_t pwmWrites;
+  uint64_t controlUs;
+};
+
+static RampSample sampleRamp(RampEngine &ramps, uint64_t controlUs) {
+  RampSample sample = {ramps.busyUs(), ramps.ticks(), ramps.writes(), 0, controlUs};
+
+  for (int channel = 0; channel < SIM_PWM_CHANNELS; channel++) {
+    sample.pwmWrites += simOutputs().pwmWrites[channel];
+  }
+
+  return sample;
+}
+
+static void printRampSample(const char *phase, const RampSample &from, const RampSample &to, double seconds) {
+  printf("%s: ramp %.1f us/s, %.0f ticks/s, %.1f value changes/s, %.1f PWM writes/s; Car::tick %.1f us/s\n", phase,
+         (to.busyUs - from.busyUs) / seconds, (to.ticks - from.ticks) / seconds, (to.writes - from.writes) / seconds,
+         (to.pwmWrites - from.pwmWrites) / seconds, (to.controlUs - from.controlUs) / seconds);
+}
+
+static int runRampBench(uint32_t seconds) {
+  if (car.init() != ESP_OK) {
+    return 1;
+  }
+
+  RampEngine &ramps = car.rampEngine();
+  const uint64_t driveUs = seconds * 500000ULL;
+  const uint64_t start = nowUs();
+  uint64_t controlUs = 0;
+  uint64_t wakeUs = start;
+  RampSample begin = sampleRamp(ramps, 0);
+  RampSample parked = begin;
+  bool driving = true;
+
+  for (uint32_t i = 0;; i++) {
+    const uint64_t elapsedUs = nowUs() - start;
+
+    if (elapsedUs >= seconds * 1000000ULL) {
+      break;
+    }
+
+    if (driving && elapsedUs >= driveUs) {
+      car.stop();
+      // the stop's own ramp step belongs to the driving half
+      delay(2);
+      parked = sampleRamp(ramps, controlUs);
+      driving = false;
+    }
+
+    // a fresh stick every RAMP_BENCH_COMMAND_MS, repeated in between like the UI does
+    if (driving && i % (RAMP_BENCH_COMMAND_MS / RAMP_BENCH_PERIOD_MS) == 0) {
+      const uint32_t command = i / (RAMP_BENCH_COMMAND_MS / RAMP_BENCH_PERIOD_MS);
+
+      car.drive(command % 2 ? 100 : 40, ((int)(command % 5) - 2) * 40);
+      car.setCamera(((int)(command % 3) - 1) * 100, 0);
+    }
+
+    const uint64_t tickStart = nowUs();
+    car.tick();
+    controlUs += nowUs() - tickStart;
+
+    wakeUs += RAMP_BENCH_PERIOD_MS * 1000;
+    const uint64_t now = nowUs();
+
+    if (wakeUs > now) {
+      std::this_thread::sleep_for(std::chrono::microseconds(wakeUs - now));
+    }
+  }
+
+  const RampSample end = sampleRamp(ramps, controlUs);
+  const double half = seconds / 2.0;
+
+  printRampSample("Driving", begin, parked, half);
+  printRampSample("Parked", parked, end, half);
+  printf("Ramp timer ran %.1f%% of the time, longest tick %uus\n", 100.0 * ramps.runUs() / (seconds * 1000000.0),
+         ramps.maxBusyUs());
+
+  return 0;
+}
@@ -0,0 +1,184 @@
+#pragma once
+// Camera servo trajectory check and latency benchmark: `program servo`
+//
+// Steps ServoTrajectory through full sweeps, short moves, reversals and extended targets, at
+// the ramp tick and with a jittery tick, and checks every path: speed and acceleration within
+// the limits, no overshoot, no wrong-way steps, and settled on the exact target no later than
+// two ticks past the fastest possible move. Exits with 1 on the first failed check. Then runs
+// moves through a RampEngine on its timer and times each command to the servo's final pulse
+#include "../RampEngine.h"
+#include "../ServoTrajectory.h"
+
+#define SERVO_BENCH_LATENCY_MOVES 20
+
+struct ServoBenchCase {
+  const char *name;
+  int from;
+  int to;
+  uint32_t retargetAtUs; // 0 - no retarget
+  int retargetTo;
+};
+
+static const ServoBenchCase servoBenchCases[] = {
+    {"full sweep", SERVO_MIN_PULSE_US, SERVO_MAX_PULSE_US, 0, 0},
+    {"full sweep back", SERVO_MAX_PULSE_US, SERVO_MIN_PULSE_US, 0, 0},
+    {"half sweep", SERVO_CENTER_PULSE_US, SERVO_MAX_PULSE_US, 0, 0},
+    {"short move", SERVO_CENTER_PULSE_US, SERVO_CENTER_PULSE_US + 200, 0, 0},
+    {"one degree", SERVO_CENTER_PULSE_US, SERVO_CENTER_PULSE_US - 10, 0, 0},
+    {"one microsecond", SERVO_CENTER_PULSE_US, SERVO_CENTER_PULSE_US + 1, 0, 0},
+    {"reversal mid-move", SERVO_MIN_PULSE_US, SERVO_MAX_PULSE_US, 120000, SERVO_MIN_PULSE_US + 300},
+    {"extended mid-move", SERVO_CENTER_PULSE_US, SERVO_CENTER_PULSE_US + 300, 60000, SERVO_MAX_PULSE_US},
+};
+
+static bool checkServo(bool ok, const char *name, const char *what, uint32_t atUs, const ServoTrajectory &trajectory) {
+  if (!ok) {
+    printf("FAIL %s: %s at %uus, pulse %dus, speed %dus/s, target %dus\n", name, what, atUs, trajectory.pulseUs(),
+           trajectory.velocity(), trajectory.target());
+  }
+
+  return ok;
+}
+
+// Returns the time to settle, 0 on a failed check
+static uint32_t runServoCase(const ServoBenchCase &test, bool jitter, uint32_t &distinctPulses) {
+  ServoTrajectory trajectory;
+  uint32_t seed = 12345;
+  uint32_t elapsedUs = 0;
+  bool retargeted = false;
+
+  trajectory.reset(test.from);
+  trajectory.setTarget(test.to);
+  distinctPulses = 1;
+
+  while (elapsedUs < 2000000) {
+    // a timer that fires up to half a tick early or late
+    seed = seed * 1103515245 + 12345;
+    const uint32_t dtUs = jitter ? RAMP_TICK_US / 2 + (seed >> 8) % RAMP_TICK_US : RAMP_TICK_US;
+
+    if (test.retargetAtUs && !retargeted && elapsedUs >= test.retargetAtUs) {
+      trajectory.setTarget(test.retargetTo);
+      retargeted = true;
+    }
+
+    const int target = trajectory.target();
+    const int before = trajectory.pulseUs();
+    const int32_t speed = trajectory.velocity();
+    const bool settled = trajectory.step(dtUs);
+    const int after = trajectory.pulseUs();
+    const int32_t speedLimit = trajectory.maxAcceleration() * (int64_t)dtUs / 1000000 + 1;
+    const int direction = target > before ? 1 : -1;
+
+    elapsedUs += dtUs;
+    distinctPulses += after != before;
+
+    bool ok = checkServo(abs(trajectory.velocity()) <= trajectory.maxVelocity(), test.name, "over speed", elapsedUs, trajectory);
+    ok = ok && checkServo(abs(trajectory.velocity() - speed) <= speedLimit, test.name, "over acceleration", elapsedUs, trajectory);
+    ok = ok && checkServo((after - target) * direction <= 0, test.name, "overshoot", elapsedUs, trajectory);
+
+    // once heading for the target it only ever gets closer, a reversal first has to brake
+    if (speed * direction >= 0) {
+      ok = ok && checkServo((after - before) * direction >= 0, test.name, "wrong way", elapsedUs, trajectory);
+    }
+
+    if (!ok) {
+      return 0;
+    }
+
+    if (settled && (!test.retargetAtUs || retargeted)) {
+      break;
+    }
+  }
+
+  const int finalTarget = test.retargetAtUs ? test.retargetTo : test.to;
+
+  if (!checkServo(trajectory.settled() && trajectory.pulseUs() == finalTarget, test.name, "not settled", elapsedUs, trajectory)) {
+    return 0;
+  }
+
+  // retargeted moves have no closed form, only straight ones are held to the fastest time
+  const uint32_t minimumUs = trajectory.minimumTimeUs(test.to - test.from);
+
+  if (!test.retargetAtUs &&
+      !checkServo(elapsedUs <= minimumUs + 2 * RAMP_TICK_US + minimumUs / 50, test.name, "too slow", elapsedUs, trajectory)) {
+    printf("  fastest possible %uus\n", minimumUs);
+    return 0;
+  }
+
+  return elapsedUs;
+}
+
+static void onBenchServo(void *context, int pulseUs) {
+  ((HalServo *)context)->writeMicroseconds(pulseUs);
+}
+
+static int runServoBench() {
+  for (int jitter = 0; jitter < 2; jitter++) {
+    for (const ServoBenchCase &test : servoBenchCases) {
+      uint32_t distinctPulses;
+      const uint32_t settleUs = runServoCase(test, jitter, distinctPulses);
+
+      if (!settleUs) {
+        return 1;
+      }
+
+      if (jitter) {
+        continue;
+      }
+
+      printf("%-18s %4d -> %4dus: settled in %3ums, %3u pulse widths", test.name, test.from,
+             test.retargetAtUs ? test.retargetTo : test.to, settleUs / 1000, distinctPulses);
+
+      if (test.retargetAtUs) {
+        printf(", retargeted after %ums\n", test.retargetAtUs / 1000);
+      } else {
+        printf(", fastest possible %ums\n", ServoTrajectory().minimumTimeUs(test.to - test.from) / 1000);
+      }
+    }
+  }
+
+  printf("Trajectories OK, with a steady and a jittery %uus tick\n", RAMP_TICK_US);
+
+  // command to final pulse through the engine's timer, the path setCamera takes
+  RampEngine engine;
+  ServoTrajectory trajectory;
+  HalServo servo;
+
+  trajectory.reset(SERVO_CENTER_PULSE_US);
+  servo.writeMicroseconds(SERVO_CENTER_PULSE_US);
+
+  const int channel = engine.addTrajectory(trajectory, onBenchServo, &servo);
+
+  if (!engine.begin()) {
+    return 1;
+  }
+
+  uint32_t worstExcessUs = 0;
+  uint64_t totalExcessUs = 0;
+  uint32_t seed = 777;
+
+  for (int move = 0; move < SERVO_BENCH_LATENCY_MOVES; move++) {
+    seed = seed * 1103515245 + 12345;
+    const int from = servo.readMicroseconds();
+    const int target = SERVO_MIN_PULSE_US + (seed >> 8) % (SERVO_MAX_PULSE_US - SERVO_MIN_PULSE_US + 1);
+    const uint64_t start = nowUs();
+
+    engine.track(channel, target);
+
+    while (servo.readMicroseconds() != target || !engine.settled(channel)) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    const uint32_t latencyUs = nowUs() - start;
+    const uint32_t minimumUs = trajectory.minimumTimeUs(target - from);
+    const uint32_t excessUs = latencyUs > minimumUs ? latencyUs - minimumUs : 0;
+
+    worstExcessUs = std::max(worstExcessUs, excessUs);
+    totalExcessUs += excessUs;
+  }
+
+  printf("Command to final pulse: %u moves, avg %uus max %uus over the fastest possible move, timer ticks %u, max tick %uus\n",
+         SERVO_BENCH_LATENCY_MOVES, (unsigned)(totalExcessUs / SERVO_BENCH_LATENCY_MOVES), worstExcessUs, engine.ticks(),
+         engine.maxBusyUs());
+
+  return 0;
+}
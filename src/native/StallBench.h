@@ -0,0 +1,181 @@
+#pragma once
+// Half-open viewer check: `program stall`
+//
+// A /stream viewer on a real loopback TCP connection, with the server's socket tuning
+// applied to the accepted socket, reads for a while and then stops reading without closing,
+// like a phone that left WiFi range or a browser tab the OS froze. Its window shuts, the
+// sender's writes stop making progress and the viewer must be dropped within the stall
+// timeout: its slot freed, the viewers hook called so the car stops, and the socket closed.
+// Exits with 1 when an option is refused, when the viewer is dropped early or late, or when
+// the car is left driving
+//
+// CAR_SIM_STALL_MS - stall timeout (default STREAM_STALL_TIMEOUT_MS)
+#include "../Car.h"
+#include "../SocketTuning.h"
+#include "../StreamSender.h"
+
+#define STALL_BENCH_READ_MS 1000
+// Time the socket buffers take to fill once the viewer stops reading, plus the sender's poll
+#define STALL_BENCH_SLACK_MS 1000
+// Small buffers on both ends, a stopped reader shuts the window within a frame or two
+#define STALL_BENCH_BUFFER_BYTES 16384
+
+struct StallBenchState {
+  Car *car;
+  volatile int viewers;
+  volatile uint64_t releasedMs;
+};
+
+static void onStallBenchViewersChanged(void *context, int delta) {
+  StallBenchState &state = *(StallBenchState *)context;
+
+  state.viewers += delta;
+
+  if (!state.viewers) {
+    state.car->stop();
+    state.releasedMs = nowMs();
+  }
+}
+
+// A connected pair on loopback: the viewer's end and the accepted end the server would get
+static bool connectLoopback(int &viewerFd, int &serverFd) {
+  sockaddr_in address;
+  socklen_t length = sizeof(address);
+  const int listener = socket(AF_INET, SOCK_STREAM, 0);
+  const int receiveBuffer = STALL_BENCH_BUFFER_BYTES;
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  viewerFd = socket(AF_INET, SOCK_STREAM, 0);
+  // before connect(), the window scale is agreed on in the handshake
+  setsockopt(viewerFd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+
+  const bool connected = listener >= 0 && viewerFd >= 0 && bind(listener, (sockaddr *)&address, sizeof(address)) == 0 &&
+                         getsockname(listener, (sockaddr *)&address, &length) == 0 && listen(listener, 1) == 0 &&
+                         connect(viewerFd, (sockaddr *)&address, sizeof(address)) == 0;
+
+  serverFd = connected ? accept(listener, nullptr, nullptr) : -1;
+  close(listener);
+
+  if (serverFd < 0) {
+    printf("Loopback connection failed: %s\n", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+static int socketOption(int fd, int level, int name) {
+  int value = 0;
+  socklen_t length = sizeof(value);
+
+  getsockopt(fd, level, name, &value, &length);
+
+  return value;
+}
+
+// Reads until the deadline. Returns the bytes read, closed set when the peer closed
+static uint64_t readUntil(int fd, uint64_t deadlineMs, bool &closed) {
+  static char buffer[STALL_BENCH_BUFFER_BYTES];
+  const timeval timeout = {0, 10000};
+  uint64_t bytes = 0;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  closed = false;
+
+  while (nowMs() < deadlineMs) {
+    const ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+
+    if (length > 0) {
+      bytes += length;
+    } else if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      closed = true;
+      break;
+    }
+  }
+
+  return bytes;
+}
+
+static int runStallBench(FrameBroadcaster &broadcaster, Car &car) {
+  static StreamSender sender;
+  static StallBenchState state;
+  const char *stallMs = getenv("CAR_SIM_STALL_MS");
+  SocketTuning tuning = defaultSocketTuning;
+  int viewerFd;
+  int serverFd;
+  bool closed;
+
+  tuning.sendBufferBytes = STALL_BENCH_BUFFER_BYTES;
+  tuning.stallTimeoutMs = stallMs && atoi(stallMs) > 0 ? atoi(stallMs) : STREAM_STALL_TIMEOUT_MS;
+
+  if (!connectLoopback(viewerFd, serverFd)) {
+    return 1;
+  }
+
+  const int refused = applySocketTuning(serverFd, tuning);
+
+  printf("\n=== Half-open viewer ===\n");
+  printf("Tuning: %d refused, TCP_NODELAY %d, SO_SNDBUF %d, keepalive %d after %ds every %ds x%d, stall %ums\n", refused,
+         socketOption(serverFd, IPPROTO_TCP, TCP_NODELAY), socketOption(serverFd, SOL_SOCKET, SO_SNDBUF),
+         socketOption(serverFd, SOL_SOCKET, SO_KEEPALIVE), socketOption(serverFd, IPPROTO_TCP, TCP_KEEPIDLE),
+         socketOption(serverFd, IPPROTO_TCP, TCP_KEEPINTVL), socketOption(serverFd, IPPROTO_TCP, TCP_KEEPCNT),
+         tuning.stallTimeoutMs);
+
+  state.car = &car;
+  const StreamHooks hooks = {&state, nullptr, nullptr, onStallBenchViewersChanged, nullptr};
+
+  sender.setStallTimeout(tuning.stallTimeoutMs);
+  sender.begin(broadcaster, hooks);
+  car.drive(DRIVE_INPUT_MAX / 2, 0);
+
+  if (!sender.add(serverFd)) {
+    return 1;
+  }
+
+  const uint64_t read = readUntil(viewerFd, nowMs() + STALL_BENCH_READ_MS, closed);
+  const bool droppedEarly = closed || state.releasedMs;
+  const bool drivingBefore = !car.isParked(0);
+  const uint64_t stoppedReadingMs = nowMs();
+
+  // the viewer's stack still acks, with a zero window: the sender sees no error, only no progress
+  while (!state.releasedMs && elapsedSince(stoppedReadingMs) < tuning.stallTimeoutMs + STALL_BENCH_SLACK_MS * 2) {
+    delay(10);
+  }
+
+  const uint64_t releasedAfterMs = state.releasedMs ? state.releasedMs - stoppedReadingMs : 0;
+  const uint64_t drained = readUntil(viewerFd, nowMs() + 1000, closed);
+
+  printf("Viewer read %llu KB in %ums, then stopped reading\n", (unsigned long long)(read / 1024), STALL_BENCH_READ_MS);
+  printf("Sender: %u frames sent, %u stall(s), %d slot(s) in use\n", sender.framesSent(), sender.stalls(),
+         sender.clientCount());
+  printf("Released %llums after the viewer stopped reading, car %s, socket %s after %llu KB left in the buffers\n",
+         (unsigned long long)releasedAfterMs, car.isParked(0) ? "stopped" : "driving", closed ? "closed" : "open",
+         (unsigned long long)(drained / 1024));
+
+  close(viewerFd);
+
+  if (refused) {
+    printf("FAIL: %d socket option(s) refused\n", refused);
+    return 1;
+  }
+
+  if (droppedEarly || !drivingBefore) {
+    printf("FAIL: the viewer was dropped while it was still reading\n");
+    return 1;
+  }
+
+  if (!state.releasedMs || releasedAfterMs > tuning.stallTimeoutMs + STALL_BENCH_SLACK_MS || releasedAfterMs < tuning.stallTimeoutMs) {
+    printf("FAIL: the stalled viewer was not released within %u to %ums\n", tuning.stallTimeoutMs,
+           tuning.stallTimeoutMs + STALL_BENCH_SLACK_MS);
+    return 1;
+  }
+
+  if (sender.stalls() != 1 || sender.clientCount() || !car.isParked(0) || !closed) {
+    printf("FAIL: the stalled viewer's slot, socket or car was left behind\n");
+    return 1;
+  }
+
+  return 0;
+}
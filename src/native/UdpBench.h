@@ -0,0 +1,286 @@
+#pragma once
+// UDP video transport check: `program udp [seconds]` and `program udp-receive [port]`
+//
+// udp: the simulated camera's frames go out through a UdpVideoSender to a loss and jitter
+// emulator on localhost, which forwards what survives to a UdpVideoReceiver. The emulator
+// serializes packets at the link rate behind a bounded queue, loses them in bursts and delays
+// each by a random jitter, so packets get reordered too. Reports what the receiver could
+// show and the sensor to reassembled latency. Exits with 1 when a reassembled frame is not
+// the JPEG that was sent or when the sender allocated once warm
+//
+// udp-receive: listens for a real car's packets and prints the receiver's counts once a
+// second. Start the car's side with the WebSocket text command udpVideo_<port>_<kbps>
+//
+// CAR_SIM_UDP_LOSS - packets lost, percent (default 2)
+// CAR_SIM_UDP_LOSS_BURST - mean run of consecutive losses, WiFi loses packets in bursts (default 2)
+// CAR_SIM_UDP_JITTER_MS - random extra delay per packet, up to (default 5)
+// CAR_SIM_LINK_KBPS - emulated link rate (default 4000)
+// CAR_SIM_UDP_KBPS - sender pacing rate (default 90% of the link)
+#include "../UdpVideoSender.h"
+#include "UdpReceiver.h"
+#include <map>
+
+#define UDP_BENCH_DEFAULT_SECONDS 10
+#define UDP_RECEIVE_DEFAULT_PORT 5600
+#define UDP_EMULATOR_BASE_DELAY_US 1000
+// A WiFi driver's transmit queue: packets beyond this much waiting time are tail dropped
+#define UDP_EMULATOR_MAX_QUEUE_US 100000
+
+static double envDouble(const char *name, double fallback) {
+  const char *value = getenv(name);
+
+  return value ? atof(value) : fallback;
+}
+
+static int bindUdp(uint16_t port, sockaddr_in &address) {
+  const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  socklen_t length = sizeof(address);
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(port ? INADDR_ANY : INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+
+  if (fd < 0 || bind(fd, (sockaddr *)&address, sizeof(address)) != 0 || getsockname(fd, (sockaddr *)&address, &length) != 0) {
+    printf("UDP socket on port %u failed: %s\n", port, strerror(errno));
+    return -1;
+  }
+
+  // a second's worth of video, the receiver thread may be descheduled for a while
+  const int bufferSize = 1024 * 1024;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+  return fd;
+}
+
+// Lossy link between the sender and the receiver
+struct UdpLinkEmulator {
+  int in;
+  int out;
+  sockaddr_in receiver;
+  uint32_t linkKbps;
+  double lossGoodToBad; // Gilbert model: packets are lost while the link is bad
+  double lossBadToGood;
+  uint32_t jitterUs;
+  volatile bool running;
+
+  uint32_t packets;
+  uint32_t lost;
+  uint32_t overflowed;
+  uint32_t reordered;
+};
+
+static void udpEmulatorTask(void *param) {
+  UdpLinkEmulator &link = *(UdpLinkEmulator *)param;
+  std::multimap<uint64_t, std::vector<uint8_t>> queue;
+  uint8_t packet[UDP_VIDEO_PACKET_SIZE];
+  uint32_t seed = 4242;
+  bool bad = false;
+  uint64_t linkFreeUs = 0;
+  uint64_t lastDeliverUs = 0;
+
+  const auto random = [&seed]() {
+    seed = seed * 1103515245 + 12345;
+    return (double)(seed >> 8) / (1 << 24);
+  };
+
+  while (link.running) {
+    uint64_t now = nowUs();
+    const uint64_t nextUs = queue.empty() ? now + 5000 : queue.begin()->first;
+    timeval timeout = {0, (suseconds_t)(nextUs > now ? std::min<uint64_t>(nextUs - now, 5000) : 0)};
+    fd_set readable;
+
+    FD_ZERO(&readable);
+    FD_SET(link.in, &readable);
+
+    if (select(link.in + 1, &readable, nullptr, nullptr, &timeout) > 0) {
+      const ssize_t length = recv(link.in, packet, sizeof(packet), 0);
+
+      now = nowUs();
+
+      if (length <= 0) {
+        continue;
+      }
+
+      link.packets++;
+      bad = bad ? random() >= link.lossBadToGood : random() < link.lossGoodToBad;
+
+      if (bad) {
+        link.lost++;
+      } else if (linkFreeUs > now + UDP_EMULATOR_MAX_QUEUE_US) {
+        link.overflowed++;
+      } else {
+        linkFreeUs = std::max(linkFreeUs, now) + (uint64_t)length * 8000 / link.linkKbps;
+
+        const uint64_t deliverUs = linkFreeUs + UDP_EMULATOR_BASE_DELAY_US + (uint64_t)(random() * link.jitterUs);
+
+        link.reordered += deliverUs < lastDeliverUs;
+        lastDeliverUs = std::max(lastDeliverUs, deliverUs);
+        queue.emplace(deliverUs, std::vector<uint8_t>(packet, packet + length));
+      }
+    }
+
+    now = nowUs();
+
+    while (!queue.empty() && queue.begin()->first <= now) {
+      const std::vector<uint8_t> &data = queue.begin()->second;
+
+      sendto(link.out, data.data(), data.size(), 0, (const sockaddr *)&link.receiver, sizeof(link.receiver));
+      queue.erase(queue.begin());
+    }
+  }
+
+  vTaskDelete(nullptr);
+}
+
+struct UdpBenchViewer {
+  int fd;
+  volatile bool running;
+  UdpVideoReceiver receiver;
+  LatencyHistogram latency;
+  uint64_t bytes;
+};
+
+static void onUdpBenchFrame(void *context, uint32_t seq, const uint8_t *jpeg, size_t length, uint64_t sensorAtUs) {
+  UdpBenchViewer &viewer = *(UdpBenchViewer *)context;
+
+  viewer.latency.add(nowUs() - sensorAtUs);
+  viewer.bytes += length;
+}
+
+static void udpViewerTask(void *param) {
+  UdpBenchViewer &viewer = *(UdpBenchViewer *)param;
+  static thread_local uint8_t packet[UDP_VIDEO_PACKET_SIZE];
+  const timeval timeout = {0, 100000};
+
+  setsockopt(viewer.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  while (viewer.running) {
+    const ssize_t length = recv(viewer.fd, packet, sizeof(packet), 0);
+
+    if (length > 0) {
+      viewer.receiver.onPacket(packet, length);
+    }
+  }
+
+  vTaskDelete(nullptr);
+}
+
+static int runUdpBench(FrameBroadcaster &broadcaster, uint32_t seconds, uint32_t linkKbps) {
+  static UdpVideoSender sender;
+  static UdpLinkEmulator link;
+  static UdpBenchViewer viewer;
+  sockaddr_in emulatorAddress;
+  sockaddr_in outAddress;
+
+  const double loss = std::min(envDouble("CAR_SIM_UDP_LOSS", 2), 99.0) / 100;
+  const double burst = std::max(envDouble("CAR_SIM_UDP_LOSS_BURST", 2), 1.0);
+
+  link.linkKbps = linkKbps;
+  link.lossBadToGood = 1 / burst;
+  link.lossGoodToBad = loss * link.lossBadToGood / (1 - loss);
+  link.jitterUs = envDouble("CAR_SIM_UDP_JITTER_MS", 5) * 1000;
+  link.running = true;
+  link.in = bindUdp(0, emulatorAddress);
+  link.out = bindUdp(0, outAddress);
+  viewer.fd = bindUdp(0, link.receiver);
+  viewer.running = true;
+  viewer.receiver.onFrame(onUdpBenchFrame, &viewer);
+
+  if (link.in < 0 || link.out < 0 || viewer.fd < 0) {
+    return 1;
+  }
+
+  const uint32_t kbps = envDouble("CAR_SIM_UDP_KBPS", linkKbps * 9 / 10);
+  const StreamHooks hooks = {};
+
+  xTaskCreate(udpEmulatorTask, "UdpLink", 4096, &link, 5, nullptr);
+  xTaskCreate(udpViewerTask, "UdpViewer", 4096, &viewer, 5, nullptr);
+  sender.begin(broadcaster, hooks);
+  sender.start(emulatorAddress, -1, kbps);
+
+  delay(seconds * 1000);
+  sender.stop();
+  delay(300);
+  link.running = false;
+  viewer.running = false;
+  delay(200);
+
+  const UdpVideoReceiver &receiver = viewer.receiver;
+  const LatencyHistogram &latency = viewer.latency;
+  const HeapWatermark &heap = sender.heap();
+  const uint32_t sent = sender.framesSent();
+
+  printf("\n=== UDP video (%us) ===\n", seconds);
+  printf("Sender: %u frames, %u skipped, %u abandoned, %u packets of up to %u bytes, %u send errors, paced at %u kbps, "
+         "waited %llums\n",
+         sent, sender.framesSkipped(), sender.framesAbandoned(), sender.packetsSent(), UDP_VIDEO_PACKET_SIZE,
+         sender.sendErrors(), kbps, (unsigned long long)(sender.pacingWaitUs() / 1000));
+  printf("Link: %u kbps, %.1f%% loss in bursts of %.1f, jitter up to %ums: %u packets, %u lost, %u queue overflow, "
+         "%u reordered\n",
+         link.linkKbps, loss * 100, burst, link.jitterUs / 1000, link.packets, link.lost, link.overflowed, link.reordered);
+  printf("Receiver: %u frames shown (%.1f%%, %.1f fps, %llu KB/s), %u dropped incomplete, %u broken, %u late packets, "
+         "%u duplicates\n",
+         receiver.framesComplete(), sent ? receiver.framesComplete() * 100.0 / sent : 0.0,
+         (double)receiver.framesComplete() / seconds, (unsigned long long)(viewer.bytes / 1024 / seconds),
+         receiver.framesIncomplete(), receiver.framesBroken(), receiver.latePackets(), receiver.duplicates());
+  printf("Sensor to reassembled: %u frames, p50 <%uus, p90 <%uus, p99 <%uus, max %uus\n", latency.count(),
+         latency.percentileUs(50), latency.percentileUs(90), latency.percentileUs(99), latency.maxUs());
+  printf("Heap udp: %u warm iterations, %u allocating, %u allocations, worst %u\n", heap.iterations(),
+         heap.allocatingIterations(), heap.allocations(), heap.worst());
+
+  if (receiver.framesBroken()) {
+    printf("FAIL: %u frame(s) reassembled from the wrong fragments\n", receiver.framesBroken());
+    return 1;
+  }
+
+  if (heap.allocations()) {
+    printf("FAIL: the UDP sender allocated once warm\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+static void onUdpReceivedFrame(void *context, uint32_t seq, const uint8_t *jpeg, size_t length, uint64_t sensorAtUs) {
+  *(uint64_t *)context += length;
+}
+
+static int runUdpReceive(uint16_t port) {
+  static UdpVideoReceiver receiver;
+  static uint8_t packet[UDP_VIDEO_PACKET_SIZE];
+  sockaddr_in address;
+  uint64_t bytes = 0;
+  const int fd = bindUdp(port, address);
+  const timeval timeout = {0, 100000};
+
+  if (fd < 0) {
+    return 1;
+  }
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  receiver.onFrame(onUdpReceivedFrame, &bytes);
+  printf("Listening on UDP port %u, send udpVideo_%u_<kbps> on the car's WebSocket\n", port, port);
+
+  uint64_t lastPrintMs = nowMs();
+  uint32_t lastFrames = 0;
+
+  for (;;) {
+    const ssize_t length = recv(fd, packet, sizeof(packet), 0);
+
+    if (length > 0) {
+      receiver.onPacket(packet, length);
+    }
+
+    if (elapsedSince(lastPrintMs) < 1000) {
+      continue;
+    }
+
+    lastPrintMs = nowMs();
+    printf("%u fps, %llu KB: %u frames shown, %u dropped incomplete, %u broken, %u late packets, %u packets\n",
+           receiver.framesComplete() - lastFrames, (unsigned long long)(bytes / 1024), receiver.framesComplete(),
+           receiver.framesIncomplete(), receiver.framesBroken(), receiver.latePackets(), receiver.packets());
+    lastFrames = receiver.framesComplete();
+    bytes = 0;
+  }
+}
@@ -0,0 +1,200 @@
+#pragma once
+// Receiving end of the UDP video transport, for Linux: reassembles the fragments of
+// UdpVideoSender's packets into JPEGs. Used by `program udp` behind the loss emulator and by
+// `program udp-receive` against a real car
+#include "../UdpVideoSender.h"
+#include <arpa/inet.h>
+
+// Frames reassembled at once. A packet of a newer frame takes the oldest slot, what it held
+// is dropped incomplete: with jitter a frame's last packets may land after the next frame's
+// first ones, not after four frames
+#define UDP_RECEIVER_SLOTS 4
+// Largest frame accepted, a UXGA JPEG at high quality
+#define UDP_RECEIVER_MAX_FRAME (512 * 1024)
+#define UDP_RECEIVER_MAX_FRAGMENTS ((UDP_RECEIVER_MAX_FRAME + UDP_VIDEO_PAYLOAD_SIZE - 1) / UDP_VIDEO_PAYLOAD_SIZE)
+
+typedef void (*UdpFrameCallback)(void *context, uint32_t seq, const uint8_t *jpeg, size_t length, uint64_t sensorAtUs);
+
+class UdpVideoReceiver {
+public:
+  UdpVideoReceiver()
+      : _onFrame(nullptr),
+        _context(nullptr),
+        _shownSeq(0),
+        _packets(0),
+        _malformed(0),
+        _duplicates(0),
+        _latePackets(0),
+        _framesComplete(0),
+        _framesIncomplete(0),
+        _framesBroken(0) {
+    for (FrameSlot &slot : _slots) {
+      slot.data.resize(UDP_RECEIVER_MAX_FRAME);
+      slot.used = false;
+    }
+  }
+
+  void onFrame(UdpFrameCallback callback, void *context) {
+    _onFrame = callback;
+    _context = context;
+  }
+
+  void onPacket(const uint8_t *packet, size_t length) {
+    VideoFragmentHeader header;
+
+    _packets++;
+
+    if (!decodeFragmentHeader(packet, length, header) || header.length > UDP_RECEIVER_MAX_FRAME ||
+        header.count > UDP_RECEIVER_MAX_FRAGMENTS) {
+      _malformed++;
+      return;
+    }
+
+    // a newer frame is already on screen, an older one would step back in time
+    if (_shownSeq && (int32_t)(header.seq - _shownSeq) <= 0) {
+      _latePackets++;
+      return;
+    }
+
+    FrameSlot *found = slotFor(header);
+
+    if (!found) {
+      _latePackets++;
+      return;
+    }
+
+    FrameSlot &slot = *found;
+    const size_t payload = length - packet[1];
+
+    if (slot.length != header.length || slot.count != header.count) {
+      _malformed++;
+      return;
+    }
+
+    if (slot.fragments[header.index]) {
+      _duplicates++;
+      return;
+    }
+
+    slot.fragments[header.index] = true;
+    slot.received++;
+    memcpy(slot.data.data() + header.offset, packet + packet[1], payload);
+
+    if (slot.received < slot.count) {
+      return;
+    }
+
+    // complete: anything older still waiting will never be shown
+    for (FrameSlot &other : _slots) {
+      if (other.used && (int32_t)(other.seq - slot.seq) < 0) {
+        other.used = false;
+        _framesIncomplete++;
+      }
+    }
+
+    slot.used = false;
+    _shownSeq = slot.seq;
+
+    // a JPEG starts with SOI and ends with EOI, a mismatch means fragments from two frames
+    if (slot.length < 4 || slot.data[0] != 0xFF || slot.data[1] != 0xD8 || slot.data[slot.length - 2] != 0xFF ||
+        slot.data[slot.length - 1] != 0xD9) {
+      _framesBroken++;
+      return;
+    }
+
+    _framesComplete++;
+
+    if (_onFrame) {
+      _onFrame(_context, slot.seq, slot.data.data(), slot.length, slot.sensorAtUs);
+    }
+  }
+
+  uint32_t packets() const {
+    return _packets;
+  }
+
+  uint32_t malformed() const {
+    return _malformed;
+  }
+
+  uint32_t duplicates() const {
+    return _duplicates;
+  }
+
+  // Packets of frames older than the one last shown
+  uint32_t latePackets() const {
+    return _latePackets;
+  }
+
+  uint32_t framesComplete() const {
+    return _framesComplete;
+  }
+
+  // Dropped with fragments missing
+  uint32_t framesIncomplete() const {
+    return _framesIncomplete;
+  }
+
+  uint32_t framesBroken() const {
+    return _framesBroken;
+  }
+
+private:
+  struct FrameSlot {
+    bool used;
+    uint32_t seq;
+    uint32_t length;
+    uint16_t count;
+    uint16_t received;
+    uint64_t sensorAtUs;
+    bool fragments[UDP_RECEIVER_MAX_FRAGMENTS];
+    std::vector<uint8_t> data;
+  };
+
+  FrameSlot _slots[UDP_RECEIVER_SLOTS];
+  UdpFrameCallback _onFrame;
+  void *_context;
+  uint32_t _shownSeq;
+
+  uint32_t _packets;
+  uint32_t _malformed;
+  uint32_t _duplicates;
+  uint32_t _latePackets;
+  uint32_t _framesComplete;
+  uint32_t _framesIncomplete;
+  uint32_t _framesBroken;
+
+  // The frame's slot, else a free one, else the oldest frame's. Null for a frame older than
+  // every one in the slots
+  FrameSlot *slotFor(const VideoFragmentHeader &header) {
+    FrameSlot *victim = &_slots[0];
+
+    for (FrameSlot &slot : _slots) {
+      if (slot.used && slot.seq == header.seq) {
+        return &slot;
+      }
+
+      if (victim->used && (!slot.used || (int32_t)(slot.seq - victim->seq) < 0)) {
+        victim = &slot;
+      }
+    }
+
+    if (victim->used) {
+      if ((int32_t)(header.seq - victim->seq) < 0) {
+        return nullptr;
+      }
+
+      _framesIncomplete++;
+    }
+
+    victim->used = true;
+    victim->seq = header.seq;
+    victim->length = header.length;
+    victim->count = header.count;
+    victim->received = 0;
+    victim->sensorAtUs = header.sensorAtUs;
+    memset(victim->fragments, 0, header.count * sizeof(bool));
+
+    return victim;
+  }
+};
@@ -0,0 +1,124 @@
+#pragma once
+// Obstacle veto benchmark over recorded clips: `program vision <clip.mjpg>...`
+//
+// Clips are read like MotionBench's. <clip>.labels holds the ground truth, one "startMs endMs"
+// line per stretch where an obstacle is close enough that forward moves must be refused, in
+// milliseconds from the clip's first frame. Each frame's veto is scored against the labels
+// and timed against VISION_BUDGET_US; a clip without labels is only timed
+#include "../ObstacleDetector.h"
+#include "../VisionStage.h"
+#include "MotionBench.h"
+
+#define VISION_BENCH_MAX_LABELS 64
+
+struct VisionLabel {
+  uint32_t startMs;
+  uint32_t endMs;
+};
+
+static int readLabels(const char *clipPath, VisionLabel *labels) {
+  std::string path(clipPath);
+  path = path.substr(0, path.rfind('.')) + ".labels";
+
+  FILE *file = fopen(path.c_str(), "r");
+
+  if (!file) {
+    return -1;
+  }
+
+  int count = 0;
+  unsigned start, end;
+
+  while (count < VISION_BENCH_MAX_LABELS && fscanf(file, "%u %u", &start, &end) == 2) {
+    labels[count++] = {start, end};
+  }
+
+  fclose(file);
+
+  return count;
+}
+
+static bool labelled(const VisionLabel *labels, int count, uint32_t ms) {
+  for (int i = 0; i < count; i++) {
+    if (ms >= labels[i].startMs && ms < labels[i].endMs) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static int runVisionBench(int count, char **paths, uint32_t fps) {
+  for (int c = 0; c < count; c++) {
+    std::vector<uint8_t> data;
+    std::vector<BenchFrame> frames;
+    VisionLabel labels[VISION_BENCH_MAX_LABELS];
+
+    if (!readClip(paths[c], data)) {
+      printf("%s: cannot read\n", paths[c]);
+      continue;
+    }
+
+    indexClip(paths[c], data, fps, frames);
+
+    const int labelCount = readLabels(paths[c], labels);
+    ObstacleDetector detector;
+    uint32_t overBudget = 0;
+    uint32_t truePositive = 0, falsePositive = 0, falseNegative = 0, trueNegative = 0;
+    uint64_t detectionDelayMs = 0;
+    uint32_t detected = 0;
+    int pending = -1; // label whose obstacle is not vetoed yet
+
+    for (size_t i = 0; i < frames.size(); i++) {
+      const BenchFrame &frame = frames[i];
+      const uint32_t ms = (frame.timestampUs - frames[0].timestampUs) / 1000;
+      const uint64_t start = nowUs();
+      const bool veto = detector.onFrame(data.data() + frame.offset, frame.length, 0, 0, PIXFORMAT_JPEG);
+      const uint64_t frameUs = nowUs() - start;
+
+      detector.addFrameTime(frameUs);
+      overBudget += frameUs > VISION_BUDGET_US;
+
+      if (labelCount <= 0) {
+        continue;
+      }
+
+      const bool obstacle = labelled(labels, labelCount, ms);
+
+      truePositive += veto && obstacle;
+      falsePositive += veto && !obstacle;
+      falseNegative += !veto && obstacle;
+      trueNegative += !veto && !obstacle;
+
+      for (int l = 0; l < labelCount; l++) {
+        if (ms >= labels[l].startMs && (i == 0 || (frames[i - 1].timestampUs - frames[0].timestampUs) / 1000 < labels[l].startMs)) {
+          pending = l;
+        }
+      }
+
+      if (pending >= 0 && veto) {
+        detectionDelayMs += ms - labels[pending].startMs;
+        detected++;
+        pending = -1;
+      }
+    }
+
+    printf("%s: %u frames, %u unreadable, %u veto(es), avg %uus max %uus, %u over the %uus budget\n", paths[c],
+           detector.frames(), detector.failed(), detector.vetoes(), detector.averageFrameUs(), detector.maxFrameUs(),
+           overBudget, VISION_BUDGET_US);
+
+    if (labelCount > 0) {
+      const uint32_t total = truePositive + falsePositive + falseNegative + trueNegative;
+
+      printf("  accuracy %.1f%%, precision %.1f%%, recall %.1f%% (tp %u fp %u fn %u tn %u), "
+             "%u of %d obstacle(s) caught, %ums after they got close on average\n",
+             total ? 100.0 * (truePositive + trueNegative) / total : 0.0,
+             truePositive + falsePositive ? 100.0 * truePositive / (truePositive + falsePositive) : 0.0,
+             truePositive + falseNegative ? 100.0 * truePositive / (truePositive + falseNegative) : 0.0,
+             truePositive, falsePositive, falseNegative, trueNegative, detected, labelCount,
+             detected ? (unsigned)(detectionDelayMs / detected) : 0);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,712 @@
+// Host simulation of the car for [env:native]: the firmware's control loop, frame broadcaster
+// and motor/servo code run against the simulated HAL. A driver thread replays a scripted
+// drive through the command queue and viewers read the stream sender's sockets at the speed of
+// a simulated link.
+//
+//   pio run -e native && .pio/build/native/program [seconds]
+//   .pio/build/native/program motion <clip.mjpg>... - idle mode benchmark, see MotionBench.h
+//   .pio/build/native/program encode [runs] - raw frame encoder benchmark, see EncoderBench.h
+//   .pio/build/native/program vision <clip.mjpg>... - obstacle veto benchmark, see VisionBench.h
+//   .pio/build/native/program drive [iterations] - drive mixing check and tick cost, see DriveBench.h
+//   .pio/build/native/program ramp [seconds] - motor and servo ramp CPU cost, see RampBench.h
+//   .pio/build/native/program servo - camera servo trajectory check and latency, see ServoBench.h
+//   .pio/build/native/program heap [seconds] - the simulation, exits with 1 if a warm loop allocated
+//   .pio/build/native/program udp [seconds] - UDP video through a lossy link emulator, see UdpBench.h
+//   .pio/build/native/program udp-receive [port] - receiver for a real car's UDP video, see UdpBench.h
+//   .pio/build/native/program log [iterations] - event log cost against Serial.printf, see LogBench.h
+//   .pio/build/native/program log-decode [capture] - formats the car's raw log records, see LogBench.h
+//   .pio/build/native/program protocol [iterations] - command parser fuzzing and parse rate, see ProtocolBench.h
+//   .pio/build/native/program pacer [seconds] - stream pacing over fast, slow and stalling links, see PacerBench.h
+//   .pio/build/native/program quality - quality controller replay of a fast and a slow viewer, see QualityBench.h
+//   .pio/build/native/program stall - a viewer that stops reading is dropped and the car stops, see StallBench.h
+//
+// CAR_SIM_FRAMES - directory of *.jpg replayed as camera frames (default ./frames)
+// CAR_SIM_FPS - camera frame rate (default 25)
+// CAR_SIM_PIXEL_FORMAT - camera pixel format, 0 - RGB565, 3 - GRAYSCALE, 4 - JPEG (default 4)
+// CAR_SIM_CAMERA_MAX_FRAMESIZE - camera init fails above this framesize, as when buffers do not fit (default none)
+// CAR_SIM_LINK_KBPS - simulated viewer link speed (default 4000)
+// CAR_SIM_VIEWERS - number of stream viewers, up to STREAM_MAX_CLIENTS (default 2)
+// CAR_SIM_WS_VIEWERS - of those, how many take WS video instead of /stream, the last ones (default 1)
+// CAR_SIM_DECODE_MS - browser JPEG decode and paint time per frame (default 8)
+// CAR_SIM_RECORD_FPS - recorder frame rate, 0 - off (default 10)
+// CAR_SIM_VISION - 1 runs the vision stage with its obstacle veto (default 0)
+// CAR_SIM_STORAGE - directory standing in for LittleFS, recordings go to <dir>/rec (default ./storage)
+
+#include "../config.h"
+#include "../Car.h"
+#include "../CameraPool.h"
+#include "../CommandQueue.h"
+#include "../FramePacer.h"
+#include "../FrameRecorder.h"
+#include "../HeapWatermark.h"
+#include "../LoopMonitor.h"
+#include "../StreamSender.h"
+#include "DriveBench.h"
+#include "EncoderBench.h"
+#include "LogBench.h"
+#include "MotionBench.h"
+#include "PacerBench.h"
+#include "ProtocolBench.h"
+#include "QualityBench.h"
+#include "RampBench.h"
+#include "ServoBench.h"
+#include "StallBench.h"
+#include "UdpBench.h"
+#include "VisionBench.h"
+
+#define CONTROL_PERIOD_MS 5
+#define DRIVER_PERIOD_MS 2
+#define DEFAULT_LINK_KBPS 4000
+#define DEFAULT_VIEWERS 2
+#define DEFAULT_DURATION_S 10
+#define DEFAULT_RECORD_FPS 10
+#define DEFAULT_WS_VIEWERS 1
+#define DEFAULT_DECODE_MS 8
+
+EventLog eventLog;
+LatencyMetrics latencyMetrics;
+Car car;
+LoopMonitor controlLoopMonitor;
+HeapWatermark controlHeap;
+static CommandLatch controlLatch;
+static FrameBroadcaster frameBroadcaster;
+static FrameRecorder frameRecorder;
+static CameraPool cameraPool;
+static VisionStage visionStage;
+static StreamSender streamSender;
+static volatile bool simRunning = true;
+
+// Reading end of a socket pair, the other end is a stream client. Plays the browser: parses
+// the frames out of what arrives and shows each after a decode, one frame decoding at a time.
+// The MJPEG <img> decodes every part in turn, WS video keeps only the newest frame waiting
+// behind the one decoding and acks each frame once shown or dropped
+struct SimViewer {
+  int id;
+  int fd;
+  int streamFd; // the sender's end
+  bool video;
+  uint32_t linkKbps;
+  uint64_t bytes;
+  volatile bool reload; // drops the connection and opens a new one, like a page reload
+
+  char header[STREAM_PART_HEADER_SIZE + 1];
+  size_t headerLength;
+  size_t bodyLeft;
+  uint32_t seq;
+  uint64_t sensorAtUs;
+
+  bool decoding;
+  uint32_t decodingSeq;
+  uint64_t shownAtUs; // when the frame decoding now, or the last one, is on screen
+  bool waiting;
+  uint32_t waitingSeq;
+  uint64_t waitingSensorUs;
+  uint64_t waitingSinceUs;
+  uint32_t shown;
+  uint32_t skipped;
+  uint32_t acks; // command acks the sender wrote between the frames
+};
+
+static SimViewer viewers[STREAM_MAX_CLIENTS];
+static uint32_t simDecodeUs = DEFAULT_DECODE_MS * 1000;
+// Sensor timestamp to the frame on screen, [0] /stream viewers, [1] WS video viewers
+static LatencyHistogram glassToGlass[2];
+// Command queued to its ack read by a WS video viewer, by the command's seq
+static LatencyHistogram commandAckLatency;
+static uint64_t ackQueuedUs[0x10000];
+static uint32_t acksQueued;
+
+static uint32_t envOr(const char *name, uint32_t fallback) {
+  const char *value = getenv(name);
+
+  return value && atoi(value) > 0 ? atoi(value) : fallback;
+}
+
+// Same movement and camera handling as the firmware's realtime command table
+static void dispatchSimCommand(const CarCommand &command) {
+  switch (command.opcode) {
+  case OP_STOP:
+    car.stop();
+    break;
+  case OP_FORWARD:
+  case OP_BACKWARD:
+  case OP_LEFT:
+  case OP_RIGHT:
+  case OP_FORWARD_LEFT:
+  case OP_FORWARD_RIGHT:
+  case OP_BACKWARD_LEFT:
+  case OP_BACKWARD_RIGHT:
+    car.drive(legacyDriveVectors[command.opcode][0], legacyDriveVectors[command.opcode][1]);
+    break;
+  case OP_DRIVE:
+    car.drive(command.arg0, command.arg1);
+    break;
+  case OP_CAMERA:
+    car.setCamera(command.arg0, command.arg1);
+    break;
+  default:
+    logEvent(LOG_INFO, EV_UNKNOWN_COMMAND, command.opcode, CAR_MESSAGE_SIZE);
+    break;
+  }
+}
+
+void controlTask(void *param) {
+  TickType_t lastWake = xTaskGetTickCount();
+  controlLoopMonitor.reset(CONTROL_PERIOD_MS * 1000, nowUs());
+  AllocationProbe probe;
+
+  probe.restart();
+
+  for (;;) {
+    vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(CONTROL_PERIOD_MS));
+    controlLoopMonitor.onWake(nowUs());
+
+    QueuedCommand item;
+
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+      if (!controlLatch.take(axis, item, nowUs())) {
+        continue;
+      }
+
+      const uint64_t dispatchedAt = nowUs();
+
+      latencyMetrics.record(LAT_COMMAND_RECEIVE_TO_DISPATCH, item.receivedAt, dispatchedAt);
+
+      // stamped first, the ramp timer may put the command on the pins before dispatch returns
+      if (axis == AXIS_DRIVE) {
+        latencyMetrics.onMovementDispatched(item.receivedAt, dispatchedAt);
+      }
+
+      dispatchSimCommand(item.command);
+    }
+
+    car.tick();
+
+    controlLoopMonitor.onDone(nowUs());
+    controlHeap.record(probe);
+  }
+}
+
+// The firmware acks each binary command on the WebSocket it came in on, here the WS video
+// viewers stand in for the browser's socket
+static void queueSimAcks(uint16_t seq) {
+  ackQueuedUs[seq] = nowUs();
+
+  for (SimViewer &viewer : viewers) {
+    if (viewer.video && viewer.linkKbps && streamSender.queueAck(viewer.streamFd, seq)) {
+      acksQueued++;
+    }
+  }
+}
+
+// Holds each movement for a second while sweeping the camera, like a driver on the joystick:
+// both are repeated every DRIVER_PERIOD_MS, faster than the control loop, as pointer events are
+void driverTask(void *param) {
+  static const uint8_t script[] = {OP_FORWARD, OP_FORWARD_LEFT, OP_LEFT, OP_STOP, OP_DRIVE, OP_BACKWARD, OP_BACKWARD_RIGHT, OP_RIGHT, OP_STOP};
+  const uint32_t steps = sizeof(script) / sizeof(script[0]);
+  uint16_t seq = 0;
+  int cameraX = -100;
+  int cameraStep = 5;
+
+  while (simRunning) {
+    const uint8_t opcode = script[(millis() / 1000) % steps];
+    // OP_DRIVE weaves at 70% throttle, steering with the camera sweep
+    const int16_t throttle = opcode == OP_DRIVE ? 70 : 0;
+    const int16_t steer = opcode == OP_DRIVE ? cameraX / 2 : 0;
+    QueuedCommand item = {{opcode, seq++, throttle, steer}, -1, nowUs()};
+    controlLatch.post(item);
+
+    cameraX += cameraStep;
+
+    if (cameraX >= 100 || cameraX <= -100) {
+      cameraStep = -cameraStep;
+    }
+
+    item = {{OP_CAMERA, seq, (int16_t)cameraX, 0}, -1, nowUs()};
+    controlLatch.post(item);
+    queueSimAcks(seq++);
+
+    vTaskDelay(DRIVER_PERIOD_MS / portTICK_PERIOD_MS);
+  }
+
+  vTaskDelete(nullptr);
+}
+
+// Socket buffers about the size of lwIP's TCP send window, so the link paces the sender
+#define SIM_SOCKET_BUFFER (6 * 1024)
+
+static bool isSimCarParked(void *context) {
+  return car.isParked(IDLE_AFTER_MS);
+}
+
+static bool connectViewer(SimViewer &viewer) {
+  int sockets[2];
+  const int bufferSize = SIM_SOCKET_BUFFER;
+  // wakes the viewer to show decoded frames and ack them while nothing arrives
+  const timeval receiveTimeout = {0, 2000};
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+    return false;
+  }
+
+  setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+  setsockopt(sockets[1], SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+  setsockopt(sockets[1], SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout));
+  viewer.fd = sockets[1];
+  viewer.streamFd = sockets[0];
+  viewer.headerLength = 0;
+  viewer.bodyLeft = 0;
+
+  if (!(viewer.video ? streamSender.addVideo(sockets[0]) : streamSender.add(sockets[0]))) {
+    close(sockets[0]);
+    close(sockets[1]);
+    return false;
+  }
+
+  return true;
+}
+
+static void startDecode(SimViewer &viewer, uint32_t seq, uint64_t sensorAtUs, uint64_t startUs) {
+  viewer.decoding = true;
+  viewer.decodingSeq = seq;
+  viewer.shownAtUs = startUs + simDecodeUs;
+  viewer.shown++;
+  glassToGlass[viewer.video].add(viewer.shownAtUs - sensorAtUs);
+}
+
+// WS video: acks the frame on screen by now and starts on the one waiting
+static void advanceDecoder(SimViewer &viewer, uint64_t now) {
+  while (viewer.decoding && now >= viewer.shownAtUs) {
+    viewer.decoding = false;
+    streamSender.onVideoAck(viewer.streamFd, viewer.decodingSeq & 0xFFFF);
+
+    if (viewer.waiting) {
+      viewer.waiting = false;
+      startDecode(viewer, viewer.waitingSeq, viewer.waitingSensorUs, std::max(viewer.waitingSinceUs, viewer.shownAtUs));
+    }
+  }
+}
+
+static void onViewerFrame(SimViewer &viewer, uint64_t now) {
+  if (!viewer.video) {
+    // every part is decoded, in turn
+    startDecode(viewer, viewer.seq, viewer.sensorAtUs, std::max(now, viewer.shownAtUs));
+    viewer.decoding = false;
+    return;
+  }
+
+  advanceDecoder(viewer, now);
+
+  if (!viewer.decoding) {
+    startDecode(viewer, viewer.seq, viewer.sensorAtUs, now);
+    return;
+  }
+
+  // a newer frame replaces the one waiting, which is dropped and acked right away
+  if (viewer.waiting) {
+    viewer.skipped++;
+    streamSender.onVideoAck(viewer.streamFd, viewer.waitingSeq & 0xFFFF);
+  }
+
+  viewer.waiting = true;
+  viewer.waitingSeq = viewer.seq;
+  viewer.waitingSensorUs = viewer.sensorAtUs;
+  viewer.waitingSinceUs = now;
+}
+
+// MJPEG part header, true once complete. The response header ahead of the parts is skipped
+static bool parsePartHeader(SimViewer &viewer) {
+  if (viewer.headerLength < 4 || memcmp(viewer.header + viewer.headerLength - 4, "\r\n\r\n", 4) != 0) {
+    return false;
+  }
+
+  viewer.header[viewer.headerLength] = '\0';
+
+  const char *length = strstr(viewer.header, "Content-Length: ");
+  const char *timestamp = strstr(viewer.header, "X-Timestamp: ");
+
+  if (strncmp(viewer.header, "--frame", 7) == 0 && length && timestamp) {
+    char *fraction;
+    const uint64_t seconds = strtoull(timestamp + 13, &fraction, 10);
+
+    viewer.bodyLeft = strtoul(length + 16, nullptr, 10);
+    viewer.sensorAtUs = seconds * 1000000 + strtoul(fraction + 1, nullptr, 10);
+  }
+
+  return true;
+}
+
+// WebSocket frame header and the video header, true once complete
+static bool parseVideoHeader(SimViewer &viewer) {
+  const uint8_t *header = (const uint8_t *)viewer.header;
+
+  if (viewer.headerLength < 2) {
+    return false;
+  }
+
+  const uint8_t lengthCode = header[1] & 0x7F;
+  const size_t frameHeaderLength = lengthCode == 126 ? 4 : (lengthCode == 127 ? 10 : 2);
+
+  // a command ack, a short text frame
+  if (header[0] == 0x81) {
+    if (viewer.headerLength < 2 + (size_t)lengthCode) {
+      return false;
+    }
+
+    viewer.header[viewer.headerLength] = '\0';
+
+    if (strncmp(viewer.header + 2, "ack-", 4) == 0) {
+      viewer.acks++;
+      commandAckLatency.add(nowUs() - ackQueuedUs[strtoul(viewer.header + 6, nullptr, 10) & 0xFFFF]);
+    }
+
+    return true;
+  }
+
+  if (viewer.headerLength < frameHeaderLength + VIDEO_HEADER_SIZE) {
+    return false;
+  }
+
+  uint64_t payload = lengthCode;
+
+  if (lengthCode >= 126) {
+    payload = 0;
+
+    for (size_t i = 2; i < frameHeaderLength; i++) {
+      payload = payload << 8 | header[i];
+    }
+  }
+
+  VideoFrameHeader video;
+
+  if (decodeVideoHeader(header + frameHeaderLength, VIDEO_HEADER_SIZE, video)) {
+    viewer.bodyLeft = payload - VIDEO_HEADER_SIZE;
+    viewer.seq = video.seq;
+    viewer.sensorAtUs = video.sensorAtUs;
+  }
+
+  return true;
+}
+
+static void parseViewerStream(SimViewer &viewer, const char *data, size_t length, uint64_t now) {
+  while (length) {
+    if (viewer.bodyLeft) {
+      const size_t taken = std::min(viewer.bodyLeft, length);
+
+      viewer.bodyLeft -= taken;
+      data += taken;
+      length -= taken;
+
+      if (!viewer.bodyLeft) {
+        onViewerFrame(viewer, now);
+      }
+
+      continue;
+    }
+
+    viewer.header[viewer.headerLength++] = *data++;
+    length--;
+
+    // out of step when a header does not fit, the next one puts it right
+    if ((viewer.video ? parseVideoHeader(viewer) : parsePartHeader(viewer)) ||
+        viewer.headerLength == STREAM_PART_HEADER_SIZE) {
+      viewer.headerLength = 0;
+    }
+  }
+}
+
+// Reads whatever the sender wrote, taking as long as the simulated link would
+void viewerTask(void *param) {
+  SimViewer *viewer = (SimViewer *)param;
+  static thread_local char buffer[2048];
+
+  while (simRunning) {
+    if (viewer->reload) {
+      viewer->reload = false;
+      close(viewer->fd);
+
+      // the old slot frees up once the sender notices the closed socket
+      for (int attempt = 0; attempt < 100 && !connectViewer(*viewer); attempt++) {
+        delay(10);
+      }
+    }
+
+    const ssize_t length = recv(viewer->fd, buffer, sizeof(buffer), 0);
+
+    if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      advanceDecoder(*viewer, nowUs());
+      continue;
+    }
+
+    if (length <= 0) {
+      break;
+    }
+
+    viewer->bytes += length;
+    std::this_thread::sleep_for(std::chrono::microseconds((uint64_t)length * 8000 / viewer->linkKbps));
+    parseViewerStream(*viewer, buffer, length, nowUs());
+    advanceDecoder(*viewer, nowUs());
+  }
+
+  vTaskDelete(nullptr);
+}
+
+// A burst from the photo button while viewers and the recorder run
+static void burstPhoto() {
+  BurstFrame frames[CAMERA_BURST_MAX_FRAMES];
+  const int taken = cameraPool.captureBurst(FRAMESIZE_UXGA, CAMERA_JPEG_QUALITY, frames, 3);
+
+  // the outage is known once the first frame after it is published
+  delay(200);
+  printf("Burst: %d frames, stream paused %ums, outage %uus, %u frame(s) lost\n", taken, cameraPool.lastBurstMs(),
+         frameBroadcaster.lastOutageUs(), frameBroadcaster.lastOutageFramesLost());
+}
+
+static void printReport(uint32_t seconds) {
+  const SimOutputs &outputs = simOutputs();
+
+  printf("\n=== Simulation report (%us) ===\n", seconds);
+  printf("Control loop: %u iterations, %u misses, jitter avg %uus max %uus, busy max %uus\n",
+         controlLoopMonitor.iterations(), controlLoopMonitor.misses(), controlLoopMonitor.averageJitterUs(),
+         controlLoopMonitor.maxJitterUs(), controlLoopMonitor.maxBusyUs());
+  printf("Commands: %u posted, %u applied, %u superseded, wait avg %uus max %uus\n", controlLatch.posted(),
+         controlLatch.taken(), controlLatch.superseded(), controlLatch.averageWaitUs(), controlLatch.maxWaitUs());
+
+  for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    const SimViewer &viewer = viewers[i];
+
+    if (viewer.linkKbps) {
+      printf("Viewer %d (%s): %llu KB read (%.0f KB/s), %u frames shown, %u dropped waiting, %u ack(s)\n", viewer.id,
+             viewer.video ? "WS video" : "MJPEG", (unsigned long long)(viewer.bytes / 1024),
+             (double)viewer.bytes / 1024 / seconds, viewer.shown, viewer.skipped, viewer.acks);
+    }
+  }
+
+  // a simulated decode of simDecodeUs stands in for the browser, the uplink of the acks is free
+  for (int video = 0; video < 2; video++) {
+    const LatencyHistogram &histogram = glassToGlass[video];
+
+    if (histogram.count()) {
+      printf("Glass to glass %s: %u frames, p50 <%uus, p90 <%uus, p99 <%uus, max %uus\n", video ? "WS video" : "MJPEG",
+             histogram.count(), histogram.percentileUs(50), histogram.percentileUs(90), histogram.percentileUs(99),
+             histogram.maxUs());
+    }
+  }
+
+  // a newer ack replaces one still waiting for a frame to finish, so fewer arrive than are queued
+  if (commandAckLatency.count()) {
+    printf("Command acks: %u queued, %u read, p50 <%uus, p90 <%uus, p99 <%uus, max %uus\n", acksQueued,
+           commandAckLatency.count(), commandAckLatency.percentileUs(50), commandAckLatency.percentileUs(90),
+           commandAckLatency.percentileUs(99), commandAckLatency.maxUs());
+  }
+
+  // since each client connected, a reloaded viewer starts over
+  for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    const StreamClient &client = streamSender.client(i);
+
+    if (client.fd >= 0) {
+      printf("Stream client %d: %u frames, %u dropped, %.1f fps, send avg %ums\n", i, client.sent, client.dropped,
+             client.pacer.fps(), client.pacer.averageSendUs() / 1000);
+    }
+  }
+
+  printf("Stream sender: 1 task, %u connection(s), %u rejected, %u frames sent, %u skipped idle, %u ack timeout(s)\n",
+         streamSender.connections(), streamSender.rejected(), streamSender.framesSent(), streamSender.idleFramesSkipped(),
+         streamSender.ackTimeouts());
+
+  const int channels[] = {LEFT_MOTOR_PWM_CHANNEL_1, LEFT_MOTOR_PWM_CHANNEL_2, RIGHT_MOTOR_PWM_CHANNEL_1, RIGHT_MOTOR_PWM_CHANNEL_2};
+
+  for (int channel : channels) {
+    printf("PWM channel %d: duty %u, %u writes (%.1f/s)\n", channel, outputs.pwmDuty[channel],
+           outputs.pwmWrites[channel], (double)outputs.pwmWrites[channel] / seconds);
+  }
+
+  printf("Camera: %u reconfiguration(s), %u burst(s), %u frame(s) lost to outages\n", cameraPool.reconfigurations(),
+         cameraPool.bursts(), frameBroadcaster.framesLost());
+  printf("Vision: %u frames, %u unreadable, %u veto(es), %u command(s) vetoed, %u stop(s), avg %uus max %uus, %u overrun(s), stride %u\n",
+         visionStage.detector().frames(), visionStage.detector().failed(), visionStage.detector().vetoes(), car.forwardVetoedCommands(),
+         car.forwardVetoStops(), visionStage.detector().averageFrameUs(), visionStage.detector().maxFrameUs(),
+         visionStage.overruns(), visionStage.stride());
+  printf("Ramp: %u ticks, %u value changes, %.1f us/s busy, max %uus, timer on for %llums\n",
+         car.rampEngine().ticks(), car.rampEngine().writes(), (double)car.rampEngine().busyUs() / seconds,
+         car.rampEngine().maxBusyUs(), (unsigned long long)(car.rampEngine().runUs() / 1000));
+  printf("Recorder: %u frames written, %u dropped, %llu KB at %u KB/s, %u segment(s), %u recycled, %u errors\n",
+         frameRecorder.framesWritten(), frameRecorder.framesDropped(),
+         (unsigned long long)(frameRecorder.bytesWritten() / 1024), frameRecorder.throughputKBps(),
+         frameRecorder.segments(), frameRecorder.segmentsRecycled(), frameRecorder.writeErrors());
+
+  for (int stage = 0; stage < LAT_STAGE_COUNT; stage++) {
+    const LatencyHistogram &histogram = latencyMetrics.histogram(stage);
+
+    printf("Latency %s: %u samples, p50 <%uus, p90 <%uus, p99 <%uus, max %uus\n", latencyStageNames[stage],
+           histogram.count(), histogram.percentileUs(50), histogram.percentileUs(90), histogram.percentileUs(99),
+           histogram.maxUs());
+  }
+
+  const HeapWatermark *heaps[] = {&frameBroadcaster.heap(), &streamSender.heap(), &controlHeap};
+  static const char *heapNames[] = {"capture", "stream", "control"};
+
+  for (int i = 0; i < 3; i++) {
+    printf("Heap %s: %u warm iterations, %u allocating, %u allocations, worst %u\n", heapNames[i],
+           heaps[i]->iterations(), heaps[i]->allocatingIterations(), heaps[i]->allocations(), heaps[i]->worst());
+  }
+
+  printf("Event log: %u dropped\n", eventLog.dropped());
+}
+
+// Every steady-state loop ran warm and none of them allocated
+static bool checkHeap() {
+  const HeapWatermark *heaps[] = {&frameBroadcaster.heap(), &streamSender.heap(), &controlHeap};
+
+  for (const HeapWatermark *heap : heaps) {
+    if (!heap->iterations() || heap->allocatingIterations()) {
+      printf("FAIL heap: a loop allocated in its steady state, or never warmed up\n");
+      return false;
+    }
+  }
+
+  printf("Heap OK: no allocations after warmup\n");
+
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 2 && strcmp(argv[1], "motion") == 0) {
+    return runMotionBench(argc - 2, argv + 2, envOr("CAR_SIM_FPS", SIM_CAMERA_DEFAULT_FPS));
+  }
+
+  if (argc > 2 && strcmp(argv[1], "vision") == 0) {
+    return runVisionBench(argc - 2, argv + 2, envOr("CAR_SIM_FPS", SIM_CAMERA_DEFAULT_FPS));
+  }
+
+  if (argc > 1 && strcmp(argv[1], "drive") == 0) {
+    return runDriveBench(argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : DRIVE_BENCH_DEFAULT_ITERATIONS);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "ramp") == 0) {
+    return runRampBench(argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : RAMP_BENCH_DEFAULT_SECONDS);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "log-decode") == 0) {
+    return runLogDecode(argc > 2 ? argv[2] : nullptr);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "log") == 0) {
+    return runLogBench(argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : LOG_BENCH_DEFAULT_ITERATIONS);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "protocol") == 0) {
+    return runProtocolBench(argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : PROTOCOL_BENCH_DEFAULT_ITERATIONS);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "pacer") == 0) {
+    return runPacerBench(argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : PACER_BENCH_DEFAULT_SECONDS);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "quality") == 0) {
+    return runQualityBench();
+  }
+
+  if (argc > 1 && strcmp(argv[1], "servo") == 0) {
+    return runServoBench();
+  }
+
+  if (argc > 1 && strcmp(argv[1], "encode") == 0) {
+    return runEncoderBench(argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : ENCODER_BENCH_DEFAULT_RUNS);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "udp-receive") == 0) {
+    return runUdpReceive(argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : UDP_RECEIVE_DEFAULT_PORT);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "udp") == 0) {
+    if (car.init() != ESP_OK) {
+      return 1;
+    }
+
+    frameBroadcaster.begin();
+    cameraPool.begin(camera_config, frameBroadcaster);
+
+    return runUdpBench(frameBroadcaster, argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : UDP_BENCH_DEFAULT_SECONDS,
+                       envOr("CAR_SIM_LINK_KBPS", DEFAULT_LINK_KBPS));
+  }
+
+  if (argc > 1 && strcmp(argv[1], "stall") == 0) {
+    if (car.init() != ESP_OK) {
+      return 1;
+    }
+
+    frameBroadcaster.begin();
+    cameraPool.begin(camera_config, frameBroadcaster);
+
+    return runStallBench(frameBroadcaster, car);
+  }
+
+  const bool heapCheck = argc > 1 && strcmp(argv[1], "heap") == 0;
+  const int secondsArg = heapCheck ? 2 : 1;
+  const uint32_t seconds = argc > secondsArg && atoi(argv[secondsArg]) > 0 ? atoi(argv[secondsArg]) : DEFAULT_DURATION_S;
+  const uint32_t viewerCount = std::min<uint32_t>(envOr("CAR_SIM_VIEWERS", DEFAULT_VIEWERS), STREAM_MAX_CLIENTS);
+  const uint32_t linkKbps = envOr("CAR_SIM_LINK_KBPS", DEFAULT_LINK_KBPS);
+  const char *wsViewers = getenv("CAR_SIM_WS_VIEWERS");
+  const uint32_t videoCount = wsViewers ? atoi(wsViewers) : DEFAULT_WS_VIEWERS;
+  const char *recordFps = getenv("CAR_SIM_RECORD_FPS");
+
+  simDecodeUs = envOr("CAR_SIM_DECODE_MS", DEFAULT_DECODE_MS) * 1000;
+  eventLog.begin();
+
+  if (car.init() != ESP_OK) {
+    return 1;
+  }
+
+  xTaskCreatePinnedToCore(controlTask, "CarControl", 4096, nullptr, configMAX_PRIORITIES - 5, nullptr, 1);
+  frameBroadcaster.begin();
+  cameraPool.begin(camera_config, frameBroadcaster);
+
+  if (const char *pixelFormat = getenv("CAR_SIM_PIXEL_FORMAT")) {
+    cameraPool.setPixelFormat((pixformat_t)atoi(pixelFormat));
+  }
+  frameRecorder.begin(frameBroadcaster);
+  visionStage.begin(frameBroadcaster, car);
+
+  if (envOr("CAR_SIM_VISION", 0)) {
+    visionStage.start();
+  }
+
+  if (!recordFps || atoi(recordFps) > 0) {
+    frameRecorder.start(recordFps ? atoi(recordFps) : DEFAULT_RECORD_FPS);
+  }
+
+  const StreamHooks streamHooks = {nullptr, isSimCarParked, nullptr, nullptr, nullptr};
+
+  streamSender.setPacing(0, 100000);
+  streamSender.begin(frameBroadcaster, streamHooks);
+
+  for (uint32_t i = 0; i < viewerCount; i++) {
+    viewers[i].id = i;
+    viewers[i].linkKbps = linkKbps;
+    viewers[i].video = i + videoCount >= viewerCount;
+
+    if (!connectViewer(viewers[i])) {
+      return 1;
+    }
+
+    xTaskCreate(viewerTask, "SimViewer", 4096, &viewers[i], 5, nullptr);
+  }
+
+  xTaskCreate(driverTask, "SimDriver", 4096, nullptr, 5, nullptr);
+
+  // halfway through, grow the buffers the way a frame size change from the UI does
+  delay(seconds * 500);
+  cameraPool.configure(FRAMESIZE_SVGA, CAMERA_JPEG_QUALITY, CAMERA_FOR_STREAM);
+  viewers[0].reload = true;
+  delay(seconds * 250);
+  burstPhoto();
+  delay(seconds * 250);
+  simRunning = false;
+  frameRecorder.stop();
+  delay(1100);
+
+  printReport(seconds);
+
+  return heapCheck && !checkHeap() ? 1 : 0;
+}
@@ -1,8 +1,12 @@
-#include "esp_camera.h"
-#include <esp_timer.h>
+#pragma once
+#include "hal/Hal.h"
 
 inline uint64_t nowMs() {
-  return esp_timer_get_time() / 1000ULL;
+  return halNowUs() / 1000ULL;
+}
+
+inline uint64_t nowUs() {
+  return halNowUs();
 }
 
 inline uint64_t elapsedSince(uint64_t time) {
@@ -119,22 +123,11 @@ framesize_t stringToFrameSize(const char *name) {
   return FRAMESIZE_INVALID; // если не нашли совпадение
 }
 
-int getClientRSSI() {
-  wifi_sta_list_t wifi_sta_list;
-  esp_wifi_ap_get_sta_list(&wifi_sta_list);
-
-  if (wifi_sta_list.num == 0) {
-    return 0;
-  }
-
-  return wifi_sta_list.sta[0].rssi;
-}
-
 void blink(int pin, int count, int delayMs = 200) {
   for (int i = 0; i < count; i++) {
-    digitalWrite(pin, LOW);
+    halDigitalWrite(pin, LOW);
     delay(delayMs);
-    digitalWrite(pin, HIGH);
+    halDigitalWrite(pin, HIGH);
       delay(delayMs);
   }
 }
\ No newline at end of file